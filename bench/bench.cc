@@ -0,0 +1,1178 @@
+#include "../msgstream.h"
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if __has_include(<linux/perf_event.h>)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#define BENCH_HAVE_PERF 1
+#endif
+
+// A tiny value tree, used to generate corpora
+// and to drive the serializers with identical input
+struct Value {
+	enum Kind {
+		NIL, BOOL, INT, FLOAT, STRING, BINARY, ARRAY, MAP,
+	};
+
+	Kind kind = NIL;
+	bool b = false;
+	int64_t i = 0;
+	double f = 0;
+	std::string str;
+	std::vector<unsigned char> bin;
+
+	// For maps, keys[n] is the key of items[n]
+	std::vector<Value> items;
+	std::vector<std::string> keys;
+};
+
+static Value makeBool(bool b) {
+	Value val;
+	val.kind = Value::BOOL;
+	val.b = b;
+	return val;
+}
+
+static Value makeInt(int64_t i) {
+	Value val;
+	val.kind = Value::INT;
+	val.i = i;
+	return val;
+}
+
+static Value makeFloat(double f) {
+	Value val;
+	val.kind = Value::FLOAT;
+	val.f = f;
+	return val;
+}
+
+static Value makeString(std::string str) {
+	Value val;
+	val.kind = Value::STRING;
+	val.str = std::move(str);
+	return val;
+}
+
+static Value makeBinary(std::vector<unsigned char> bin) {
+	Value val;
+	val.kind = Value::BINARY;
+	val.bin = std::move(bin);
+	return val;
+}
+
+static Value makeArray() {
+	Value val;
+	val.kind = Value::ARRAY;
+	return val;
+}
+
+static Value makeMap() {
+	Value val;
+	val.kind = Value::MAP;
+	return val;
+}
+
+static void mapSet(Value &map, std::string key, Value val) {
+	map.keys.push_back(std::move(key));
+	map.items.push_back(std::move(val));
+}
+
+struct Corpus {
+	explicit Corpus(std::string name): name(std::move(name)) {}
+
+	std::string name;
+	std::vector<Value> records;
+	size_t numValues = 0;
+	std::string encoded;
+};
+
+// Deterministic xorshift PRNG, so that runs are comparable
+class Random {
+public:
+	uint64_t next() {
+		state_ ^= state_ << 13;
+		state_ ^= state_ >> 7;
+		state_ ^= state_ << 17;
+		return state_;
+	}
+
+	uint64_t below(uint64_t n) {
+		return next() % n;
+	}
+
+	double real() {
+		return (double)(next() >> 11) / (double)(1ull << 53);
+	}
+
+private:
+	uint64_t state_ = 0x9e3779b97f4a7c15ull;
+};
+
+static std::string randomString(Random &rand, size_t length) {
+	std::string str;
+	str.reserve(length);
+	for (size_t i = 0; i < length; ++i) {
+		str += (char)('a' + rand.below(26));
+	}
+
+	return str;
+}
+
+static Value rpcRecord(Random &rand, uint64_t id) {
+	static const char *methods[] = {
+		"getUser", "listOrders", "updateProfile", "ping", "subscribe"};
+
+	Value fields = makeArray();
+	fields.items.push_back(makeString("name"));
+	fields.items.push_back(makeString("email"));
+	fields.items.push_back(makeString("created_at"));
+
+	Value params = makeMap();
+	mapSet(params, "userId", makeInt(rand.below(1000000)));
+	mapSet(params, "verbose", makeBool(rand.below(2) == 0));
+	mapSet(params, "fields", std::move(fields));
+
+	Value record = makeMap();
+	mapSet(record, "jsonrpc", makeString("2.0"));
+	mapSet(record, "id", makeInt(id));
+	mapSet(record, "method", makeString(methods[rand.below(5)]));
+	mapSet(record, "params", std::move(params));
+	mapSet(record, "timeout", makeFloat(rand.real() * 30));
+	mapSet(record, "trace", Value());
+	return record;
+}
+
+// Field names for wide-maps, in the style of a flattened database row
+static const std::vector<std::string> &wideKeys() {
+	static const std::vector<std::string> keys = [] {
+		static const char *names[] = {
+			"id", "uuid", "name", "email", "phone", "status", "created_at",
+			"updated_at", "deleted_at", "owner_id", "account_id", "region",
+			"country", "city", "zip", "street", "lat", "lon", "timezone",
+			"locale", "currency", "balance", "credit_limit", "plan", "tier",
+			"referrer", "utm_source", "utm_medium", "utm_campaign",
+			"last_login", "login_count", "flags"};
+		return std::vector<std::string>(std::begin(names), std::end(names));
+	}();
+	return keys;
+}
+
+static Value wideRecord(Random &rand) {
+	Value record = makeMap();
+	for (auto &key: wideKeys()) {
+		if (rand.below(2) == 0) {
+			mapSet(record, key, makeInt(rand.below(1000000)));
+		} else {
+			mapSet(record, key, makeString(randomString(rand, rand.below(12))));
+		}
+	}
+	return record;
+}
+
+static Value deepRecord(Random &rand, int depth) {
+	if (depth == 0) {
+		return makeInt(rand.below(100));
+	}
+
+	if (depth % 2 == 0) {
+		Value arr = makeArray();
+		arr.items.push_back(makeInt(depth));
+		arr.items.push_back(deepRecord(rand, depth - 1));
+		return arr;
+	} else {
+		Value map = makeMap();
+		mapSet(map, "d", deepRecord(rand, depth - 1));
+		return map;
+	}
+}
+
+static size_t countValues(const Value &val) {
+	size_t n = 1 + val.keys.size();
+	for (auto &sub: val.items) {
+		n += countValues(sub);
+	}
+
+	return n;
+}
+
+// Serialization strategies for containers
+enum class Containers {
+	SIZED, // beginArray(n)/beginMap(n)
+	BUILDER, // ArrayBuilder/MapBuilder
+	IN_PLACE, // BufferArrayBuilder/BufferMapBuilder
+};
+
+template<Containers C, typename Sink>
+static void writeValue(MsgStream::BasicSerializer<Sink> &s, const Value &val) {
+	switch (val.kind) {
+	case Value::NIL:
+		s.writeNil();
+		break;
+	case Value::BOOL:
+		s.writeBool(val.b);
+		break;
+	case Value::INT:
+		s.writeInt(val.i);
+		break;
+	case Value::FLOAT:
+		s.writeFloat64(val.f);
+		break;
+	case Value::STRING:
+		s.writeString(val.str);
+		break;
+	case Value::BINARY:
+		s.writeBinary(val.bin);
+		break;
+	case Value::ARRAY:
+		if constexpr (C == Containers::BUILDER) {
+			MsgStream::ArrayBuilder ab;
+			for (auto &item: val.items) {
+				writeValue<C>(ab, item);
+			}
+			s.writeArray(ab);
+		} else if constexpr (C == Containers::IN_PLACE) {
+			MsgStream::BufferArrayBuilder ab(s);
+			for (auto &item: val.items) {
+				writeValue<C>(ab, item);
+			}
+			s.writeArray(ab);
+		} else {
+			auto sub = s.beginArray(val.items.size());
+			for (auto &item: val.items) {
+				writeValue<C>(sub, item);
+			}
+			s.endArray(sub);
+		}
+		break;
+	case Value::MAP:
+		if constexpr (C == Containers::BUILDER) {
+			MsgStream::MapBuilder mb;
+			for (size_t i = 0; i < val.items.size(); ++i) {
+				mb.writeString(val.keys[i]);
+				writeValue<C>(mb, val.items[i]);
+			}
+			s.writeMap(mb);
+		} else if constexpr (C == Containers::IN_PLACE) {
+			MsgStream::BufferMapBuilder mb(s);
+			for (size_t i = 0; i < val.items.size(); ++i) {
+				mb.writeString(val.keys[i]);
+				writeValue<C>(mb, val.items[i]);
+			}
+			s.writeMap(mb);
+		} else {
+			auto sub = s.beginMap(val.items.size());
+			for (size_t i = 0; i < val.items.size(); ++i) {
+				sub.writeString(val.keys[i]);
+				writeValue<C>(sub, val.items[i]);
+			}
+			s.endMap(sub);
+		}
+		break;
+	}
+}
+
+static std::vector<Corpus> makeCorpora() {
+	Random rand;
+	std::vector<Corpus> corpora;
+
+	{
+		Corpus c{"rpc-maps"};
+		for (uint64_t i = 0; i < 100000; ++i) {
+			c.records.push_back(rpcRecord(rand, i));
+		}
+		corpora.push_back(std::move(c));
+	}
+
+	{
+		Corpus c{"deep-nesting"};
+		for (int i = 0; i < 1000; ++i) {
+			c.records.push_back(deepRecord(rand, 400));
+		}
+		corpora.push_back(std::move(c));
+	}
+
+	{
+		Corpus c{"wide-maps"};
+		for (int i = 0; i < 50000; ++i) {
+			c.records.push_back(wideRecord(rand));
+		}
+		corpora.push_back(std::move(c));
+	}
+
+	{
+		Corpus c{"float-arrays"};
+		for (int i = 0; i < 16; ++i) {
+			Value arr = makeArray();
+			for (int j = 0; j < 65536; ++j) {
+				arr.items.push_back(makeFloat(rand.real() * 1000 - 500));
+			}
+			c.records.push_back(std::move(arr));
+		}
+		corpora.push_back(std::move(c));
+	}
+
+	{
+		Corpus c{"long-blobs"};
+		for (int i = 0; i < 64; ++i) {
+			c.records.push_back(makeString(randomString(rand, 64 * 1024)));
+			std::vector<unsigned char> bin(256 * 1024);
+			for (auto &b: bin) {
+				b = rand.next();
+			}
+			c.records.push_back(makeBinary(std::move(bin)));
+		}
+		corpora.push_back(std::move(c));
+	}
+
+	{
+		Corpus c{"scalar-records"};
+		for (int i = 0; i < 1000000; ++i) {
+			switch (rand.below(6)) {
+			case 0:
+				c.records.push_back(makeInt(rand.below(100)));
+				break;
+			case 1:
+				c.records.push_back(makeInt(rand.next()));
+				break;
+			case 2:
+				c.records.push_back(makeFloat(rand.real()));
+				break;
+			case 3:
+				c.records.push_back(
+					makeString(randomString(rand, rand.below(40))));
+				break;
+			case 4:
+				c.records.push_back(makeBool(rand.below(2) == 0));
+				break;
+			case 5:
+				c.records.push_back(Value());
+				break;
+			}
+		}
+		corpora.push_back(std::move(c));
+	}
+
+	for (auto &c: corpora) {
+		MsgStream::BufferSink sink;
+		MsgStream::BufferSerializer s(sink);
+		for (auto &val: c.records) {
+			writeValue<Containers::SIZED>(s, val);
+			c.numValues += countValues(val);
+		}
+		c.encoded.assign((const char *)sink.data().data(), sink.size());
+	}
+
+	return corpora;
+}
+
+// The records of the rpc-maps corpus, as bound structs
+struct RpcParams {
+	int64_t userId = 0;
+	bool verbose = false;
+	std::vector<std::string> fields;
+
+	using MsgStreamFields = MsgStream::FieldList<
+		MsgStream::Field<"userId", &RpcParams::userId>,
+		MsgStream::Field<"verbose", &RpcParams::verbose>,
+		MsgStream::Field<"fields", &RpcParams::fields>>;
+};
+
+struct RpcRecord {
+	std::string jsonrpc;
+	int64_t id = 0;
+	std::string method;
+	RpcParams params;
+	double timeout = 0;
+	std::optional<std::string> trace;
+
+	using MsgStreamFields = MsgStream::FieldList<
+		MsgStream::Field<"jsonrpc", &RpcRecord::jsonrpc>,
+		MsgStream::Field<"id", &RpcRecord::id>,
+		MsgStream::Field<"method", &RpcRecord::method>,
+		MsgStream::Field<"params", &RpcRecord::params>,
+		MsgStream::Field<"timeout", &RpcRecord::timeout>,
+		MsgStream::Field<"trace", &RpcRecord::trace>>;
+};
+
+// The hand-written equivalent of deserializing an RpcRecord,
+// with an std::string per key
+static void decodeRpcRecord(MsgStream::MapParser map, RpcRecord &rec) {
+	std::string key;
+	while (map.nextKey(key)) {
+		if (key == "jsonrpc") {
+			map.nextString(rec.jsonrpc);
+		} else if (key == "id") {
+			rec.id = map.nextInt();
+		} else if (key == "method") {
+			map.nextString(rec.method);
+		} else if (key == "params") {
+			MsgStream::MapParser params = map.nextMap();
+			while (params.nextKey(key)) {
+				if (key == "userId") {
+					rec.params.userId = params.nextInt();
+				} else if (key == "verbose") {
+					rec.params.verbose = params.nextBool();
+				} else if (key == "fields") {
+					MsgStream::ArrayParser arr = params.nextArray();
+					rec.params.fields.clear();
+					while (arr.hasNext()) {
+						arr.nextString(rec.params.fields.emplace_back());
+					}
+				} else {
+					params.skipNext();
+				}
+			}
+		} else if (key == "timeout") {
+			rec.timeout = map.nextFloat64();
+		} else if (key == "trace") {
+			if (map.nextType() == MsgStream::Type::NIL) {
+				map.skipNil();
+				rec.trace.reset();
+			} else {
+				map.nextString(rec.trace.emplace());
+			}
+		} else {
+			map.skipNext();
+		}
+	}
+}
+
+// Decode every value into its native type, to measure the whole parser
+template<typename Source>
+static void decodeValue(MsgStream::BasicParser<Source> &p, std::string &str) {
+	using Type = MsgStream::Type;
+	switch (p.nextType()) {
+	case Type::INT:
+	case Type::UINT:
+		asm volatile("" :: "r"(p.nextInt()));
+		break;
+	case Type::NIL:
+		p.skipNil();
+		break;
+	case Type::BOOL:
+		asm volatile("" :: "r"(p.nextBool()));
+		break;
+	case Type::FLOAT32:
+	case Type::FLOAT64:
+		asm volatile("" :: "x"(p.nextFloat64()));
+		break;
+	case Type::STRING:
+		p.nextString(str);
+		break;
+	case Type::BINARY:
+		p.nextBinary();
+		break;
+	case Type::ARRAY: {
+		auto arr = p.nextArray();
+		while (arr.hasNext()) {
+			decodeValue(arr, str);
+		}
+	}
+		break;
+	case Type::MAP: {
+		auto map = p.nextMap();
+		while (map.hasNext()) {
+			decodeValue(map, str);
+		}
+	}
+		break;
+	case Type::EXTENSION: {
+		std::vector<unsigned char> ext;
+		p.nextExtension(ext);
+	}
+		break;
+	}
+}
+
+// Like 'decodeValue', but with one nextToken() call per value
+// instead of nextType() followed by one of the nextX() methods.
+// Containers' values follow in the same token stream.
+template<typename Source>
+static void decodeToken(MsgStream::BasicParser<Source> &p, std::string &str) {
+	using Type = MsgStream::Type;
+	MsgStream::Token token = p.nextToken();
+	switch (token.type) {
+	case Type::INT:
+	case Type::UINT:
+	case Type::BOOL:
+		asm volatile("" :: "r"(token.value));
+		break;
+	case Type::FLOAT32:
+	case Type::FLOAT64:
+		asm volatile("" :: "x"(token.floatValue));
+		break;
+	case Type::STRING:
+		p.nextPayload(str, token.length);
+		break;
+	case Type::BINARY:
+	case Type::EXTENSION: {
+		std::vector<unsigned char> bin;
+		p.nextPayload(bin, token.length);
+	}
+		break;
+	case Type::NIL:
+	case Type::ARRAY:
+	case Type::MAP:
+		break;
+	}
+}
+
+// Like 'decodeValue', but with zero-copy views for strings and binaries
+// Push parser handler which touches every value, like decodeValue
+struct PushCounter: MsgStream::PushHandler {
+	std::string str;
+	size_t count = 0;
+
+	void onNil() { count += 1; }
+	void onBool(bool b) { count += b; }
+	void onInt(int64_t num) { count += num; }
+	void onUInt(uint64_t num) { count += num; }
+	void onFloat32(float num) { count += num > 0; }
+	void onFloat64(double num) { count += num > 0; }
+	void onString(std::string_view s) { str.assign(s); }
+	void onBinary(std::span<const unsigned char> b) { count += b.size(); }
+	void onArrayBegin(size_t n) { count += n; }
+	void onMapBegin(size_t n) { count += n; }
+};
+
+// Like 'decodeValue', with an async parser, for the next 'count' values.
+// Only containers need a coroutine of their own.
+static MsgStream::Task<void> decodeAsync(
+		MsgStream::BasicAsyncParser<MsgStream::AsyncPipe> &p,
+		size_t count, std::string &str) {
+	using Type = MsgStream::Type;
+	for (; count > 0; --count) {
+		Type type = co_await p.nextType();
+		switch (type) {
+		case Type::INT:
+		case Type::UINT: {
+			int64_t num = co_await p.nextInt();
+			asm volatile("" :: "r"(num));
+		}
+			break;
+		case Type::NIL:
+			co_await p.skipNil();
+			break;
+		case Type::BOOL: {
+			bool b = co_await p.nextBool();
+			asm volatile("" :: "r"(b));
+		}
+			break;
+		case Type::FLOAT32:
+		case Type::FLOAT64: {
+			double num = co_await p.nextFloat64();
+			asm volatile("" :: "x"(num));
+		}
+			break;
+		case Type::STRING:
+			str = co_await p.nextString();
+			break;
+		case Type::ARRAY: {
+			auto arr = co_await p.nextArray();
+			co_await decodeAsync(arr, arr.arraySize(), str);
+		}
+			break;
+		case Type::MAP: {
+			auto map = co_await p.nextMap();
+			co_await decodeAsync(map, map.mapSize() * 2, str);
+		}
+			break;
+		default:
+			co_await p.skipNext();
+			break;
+		}
+	}
+}
+
+static MsgStream::Task<void> decodeAllAsync(MsgStream::AsyncPipe &pipe) {
+	MsgStream::AsyncParser<MsgStream::AsyncPipe> p(pipe);
+	std::string str;
+	for (;;) {
+		bool more = co_await p.hasNext();
+		if (!more) {
+			break;
+		}
+
+		co_await decodeAsync(p, 1, str);
+	}
+}
+
+static void decodeViews(MsgStream::SpanParser &p) {
+	using Type = MsgStream::Type;
+	switch (p.nextType()) {
+	case Type::STRING:
+		asm volatile("" :: "r"(p.nextStringView().data()));
+		break;
+	case Type::BINARY:
+		asm volatile("" :: "r"(p.nextBinaryView().data()));
+		break;
+	case Type::ARRAY: {
+		auto arr = p.nextArray();
+		while (arr.hasNext()) {
+			decodeViews(arr);
+		}
+	}
+		break;
+	case Type::MAP: {
+		auto map = p.nextMap();
+		while (map.hasNext()) {
+			decodeViews(map);
+		}
+	}
+		break;
+	default: {
+		std::string str;
+		decodeValue(p, str);
+	}
+		break;
+	}
+}
+
+struct Options {
+	double minSeconds = 0.5;
+	std::string filter;
+	std::string msgpackToJson;
+	std::string jsonToMsgpack;
+};
+
+// Counts mispredicted branches in this thread, where the kernel
+// and the hardware support it (which often isn't the case in VMs)
+class BranchMissCounter {
+public:
+	BranchMissCounter() {
+#ifdef BENCH_HAVE_PERF
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd_ = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+	}
+
+	~BranchMissCounter() {
+		if (fd_ >= 0) {
+			close(fd_);
+		}
+	}
+
+	void start() {
+#ifdef BENCH_HAVE_PERF
+		if (fd_ >= 0) {
+			ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+		}
+#endif
+	}
+
+	std::optional<uint64_t> stop() {
+#ifdef BENCH_HAVE_PERF
+		uint64_t count;
+		if (
+				fd_ >= 0 &&
+				ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0) == 0 &&
+				::read(fd_, &count, sizeof(count)) == sizeof(count)) {
+			return count;
+		}
+#endif
+		return std::nullopt;
+	}
+
+private:
+	int fd_ = -1;
+};
+
+static void report(
+		const std::string &bench, const std::string &corpus,
+		size_t bytes, size_t values, size_t iterations, double seconds,
+		std::optional<uint64_t> branchMisses) {
+	double perIteration = seconds / iterations;
+	std::cout
+		<< "{\"bench\":\"" << bench << "\""
+		<< ",\"corpus\":\"" << corpus << "\""
+		<< ",\"bytes\":" << bytes
+		<< ",\"values\":" << values
+		<< ",\"iterations\":" << iterations
+		<< ",\"seconds_per_iteration\":" << perIteration
+		<< ",\"mb_per_s\":" << (bytes / perIteration / 1e6)
+		<< ",\"values_per_s\":" << (values / perIteration);
+	if (branchMisses) {
+		std::cout
+			<< ",\"branch_misses_per_value\":"
+			<< ((double)*branchMisses / iterations / values);
+	}
+	std::cout << "}\n" << std::flush;
+}
+
+// Run 'fn' repeatedly for at least 'minSeconds', and report the mean time
+// and the throughput for reading 'bytes' of input
+static void run(
+		const Options &opts, const std::string &bench, const Corpus &corpus,
+		size_t bytes, const std::function<void()> &fn) {
+	if (
+			opts.filter != "" &&
+			(bench + "/" + corpus.name).find(opts.filter) == std::string::npos) {
+		return;
+	}
+
+	using Clock = std::chrono::steady_clock;
+
+	// Warm-up
+	fn();
+
+	static BranchMissCounter branchMisses;
+	branchMisses.start();
+
+	size_t iterations = 0;
+	auto start = Clock::now();
+	std::chrono::duration<double> elapsed;
+	do {
+		fn();
+		iterations += 1;
+		elapsed = Clock::now() - start;
+	} while (elapsed.count() < opts.minSeconds);
+
+	report(
+		bench, corpus.name, bytes, corpus.numValues,
+		iterations, elapsed.count(), branchMisses.stop());
+}
+
+// As above, for benchmarks which read the corpus's MessagePack encoding
+static void run(
+		const Options &opts, const std::string &bench, const Corpus &corpus,
+		const std::function<void()> &fn) {
+	run(opts, bench, corpus, corpus.encoded.size(), fn);
+}
+
+static size_t fileSize(const std::string &path) {
+	std::ifstream is(path, std::ios::binary | std::ios::ate);
+	return is ? (size_t)is.tellg() : 0;
+}
+
+static void runConverters(
+		const Options &opts, const Corpus &corpus, const std::string &dir) {
+	std::string msgpackPath = dir + "/" + corpus.name + ".msgpack";
+	std::string jsonPath = dir + "/" + corpus.name + ".json";
+	std::string ndjsonPath = dir + "/" + corpus.name + ".ndjson";
+	std::string recordsPath = dir + "/" + corpus.name + ".records.msgpack";
+	std::string outPath = dir + "/out";
+
+	// The converters are run on the whole corpus wrapped in an array,
+	// as one pretty-printed document
+	{
+		std::ofstream os(msgpackPath, std::ios::binary);
+		MsgStream::Serializer s(os);
+		auto sub = s.beginArray(corpus.records.size());
+		for (auto &val: corpus.records) {
+			writeValue<Containers::SIZED>(sub, val);
+		}
+		s.endArray(sub);
+	}
+
+	if (opts.msgpackToJson != "") {
+		std::string cmd =
+			opts.msgpackToJson + " " + msgpackPath + " > " + jsonPath;
+		if (system(cmd.c_str()) != 0) {
+			std::cerr << "Command failed: " << cmd << '\n';
+			return;
+		}
+
+		cmd = opts.msgpackToJson + " " + msgpackPath + " > " + outPath;
+		run(opts, "msgpack-to-json", corpus, [&] {
+			if (system(cmd.c_str()) != 0) {
+				std::cerr << "Command failed: " << cmd << '\n';
+			}
+		});
+
+		// '-j' splits the input at top-level values,
+		// so this one reads the records without the wrapping array
+		{
+			std::ofstream os(recordsPath, std::ios::binary);
+			os.write(corpus.encoded.data(), corpus.encoded.size());
+		}
+
+		cmd = opts.msgpackToJson + " -j 4 " + recordsPath + " > " + outPath;
+		run(opts, "msgpack-to-json/j4", corpus, [&] {
+			if (system(cmd.c_str()) != 0) {
+				std::cerr << "Command failed: " << cmd << '\n';
+			}
+		});
+	}
+
+	if (opts.msgpackToJson != "" && opts.jsonToMsgpack != "") {
+		std::string cmd =
+			opts.jsonToMsgpack + " " + jsonPath + " > " + outPath;
+		// These read JSON, so their throughput is for the JSON text
+		run(opts, "json-to-msgpack", corpus, fileSize(jsonPath), [&] {
+			if (system(cmd.c_str()) != 0) {
+				std::cerr << "Command failed: " << cmd << '\n';
+			}
+		});
+
+		// And on the records as NDJSON, one compact value per line
+		cmd = opts.msgpackToJson + " -c " + recordsPath + " > " + ndjsonPath;
+		if (system(cmd.c_str()) != 0) {
+			std::cerr << "Command failed: " << cmd << '\n';
+			return;
+		}
+
+		cmd = opts.jsonToMsgpack + " " + ndjsonPath + " > " + outPath;
+		run(opts, "json-to-msgpack/ndjson", corpus, fileSize(ndjsonPath), [&] {
+			if (system(cmd.c_str()) != 0) {
+				std::cerr << "Command failed: " << cmd << '\n';
+			}
+		});
+	}
+
+	unlink(msgpackPath.c_str());
+	unlink(recordsPath.c_str());
+	unlink(jsonPath.c_str());
+	unlink(ndjsonPath.c_str());
+	unlink(outPath.c_str());
+}
+
+int main(int argc, char **argv) {
+	Options opts;
+	for (int i = 1; i < argc; ++i) {
+		std::string_view arg = argv[i];
+		if (arg == "--min-time" && i + 1 < argc) {
+			opts.minSeconds = atof(argv[++i]);
+		} else if (arg == "--filter" && i + 1 < argc) {
+			opts.filter = argv[++i];
+		} else if (arg == "--msgpack-to-json" && i + 1 < argc) {
+			opts.msgpackToJson = argv[++i];
+		} else if (arg == "--json-to-msgpack" && i + 1 < argc) {
+			opts.jsonToMsgpack = argv[++i];
+		} else {
+			std::cerr
+				<< "Usage: " << argv[0]
+				<< " [--min-time <seconds>] [--filter <substring>]"
+				<< " [--msgpack-to-json <path>] [--json-to-msgpack <path>]\n";
+			return 1;
+		}
+	}
+
+	std::vector<Corpus> corpora = makeCorpora();
+
+	char dirTemplate[] = "/tmp/msgstream-bench-XXXXXX";
+	const char *dir = mkdtemp(dirTemplate);
+	if (!dir) {
+		std::cerr << "Failed to create temporary directory\n";
+		return 1;
+	}
+
+	for (auto &c: corpora) {
+		std::string str;
+
+		run(opts, "parse-typed/istream", c, [&] {
+			std::stringstream ss(c.encoded);
+			MsgStream::Parser p(ss);
+			while (p.hasNext()) {
+				decodeValue(p, str);
+			}
+		});
+
+		run(opts, "parse-typed/span", c, [&] {
+			MsgStream::SpanSource src(c.encoded);
+			MsgStream::SpanParser p(src);
+			while (p.hasNext()) {
+				decodeValue(p, str);
+			}
+		});
+
+		// Chunks of top-level values on one thread per core
+		run(opts, "parse-typed/parallel", c, [&] {
+			MsgStream::ParallelOptions options;
+			options.chunkSize = 64 * 1024;
+			MsgStream::parseParallel(
+				std::span(
+					(const unsigned char *)c.encoded.data(), c.encoded.size()),
+				[](MsgStream::SpanParser &p) {
+					std::string str;
+					while (p.hasNext()) {
+						decodeValue(p, str);
+					}
+					return str.size();
+				},
+				[](size_t size) { asm volatile("" :: "r"(size)); },
+				options);
+		});
+
+		run(opts, "parse-tokens/istream", c, [&] {
+			std::stringstream ss(c.encoded);
+			MsgStream::Parser p(ss);
+			while (p.hasNext()) {
+				decodeToken(p, str);
+			}
+		});
+
+		run(opts, "parse-tokens/span", c, [&] {
+			MsgStream::SpanSource src(c.encoded);
+			MsgStream::SpanParser p(src);
+			while (p.hasNext()) {
+				decodeToken(p, str);
+			}
+		});
+
+		run(opts, "parse-views/span", c, [&] {
+			MsgStream::SpanSource src(c.encoded);
+			MsgStream::SpanParser p(src);
+			while (p.hasNext()) {
+				decodeViews(p);
+			}
+		});
+
+		run(opts, "skip-all/istream", c, [&] {
+			std::stringstream ss(c.encoded);
+			MsgStream::Parser p(ss);
+			p.skipAll();
+		});
+
+		run(opts, "skip-all/span", c, [&] {
+			MsgStream::SpanSource src(c.encoded);
+			MsgStream::SpanParser p(src);
+			p.skipAll();
+		});
+
+		run(opts, "tape/span", c, [&] {
+			MsgStream::Tape tape(c.encoded);
+			asm volatile("" :: "r"(tape.size()));
+		});
+
+		// Input arriving in pieces, as from a socket
+		for (size_t chunk: {(size_t)64, (size_t)4096}) {
+			run(opts, "push/" + std::to_string(chunk), c, [&] {
+				PushCounter counter;
+				MsgStream::PushParser p(counter);
+				std::string_view rest(c.encoded);
+				while (rest.size() > 0) {
+					p.feed(rest.substr(0, chunk));
+					rest.remove_prefix(std::min(chunk, rest.size()));
+				}
+				p.finish();
+				asm volatile("" :: "r"(counter.count));
+			});
+		}
+
+		// The same, through a pipe to a coroutine with an async parser
+		run(opts, "async/4096", c, [&] {
+			MsgStream::AsyncPipe pipe(4096);
+			MsgStream::Task<void> task = decodeAllAsync(pipe);
+			task.start();
+			std::string_view rest(c.encoded);
+			while (rest.size() > 0) {
+				rest.remove_prefix(pipe.writeSome(rest.data(), rest.size()));
+			}
+			pipe.close();
+			task.result();
+		});
+
+		if (c.name == "rpc-maps") {
+			RpcRecord rec;
+
+			run(opts, "decode-manual/istream", c, [&] {
+				std::stringstream ss(c.encoded);
+				MsgStream::Parser p(ss);
+				while (p.hasNext()) {
+					decodeRpcRecord(p.nextMap(), rec);
+				}
+			});
+
+			run(opts, "decode-bound/istream", c, [&] {
+				std::stringstream ss(c.encoded);
+				MsgStream::Parser p(ss);
+				while (p.hasNext()) {
+					MsgStream::deserialize(p, rec);
+				}
+			});
+
+			run(opts, "decode-bound/span", c, [&] {
+				MsgStream::SpanSource src(c.encoded);
+				MsgStream::SpanParser p(src);
+				while (p.hasNext()) {
+					MsgStream::deserialize(p, rec);
+				}
+			});
+		}
+
+		if (c.name == "float-arrays") {
+			std::vector<double> floats;
+			std::vector<std::vector<double>> arrays;
+			for (auto &rec: c.records) {
+				auto &arr = arrays.emplace_back();
+				for (auto &item: rec.items) {
+					arr.push_back(item.f);
+				}
+			}
+
+			run(opts, "bulk-floats/istream", c, [&] {
+				std::stringstream ss(c.encoded);
+				MsgStream::Parser p(ss);
+				while (p.hasNext()) {
+					p.nextArray().readInto(floats);
+				}
+			});
+
+			run(opts, "bulk-floats/span", c, [&] {
+				MsgStream::SpanSource src(c.encoded);
+				MsgStream::SpanParser p(src);
+				while (p.hasNext()) {
+					p.nextArray().readInto(floats);
+				}
+			});
+
+			MsgStream::BufferSink floatSink;
+			run(opts, "serialize-floats/buffer", c, [&] {
+				floatSink.clear();
+				MsgStream::BufferSerializer s(floatSink);
+				for (auto &arr: arrays) {
+					auto sub = s.beginArray(arr.size());
+					for (double f: arr) {
+						sub.writeFloat64(f);
+					}
+					s.endArray(sub);
+				}
+			});
+
+			run(opts, "serialize-bulk/ostream", c, [&] {
+				std::stringstream ss;
+				MsgStream::Serializer s(ss);
+				for (auto &arr: arrays) {
+					s.writeArray(std::span<const double>(arr));
+				}
+			});
+
+			run(opts, "serialize-bulk/buffer", c, [&] {
+				floatSink.clear();
+				MsgStream::BufferSerializer s(floatSink);
+				for (auto &arr: arrays) {
+					s.writeArray(std::span<const double>(arr));
+				}
+			});
+		}
+
+		if (c.name == "wide-maps") {
+			std::vector<std::string_view> keys(
+				wideKeys().begin(), wideKeys().end());
+			MsgStream::KeyMatcher matcher(keys);
+			size_t hits = 0;
+
+			run(opts, "keys-string/istream", c, [&] {
+				std::stringstream ss(c.encoded);
+				MsgStream::Parser p(ss);
+				while (p.hasNext()) {
+					MsgStream::MapParser map = p.nextMap();
+					while (map.nextKey(str)) {
+						for (size_t i = 0; i < keys.size(); ++i) {
+							if (str == keys[i]) {
+								hits += i;
+								break;
+							}
+						}
+						map.skipNext();
+					}
+				}
+			});
+
+			run(opts, "keys-matcher/istream", c, [&] {
+				std::stringstream ss(c.encoded);
+				MsgStream::Parser p(ss);
+				size_t index;
+				while (p.hasNext()) {
+					MsgStream::MapParser map = p.nextMap();
+					while (map.nextKeyIndex(matcher, index)) {
+						hits += index;
+						map.skipNext();
+					}
+				}
+			});
+
+			run(opts, "keys-string/span", c, [&] {
+				MsgStream::SpanSource src(c.encoded);
+				MsgStream::SpanParser p(src);
+				std::string_view key;
+				while (p.hasNext()) {
+					MsgStream::SpanMapParser map = p.nextMap();
+					while (map.nextKey(key)) {
+						for (size_t i = 0; i < keys.size(); ++i) {
+							if (key == keys[i]) {
+								hits += i;
+								break;
+							}
+						}
+						map.skipNext();
+					}
+				}
+			});
+
+			run(opts, "keys-matcher/span", c, [&] {
+				MsgStream::SpanSource src(c.encoded);
+				MsgStream::SpanParser p(src);
+				size_t index;
+				while (p.hasNext()) {
+					MsgStream::SpanMapParser map = p.nextMap();
+					while (map.nextKeyIndex(matcher, index)) {
+						hits += index;
+						map.skipNext();
+					}
+				}
+			});
+
+			asm volatile("" :: "r"(hits));
+		}
+
+		run(opts, "serialize/ostream", c, [&] {
+			std::stringstream ss;
+			MsgStream::Serializer s(ss);
+			for (auto &val: c.records) {
+				writeValue<Containers::SIZED>(s, val);
+			}
+		});
+
+		MsgStream::BufferSink sink;
+		run(opts, "serialize/buffer", c, [&] {
+			sink.clear();
+			MsgStream::BufferSerializer s(sink);
+			for (auto &val: c.records) {
+				writeValue<Containers::SIZED>(s, val);
+			}
+		});
+
+		run(opts, "serialize-builders/ostream", c, [&] {
+			std::stringstream ss;
+			MsgStream::Serializer s(ss);
+			for (auto &val: c.records) {
+				writeValue<Containers::BUILDER>(s, val);
+			}
+		});
+
+		run(opts, "serialize-builders/buffer", c, [&] {
+			sink.clear();
+			MsgStream::BufferSerializer s(sink);
+			for (auto &val: c.records) {
+				writeValue<Containers::IN_PLACE>(s, val);
+			}
+		});
+
+		runConverters(opts, c, dir);
+	}
+
+	rmdir(dir);
+}
@@ -0,0 +1,204 @@
+#ifndef MSGSTREAM_EXAMPLES_BASE64_H
+#define MSGSTREAM_EXAMPLES_BASE64_H
+
+#include <span>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__AVX512VBMI__) || defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#define BASE64_HAVE_SIMD 1
+#endif
+
+/**
+ * Base64 encoding (RFC 4648, with padding).
+ *
+ * The encoder writes straight into a buffer of the final size,
+ * which 'encodedSize' gives. Depending on the instruction sets
+ * enabled at compile time (with -mavx512vbmi, -mavx2, -mssse3,
+ * or -march=native), it encodes 48, 24 or 12 bytes per iteration,
+ * and falls back to encoding 3 bytes at a time.
+ */
+namespace Base64 {
+
+constexpr const char *ALPHABET =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	"abcdefghijklmnopqrstuvwxyz"
+	"0123456789+/";
+
+/**
+ * Get the length of the base64 encoding of 'length' bytes.
+ */
+inline size_t encodedSize(size_t length) {
+	return (length + 2) / 3 * 4;
+}
+
+#ifdef BASE64_HAVE_SIMD
+namespace detail {
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+// Map 6-bit values to base64 characters, by adding an offset
+// which depends on which range of the alphabet the value is in.
+// The ranges are told apart with a saturating subtraction
+// and a comparison, which give an index into a table of offsets.
+inline __m128i lookup(__m128i indices) {
+	__m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+	__m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+	range = _mm_or_si128(range, _mm_and_si128(upper, _mm_set1_epi8(13)));
+	const __m128i offsets = _mm_setr_epi8(
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+		'/' - 63, 'A', 0, 0);
+	return _mm_add_epi8(_mm_shuffle_epi8(offsets, range), indices);
+}
+
+// Split the first 12 bytes of 'in' into 16 6-bit values,
+// one per byte. Each 3 input bytes are first spread over 4 bytes,
+// then the multiplications shift each 6-bit field into place.
+inline __m128i unpack(__m128i in) {
+	in = _mm_shuffle_epi8(in, _mm_setr_epi8(
+		1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+	__m128i hi = _mm_mulhi_epu16(
+		_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+		_mm_set1_epi32(0x04000040));
+	__m128i lo = _mm_mullo_epi16(
+		_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+		_mm_set1_epi32(0x01000010));
+	return _mm_or_si128(hi, lo);
+}
+#endif
+
+#if defined(__AVX2__)
+// The same as 'lookup' and 'unpack', on both lanes at once
+inline __m256i lookup(__m256i indices) {
+	__m256i range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+	__m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+	range = _mm256_or_si256(
+		range, _mm256_and_si256(upper, _mm256_set1_epi8(13)));
+	const __m256i offsets = _mm256_setr_epi8(
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+		'/' - 63, 'A', 0, 0,
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+		'/' - 63, 'A', 0, 0);
+	return _mm256_add_epi8(_mm256_shuffle_epi8(offsets, range), indices);
+}
+
+inline __m256i unpack(__m256i in) {
+	in = _mm256_shuffle_epi8(in, _mm256_setr_epi8(
+		1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+		1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+	__m256i hi = _mm256_mulhi_epu16(
+		_mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)),
+		_mm256_set1_epi32(0x04000040));
+	__m256i lo = _mm256_mullo_epi16(
+		_mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)),
+		_mm256_set1_epi32(0x01000010));
+	return _mm256_or_si256(hi, lo);
+}
+#endif
+
+// Encode as many whole blocks as the enabled instruction set can,
+// and return the number of input bytes consumed
+inline size_t encodeBlocks(
+		const unsigned char *data, size_t length, char *out) {
+	size_t i = 0;
+
+#if defined(__AVX512VBMI__)
+	// Each 48 input bytes are gathered into the 4-byte groups
+	// which hold each 3 bytes, a multishift extracts the 6-bit fields,
+	// and a permute looks them up in the whole alphabet at once
+	const __m512i gather = _mm512_setr_epi32(
+		0x01020001, 0x04050304, 0x07080607, 0x0a0b090a,
+		0x0d0e0c0d, 0x10110f10, 0x13141213, 0x16171516,
+		0x191a1819, 0x1c1d1b1c, 0x1f201e1f, 0x22232122,
+		0x25262425, 0x28292728, 0x2b2c2a2b, 0x2e2f2d2e);
+	const __m512i shifts = _mm512_set1_epi64(0x3036242a1016040a);
+	const __m512i alphabet = _mm512_loadu_si512((const void *)ALPHABET);
+
+	// The zero-masked forms with every lane enabled are the same
+	// as the plain ones, but don't trip GCC's uninitialized warnings
+	const __mmask64 all = ~(__mmask64)0;
+	while (length - i >= 48) {
+		__m512i in = _mm512_maskz_loadu_epi8(0xffffffffffffull, data + i);
+		in = _mm512_maskz_permutexvar_epi8(all, gather, in);
+		__m512i indices = _mm512_maskz_multishift_epi64_epi8(all, shifts, in);
+		_mm512_storeu_si512(
+			(void *)out, _mm512_maskz_permutexvar_epi8(all, indices, alphabet));
+		i += 48;
+		out += 64;
+	}
+#elif defined(__AVX2__)
+	// Each lane takes 12 bytes; the loads read 4 bytes past those,
+	// so stop while there are at least 28 bytes left
+	while (length - i >= 28) {
+		__m256i in = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(
+				_mm_loadu_si128((const __m128i *)(data + i))),
+			_mm_loadu_si128((const __m128i *)(data + i + 12)), 1);
+		_mm256_storeu_si256((__m256i *)out, lookup(unpack(in)));
+		i += 24;
+		out += 32;
+	}
+#endif
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+	// Takes 12 bytes, but loads 16
+	while (length - i >= 16) {
+		__m128i in = _mm_loadu_si128((const __m128i *)(data + i));
+		_mm_storeu_si128((__m128i *)out, lookup(unpack(in)));
+		i += 12;
+		out += 16;
+	}
+#endif
+
+	return i;
+}
+
+}
+#endif
+
+/**
+ * Write the base64 encoding of 'data' to 'out',
+ * which must have room for 'encodedSize(data.size())' characters.
+ */
+inline void encode(std::span<const unsigned char> data, char *out) {
+	size_t length = data.size();
+	size_t i = 0;
+#ifdef BASE64_HAVE_SIMD
+	i = detail::encodeBlocks(data.data(), length, out);
+	out += i / 3 * 4;
+#endif
+
+	for (; length - i >= 3; i += 3) {
+		uint32_t num = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+		out[0] = ALPHABET[(num >> 18) & 0x3f];
+		out[1] = ALPHABET[(num >> 12) & 0x3f];
+		out[2] = ALPHABET[(num >> 6) & 0x3f];
+		out[3] = ALPHABET[num & 0x3f];
+		out += 4;
+	}
+
+	if (length - i == 2) {
+		// in:  [ xxxxxxxx yyyyyyyy ]
+		// out: [ xxxxxx xxyyyy yyyy00 = ]
+		uint16_t num = (data[i] << 8) | data[i + 1];
+		out[0] = ALPHABET[(num >> 10) & 0x3f];
+		out[1] = ALPHABET[(num >> 4) & 0x3f];
+		out[2] = ALPHABET[(num << 2) & 0x3f];
+		out[3] = '=';
+	} else if (length - i == 1) {
+		// in:  [ xxxxxxxx ]
+		// out: [ xxxxxx xx0000 = = ]
+		uint8_t num = data[i];
+		out[0] = ALPHABET[(num >> 2) & 0x3f];
+		out[1] = ALPHABET[(num << 4) & 0x3f];
+		out[2] = '=';
+		out[3] = '=';
+	}
+}
+
+}
+
+#endif
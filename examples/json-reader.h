@@ -0,0 +1,624 @@
+#ifndef MSGSTREAM_EXAMPLES_JSON_READER_H
+#define MSGSTREAM_EXAMPLES_JSON_READER_H
+
+#include <charconv>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * An error in the JSON input.
+ */
+class JsonError: public std::runtime_error {
+public:
+	JsonError(const std::string &what, size_t offset):
+		std::runtime_error(what + " at offset " + std::to_string(offset)),
+		offset_(offset) {}
+
+	/**
+	 * The offset in the input where the error was found.
+	 */
+	size_t offset() const { return offset_; }
+
+private:
+	size_t offset_;
+};
+
+/**
+ * A streaming JSON tokenizer.
+ * Instead of building a tree of the whole document, it calls
+ * a handler for each value as it's read, keeping only the stack
+ * of open containers, so memory use doesn't depend on the input's size.
+ * It doesn't recurse, so arbitrarily deep nesting is fine.
+ *
+ * The input can be a sequence of top-level values, optionally separated
+ * by whitespace, such as NDJSON. 'parseNext' reads one of them.
+ *
+ * The handler must have these methods:
+ *
+ *   void onNull();
+ *   void onBool(bool b);
+ *   void onInt(int64_t num);     // negative integers
+ *   void onUInt(uint64_t num);   // non-negative integers
+ *   void onDouble(double num);   // everything else
+ *   void onString(std::string_view str);
+ *   void onArrayBegin();
+ *   void onArrayEnd();
+ *   void onObjectBegin();
+ *   void onObjectEnd();
+ *
+ * In objects, keys are passed to 'onString', alternating with values.
+ * String views are only valid until the next call to the handler.
+ */
+class JsonReader {
+public:
+	/**
+	 * Read the JSON text in 'data', which must stay valid while it's read.
+	 * Strings without escapes are passed to the handler as views into it.
+	 */
+	explicit JsonReader(std::string_view data):
+		start_(data.data()), pos_(data.data()),
+		end_(data.data() + data.size()) {}
+
+	/**
+	 * Read JSON text by calling 'read(buffer, size)', which must fill
+	 * 'buffer' with up to 'size' bytes and return how many it read,
+	 * or 0 at the end of the input.
+	 */
+	explicit JsonReader(
+			std::function<size_t(char *, size_t)> read,
+			size_t bufferSize = 64 * 1024):
+		read_(std::move(read)), buf_(bufferSize) {}
+
+	/**
+	 * Read the next top-level value, and pass it to 'handler'.
+	 * Returns false if there are no more values.
+	 */
+	template<typename Handler>
+	bool parseNext(Handler &handler) {
+		skipWhitespace();
+		if (!fill()) {
+			return false;
+		}
+
+		stack_.clear();
+		while (true) {
+			// Opening a container is followed by its first value
+			while (parseValue(handler)) {
+			}
+
+			// After a value, close any containers which end there,
+			// until a comma (or the end of the top-level value)
+			bool more = false;
+			while (!more && !stack_.empty()) {
+				skipWhitespace();
+				char ch = next("Unexpected end of input");
+				if (ch == ',') {
+					if (stack_.back() == '{') {
+						parseKey(handler);
+					}
+					more = true;
+				} else if (ch == ']' && stack_.back() == '[') {
+					stack_.pop_back();
+					handler.onArrayEnd();
+				} else if (ch == '}' && stack_.back() == '{') {
+					stack_.pop_back();
+					handler.onObjectEnd();
+				} else {
+					fail("Expected ',' or the end of the container", 1);
+				}
+			}
+
+			if (!more) {
+				return true;
+			}
+		}
+	}
+
+	/**
+	 * The offset in the input of the next byte to be read.
+	 */
+	size_t offset() const {
+		return consumed_ + (pos_ - start_);
+	}
+
+private:
+	// Read a value, or the beginning of a container and,
+	// for objects, its first key.
+	// Returns true if a non-empty container was opened,
+	// so that a value must follow.
+	template<typename Handler>
+	bool parseValue(Handler &handler) {
+		skipWhitespace();
+		switch (peek("Unexpected end of input")) {
+		case '{':
+			pos_ += 1;
+			handler.onObjectBegin();
+			skipWhitespace();
+			if (peek("Unexpected end of input") == '}') {
+				pos_ += 1;
+				handler.onObjectEnd();
+				return false;
+			}
+
+			stack_.push_back('{');
+			parseKey(handler);
+			return true;
+		case '[':
+			pos_ += 1;
+			handler.onArrayBegin();
+			skipWhitespace();
+			if (peek("Unexpected end of input") == ']') {
+				pos_ += 1;
+				handler.onArrayEnd();
+				return false;
+			}
+
+			stack_.push_back('[');
+			return true;
+		case '"':
+			handler.onString(parseString());
+			return false;
+		case 't':
+			expectLiteral("true");
+			handler.onBool(true);
+			return false;
+		case 'f':
+			expectLiteral("false");
+			handler.onBool(false);
+			return false;
+		case 'n':
+			expectLiteral("null");
+			handler.onNull();
+			return false;
+		default:
+			parseNumber(handler);
+			return false;
+		}
+	}
+
+	// Read an object key and the colon after it
+	template<typename Handler>
+	void parseKey(Handler &handler) {
+		skipWhitespace();
+		if (peek("Unexpected end of input") != '"') {
+			fail("Expected a string key", 0);
+		}
+
+		handler.onString(parseString());
+		skipWhitespace();
+		if (next("Unexpected end of input") != ':') {
+			fail("Expected ':'", 1);
+		}
+	}
+
+	std::string_view parseString() {
+		pos_ += 1;
+
+		// Most strings have no escapes and fit in the buffer,
+		// and are returned without copying them
+		size_t length = countPlain(pos_, end_ - pos_);
+		if (pos_ + length < end_ && pos_[length] == '"') {
+			std::string_view str(pos_, length);
+			pos_ += length + 1;
+			return str;
+		}
+
+		scratch_.clear();
+		while (true) {
+			length = countPlain(pos_, end_ - pos_);
+			scratch_.append(pos_, length);
+			pos_ += length;
+			if (pos_ == end_) {
+				// Ran out of buffer, not into a special character
+				if (!fill()) {
+					fail("Unterminated string", 0);
+				}
+				continue;
+			}
+
+			char ch = next("Unterminated string");
+			if (ch == '"') {
+				return scratch_;
+			} else if (ch == '\\') {
+				parseEscape();
+			} else {
+				fail("Unescaped control character in string", 1);
+			}
+		}
+	}
+
+	void parseEscape() {
+		char ch = next("Unterminated string");
+		switch (ch) {
+		case '"': scratch_ += '"'; return;
+		case '\\': scratch_ += '\\'; return;
+		case '/': scratch_ += '/'; return;
+		case 'b': scratch_ += '\b'; return;
+		case 'f': scratch_ += '\f'; return;
+		case 'n': scratch_ += '\n'; return;
+		case 'r': scratch_ += '\r'; return;
+		case 't': scratch_ += '\t'; return;
+		case 'u': break;
+		default: fail("Invalid escape sequence", 1);
+		}
+
+		uint32_t code = parseHex4();
+
+		// Characters outside the BMP are escaped as a surrogate pair
+		if (code >= 0xd800 && code <= 0xdbff) {
+			if (next("Unterminated string") != '\\' ||
+					next("Unterminated string") != 'u') {
+				fail("Unpaired surrogate", 2);
+			}
+
+			uint32_t low = parseHex4();
+			if (low < 0xdc00 || low > 0xdfff) {
+				fail("Unpaired surrogate", 6);
+			}
+
+			code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+		} else if (code >= 0xdc00 && code <= 0xdfff) {
+			fail("Unpaired surrogate", 6);
+		}
+
+		appendUtf8(code);
+	}
+
+	uint32_t parseHex4() {
+		uint32_t code = 0;
+		for (int i = 0; i < 4; ++i) {
+			char ch = next("Unterminated string");
+			code <<= 4;
+			if (ch >= '0' && ch <= '9') {
+				code |= ch - '0';
+			} else if (ch >= 'a' && ch <= 'f') {
+				code |= ch - 'a' + 10;
+			} else if (ch >= 'A' && ch <= 'F') {
+				code |= ch - 'A' + 10;
+			} else {
+				fail("Invalid \\u escape", 1);
+			}
+		}
+
+		return code;
+	}
+
+	void appendUtf8(uint32_t code) {
+		if (code < 0x80) {
+			scratch_ += (char)code;
+		} else if (code < 0x800) {
+			scratch_ += (char)(0xc0 | (code >> 6));
+			scratch_ += (char)(0x80 | (code & 0x3f));
+		} else if (code < 0x10000) {
+			scratch_ += (char)(0xe0 | (code >> 12));
+			scratch_ += (char)(0x80 | ((code >> 6) & 0x3f));
+			scratch_ += (char)(0x80 | (code & 0x3f));
+		} else {
+			scratch_ += (char)(0xf0 | (code >> 18));
+			scratch_ += (char)(0x80 | ((code >> 12) & 0x3f));
+			scratch_ += (char)(0x80 | ((code >> 6) & 0x3f));
+			scratch_ += (char)(0x80 | (code & 0x3f));
+		}
+	}
+
+	static bool isNumberChar(char ch) {
+		return
+			(ch >= '0' && ch <= '9') ||
+			ch == '-' || ch == '+' || ch == '.' || ch == 'e' || ch == 'E';
+	}
+
+	template<typename Handler>
+	void parseNumber(Handler &handler) {
+		// Numbers are parsed in place, unless they're split
+		// between two reads
+		const char *start = pos_;
+		const char *end = pos_;
+		while (end < end_ && isNumberChar(*end)) {
+			end += 1;
+		}
+
+		if (end == end_ && read_) {
+			scratch_.assign(start, end);
+			pos_ = end;
+			while (fill() && isNumberChar(*pos_)) {
+				scratch_ += *pos_;
+				pos_ += 1;
+			}
+
+			start = scratch_.data();
+			end = start + scratch_.size();
+		} else {
+			pos_ = end;
+		}
+
+		size_t length = end - start;
+		bool isInteger;
+		if (!validNumber(start, end, isInteger)) {
+			fail("Invalid value", length);
+		}
+
+		if (isInteger && *start == '-') {
+			int64_t num;
+			if (std::from_chars(start, end, num).ec == std::errc()) {
+				handler.onInt(num);
+				return;
+			}
+		} else if (isInteger) {
+			uint64_t num;
+			if (std::from_chars(start, end, num).ec == std::errc()) {
+				handler.onUInt(num);
+				return;
+			}
+		}
+
+		// Integers which don't fit in 64 bits are read as doubles too
+		double num;
+		auto res = std::from_chars(start, end, num);
+		if (res.ec == std::errc::result_out_of_range) {
+			// Numbers too small for a double are just rounded to zero
+			if (!belowOne(start, end)) {
+				fail("Number out of range", length);
+			}
+			num = *start == '-' ? -0.0 : 0.0;
+		}
+
+		handler.onDouble(num);
+	}
+
+	// Check whether the valid JSON number from 'start' to 'end'
+	// is less than 1 in magnitude, without converting it
+	static bool belowOne(const char *start, const char *end) {
+		const char *p = start;
+		if (*p == '-') {
+			p += 1;
+		}
+
+		// The number is below 10^order, and at least 10^(order - 1)
+		// (unless it's 0): count the integer digits from the first
+		// non-zero one, or the zeros at the start of the fraction
+		int64_t order = 0;
+		bool significant = false;
+		bool fraction = false;
+		for (; p < end && *p != 'e' && *p != 'E'; ++p) {
+			if (*p == '.') {
+				fraction = true;
+			} else if (*p != '0') {
+				significant = true;
+				if (!fraction) {
+					order += 1;
+				}
+			} else if (!fraction && significant) {
+				order += 1;
+			} else if (fraction && !significant) {
+				order -= 1;
+			}
+		}
+
+		if (p < end) {
+			p += 1;
+			bool negative = *p == '-';
+			if (*p == '-' || *p == '+') {
+				p += 1;
+			}
+
+			// Exponents this large are out of range whatever the digits
+			int64_t exponent = 0;
+			for (; p < end && exponent < 1000000000; ++p) {
+				exponent = exponent * 10 + (*p - '0');
+			}
+			order += negative ? -exponent : exponent;
+		}
+
+		return order <= 0;
+	}
+
+	// Check that 'start' to 'end' is a JSON number:
+	// -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+	static bool validNumber(const char *start, const char *end, bool &isInteger) {
+		auto digits = [&](const char *&p) {
+			const char *begin = p;
+			while (p < end && *p >= '0' && *p <= '9') {
+				p += 1;
+			}
+			return p > begin;
+		};
+
+		const char *p = start;
+		if (p < end && *p == '-') {
+			p += 1;
+		}
+
+		if (p < end && *p == '0') {
+			p += 1;
+		} else if (!digits(p)) {
+			return false;
+		}
+
+		isInteger = true;
+		if (p < end && *p == '.') {
+			p += 1;
+			isInteger = false;
+			if (!digits(p)) {
+				return false;
+			}
+		}
+
+		if (p < end && (*p == 'e' || *p == 'E')) {
+			p += 1;
+			isInteger = false;
+			if (p < end && (*p == '+' || *p == '-')) {
+				p += 1;
+			}
+			if (!digits(p)) {
+				return false;
+			}
+		}
+
+		return p == end;
+	}
+
+	template<size_t N>
+	void expectLiteral(const char (&literal)[N]) {
+		for (size_t i = 0; i < N - 1; ++i) {
+			if (!fill() || *pos_ != literal[i]) {
+				fail("Invalid value", 0);
+			}
+			pos_ += 1;
+		}
+	}
+
+	// Count the bytes at the start of 'data' which can be copied
+	// as they are into a string, up to 'size'
+	static size_t countPlain(const char *data, size_t size) {
+		size_t count = 0;
+
+#if defined(__SSE2__)
+		const __m128i quote = _mm_set1_epi8('"');
+		const __m128i backslash = _mm_set1_epi8('\\');
+		const __m128i control = _mm_set1_epi8(0x1f);
+		while (size - count >= 16) {
+			__m128i chunk = _mm_loadu_si128((const __m128i *)(data + count));
+			__m128i special = _mm_or_si128(
+				_mm_or_si128(
+					_mm_cmpeq_epi8(chunk, quote),
+					_mm_cmpeq_epi8(chunk, backslash)),
+				_mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk));
+			unsigned int mask = _mm_movemask_epi8(special);
+			if (mask != 0) {
+				return count + __builtin_ctz(mask);
+			}
+
+			count += 16;
+		}
+#endif
+
+		while (count < size) {
+			unsigned char ch = data[count];
+			if (ch < 0x20 || ch == '"' || ch == '\\') {
+				break;
+			}
+			count += 1;
+		}
+
+		return count;
+	}
+
+	static bool isWhitespace(char ch) {
+		return ch == ' ' || ch == '\n' || ch == '\r' || ch == '\t';
+	}
+
+	// Count the whitespace bytes at the start of 'data', up to 'size'.
+	// Pretty-printed JSON can be mostly indentation,
+	// so long runs are worth scanning 16 bytes at a time.
+	static size_t countWhitespace(const char *data, size_t size) {
+		size_t count = 0;
+
+#if defined(__SSE2__)
+		const __m128i space = _mm_set1_epi8(' ');
+		const __m128i newline = _mm_set1_epi8('\n');
+		const __m128i cr = _mm_set1_epi8('\r');
+		const __m128i tab = _mm_set1_epi8('\t');
+		while (size - count >= 16) {
+			__m128i chunk = _mm_loadu_si128((const __m128i *)(data + count));
+			__m128i whitespace = _mm_or_si128(
+				_mm_or_si128(
+					_mm_cmpeq_epi8(chunk, space),
+					_mm_cmpeq_epi8(chunk, newline)),
+				_mm_or_si128(
+					_mm_cmpeq_epi8(chunk, cr),
+					_mm_cmpeq_epi8(chunk, tab)));
+			unsigned int mask = _mm_movemask_epi8(whitespace) ^ 0xffff;
+			if (mask != 0) {
+				return count + __builtin_ctz(mask);
+			}
+
+			count += 16;
+		}
+#endif
+
+		while (count < size && isWhitespace(data[count])) {
+			count += 1;
+		}
+
+		return count;
+	}
+
+	void skipWhitespace() {
+		while (fill()) {
+			// Values are usually separated by no or one whitespace byte,
+			// so check that before scanning for longer runs
+			if (!isWhitespace(*pos_)) {
+				return;
+			}
+
+			pos_ += 1;
+			pos_ += countWhitespace(pos_, end_ - pos_);
+		}
+	}
+
+	char peek(const char *eofMessage) {
+		if (!fill()) {
+			fail(eofMessage, 0);
+		}
+		return *pos_;
+	}
+
+	char next(const char *eofMessage) {
+		char ch = peek(eofMessage);
+		pos_ += 1;
+		return ch;
+	}
+
+	// Make sure there's at least one byte to read,
+	// reading more input if necessary.
+	// Returns false at the end of the input.
+	bool fill() {
+		if (pos_ < end_) {
+			return true;
+		}
+
+		if (!read_) {
+			return false;
+		}
+
+		consumed_ += end_ - start_;
+		size_t n = read_(buf_.data(), buf_.size());
+		start_ = buf_.data();
+		pos_ = start_;
+		end_ = pos_ + n;
+		return n > 0;
+	}
+
+	[[noreturn]] void fail(const char *message, size_t back) {
+		throw JsonError(message, offset() - back);
+	}
+
+	std::function<size_t(char *, size_t)> read_;
+	std::vector<char> buf_;
+
+	// The current buffer, and the next byte to read in it
+	const char *start_ = nullptr;
+	const char *pos_ = nullptr;
+	const char *end_ = nullptr;
+
+	// Number of bytes before the start of the current buffer
+	size_t consumed_ = 0;
+
+	// Open containers, as their opening bracket
+	std::vector<char> stack_;
+
+	// Strings with escapes, or which are split between reads
+	std::string scratch_;
+};
+
+#endif
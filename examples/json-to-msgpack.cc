@@ -1,58 +1,271 @@
 #include "../msgstream.h"
-#include <json/json.h>
+#include "json-reader.h"
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <vector>
 
-void writeValue(MsgStream::Serializer &serializer, const Json::Value &val) {
-	if (val.isUInt() || val.isUInt64()) {
-		serializer.writeUInt(val.asUInt64());
-	} else if (val.isInt() || val.isInt64()) {
-		serializer.writeInt(val.asInt64());
-	} else if (val.isNumeric()) {
-		serializer.writeFloat64(val.asDouble());
-	} else if (val.isNull()) {
-		serializer.writeNil();
-	} else if (val.isBool()) {
-		serializer.writeBool(val.asBool());
-	} else if (val.isString()) {
-		serializer.writeString(val.asCString());
-	} else if (val.isArray()) {
-		auto sub = serializer.beginArray(val.size());
-		for (Json::ArrayIndex i = 0; i < val.size(); ++i) {
-			writeValue(sub, val[i]);
+#ifdef MSGSTREAM_HAVE_MMAP
+#include <fcntl.h>
+#endif
+
+// Serializes values as the reader finds them, for input which
+// can only be read once.
+// The lengths of arrays and objects aren't known until they end,
+// so they're written with in-place builders, which reserve a header
+// and fill it in (with the smallest header that fits) at the end.
+// This means each top-level value is buffered until it ends.
+class BufferingHandler {
+public:
+	BufferingHandler(): serializer_(sink_) {}
+
+	void onNull() { top().writeNil(); }
+	void onBool(bool b) { top().writeBool(b); }
+	void onInt(int64_t num) { top().writeInt(num); }
+	void onUInt(uint64_t num) { top().writeUInt(num); }
+	void onDouble(double num) { top().writeFloat64(num); }
+	void onString(std::string_view str) { top().writeString(str); }
+
+	void onArrayBegin() {
+		stack_.push_back(std::make_unique<MsgStream::BufferArrayBuilder>(top()));
+	}
+
+	void onArrayEnd() {
+		std::unique_ptr<MsgStream::BufferSerializer> builder = pop();
+		top().writeArray(static_cast<MsgStream::BufferArrayBuilder &>(*builder));
+	}
+
+	void onObjectBegin() {
+		stack_.push_back(std::make_unique<MsgStream::BufferMapBuilder>(top()));
+	}
+
+	void onObjectEnd() {
+		std::unique_ptr<MsgStream::BufferSerializer> builder = pop();
+		top().writeMap(static_cast<MsgStream::BufferMapBuilder &>(*builder));
+	}
+
+	// Write out the first 'length' bytes serialized so far,
+	// which must end between top-level values, and drop the rest
+	void flush(size_t length) {
+		std::cout.write((const char *)sink_.data().data(), length);
+		sink_.clear();
+	}
+
+	size_t buffered() const { return sink_.size(); }
+
+private:
+	MsgStream::BufferSerializer &top() {
+		return stack_.empty() ? serializer_ : *stack_.back();
+	}
+
+	std::unique_ptr<MsgStream::BufferSerializer> pop() {
+		std::unique_ptr<MsgStream::BufferSerializer> builder =
+			std::move(stack_.back());
+		stack_.pop_back();
+		return builder;
+	}
+
+	MsgStream::BufferSink sink_;
+	MsgStream::BufferSerializer serializer_;
+	std::vector<std::unique_ptr<MsgStream::BufferSerializer>> stack_;
+};
+
+// Convert every top-level value in the input,
+// writing the output in blocks of about 64KiB.
+// If the input is invalid, the output ends after the last valid value.
+static void convertAll(JsonReader &reader) {
+	BufferingHandler handler;
+	size_t complete = 0;
+	try {
+		while (reader.parseNext(handler)) {
+			complete = handler.buffered();
+			if (complete >= 64 * 1024) {
+				handler.flush(complete);
+				complete = 0;
+			}
 		}
-		serializer.endArray(sub);
-	} else if (val.isObject()) {
-		auto keys = val.getMemberNames();
-		auto sub = serializer.beginMap(keys.size());
-		for (auto &key: keys) {
-			sub.writeString(key);
-			writeValue(sub, val[key]);
+	} catch (JsonError &err) {
+		handler.flush(complete);
+		throw;
+	}
+
+	handler.flush(handler.buffered());
+}
+
+#ifdef MSGSTREAM_HAVE_MMAP
+using FdSerializer = MsgStream::BasicSerializer<MsgStream::FdSink>;
+
+// The first pass over a top-level value in memory:
+// counts the values in each array and object,
+// in the order the containers are opened.
+// Objects count their keys and values.
+class CountingHandler {
+public:
+	void onNull() { count(); }
+	void onBool(bool) { count(); }
+	void onInt(int64_t) { count(); }
+	void onUInt(uint64_t) { count(); }
+	void onDouble(double) { count(); }
+	void onString(std::string_view) { count(); }
+
+	void onArrayBegin() { open(); }
+	void onArrayEnd() { open_.pop_back(); }
+	void onObjectBegin() { open(); }
+	void onObjectEnd() { open_.pop_back(); }
+
+	const std::vector<size_t> &counts() const { return counts_; }
+
+	void clear() { counts_.clear(); }
+
+private:
+	void count() {
+		if (!open_.empty()) {
+			counts_[open_.back()] += 1;
 		}
-		serializer.endMap(sub);
 	}
+
+	void open() {
+		count();
+		open_.push_back(counts_.size());
+		counts_.push_back(0);
+	}
+
+	std::vector<size_t> counts_;
+
+	// Indices in 'counts_' of the open containers
+	std::vector<size_t> open_;
+};
+
+// The second pass: with the lengths known up front,
+// values are serialized straight to the output
+class StreamingHandler {
+public:
+	StreamingHandler(FdSerializer &serializer, const std::vector<size_t> &counts):
+		serializer_(serializer), counts_(counts) {}
+
+	void onNull() { top().writeNil(); }
+	void onBool(bool b) { top().writeBool(b); }
+	void onInt(int64_t num) { top().writeInt(num); }
+	void onUInt(uint64_t num) { top().writeUInt(num); }
+	void onDouble(double num) { top().writeFloat64(num); }
+	void onString(std::string_view str) { top().writeString(str); }
+
+	void onArrayBegin() {
+		stack_.push_back(top().beginArray(counts_[next_++]));
+	}
+
+	void onArrayEnd() {
+		FdSerializer sub = pop();
+		top().endArray(sub);
+	}
+
+	void onObjectBegin() {
+		stack_.push_back(top().beginMap(counts_[next_++] / 2));
+	}
+
+	void onObjectEnd() {
+		FdSerializer sub = pop();
+		top().endMap(sub);
+	}
+
+private:
+	FdSerializer &top() {
+		return stack_.empty() ? serializer_ : stack_.back();
+	}
+
+	FdSerializer pop() {
+		FdSerializer sub = std::move(stack_.back());
+		stack_.pop_back();
+		return sub;
+	}
+
+	FdSerializer &serializer_;
+	const std::vector<size_t> &counts_;
+	size_t next_ = 0;
+	std::vector<FdSerializer> stack_;
+};
+
+// Convert every top-level value in 'text', which is all in memory.
+// Each value is read twice, first to count the lengths of its
+// arrays and objects, then to write it out with those lengths,
+// so only the lengths are kept in memory rather than the output.
+// Invalid values are found by the first pass, before any of them is written.
+static void convertMapped(std::string_view text) {
+	JsonReader counter(text);
+	JsonReader reader(text);
+	CountingHandler counts;
+	MsgStream::FdSink sink(STDOUT_FILENO);
+	FdSerializer serializer(sink);
+	while (counter.parseNext(counts)) {
+		StreamingHandler handler(serializer, counts.counts());
+		reader.parseNext(handler);
+		counts.clear();
+	}
+
+	sink.flush();
 }
+#endif
 
 int main(int argc, char **argv) {
-	std::ifstream file;
-	std::istream *is;
-	if (argc == 1) {
-		is = &std::cin;
-	} else if (argc == 2) {
-		file = std::ifstream(argv[1]);
-		if (!file) {
-			std::cerr << "Failed to open " << argv[1] << '\n';
-			return 1;
-		}
-		is = &file;
-	} else {
+	if (argc > 2) {
 		std::cerr << "Usage: " << argv[0] << " [file]\n";
 		return 1;
 	}
 
-	Json::Value val;
-	*is >> val;
+	try {
+#ifdef MSGSTREAM_HAVE_MMAP
+		// Regular files are mapped into memory and read in place,
+		// everything else (pipes, terminals, sockets) is read in blocks
+		// and converted one top-level value at a time
+		int fd = STDIN_FILENO;
+		if (argc == 2) {
+			fd = open(argv[1], O_RDONLY);
+			if (fd < 0) {
+				std::cerr << "Failed to open " << argv[1] << '\n';
+				return 1;
+			}
+		}
+
+		if (MsgStream::MappedFile::canMap(fd)) {
+			MsgStream::MappedFile file(fd);
+			std::span<const unsigned char> data = file.data();
+			convertMapped(
+				std::string_view((const char *)data.data(), data.size()));
+		} else {
+			MsgStream::FdSource src(fd);
+			JsonReader reader([&](char *buf, size_t size) {
+				return src.read(buf, size);
+			});
+			convertAll(reader);
+		}
+#else
+		std::ifstream file;
+		std::istream *is = &std::cin;
+		if (argc == 2) {
+			file = std::ifstream(argv[1], std::ios::binary);
+			if (!file) {
+				std::cerr << "Failed to open " << argv[1] << '\n';
+				return 1;
+			}
+			is = &file;
+		}
 
-	MsgStream::Serializer serializer(std::cout);
-	writeValue(serializer, val);
+		JsonReader reader([&](char *buf, size_t size) {
+			is->read(buf, size);
+			return (size_t)is->gcount();
+		});
+		convertAll(reader);
+#endif
+	} catch (JsonError &err) {
+		std::cerr << "JSON error: " << err.what() << '\n';
+		return 1;
+	} catch (MsgStream::ParseError &err) {
+		// From FdSource, if reading fails
+		std::cerr << "Read error: " << err.what() << '\n';
+		return 1;
+	} catch (MsgStream::SerializeError &err) {
+		// From FdSink, if writing fails
+		std::cerr << "Write error: " << err.what() << '\n';
+		return 1;
+	}
 }
@@ -0,0 +1,361 @@
+#ifndef MSGSTREAM_EXAMPLES_JSON_WRITER_H
+#define MSGSTREAM_EXAMPLES_JSON_WRITER_H
+
+#include <charconv>
+#include <cmath>
+#include <memory>
+#include <string_view>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * Writes JSON text into a growable buffer.
+ *
+ * Values are written with the writeX() methods, and containers
+ * with beginArray()/endArray() and beginObject()/endObject().
+ * In an object, values alternate between keys and values;
+ * the writer puts the separators and (when pretty-printing)
+ * the newlines and indentation between them.
+ * Each top-level value is followed by a newline, so that in compact mode
+ * a series of top-level values is written as NDJSON.
+ *
+ * Like JSON itself, the writer doesn't check that keys are strings,
+ * and NaNs and infinities are written as null.
+ */
+class JsonWriter {
+public:
+	explicit JsonWriter(bool pretty = true): pretty_(pretty) {}
+
+	/**
+	 * Get the text written so far.
+	 * The view is invalidated by further writes.
+	 */
+	std::string_view data() const {
+		return std::string_view(buf_.get(), size_);
+	}
+
+	size_t size() const { return size_; }
+
+	/**
+	 * Get the number of containers the writer is in.
+	 */
+	size_t depth() const { return stack_.size(); }
+
+	/**
+	 * Clear the written text, keeping the buffer's capacity.
+	 * This doesn't change which container the writer is in.
+	 */
+	void clear() { size_ = 0; }
+
+	void writeNull() {
+		beforeValue();
+		appendLiteral("null");
+		afterValue();
+	}
+
+	void writeBool(bool b) {
+		beforeValue();
+		if (b) {
+			appendLiteral("true");
+		} else {
+			appendLiteral("false");
+		}
+		afterValue();
+	}
+
+	void writeInt(int64_t num) {
+		beforeValue();
+		appendNumber(num);
+		afterValue();
+	}
+
+	void writeUInt(uint64_t num) {
+		beforeValue();
+		appendNumber(num);
+		afterValue();
+	}
+
+	/**
+	 * Write the shortest decimal representation which reads back
+	 * as the same float.
+	 */
+	void writeFloat32(float num) {
+		beforeValue();
+		if (std::isfinite(num)) {
+			appendNumber(num);
+		} else {
+			appendLiteral("null");
+		}
+		afterValue();
+	}
+
+	/**
+	 * Write the shortest decimal representation which reads back
+	 * as the same double.
+	 */
+	void writeFloat64(double num) {
+		beforeValue();
+		if (std::isfinite(num)) {
+			appendNumber(num);
+		} else {
+			appendLiteral("null");
+		}
+		afterValue();
+	}
+
+	/**
+	 * Write a string, escaping quotes, backslashes and control characters.
+	 * Other bytes are copied as they are, so the string should be UTF-8.
+	 */
+	void writeString(std::string_view str) {
+		beforeValue();
+		*append(1) = '"';
+
+		const char *ptr = str.data();
+		const char *end = ptr + str.size();
+		while (true) {
+			size_t length = countUnescaped(ptr, end - ptr);
+			if (length > 0) {
+				memcpy(append(length), ptr, length);
+				ptr += length;
+			}
+
+			if (ptr == end) {
+				break;
+			}
+
+			appendEscape((unsigned char)*ptr);
+			ptr += 1;
+		}
+
+		*append(1) = '"';
+		afterValue();
+	}
+
+	/**
+	 * Write a string of 'length' bytes which don't need escaping,
+	 * and return a pointer to where its contents go.
+	 * The caller must fill in all 'length' bytes before
+	 * writing anything else.
+	 */
+	char *writeUnescapedString(size_t length) {
+		beforeValue();
+		size_t pos = size_ + 1;
+		char *out = append(length + 2);
+		out[0] = '"';
+		out[length + 1] = '"';
+
+		// The newline after a top-level value can move the buffer
+		afterValue();
+		return buf_.get() + pos;
+	}
+
+	void beginArray() {
+		beforeValue();
+		*append(1) = '[';
+		stack_.push_back({false, 0});
+	}
+
+	void endArray() {
+		endContainer(']');
+	}
+
+	void beginObject() {
+		beforeValue();
+		*append(1) = '{';
+		stack_.push_back({true, 0});
+	}
+
+	void endObject() {
+		endContainer('}');
+	}
+
+private:
+	struct Container {
+		bool isObject;
+
+		// Number of values written so far, including keys
+		size_t count;
+	};
+
+	// Whether 'ch' can't be written as it is in a string
+	static bool needsEscape(unsigned char ch) {
+		return ch < 0x20 || ch == '"' || ch == '\\';
+	}
+
+	// Count the bytes at the start of 'data' which don't need escaping,
+	// up to 'size'
+	static size_t countUnescaped(const char *data, size_t size) {
+		size_t count = 0;
+
+#if defined(__SSE2__)
+		const __m128i quote = _mm_set1_epi8('"');
+		const __m128i backslash = _mm_set1_epi8('\\');
+		const __m128i control = _mm_set1_epi8(0x1f);
+		while (size - count >= 16) {
+			__m128i chunk = _mm_loadu_si128((const __m128i *)(data + count));
+
+			// A byte is a control character if it's unchanged
+			// by an unsigned min with 0x1f
+			__m128i escapes = _mm_or_si128(
+				_mm_or_si128(
+					_mm_cmpeq_epi8(chunk, quote),
+					_mm_cmpeq_epi8(chunk, backslash)),
+				_mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk));
+			unsigned int mask = _mm_movemask_epi8(escapes);
+			if (mask != 0) {
+				return count + __builtin_ctz(mask);
+			}
+
+			count += 16;
+		}
+#endif
+
+		while (count < size && !needsEscape(data[count])) {
+			count += 1;
+		}
+
+		return count;
+	}
+
+	void appendEscape(unsigned char ch) {
+		char *out = append(2);
+		out[0] = '\\';
+		switch (ch) {
+		case '"': out[1] = '"'; return;
+		case '\\': out[1] = '\\'; return;
+		case '\b': out[1] = 'b'; return;
+		case '\f': out[1] = 'f'; return;
+		case '\n': out[1] = 'n'; return;
+		case '\r': out[1] = 'r'; return;
+		case '\t': out[1] = 't'; return;
+		}
+
+		static constexpr const char *HEX = "0123456789abcdef";
+		out[1] = 'u';
+		out = append(4);
+		out[0] = '0';
+		out[1] = '0';
+		out[2] = HEX[ch >> 4];
+		out[3] = HEX[ch & 0x0f];
+	}
+
+	template<size_t N>
+	void appendLiteral(const char (&str)[N]) {
+		memcpy(append(N - 1), str, N - 1);
+	}
+
+	template<typename T>
+	void appendNumber(T num) {
+		// Enough for any integer, and for any float or double
+		// in its shortest representation
+		constexpr size_t maxLength = 32;
+		reserve(maxLength);
+		char *ptr = buf_.get() + size_;
+		size_ = std::to_chars(ptr, ptr + maxLength, num).ptr - buf_.get();
+	}
+
+	void newline(size_t depth) {
+		static constexpr const char SPACES[] =
+			"                                                                ";
+		*append(1) = '\n';
+
+		size_t length = depth * 2;
+		while (length > 0) {
+			size_t n = length < sizeof(SPACES) - 1 ? length : sizeof(SPACES) - 1;
+			memcpy(append(n), SPACES, n);
+			length -= n;
+		}
+	}
+
+	void beforeValue() {
+		if (stack_.empty()) {
+			return;
+		}
+
+		Container &top = stack_.back();
+		if (top.isObject && top.count % 2 == 1) {
+			if (pretty_) {
+				memcpy(append(2), ": ", 2);
+			} else {
+				*append(1) = ':';
+			}
+			return;
+		}
+
+		if (top.count > 0) {
+			*append(1) = ',';
+		}
+		if (pretty_) {
+			newline(stack_.size());
+		}
+	}
+
+	void afterValue() {
+		if (stack_.empty()) {
+			*append(1) = '\n';
+		} else {
+			stack_.back().count += 1;
+		}
+	}
+
+	void endContainer(char ch) {
+		bool empty = stack_.back().count == 0;
+		stack_.pop_back();
+		if (pretty_ && !empty) {
+			newline(stack_.size());
+		}
+
+		*append(1) = ch;
+		afterValue();
+	}
+
+	void reserve(size_t length) {
+		if (length > capacity_ - size_) {
+			grow(length);
+		}
+	}
+
+	// Extend the written text by 'length' bytes,
+	// and return a pointer to the start of the new bytes
+	char *append(size_t length) {
+		reserve(length);
+		char *ptr = buf_.get() + size_;
+		size_ += length;
+		return ptr;
+	}
+
+	void grow(size_t length) {
+		size_t capacity = capacity_ * 2;
+		if (capacity < size_ + length) {
+			capacity = size_ + length;
+		}
+		if (capacity < 4096) {
+			capacity = 4096;
+		}
+
+		std::unique_ptr<char[]> buf =
+			std::make_unique_for_overwrite<char[]>(capacity);
+		if (size_ > 0) {
+			memcpy(buf.get(), buf_.get(), size_);
+		}
+
+		buf_ = std::move(buf);
+		capacity_ = capacity;
+	}
+
+	bool pretty_;
+	std::vector<Container> stack_;
+
+	std::unique_ptr<char[]> buf_;
+	size_t capacity_ = 0;
+	size_t size_ = 0;
+};
+
+#endif
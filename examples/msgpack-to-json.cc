@@ -1,198 +1,350 @@
 #include "../msgstream.h"
+#include "base64.h"
+#include "json-writer.h"
+#include <algorithm>
 #include <iostream>
+#include <optional>
 #include <fstream>
+#include <stdio.h>
+#include <stdlib.h>
 #include <span>
 #include <string>
+#include <string_view>
+#include <type_traits>
 
-static void printString(const std::string &str) {
-	std::cout << '"';
-
-	for (char ch: str) {
-		if (ch == '\n') {
-			std::cout << "\\n";
-		} else if (ch == '\r') {
-			std::cout << "\\r";
-		} else if (ch == '\t') {
-			std::cout << "\\t";
-		} else if (ch == '"') {
-			std::cout << "\\\"";
-		} else {
-			std::cout << ch;
-		}
-	}
-
-	std::cout << '"';
-}
+#ifdef MSGSTREAM_HAVE_MMAP
+#include <fcntl.h>
+#endif
 
 // JSON doesn't natively support binary and extension types,
-// so we'll print them as base64 data URIs
-static void printBinary(std::string_view mime, std::span<unsigned char> data) {
-	constexpr const char *ALPHABET =
-		"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-		"abcdefghijklmnopqrstuvwxyz"
-		"0123456789+/";
-
-	std::string str;
-	str += "data:";
-	str += mime; 
-	str += ";base64,";
-
-	size_t i;
-	for (i = 0; i + 2 < data.size(); i += 3) {
-		uint32_t num =
-			(data[i] << 16) |
-			(data[i + 1] << 8) |
-			(data[i + 2] << 0);
-		str += ALPHABET[(num >> 18) & 0x3f];
-		str += ALPHABET[(num >> 12) & 0x3f];
-		str += ALPHABET[(num >> 6) & 0x3f];
-		str += ALPHABET[(num >> 0) & 0x3f];
-	}
-
-	if (data.size() - i == 2) {
-		// in:  [ xxxxxxxx yyyyyyyy ]
-		// out: [ xxxxxx xxyyyy yyyy00 ]
-		uint16_t num = (data[i] << 8) | data[i + 1];
-		str += ALPHABET[(num >> 10) & 0x3f];
-		str += ALPHABET[(num >> 4) & 0x3f];
-		str += ALPHABET[(num << 2) & 0x3f];
-		str += '=';
-	} else if (data.size() - i == 1) {
-		// in:  [ xxxxxxxx ]
-		// out: [ xxxxxx xx0000 ]
-		uint8_t num = data[i];
-		str += ALPHABET[(num >> 2) & 0x3f];
-		str += ALPHABET[(num << 4) & 0x3f];
-		str += "==";
-	}
+// so we'll print them as base64 data URIs.
+// Neither the MIME types nor base64 need escaping,
+// so the URI is written straight into the output.
+static void printBinary(
+		JsonWriter &out, std::string_view mime,
+		std::span<const unsigned char> data) {
+	constexpr std::string_view prefix = "data:";
+	constexpr std::string_view separator = ";base64,";
 
-	printString(str);
+	char *ptr = out.writeUnescapedString(
+		prefix.size() + mime.size() + separator.size() +
+		Base64::encodedSize(data.size()));
+	ptr = std::copy(prefix.begin(), prefix.end(), ptr);
+	ptr = std::copy(mime.begin(), mime.end(), ptr);
+	ptr = std::copy(separator.begin(), separator.end(), ptr);
+	Base64::encode(data, ptr);
 }
 
-static void indent(int depth) {
-	for (int i = 0; i < depth; ++i) {
-		std::cout << "  ";
+// Timestamps are printed as ISO-8601 strings in UTC
+static void printTimestamp(
+		JsonWriter &out, const MsgStream::Timestamp &ts) {
+	// Split into days and seconds of the day, rounding towards -infinity
+	int64_t days = ts.seconds / 86400;
+	int64_t secs = ts.seconds % 86400;
+	if (secs < 0) {
+		days -= 1;
+		secs += 86400;
 	}
-}
 
-static void printValue(MsgStream::Parser &parser, int depth);
+	// Convert days since the epoch to a (proleptic Gregorian) date,
+	// with years starting in March so that leap days come last
+	days += 719468;
+	int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+	int64_t dayOfEra = days - era * 146097;
+	int64_t yearOfEra = (
+		dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+	int64_t dayOfYear = dayOfEra - (
+		365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+	int64_t monthIndex = (5 * dayOfYear + 2) / 153;
+	int64_t day = dayOfYear - (153 * monthIndex + 2) / 5 + 1;
+	int64_t month = monthIndex < 10 ? monthIndex + 3 : monthIndex - 9;
+	int64_t year = yearOfEra + era * 400 + (month <= 2 ? 1 : 0);
 
-static void printArray(MsgStream::ArrayParser parser, int depth) {
-	std::cout << "[\n";
+	char buf[64];
+	int length = snprintf(
+		buf, sizeof(buf),
+		year >= 0 && year <= 9999 ? "%04lld" : "%+05lld", (long long)year);
+	length += snprintf(
+		buf + length, sizeof(buf) - length, "-%02d-%02dT%02d:%02d:%02d",
+		(int)month, (int)day,
+		(int)(secs / 3600), (int)(secs / 60 % 60), (int)(secs % 60));
 
-	while (parser.hasNext()) {
-		indent(depth + 1);
-		printValue(parser, depth + 1);
-		if (parser.hasNext()) {
-			std::cout << ',';
+	if (ts.nanoseconds != 0) {
+		int digits = 9;
+		uint32_t fraction = ts.nanoseconds;
+		while (fraction % 10 == 0) {
+			fraction /= 10;
+			digits -= 1;
 		}
 
-		std::cout << '\n';
+		length += snprintf(
+			buf + length, sizeof(buf) - length, ".%0*u", digits, fraction);
 	}
 
-	indent(depth);
-	std::cout << ']';
+	buf[length++] = 'Z';
+	out.writeString(std::string_view(buf, length));
 }
 
-static void printMap(MsgStream::MapParser parser, int depth) {
-	std::cout << "{\n";
-
-	while (parser.hasNext()) {
-		indent(depth + 1);
-
-		printValue(parser, depth + 1);
-
-		std::cout << ": ";
-
-		printValue(parser, depth + 1);
+// Call 'flush' once a good amount of text has been written.
+// The writer keeps track of which container it's in,
+// so this can be done between any two values.
+template<typename Flush>
+static void maybeFlush(JsonWriter &out, Flush &flush) {
+	if (out.size() >= 64 * 1024) {
+		flush(out);
+	}
+}
 
-		if (parser.hasNext()) {
-			std::cout << ',';
-		}
+template<typename Source, typename Flush>
+static void printValue(
+		JsonWriter &out, MsgStream::BasicParser<Source> &parser, Flush &flush);
 
-		std::cout << '\n';
+template<typename Source, typename Flush>
+static void printArray(
+		JsonWriter &out, MsgStream::BasicArrayParser<Source> parser,
+		Flush &flush) {
+	out.beginArray();
+	while (parser.hasNext()) {
+		printValue(out, parser, flush);
+		maybeFlush(out, flush);
 	}
+	out.endArray();
+}
 
-	indent(depth);
-	std::cout << '}';
+template<typename Source, typename Flush>
+static void printMap(
+		JsonWriter &out, MsgStream::BasicMapParser<Source> parser,
+		Flush &flush) {
+	out.beginObject();
+	while (parser.hasNext()) {
+		printValue(out, parser, flush);
+		printValue(out, parser, flush);
+		maybeFlush(out, flush);
+	}
+	out.endObject();
 }
 
-static void printValue(MsgStream::Parser &parser, int depth) {
+template<typename Source, typename Flush>
+static void printValue(
+		JsonWriter &out, MsgStream::BasicParser<Source> &parser, Flush &flush) {
 	using Type = MsgStream::Type;
 
-	if (depth >= 1000) {
+	// When the whole input is in memory, strings and binaries
+	// can be printed straight from it without copying them first
+	constexpr bool inMemory = std::is_same_v<Source, MsgStream::SpanSource>;
+
+	if (out.depth() >= 1000) {
 		throw MsgStream::ParseError("Depth limit exceeded");
 	}
 
 	switch (parser.nextType()) {
 	case Type::INT:
-		std::cout << parser.nextInt();
+		out.writeInt(parser.nextInt());
 		break;
 	case Type::UINT:
-		std::cout << parser.nextUInt();
+		out.writeUInt(parser.nextUInt());
 		break;
 	case Type::NIL:
 		parser.skipNil();
-		std::cout << "null";
+		out.writeNull();
 		break;
 	case Type::BOOL:
-		std::cout << (parser.nextBool() ? "true" : "false");
+		out.writeBool(parser.nextBool());
 		break;
 	case Type::FLOAT32:
-		std::cout << parser.nextFloat32();
+		out.writeFloat32(parser.nextFloat32());
 		break;
 	case Type::FLOAT64:
-		std::cout << parser.nextFloat64();
+		out.writeFloat64(parser.nextFloat64());
 		break;
 	case Type::STRING:
-		printString(parser.nextString());
+		if constexpr (inMemory) {
+			out.writeString(parser.nextStringView());
+		} else {
+			out.writeString(parser.nextString());
+		}
 		break;
-	case Type::BINARY: {
-		auto bin = parser.nextBinary();
-		printBinary("application/octet-stream", bin);
-	}
+	case Type::BINARY:
+		if constexpr (inMemory) {
+			printBinary(out, "application/octet-stream", parser.nextBinaryView());
+		} else {
+			printBinary(out, "application/octet-stream", parser.nextBinary());
+		}
 		break;
 	case Type::ARRAY:
-		printArray(parser.nextArray(), depth);
+		printArray(out, parser.nextArray(), flush);
 		break;
 	case Type::MAP:
-		printMap(parser.nextMap(), depth);
+		printMap(out, parser.nextMap(), flush);
 		break;
 	case Type::EXTENSION: {
-		std::vector<unsigned char> bin;
-		int64_t type = parser.nextExtension(bin);
+		std::vector<unsigned char> buf;
+		std::span<const unsigned char> bin;
+		int64_t type;
+		if constexpr (inMemory) {
+			type = parser.nextExtensionView(bin);
+		} else {
+			type = parser.nextExtension(buf);
+			bin = buf;
+		}
+
+		if (type == MsgStream::Timestamp::EXTENSION_TYPE) {
+			printTimestamp(out, MsgStream::Timestamp::decode(bin));
+			break;
+		}
+
 		std::string mime = "application/x-msgpack-ext.";
 		mime += std::to_string(type);
-		printBinary(mime, bin);
+		printBinary(out, mime, bin);
 	}
 		break;
 	}
 }
 
+static void writeOut(JsonWriter &out) {
+	std::cout.write(out.data().data(), out.size());
+	out.clear();
+}
+
+// Print every value in 'parser', calling 'flush' whenever
+// a good amount of text has been written,
+// including in the middle of large arrays and maps
+template<typename Source, typename Flush>
+static void printAll(
+		JsonWriter &out, MsgStream::BasicParser<Source> &parser, Flush flush) {
+	while (parser.hasNext()) {
+		printValue(out, parser, flush);
+		maybeFlush(out, flush);
+	}
+}
+
+template<typename Source>
+static void printAll(Source &src, bool pretty) {
+	MsgStream::BasicParser<Source> parser(src);
+	JsonWriter out(pretty);
+	try {
+		printAll(out, parser, writeOut);
+	} catch (MsgStream::ParseError &err) {
+		writeOut(out);
+		throw;
+	}
+
+	writeOut(out);
+}
+
+#ifdef MSGSTREAM_HAVE_MMAP
+// The JSON for a chunk of top-level values,
+// and the error which ended it, if any
+struct RenderedChunk {
+	JsonWriter json;
+	std::optional<MsgStream::ParseError> error;
+};
+
+// Convert the top-level values in 'data' on 'threads' threads.
+// Each chunk of values is rendered into its own buffer,
+// and the buffers are written out in order, one write each.
+// As on one thread, the output ends where the first invalid value is.
+static void printAllParallel(
+		std::span<const unsigned char> data, bool pretty, unsigned threads) {
+	std::optional<MsgStream::ParseError> error;
+	MsgStream::ParallelOptions options;
+	options.threads = threads;
+	MsgStream::parseParallel(
+		data,
+		[pretty](MsgStream::SpanParser &parser) {
+			RenderedChunk chunk{JsonWriter(pretty), std::nullopt};
+			try {
+				printAll(chunk.json, parser, [](JsonWriter &) {});
+			} catch (MsgStream::ParseError &err) {
+				chunk.error = err;
+			}
+
+			return chunk;
+		},
+		[&](RenderedChunk chunk) {
+			if (error) {
+				return;
+			}
+
+			writeOut(chunk.json);
+			error = chunk.error;
+		},
+		options);
+
+	std::cout.flush();
+	if (error) {
+		throw *error;
+	}
+}
+#endif
+
+static int usage(const char *argv0) {
+	std::cerr << "Usage: " << argv0 << " [-c] [-j threads] [file]\n";
+	return 1;
+}
+
 int main(int argc, char **argv) {
-	std::ifstream file;
-	std::istream *is;
-	if (argc == 1) {
-		is = &std::cin;
-	} else if (argc == 2) {
-		file = std::ifstream(argv[1]);
-		if (!file) {
-			std::cerr << "Failed to open " << argv[1] << '\n';
-			return 1;
+	// With '-c', each top-level value is printed on one line (NDJSON).
+	// With '-j', regular files are converted on several threads.
+	bool pretty = true;
+	unsigned threads = 1;
+	const char *path = nullptr;
+	for (int i = 1; i < argc; ++i) {
+		std::string_view arg = argv[i];
+		if (arg == "-c") {
+			pretty = false;
+		} else if (arg == "-j" && i + 1 < argc) {
+			char *end;
+			threads = strtoul(argv[++i], &end, 10);
+			if (*end != '\0' || threads == 0) {
+				return usage(argv[0]);
+			}
+		} else if (path == nullptr) {
+			path = argv[i];
+		} else {
+			return usage(argv[0]);
 		}
-		is = &file;
-	} else {
-		std::cerr << "Usage: " << argv[0] << " [file]\n";
-		return 1;
 	}
 
 	try {
-		MsgStream::Parser parser(*is);
+#ifdef MSGSTREAM_HAVE_MMAP
+		// Regular files are mapped into memory and parsed in place,
+		// everything else (pipes, terminals, sockets) is streamed
+		int fd = STDIN_FILENO;
+		if (path != nullptr) {
+			fd = open(path, O_RDONLY);
+			if (fd < 0) {
+				std::cerr << "Failed to open " << path << '\n';
+				return 1;
+			}
+		}
 
-		while (parser.hasNext()) {
-			printValue(parser, 0);
-			std::cout << '\n';
+		if (MsgStream::MappedFile::canMap(fd)) {
+			MsgStream::MappedFile file(fd);
+			if (threads > 1) {
+				printAllParallel(file.data(), pretty, threads);
+			} else {
+				MsgStream::SpanSource src(file.data());
+				printAll(src, pretty);
+			}
+		} else {
+			MsgStream::FdSource src(fd);
+			printAll(src, pretty);
+		}
+#else
+		std::ifstream file;
+		std::istream *is = &std::cin;
+		if (path != nullptr) {
+			file = std::ifstream(path);
+			if (!file) {
+				std::cerr << "Failed to open " << path << '\n';
+				return 1;
+			}
+			is = &file;
 		}
+
+		printAll(*is, pretty);
+#endif
 	} catch (MsgStream::ParseError &err) {
 		std::cerr << "Parse error: " << err.what() << '\n';
 		return 1;
@@ -1,29 +1,118 @@
 #ifndef LIBMSGSTREAM_HEADER
 #define LIBMSGSTREAM_HEADER
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <concepts>
+#include <condition_variable>
+#include <coroutine>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <span>
 #include <sstream>
 #include <exception>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include <stdint.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if __has_include(<unistd.h>)
+#include <errno.h>
+#include <unistd.h>
+#define MSGSTREAM_HAVE_UNISTD 1
+#endif
+
+#if defined(MSGSTREAM_HAVE_UNISTD) && \
+	__has_include(<sys/mman.h>) && __has_include(<sys/stat.h>)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define MSGSTREAM_HAVE_MMAP 1
+#endif
+
+// When exceptions are disabled (such as with -fno-exceptions),
+// errors are reported through a ParseStatus instead (see below)
+#if !defined(MSGSTREAM_NO_EXCEPTIONS) && !defined(__cpp_exceptions)
+#define MSGSTREAM_NO_EXCEPTIONS 1
+#endif
+
+// Error paths are kept out of line, so that they don't get in the way
+// of inlining the parser's fast paths
+#if defined(__GNUC__)
+#define MSGSTREAM_COLD __attribute__((cold, noinline))
+#else
+#define MSGSTREAM_COLD
+#endif
+
 namespace MsgStream {
 
+/**
+ * What kind of error a ParseError or ParseStatus describes.
+ */
+enum class ErrorCode {
+	NONE,
+
+	// The input ended in the middle of a value
+	UNEXPECTED_EOF,
+
+	// A header byte which MessagePack doesn't use (0xc1)
+	INVALID_HEADER,
+
+	// The value isn't of the type it was read as
+	TYPE_MISMATCH,
+
+	// More values were read than an array or map contains
+	LENGTH_LIMIT,
+
+	// A value which is invalid for its type, such as a malformed timestamp,
+	// or an integer which doesn't fit in the type it was read into
+	INVALID_VALUE,
+
+	// An index or key which isn't in an array or map
+	NOT_FOUND,
+
+	// The source failed to read
+	IO_ERROR,
+
+	// Invalid arguments which don't depend on the input
+	INVALID_ARGUMENT,
+};
+
 class ParseError: public std::exception {
 public:
-	ParseError(const char *what): what_(what) {}
+	ParseError(const char *what):
+		what_(what), code_(ErrorCode::INVALID_VALUE) {}
+
+	ParseError(ErrorCode code, const char *what): what_(what), code_(code) {}
 
 	const char *what() const noexcept override {
 		return what_;
 	}
 
+	ErrorCode code() const noexcept {
+		return code_;
+	}
+
 private:
 	const char *what_;
+	ErrorCode code_;
 };
 
 class SerializeError: public std::exception {
@@ -38,1106 +127,6652 @@ private:
 	const char *what_;
 };
 
+/**
+ * Where a parser records the first error in its input,
+ * as an alternative to throwing a ParseError.
+ * This avoids the cost of unwinding on malformed input,
+ * and is the only way of recovering from errors
+ * when exceptions are disabled.
+ *
+ * Parsers record errors in a status when their ErrorMode is STATUS,
+ * such as 'SpanStatusParser' and 'StatusParser'.
+ * After an error, the parser (and all its sub-parsers) stop reading:
+ * 'hasNext()' returns false, and the 'nextX()' methods return
+ * zero, empty or false values. Check 'ok()' when done parsing:
+ *
+ *   ParseStatus status;
+ *   SpanStatusParser parser(src, status);
+ *   ...
+ *   if (!status.ok()) {
+ *     log(status.message, status.offset);
+ *   }
+ *
+ * A status must outlive the parsers which use it.
+ */
+struct ParseStatus {
+	// The offset of errors in sources which can't tell their position
+	static constexpr size_t UNKNOWN_OFFSET = (size_t)-1;
+
+	ErrorCode code = ErrorCode::NONE;
+
+	// The same message a ParseError would have
+	const char *message = nullptr;
+
+	// The number of bytes consumed from the source
+	// when the error was detected
+	size_t offset = 0;
+
+	bool ok() const { return code == ErrorCode::NONE; }
+
+	/**
+	 * Forget the error, to parse something else with the same status.
+	 */
+	void clear() { *this = ParseStatus(); }
+};
+
+/**
+ * How a parser reports errors: by throwing a ParseError,
+ * or by recording them in a ParseStatus.
+ * This is a template parameter of the parsers, so parsers which throw
+ * don't check for a recorded error as they read.
+ */
+enum class ErrorMode {
+	THROW,
+	STATUS,
+};
+
+namespace detail {
+
+// Throw 'err', or if exceptions are disabled, abort:
+// this is only used where the error can't be recorded in a ParseStatus
+template<typename Error>
+[[noreturn]] inline void raise(const Error &err) {
+#ifdef MSGSTREAM_NO_EXCEPTIONS
+	fprintf(stderr, "MsgStream: %s\n", err.what());
+	abort();
+#else
+	throw err;
+#endif
+}
+
+// Record an error in 'status', or throw it if there's no status.
+// Only the first error is recorded;
+// anything after it is likely a consequence of it.
+MSGSTREAM_COLD inline void report(
+		ParseStatus *status, ErrorCode code, const char *what, size_t offset) {
+	if (!status) {
+		raise(ParseError(code, what));
+	}
+
+	if (status->code == ErrorCode::NONE) {
+		status->code = code;
+		status->message = what;
+		status->offset = offset;
+	}
+}
+
+}
+
+/**
+ * A byte source which a parser can read from.
+ * Other than 'std::istream', sources must provide these methods:
+ *
+ *   int peek():
+ *     Get the next byte without consuming it, or -1 at the end of input.
+ *   size_t read(void *data, size_t length):
+ *     Read up to 'length' bytes into 'data', returning the number of bytes read.
+ *     Less than 'length' bytes must only be returned at the end of input.
+ *   size_t skip(size_t length):
+ *     Discard up to 'length' bytes, returning the number of bytes discarded.
+ *     Less than 'length' bytes must only be discarded at the end of input.
+ *
+ * Sources may also provide 'size_t position()', returning
+ * the number of bytes consumed so far, for ParseStatus offsets.
+ *
+ * Parsers only keep a reference to their source,
+ * so the source must outlive the parsers which read from it.
+ */
+template<typename T>
+concept ByteSource = requires(T &src, void *data, size_t length) {
+	{ src.peek() } -> std::convertible_to<int>;
+	{ src.read(data, length) } -> std::convertible_to<size_t>;
+	{ src.skip(length) } -> std::convertible_to<size_t>;
+};
+
+/**
+ * A byte sink which a serializer can write to.
+ * Other than 'std::ostream', sinks must provide this method:
+ *
+ *   void write(const void *data, size_t length):
+ *     Write all 'length' bytes from 'data'.
+ *     Failures should be reported by throwing an exception.
+ *
+ * Serializers only keep a reference to their sink,
+ * so the sink must outlive the serializers which write to it.
+ */
+template<typename T>
+concept ByteSink = requires(T &sink, const void *data, size_t length) {
+	sink.write(data, length);
+};
+
+/**
+ * A byte sink which allows overwriting bytes which were already written.
+ * This is required for 'beginArrayDeferred'/'beginMapDeferred'.
+ * Other than 'std::ostream', seekable sinks must provide these methods:
+ *
+ *   size_t position():
+ *     Get the number of bytes written so far.
+ *     Should throw a SerializeError if the sink isn't seekable.
+ *   void patch(size_t pos, const void *data, size_t length):
+ *     Overwrite the 'length' bytes starting at 'pos' with 'data'.
+ *     Subsequent writes must still go to the end.
+ */
+template<typename T>
+concept SeekableSink = ByteSink<T> && requires(
+		T &sink, size_t pos, const void *data, size_t length) {
+	{ sink.position() } -> std::convertible_to<size_t>;
+	sink.patch(pos, data, length);
+};
+
 namespace detail {
 
-class Reader {
+template<typename Source, ErrorMode Mode>
+class Reader;
+
+template<typename Sink>
+class Writer;
+
+}
+
+/**
+ * A byte source over a contiguous region of memory.
+ * Parsers which read from a SpanSource avoid the per-byte overhead of
+ * std::istream: multi-byte integers are read with a single load,
+ * and bounds are checked once per header or payload rather than once per byte.
+ *
+ * The SpanSource doesn't own the memory; the memory must stay valid
+ * for as long as the source and any parser reading from it are in use.
+ */
+class SpanSource {
 public:
-	explicit Reader(std::istream &is): is_(is) {}
+	explicit SpanSource(std::span<const unsigned char> data):
+		begin_(data.data()), cur_(begin_), end_(begin_ + data.size()) {}
+
+	explicit SpanSource(std::string_view data):
+		SpanSource(std::span<const unsigned char>(
+			(const unsigned char *)data.data(), data.size())) {}
+
+	/**
+	 * Get the number of bytes consumed so far.
+	 */
+	size_t position() const { return cur_ - begin_; }
+
+	/**
+	 * Get the number of bytes left to read.
+	 */
+	size_t remaining() const { return end_ - cur_; }
 
 	int peek() {
-		return is_.peek();
+		return cur_ == end_ ? -1 : *cur_;
 	}
 
-	int get() {
-		return is_.get();
+	size_t read(void *data, size_t length) {
+		length = skip(length);
+		memcpy(data, cur_ - length, length);
+		return length;
 	}
 
-	uint8_t nextU8() {
-		int ch = get();
-		if (ch < 0) {
-			throw ParseError("Unexpected EOF");
+	size_t skip(size_t length) {
+		if (length > remaining()) {
+			length = remaining();
 		}
 
-		return ch;
+		cur_ += length;
+		return length;
 	}
 
-	uint16_t nextU16() {
-		uint16_t a = (uint16_t)nextU8();
-		uint16_t b = (uint16_t)nextU8();
-		return (a << 8) | b;
-	}
+private:
+	template<typename Source, ErrorMode Mode>
+	friend class detail::Reader;
 
-	uint32_t nextU32() {
-		uint32_t a = (uint32_t)nextU16();
-		uint32_t b = (uint32_t)nextU16();
-		return (a << 16) | b;
-	}
+	const unsigned char *begin_;
+	const unsigned char *cur_;
+	const unsigned char *end_;
+};
 
-	uint64_t nextU64() {
-		uint64_t a = (uint64_t)nextU32();
-		uint64_t b = (uint64_t)nextU32();
-		return (a << 32) | b;
-	}
+/**
+ * A byte sink which writes to a growable contiguous buffer.
+ * Serializers which write to a BufferSink avoid the per-byte overhead of
+ * std::ostream: each header is written with a single bounds check
+ * and a single unaligned store, and payloads are written with memcpy.
+ *
+ * The buffer is owned by the sink, but a caller-supplied buffer
+ * can be handed to the sink in the constructor and taken back out
+ * with 'release()', to re-use its capacity.
+ * Growing the buffer doesn't initialize the new bytes,
+ * since they're about to be written anyway.
+ */
+class BufferSink {
+public:
+	BufferSink() = default;
 
-	int8_t nextI8() {
-		return (int8_t)nextU8();
-	}
+	/**
+	 * Create a sink which writes to 'buf', which has room for
+	 * 'capacity' bytes. The buffer's contents are discarded.
+	 */
+	BufferSink(std::unique_ptr<unsigned char[]> buf, size_t capacity):
+		buf_(std::move(buf)), capacity_(capacity) {}
 
-	int16_t nextI16() {
-		return (int16_t)nextU16();
+	/**
+	 * Get the bytes written so far.
+	 * The span is invalidated by further writes to the sink.
+	 */
+	std::span<const unsigned char> data() const {
+		return std::span<const unsigned char>(buf_.get(), size_);
 	}
 
-	int32_t nextI32() {
-		return (int32_t)nextU32();
+	/**
+	 * Get the number of bytes written so far.
+	 */
+	size_t size() const { return size_; }
+
+	/**
+	 * Get the number of bytes which fit in the buffer
+	 * before it has to grow.
+	 */
+	size_t capacity() const { return capacity_; }
+
+	/**
+	 * Clear the written bytes.
+	 * The capacity of the buffer will be kept.
+	 */
+	void clear() { size_ = 0; }
+
+	/**
+	 * Take the underlying buffer out of the sink.
+	 * Its first 'size()' bytes are the bytes written so far,
+	 * and it has room for 'capacity()' bytes, so read those first;
+	 * the sink is left empty, without a buffer.
+	 */
+	std::unique_ptr<unsigned char[]> release() {
+		size_ = 0;
+		capacity_ = 0;
+		return std::move(buf_);
 	}
 
-	int64_t nextI64() {
-		return (int64_t)nextU64();
+	/**
+	 * Make sure that at least 'length' more bytes can be written
+	 * without growing the buffer.
+	 */
+	void reserve(size_t length) {
+		if (length > capacity_ - size_) {
+			grow(length);
+		}
 	}
 
-	void nextBlob(void *data, size_t length) {
-		unsigned char *ptr = (unsigned char *)data;
-		unsigned char *end = ptr + length;
-		while (ptr != end) {
-			*(ptr++) = (unsigned char)nextU8();
+	void write(const void *data, size_t length) {
+		if (length > 0) {
+			memcpy(append(length), data, length);
 		}
 	}
 
-	template<typename T>
-	void fillContainer(T &container, size_t length) {
-		container.resize(0);
-		container.reserve(length);
+	size_t position() const { return size_; }
 
-		// Read in chunks, to avoid calling 'resize()' and memsetting
-		// some huge memory region unnecessarily
-		size_t index = 0;
-		while (length > 0) {
-			size_t chunk = length;
-			if (chunk > 4096) {
-				chunk = 4096;
-			}
+	void patch(size_t pos, const void *data, size_t length) {
+		memcpy(buf_.get() + pos, data, length);
+	}
 
-			container.resize(index + chunk);
-			nextBlob((void *)&container[index], chunk);
-			index += chunk;
-			length -= chunk;
-		}
+private:
+	template<typename Sink>
+	friend class detail::Writer;
+
+	// Extend the written region by 'length' bytes,
+	// and return a pointer to the start of the new bytes
+	unsigned char *append(size_t length) {
+		reserve(length);
+		unsigned char *ptr = buf_.get() + size_;
+		size_ += length;
+		return ptr;
 	}
 
-	void skip(size_t length) {
-		while (length--) {
-			nextU8();
+	void grow(size_t length) {
+		size_t capacity = capacity_ * 2;
+		if (capacity < size_ + length) {
+			capacity = size_ + length;
+		}
+		if (capacity < 64) {
+			capacity = 64;
+		}
+
+		std::unique_ptr<unsigned char[]> buf =
+			std::make_unique_for_overwrite<unsigned char[]>(capacity);
+		if (size_ > 0) {
+			memcpy(buf.get(), buf_.get(), size_);
 		}
+
+		buf_ = std::move(buf);
+		capacity_ = capacity;
 	}
 
-	std::istream &is_;
+	std::unique_ptr<unsigned char[]> buf_;
+	size_t capacity_ = 0;
+	size_t size_ = 0;
 };
 
-class Writer {
+/**
+ * A byte source which reads from an 'std::streambuf' through 'sgetn',
+ * bypassing the formatting and sentry overhead of 'std::istream'.
+ */
+class StreambufSource {
 public:
-	explicit Writer(std::ostream &os): os_(os) {}
+	explicit StreambufSource(std::streambuf &buf): buf_(buf) {}
 
-	void writeU8(uint8_t num) {
-		os_.put((char)num);
-	}
+	int peek() {
+		auto ch = buf_.sgetc();
+		if (ch == std::streambuf::traits_type::eof()) {
+			return -1;
+		}
 
-	void writeU16(uint16_t num) {
-		writeU8(num >> 8);
-		writeU8(num & 0xffu);
+		return std::streambuf::traits_type::to_int_type(ch);
 	}
 
-	void writeU32(uint32_t num) {
-		writeU16(num >> 16);
-		writeU16(num & 0xffffu);
+	size_t read(void *data, size_t length) {
+		return buf_.sgetn((char *)data, length);
 	}
 
-	void writeU64(uint64_t num) {
-		writeU32(num >> 32);
-		writeU32(num & 0xffffffffu);
-	}
+	size_t position() {
+		auto pos = buf_.pubseekoff(0, std::ios_base::cur, std::ios_base::in);
+		if (pos < 0) {
+			return ParseStatus::UNKNOWN_OFFSET;
+		}
 
-	void writeI8(int8_t num) {
-		writeU8((uint8_t)num);
+		return pos;
 	}
 
-	void writeI16(int16_t num) {
-		writeU16((uint16_t)num);
-	}
+	size_t skip(size_t length) {
+		char scratch[4096];
+		size_t skipped = 0;
+		while (skipped < length) {
+			size_t chunk = length - skipped;
+			if (chunk > sizeof(scratch)) {
+				chunk = sizeof(scratch);
+			}
 
-	void writeI32(int32_t num) {
-		writeU32((uint32_t)num);
+			size_t n = buf_.sgetn(scratch, chunk);
+			skipped += n;
+			if (n < chunk) {
+				break;
+			}
+		}
+
+		return skipped;
 	}
 
-	void writeI64(int64_t num) {
-		writeU64((int64_t)num);
+private:
+	std::streambuf &buf_;
+};
+
+/**
+ * A byte sink which writes to an 'std::streambuf' through 'sputn',
+ * bypassing the formatting and sentry overhead of 'std::ostream'.
+ */
+class StreambufSink {
+public:
+	explicit StreambufSink(std::streambuf &buf): buf_(buf) {}
+
+	void write(const void *data, size_t length) {
+		if ((size_t)buf_.sputn((const char *)data, length) != length) {
+			detail::raise(SerializeError("Write failed"));
+		}
 	}
 
-	void writeBlob(const void *data, size_t length) {
-		unsigned char *ptr = (unsigned char *)data;
-		unsigned char *end = ptr + length;
-		while (ptr != end) {
-			writeU8(*(ptr++));
+	size_t position() {
+		auto pos = buf_.pubseekoff(0, std::ios_base::cur, std::ios_base::out);
+		if (pos < 0) {
+			detail::raise(SerializeError("Stream is not seekable"));
 		}
+
+		return pos;
 	}
 
-	std::ostream &os_;
-};
+	void patch(size_t pos, const void *data, size_t length) {
+		auto end = buf_.pubseekoff(0, std::ios_base::cur, std::ios_base::out);
+		if (buf_.pubseekpos(pos, std::ios_base::out) < 0) {
+			detail::raise(SerializeError("Stream is not seekable"));
+		}
 
-}
+		write(data, length);
+		buf_.pubseekpos(end, std::ios_base::out);
+	}
 
-enum class Type {
-	INT,
-	UINT,
-	NIL,
-	BOOL,
-	FLOAT32,
-	FLOAT64,
-	STRING,
-	BINARY,
-	ARRAY,
-	MAP,
-	EXTENSION,
+private:
+	std::streambuf &buf_;
 };
 
-class MapParser;
-class ArrayParser;
+#ifdef MSGSTREAM_HAVE_UNISTD
 
 /**
- * A MessagePack stream parser.
- * Methods will throw a ParseError if preconditions are violated.
+ * A byte source which reads from a file descriptor,
+ * such as a pipe or a socket, through an internal buffer.
+ * The file descriptor is not closed by the source.
+ *
+ * Failed reads throw a ParseError, or when exceptions are disabled,
+ * are treated as the end of input, with the errno kept in 'error()'.
  */
-class Parser {
+class FdSource {
 public:
-	explicit Parser(std::istream &is):
-		r_(is) {}
+	explicit FdSource(int fd, size_t bufferSize = 64 * 1024):
+		fd_(fd), buf_(bufferSize) {}
 
 	/**
-	 * Check whether there are more objects available in the stream.
-	 * For unconstrained parsers, this returns 'false' only when EOF is reached.
-	 * For constrained parsers (i.e MapParser and ArrayParser),
-	 * this returns 'false' when there are no more values left to read
-	 * in the array/map.
-	 *
-	 * Preconditions: None
+	 * Get the number of bytes consumed so far.
 	 */
-	bool hasNext() {
-		if (hasLimit_) {
-			return limit_ > 0;
-		} else {
-			return r_.peek() >= 0;
-		}
+	size_t position() const {
+		return filled_ - (end_ - start_);
 	}
 
 	/**
-	 * Get the type of the next value.
-	 *
-	 * Preconditions:
-	 *   The stream cursor must be at the start of a valid object
-	 *   hasNext() == true
+	 * Get the errno of the read which failed, or 0.
 	 */
-	Type nextType() {
-		if (limit_ == 0) {
-			throw ParseError("Length limit exceeded");
+	int error() const {
+		return error_;
+	}
+
+	int peek() {
+		if (start_ == end_ && !fill()) {
+			return -1;
 		}
 
-		int ch = r_.peek();
-		if (ch < 0) {
-			throw ParseError("Unexpected EOF");
+		return buf_[start_];
+	}
+
+	size_t read(void *data, size_t length) {
+		unsigned char *ptr = (unsigned char *)data;
+		size_t done = takeBuffered(ptr, length);
+
+		// Large reads go straight into the destination
+		while (done < length && length - done >= buf_.size()) {
+			ssize_t n = readSome(ptr + done, length - done);
+			if (n <= 0) {
+				return done;
+			}
+
+			filled_ += n;
+			done += n;
 		}
 
-		if (ch >= 0x00 && ch <= 0x7f) {
-			return Type::UINT;
-		} else if (ch >= 0x80 && ch <= 0x8f) {
-			return Type::MAP;
-		} else if (ch >= 0x90 && ch <= 0x9f) {
-			return Type::ARRAY;
-		} else if (ch >= 0xa0 && ch <= 0xbf) {
-			return Type::STRING;
-		} else if (ch == 0xc0) {
-			return Type::NIL;
-		} else if (ch == 0xc1) {
-			// Never used
-			throw ParseError("Unexpected header byte");
-		} else if (ch == 0xc2 || ch == 0xc3) {
-			return Type::BOOL;
-		} else if (ch >= 0xc4 && ch <= 0xc6) {
-			return Type::BINARY;
-		} else if (ch >= 0xc7 && ch <= 0xc9) {
-			return Type::EXTENSION;
-		} else if (ch == 0xca) {
-			return Type::FLOAT32;
-		} else if (ch == 0xcb) {
-			return Type::FLOAT64;
-		} else if (ch >= 0xcc && ch <= 0xcf) {
-			return Type::UINT;
-		} else if (ch >= 0xd0 && ch <= 0xd3) {
-			return Type::INT;
-		} else if (ch >= 0xd4 && ch <= 0xd8) {
-			return Type::EXTENSION;
-		} else if (ch >= 0xd9 && ch <= 0xdb) {
-			return Type::STRING;
-		} else if (ch >= 0xdc && ch <= 0xdd) {
-			return Type::ARRAY;
-		} else if (ch >= 0xde && ch <= 0xdf) {
-			return Type::MAP;
-		} else if (ch >= 0xe0 && ch <= 0xff) {
-			return Type::INT;
-		} else {
-			throw ParseError("Unexpected header byte");
+		while (done < length) {
+			if (!fill()) {
+				return done;
+			}
+
+			done += takeBuffered(ptr + done, length - done);
 		}
+
+		return done;
 	}
 
-	/**
-	 * Get the next value as an integer.
-	 *
-	 * Preconditions:
-	 *   hasNext() == true
-	 *   nextType() == Type::INT || nextType() == Type::UINT
-	 *
-	 * Note: if nextType() == Type::UINT,
-	 * the int might not fit in an int64_t.
-	 * This will cause the value to wrap around.
-	 */
-	int64_t nextInt() {
-		return (int64_t)nextUInt();
+	size_t skip(size_t length) {
+		size_t done = takeBuffered(nullptr, length);
+		while (done < length) {
+			if (!fill()) {
+				return done;
+			}
+
+			done += takeBuffered(nullptr, length - done);
+		}
+
+		return done;
 	}
 
-	/**
-	 * Get the next value as an unsigned integer.
-	 *
-	 * Preconditions:
-	 *   hasNext() == true
-	 *   nextType() == Type::INT || nextType() == Type::UINT
-	 *
-	 * Note: if nextType() == Type::INT,
-	 * the int might not fit in a uint64_t.
-	 * This will cause the value to wrap around.
-	 */
-	uint64_t nextUInt() {
-		proceed();
+private:
+	// Move up to 'length' buffered bytes into 'data' (or discard them,
+	// if 'data' is null), returning the number of bytes moved
+	size_t takeBuffered(unsigned char *data, size_t length) {
+		size_t n = end_ - start_;
+		if (n > length) {
+			n = length;
+		}
 
-		uint8_t ch = r_.nextU8();
-		if (ch <= 0x7fu) {
-			return ch;
-		} else if (ch == 0xcc) {
-			return r_.nextU8();
-		} else if (ch == 0xcd) {
-			return r_.nextU16();
-		} else if (ch == 0xce) {
-			return r_.nextU32();
-		} else if (ch == 0xcf) {
-			return r_.nextU64();
-		} else if (ch >= 0xe0) {
-			// This series of casts produces a sign-extended u64
-			return (uint64_t)(int64_t)(int8_t)ch;
-		} else if (ch == 0xd0) {
-			return (uint64_t)(int64_t)r_.nextI8();
-		} else if (ch == 0xd1) {
-			return (uint64_t)(int64_t)r_.nextI16();
-		} else if (ch == 0xd2) {
-			return (uint64_t)(int64_t)r_.nextI32();
-		} else if (ch == 0xd3) {
-			return (uint64_t)(int64_t)r_.nextI64();
-		} else {
-			throw ParseError("Attempt to parse non-integer as integer");
+		if (data && n > 0) {
+			memcpy(data, &buf_[start_], n);
 		}
+
+		start_ += n;
+		return n;
 	}
 
-	/**
-	 * Skip the next value if it's a nil.
-	 *
-	 * Preconditions:
-	 *   hasNext() == true
-	 *   nextType() == Type::NIL
-	 */
-	void skipNil() {
-		proceed();
+	bool fill() {
+		ssize_t n = readSome(buf_.data(), buf_.size());
+		if (n <= 0) {
+			return false;
+		}
 
-		uint8_t ch = r_.nextU8();
-		if (ch == 0xc0) {
-			return;
-		} else {
-			throw ParseError("Attempt to parse non-nil as nil");
+		filled_ += n;
+		start_ = 0;
+		end_ = n;
+		return true;
+	}
+
+	ssize_t readSome(unsigned char *data, size_t length) {
+		while (true) {
+			ssize_t n = ::read(fd_, data, length);
+			if (n >= 0) {
+				return n;
+			} else if (errno != EINTR) {
+#ifdef MSGSTREAM_NO_EXCEPTIONS
+				error_ = errno;
+				return 0;
+#else
+				throw ParseError(ErrorCode::IO_ERROR, "Read failed");
+#endif
+			}
 		}
 	}
 
+	int fd_;
+	std::vector<unsigned char> buf_;
+	size_t start_ = 0;
+	size_t end_ = 0;
 
-	/**
-	 * Get the next value as a boolean.
-	 *
-	 * Preconditions:
-	 *   hasNext() == true
-	 *   nextType() == Type::BOOL
-	 */
-	bool nextBool() {
-		proceed();
+	// The number of bytes read from the file descriptor
+	size_t filled_ = 0;
+	int error_ = 0;
+};
 
-		uint8_t ch = r_.nextU8();
-		if (ch == 0xc2) {
-			return false;
-		} else if (ch == 0xc3) {
-			return true;
+/**
+ * A byte sink which writes to a file descriptor,
+ * such as a pipe or a socket, through an internal buffer.
+ * 'flush()' must be called to write out any buffered bytes;
+ * the destructor flushes too, but can't report errors.
+ * The file descriptor is not closed by the sink.
+ */
+class FdSink {
+public:
+	explicit FdSink(int fd, size_t bufferSize = 64 * 1024):
+		fd_(fd) {
+		buf_.reserve(bufferSize);
+	}
+
+	FdSink(const FdSink &) = delete;
+	FdSink &operator=(const FdSink &) = delete;
+
+	~FdSink() {
+		writeAll(buf_.data(), buf_.size());
+	}
+
+	void write(const void *data, size_t length) {
+		const unsigned char *ptr = (const unsigned char *)data;
+		if (length > buf_.capacity() - buf_.size()) {
+			flush();
+		}
+
+		// Large writes go straight to the file descriptor
+		if (length >= buf_.capacity()) {
+			if (!writeAll(ptr, length)) {
+				detail::raise(SerializeError("Write failed"));
+			}
 		} else {
-			throw ParseError("Attempt to parse non-bool as bool");
+			buf_.insert(buf_.end(), ptr, ptr + length);
 		}
 	}
 
 	/**
-	 * Get the next value as a 32-bit float.
-	 *
-	 * Preconditions:
-	 *   hasNext() == true
-	 *   nextType() == Type::FLOAT32 || nextType() == Type::FLOAT64
+	 * Write out any buffered bytes.
 	 */
-	float nextFloat32() {
-		proceed();
+	void flush() {
+		bool ok = writeAll(buf_.data(), buf_.size());
+		buf_.clear();
+		if (!ok) {
+			detail::raise(SerializeError("Write failed"));
+		}
+	}
 
-		uint8_t ch = r_.nextU8();
-		if (ch == 0xca) {
-			static_assert(sizeof(float) == sizeof(uint32_t));
-			float f32;
-			uint32_t u32 = r_.nextU32();
-			memcpy(&f32, &u32, 4);
-			return f32;
-		} else if (ch == 0xcb) {
-			static_assert(sizeof(double) == sizeof(uint64_t));
-			double f64;
-			uint64_t u64 = r_.nextU64();
-			memcpy(&f64, &u64, 8);
-			return (float)f64;
-		} else {
-			throw ParseError("Attempt to parse non-float as float");
+private:
+	// Returns false if a write fails
+	bool writeAll(const unsigned char *data, size_t length) {
+		while (length > 0) {
+			ssize_t n = ::write(fd_, data, length);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			} else if (n < 0) {
+				return false;
+			}
+
+			data += n;
+			length -= n;
 		}
+
+		return true;
 	}
 
+	int fd_;
+	std::vector<unsigned char> buf_;
+};
+
+#endif
+
+#ifdef MSGSTREAM_HAVE_MMAP
+
+/**
+ * A read-only memory mapping of a regular file,
+ * for parsing a whole file in place with a SpanParser:
+ *
+ *   MappedFile file(fd);
+ *   SpanSource src(file.data());
+ *   SpanParser parser(src);
+ *
+ * Pages are faulted in straight from the page cache as the parser
+ * reaches them, so the file is never copied into a user-space buffer.
+ * The mapping is hinted as sequential, and as a huge page candidate
+ * where the platform supports it.
+ *
+ * Like reading from 'fd' would, the mapping starts at the descriptor's
+ * current offset, so a file which has been partly read already
+ * is picked up where reading stopped. The offset itself isn't moved.
+ *
+ * The file descriptor is not closed by the MappedFile,
+ * and may be closed as soon as the MappedFile has been constructed.
+ * The file must not be truncated while it's mapped.
+ */
+class MappedFile {
+public:
 	/**
-	 * Get the next value as a 64-bit float.
-	 *
-	 * Preconditions:
-	 *   hasNext() == true
-	 *   nextType() == Type::FLOAT32 || nextType() == Type::FLOAT64
+	 * Map the file referred to by 'fd', from its current offset to the end.
+	 * Throws a ParseError if 'fd' isn't a regular file
+	 * or if the mapping fails.
 	 */
-	double nextFloat64() {
-		proceed();
+	explicit MappedFile(int fd) {
+		struct stat st;
+		if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+			detail::raise(ParseError(
+				ErrorCode::IO_ERROR,
+				"Attempt to map something which isn't a regular file"));
+		}
 
-		uint8_t ch = r_.nextU8();
-		if (ch == 0xca) {
-			static_assert(sizeof(float) == sizeof(uint32_t));
-			float f32;
-			uint32_t u32 = r_.nextU32();
-			memcpy(&f32, &u32, 4);
-			return (double)f32;
-		} else if (ch == 0xcb) {
-			static_assert(sizeof(double) == sizeof(uint64_t));
-			double f64;
-			uint64_t u64 = r_.nextU64();
-			memcpy(&f64, &u64, 8);
-			return f64;
-		} else {
-			throw ParseError("Attempt to parse non-float as float");
+		size_ = st.st_size;
+		off_t offset = lseek(fd, 0, SEEK_CUR);
+		if (offset > 0) {
+			offset_ = (size_t)offset < size_ ? offset : size_;
+		}
+
+		if (size_ == 0) {
+			// Zero-length mappings aren't allowed
+			return;
+		}
+
+		void *addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (addr == MAP_FAILED) {
+			detail::raise(ParseError(
+				ErrorCode::IO_ERROR, "Failed to map file"));
 		}
+
+		addr_ = addr;
+
+		// These are only hints, so failures are ignored
+		madvise(addr_, size_, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+		madvise(addr_, size_, MADV_HUGEPAGE);
+#endif
 	}
 
-	/**
-	 * Get the next value as a string.
-	 *
-	 * Preconditions:
-	 *   hasNext() == true
-	 *   nextType() == Type::STRING
-	 */
-	void nextString(std::string &str) {
-		size_t length = nextStringHeader();
-		r_.fillContainer(str, length);
+	MappedFile(MappedFile &&other) noexcept:
+		addr_(other.addr_), size_(other.size_), offset_(other.offset_) {
+		other.addr_ = nullptr;
+		other.size_ = 0;
+		other.offset_ = 0;
+	}
+
+	MappedFile &operator=(MappedFile &&other) noexcept {
+		if (this != &other) {
+			unmap();
+			addr_ = other.addr_;
+			size_ = other.size_;
+			offset_ = other.offset_;
+			other.addr_ = nullptr;
+			other.size_ = 0;
+			other.offset_ = 0;
+		}
+
+		return *this;
+	}
+
+	~MappedFile() {
+		unmap();
 	}
 
 	/**
-	 * Like 'nextString(std::string &)',
-	 * except that a new string is returned instead.
+	 * Check whether 'fd' refers to something which can be mapped,
+	 * i.e a regular file rather than a pipe, socket or terminal.
 	 */
-	std::string nextString() {
-		std::string str;
-		nextString(str);
-		return str;
+	static bool canMap(int fd) {
+		struct stat st;
+		return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
 	}
 
 	/**
-	 * Get the next value as a byte string.
-	 *
-	 * Preconditions:
-	 *   hasNext() == true
-	 *   nextType() == Type::BINARY
+	 * Get the mapped contents of the file,
+	 * from the descriptor's offset when it was mapped.
 	 */
-	void nextBinary(std::vector<unsigned char> &bin) {
-		size_t length = nextBinaryHeader();
-		r_.fillContainer(bin, length);
+	std::span<const unsigned char> data() const {
+		return std::span<const unsigned char>(
+			(const unsigned char *)addr_, size_).subspan(offset_);
+	}
+
+private:
+	void unmap() {
+		if (addr_) {
+			munmap(addr_, size_);
+		}
+	}
+
+	// The whole file is mapped, since mappings must start
+	// on a page boundary; 'data()' starts at 'offset_'
+	void *addr_ = nullptr;
+	size_t size_ = 0;
+	size_t offset_ = 0;
+};
+
+#endif
+
+namespace detail {
+
+inline uint16_t byteswap(uint16_t num) {
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_bswap16(num);
+#else
+	return (num << 8) | (num >> 8);
+#endif
+}
+
+inline uint32_t byteswap(uint32_t num) {
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_bswap32(num);
+#else
+	return
+		((uint32_t)byteswap((uint16_t)num) << 16) |
+		(uint32_t)byteswap((uint16_t)(num >> 16));
+#endif
+}
+
+inline uint64_t byteswap(uint64_t num) {
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_bswap64(num);
+#else
+	return
+		((uint64_t)byteswap((uint32_t)num) << 32) |
+		(uint64_t)byteswap((uint32_t)(num >> 32));
+#endif
+}
+
+// Load a big-endian integer from a possibly unaligned address
+template<typename T>
+inline T loadBE(const unsigned char *ptr) {
+	T num;
+	memcpy(&num, ptr, sizeof(num));
+	if constexpr (sizeof(T) > 1 && std::endian::native == std::endian::little) {
+		num = byteswap(num);
+	}
+
+	return num;
+}
+
+// Store a big-endian integer to a possibly unaligned address
+template<typename T>
+inline void storeBE(unsigned char *ptr, T num) {
+	if constexpr (std::endian::native == std::endian::little) {
+		num = byteswap(num);
+	}
+
+	memcpy(ptr, &num, sizeof(num));
+}
+
+// Zeroes for reads which failed
+inline constexpr unsigned char zeroBytes[16] = {};
+
+// Error reporting for the Readers:
+// errors are thrown, or recorded in a ParseStatus in STATUS mode.
+// With a status, reads which fail return zeroes instead.
+template<ErrorMode Mode>
+class ReaderBase {
+public:
+	ParseStatus *status() const {
+		return status_;
+	}
+
+	// Whether an error has been recorded in the status
+	bool failed() const {
+		return status_->code != ErrorCode::NONE;
+	}
+
+	// Whether reading has stopped because of an error;
+	// Readers can check something cheaper first
+	bool stopped() const {
+		return failed();
+	}
+
+protected:
+	explicit ReaderBase(ParseStatus *status): status_(status) {}
+
+	void record(ErrorCode code, const char *what, size_t offset) {
+		report(status_, code, what, offset);
+	}
+
+	ParseStatus *status_;
+};
+
+// Without a status, errors are always thrown,
+// so reading never stops and there's nothing to check
+template<>
+class ReaderBase<ErrorMode::THROW> {
+public:
+	ParseStatus *status() const {
+		return nullptr;
+	}
+
+	constexpr bool failed() const {
+		return false;
+	}
+
+	constexpr bool stopped() const {
+		return false;
+	}
+
+protected:
+	explicit ReaderBase(ParseStatus *) {}
+
+	[[noreturn]] void record(ErrorCode code, const char *what, size_t) {
+		raise(ParseError(code, what));
+	}
+};
+
+template<typename Source, ErrorMode Mode>
+class Reader: public ReaderBase<Mode> {
+public:
+	static_assert(ByteSource<Source>, "Parser source must be a ByteSource");
+
+	explicit Reader(Source &src, ParseStatus *status = nullptr):
+		ReaderBase<Mode>(status), src_(src) {}
+
+	Source &source() {
+		return src_;
+	}
+
+	size_t position() {
+		if constexpr (requires { { src_.position() } -> std::convertible_to<size_t>; }) {
+			return src_.position();
+		} else {
+			return ParseStatus::UNKNOWN_OFFSET;
+		}
+	}
+
+	MSGSTREAM_COLD void fail(ErrorCode code, const char *what) {
+		this->record(code, what, position());
+	}
+
+	int peek() {
+		return src_.peek();
+	}
+
+	uint8_t nextU8() {
+		unsigned char ch;
+		nextBlob(&ch, 1);
+		return ch;
+	}
+
+	uint16_t nextU16() {
+		unsigned char buf[2];
+		nextBlob(buf, sizeof(buf));
+		return loadBE<uint16_t>(buf);
+	}
+
+	uint32_t nextU32() {
+		unsigned char buf[4];
+		nextBlob(buf, sizeof(buf));
+		return loadBE<uint32_t>(buf);
+	}
+
+	uint64_t nextU64() {
+		unsigned char buf[8];
+		nextBlob(buf, sizeof(buf));
+		return loadBE<uint64_t>(buf);
+	}
+
+	int8_t nextI8() {
+		return (int8_t)nextU8();
+	}
+
+	int16_t nextI16() {
+		return (int16_t)nextU16();
+	}
+
+	int32_t nextI32() {
+		return (int32_t)nextU32();
+	}
+
+	int64_t nextI64() {
+		return (int64_t)nextU64();
+	}
+
+	// Returns false if the input ended first
+	bool nextBlob(void *data, size_t length) {
+		if (src_.read(data, length) != length) {
+			memset(data, 0, length);
+			fail(ErrorCode::UNEXPECTED_EOF, "Unexpected EOF");
+			return false;
+		}
+
+		return true;
+	}
+
+	template<typename T>
+	void fillContainer(T &container, size_t length) {
+		container.resize(0);
+
+		// Read in chunks, to avoid allocating and memsetting
+		// some huge memory region before we know the input is that long
+		size_t index = 0;
+		while (length > 0) {
+			size_t chunk = length;
+			if (chunk > 4096) {
+				chunk = 4096;
+			}
+
+			container.resize(index + chunk);
+			if (!nextBlob((void *)&container[index], chunk)) {
+				container.resize(0);
+				return;
+			}
+
+			index += chunk;
+			length -= chunk;
+		}
+	}
+
+	void skip(size_t length) {
+		if (src_.skip(length) != length) {
+			fail(ErrorCode::UNEXPECTED_EOF, "Unexpected EOF");
+		}
+	}
+
+private:
+	Source &src_;
+};
+
+template<ErrorMode Mode>
+class Reader<std::istream, Mode>: public ReaderBase<Mode> {
+public:
+	explicit Reader(std::istream &is, ParseStatus *status = nullptr):
+		ReaderBase<Mode>(status), is_(is) {}
+
+	std::istream &source() {
+		return is_;
+	}
+
+	// This goes through the streambuf, which can still tell its position
+	// after the stream has failed
+	size_t position() {
+		std::streambuf *buf = is_.rdbuf();
+		if (!buf) {
+			return ParseStatus::UNKNOWN_OFFSET;
+		}
+
+		auto pos = buf->pubseekoff(0, std::ios_base::cur, std::ios_base::in);
+		if (pos < 0) {
+			return ParseStatus::UNKNOWN_OFFSET;
+		}
+
+		return pos;
+	}
+
+	// After an error, the stream is marked as failed,
+	// so that any further reads fail straight away
+	MSGSTREAM_COLD void fail(ErrorCode code, const char *what) {
+		this->record(code, what, position());
+		is_.setstate(std::ios_base::failbit);
+	}
+
+	int peek() {
+		return is_.peek();
+	}
+
+	int get() {
+		return is_.get();
+	}
+
+	uint8_t nextU8() {
+		int ch = get();
+		if (ch < 0) {
+			fail(ErrorCode::UNEXPECTED_EOF, "Unexpected EOF");
+			return 0;
+		}
+
+		return ch;
+	}
+
+	uint16_t nextU16() {
+		unsigned char buf[2];
+		nextBlob(buf, sizeof(buf));
+		return loadBE<uint16_t>(buf);
+	}
+
+	uint32_t nextU32() {
+		unsigned char buf[4];
+		nextBlob(buf, sizeof(buf));
+		return loadBE<uint32_t>(buf);
+	}
+
+	uint64_t nextU64() {
+		unsigned char buf[8];
+		nextBlob(buf, sizeof(buf));
+		return loadBE<uint64_t>(buf);
+	}
+
+	int8_t nextI8() {
+		return (int8_t)nextU8();
+	}
+
+	int16_t nextI16() {
+		return (int16_t)nextU16();
+	}
+
+	int32_t nextI32() {
+		return (int32_t)nextU32();
+	}
+
+	int64_t nextI64() {
+		return (int64_t)nextU64();
+	}
+
+	// Returns false if the input ended first
+	bool nextBlob(void *data, size_t length) {
+		is_.read((char *)data, length);
+		if ((size_t)is_.gcount() != length) {
+			memset(data, 0, length);
+			fail(ErrorCode::UNEXPECTED_EOF, "Unexpected EOF");
+			return false;
+		}
+
+		return true;
+	}
+
+	template<typename T>
+	void fillContainer(T &container, size_t length) {
+		container.resize(0);
+		container.reserve(length);
+
+		// Read in chunks, to avoid calling 'resize()' and memsetting
+		// some huge memory region unnecessarily
+		size_t index = 0;
+		while (length > 0) {
+			size_t chunk = length;
+			if (chunk > 4096) {
+				chunk = 4096;
+			}
+
+			container.resize(index + chunk);
+			if (!nextBlob((void *)&container[index], chunk)) {
+				container.resize(0);
+				return;
+			}
+
+			index += chunk;
+			length -= chunk;
+		}
+	}
+
+	void skip(size_t length) {
+		is_.ignore(length);
+		if ((size_t)is_.gcount() != length) {
+			fail(ErrorCode::UNEXPECTED_EOF, "Unexpected EOF");
+		}
+	}
+
+private:
+	std::istream &is_;
+};
+
+template<ErrorMode Mode>
+class Reader<SpanSource, Mode>: public ReaderBase<Mode> {
+public:
+	explicit Reader(SpanSource &src, ParseStatus *status = nullptr):
+		ReaderBase<Mode>(status), src_(src) {}
+
+	SpanSource &source() {
+		return src_;
+	}
+
+	size_t position() {
+		return src_.position();
+	}
+
+	// After an error, the rest of the input is discarded,
+	// so that any further reads fail straight away
+	MSGSTREAM_COLD void fail(ErrorCode code, const char *what) {
+		this->record(code, what, position());
+		src_.cur_ = src_.end_;
+	}
+
+	bool stopped() const {
+		return src_.cur_ == src_.end_ && this->failed();
+	}
+
+	int peek() {
+		if (src_.cur_ == src_.end_) {
+			return -1;
+		}
+
+		return *src_.cur_;
+	}
+
+	uint8_t nextU8() {
+		return *takeFixed<1>();
+	}
+
+	uint16_t nextU16() {
+		return loadBE<uint16_t>(takeFixed<2>());
+	}
+
+	uint32_t nextU32() {
+		return loadBE<uint32_t>(takeFixed<4>());
+	}
+
+	uint64_t nextU64() {
+		return loadBE<uint64_t>(takeFixed<8>());
+	}
+
+	int8_t nextI8() {
+		return (int8_t)nextU8();
+	}
+
+	int16_t nextI16() {
+		return (int16_t)nextU16();
+	}
+
+	int32_t nextI32() {
+		return (int32_t)nextU32();
+	}
+
+	int64_t nextI64() {
+		return (int64_t)nextU64();
+	}
+
+	// Returns false if the input ended first
+	bool nextBlob(void *data, size_t length) {
+		size_t n = length;
+		const unsigned char *ptr = take(n);
+		if (n != length) {
+			memset(data, 0, length);
+			return false;
+		}
+
+		memcpy(data, ptr, length);
+		return true;
+	}
+
+	template<typename T>
+	void fillContainer(T &container, size_t length) {
+		// The whole payload is known to be available,
+		// so there's no need to read in chunks
+		using Value = typename T::value_type;
+		const Value *ptr = (const Value *)take(length);
+		container.assign(ptr, ptr + length);
+	}
+
+	void skip(size_t length) {
+		take(length);
+	}
+
+	// The bytes which haven't been consumed yet
+	std::span<const unsigned char> available() {
+		return std::span<const unsigned char>(src_.cur_, src_.end_);
+	}
+
+	// Consume 'length' bytes and return a pointer to them.
+	// If the input is shorter, 'length' is set to 0
+	// and the pointer is to at least 8 zeroes.
+	const unsigned char *take(size_t &length) {
+		if (length > (size_t)(src_.end_ - src_.cur_)) {
+			length = 0;
+			return takeFailed();
+		}
+
+		const unsigned char *ptr = src_.cur_;
+		src_.cur_ += length;
+		return ptr;
+	}
+
+private:
+	// Like take(), for the fixed-size reads on the hot path
+	template<size_t N>
+	const unsigned char *takeFixed() {
+		if (N > (size_t)(src_.end_ - src_.cur_)) {
+			return takeFailed();
+		}
+
+		const unsigned char *ptr = src_.cur_;
+		src_.cur_ += N;
+		return ptr;
+	}
+
+	MSGSTREAM_COLD const unsigned char *takeFailed() {
+		fail(ErrorCode::UNEXPECTED_EOF, "Unexpected EOF");
+		return zeroBytes;
+	}
+
+	SpanSource &src_;
+};
+
+// Writes to either an 'std::ostream' or a ByteSink.
+// Every write is turned into a single bulk write to the sink.
+template<typename Sink>
+class Writer {
+public:
+	static_assert(
+		std::same_as<Sink, std::ostream> || ByteSink<Sink>,
+		"Serializer sink must be an std::ostream or a ByteSink");
+
+	explicit Writer(Sink &sink): sink_(sink) {}
+
+	Sink &sink() {
+		return sink_;
+	}
+
+	void writeU8(uint8_t num) {
+		if constexpr (std::same_as<Sink, std::ostream>) {
+			sink_.put((char)num);
+		} else {
+			sink_.write(&num, 1);
+		}
+	}
+
+	void writeU16(uint16_t num) {
+		unsigned char buf[2];
+		storeBE(buf, num);
+		writeBlob(buf, sizeof(buf));
+	}
+
+	void writeU32(uint32_t num) {
+		unsigned char buf[4];
+		storeBE(buf, num);
+		writeBlob(buf, sizeof(buf));
+	}
+
+	void writeU64(uint64_t num) {
+		unsigned char buf[8];
+		storeBE(buf, num);
+		writeBlob(buf, sizeof(buf));
+	}
+
+	void writeI8(int8_t num) {
+		writeU8((uint8_t)num);
+	}
+
+	void writeI16(int16_t num) {
+		writeU16((uint16_t)num);
+	}
+
+	void writeI32(int32_t num) {
+		writeU32((uint32_t)num);
+	}
+
+	void writeI64(int64_t num) {
+		writeU64((int64_t)num);
+	}
+
+	void writeTagU8(uint8_t tag, uint8_t num) {
+		unsigned char buf[2] = {tag, num};
+		writeBlob(buf, sizeof(buf));
+	}
+
+	void writeTagU16(uint8_t tag, uint16_t num) {
+		unsigned char buf[3] = {tag};
+		storeBE(buf + 1, num);
+		writeBlob(buf, sizeof(buf));
+	}
+
+	void writeTagU32(uint8_t tag, uint32_t num) {
+		unsigned char buf[5] = {tag};
+		storeBE(buf + 1, num);
+		writeBlob(buf, sizeof(buf));
+	}
+
+	void writeTagU64(uint8_t tag, uint64_t num) {
+		unsigned char buf[9] = {tag};
+		storeBE(buf + 1, num);
+		writeBlob(buf, sizeof(buf));
+	}
+
+	void writeTagI8(uint8_t tag, int8_t num) {
+		writeTagU8(tag, (uint8_t)num);
+	}
+
+	void writeTagI16(uint8_t tag, int16_t num) {
+		writeTagU16(tag, (uint16_t)num);
+	}
+
+	void writeTagI32(uint8_t tag, int32_t num) {
+		writeTagU32(tag, (uint32_t)num);
+	}
+
+	void writeTagI64(uint8_t tag, int64_t num) {
+		writeTagU64(tag, (uint64_t)num);
+	}
+
+	void writeBlob(const void *data, size_t length) {
+		if constexpr (std::same_as<Sink, std::ostream>) {
+			sink_.write((const char *)data, length);
+		} else {
+			sink_.write(data, length);
+		}
+	}
+
+	// Let 'encode' write up to 'maxLength' bytes, returning how many it wrote.
+	// Here it writes to a stack buffer, which is then written to the sink.
+	template<size_t maxLength, typename Encode>
+	void writeEncoded(Encode encode) {
+		unsigned char buf[maxLength];
+		writeBlob(buf, encode(buf));
+	}
+
+	size_t position() {
+		if constexpr (std::same_as<Sink, std::ostream>) {
+			auto pos = sink_.tellp();
+			if (pos < 0) {
+				detail::raise(SerializeError("Stream is not seekable"));
+			}
+
+			return pos;
+		} else {
+			return sink_.position();
+		}
+	}
+
+	void patch(size_t pos, const unsigned char *data, size_t length) {
+		if constexpr (std::same_as<Sink, std::ostream>) {
+			auto end = sink_.tellp();
+			sink_.seekp(pos);
+			sink_.write((const char *)data, length);
+			sink_.seekp(end);
+			if (!sink_) {
+				detail::raise(SerializeError("Failed to patch stream"));
+			}
+		} else {
+			sink_.patch(pos, data, length);
+		}
+	}
+
+private:
+	Sink &sink_;
+};
+
+template<>
+class Writer<BufferSink> {
+public:
+	explicit Writer(BufferSink &sink): sink_(sink) {}
+
+	BufferSink &sink() {
+		return sink_;
+	}
+
+	void writeU8(uint8_t num) {
+		*sink_.append(1) = num;
+	}
+
+	void writeU16(uint16_t num) {
+		storeBE(sink_.append(2), num);
+	}
+
+	void writeU32(uint32_t num) {
+		storeBE(sink_.append(4), num);
+	}
+
+	void writeU64(uint64_t num) {
+		storeBE(sink_.append(8), num);
+	}
+
+	void writeI8(int8_t num) {
+		writeU8((uint8_t)num);
+	}
+
+	void writeI16(int16_t num) {
+		writeU16((uint16_t)num);
+	}
+
+	void writeI32(int32_t num) {
+		writeU32((uint32_t)num);
+	}
+
+	void writeI64(int64_t num) {
+		writeU64((uint64_t)num);
+	}
+
+	void writeTagU8(uint8_t tag, uint8_t num) {
+		unsigned char *ptr = sink_.append(2);
+		ptr[0] = tag;
+		ptr[1] = num;
+	}
+
+	void writeTagU16(uint8_t tag, uint16_t num) {
+		unsigned char *ptr = sink_.append(3);
+		ptr[0] = tag;
+		storeBE(ptr + 1, num);
+	}
+
+	void writeTagU32(uint8_t tag, uint32_t num) {
+		unsigned char *ptr = sink_.append(5);
+		ptr[0] = tag;
+		storeBE(ptr + 1, num);
+	}
+
+	void writeTagU64(uint8_t tag, uint64_t num) {
+		unsigned char *ptr = sink_.append(9);
+		ptr[0] = tag;
+		storeBE(ptr + 1, num);
+	}
+
+	void writeTagI8(uint8_t tag, int8_t num) {
+		writeTagU8(tag, (uint8_t)num);
+	}
+
+	void writeTagI16(uint8_t tag, int16_t num) {
+		writeTagU16(tag, (uint16_t)num);
+	}
+
+	void writeTagI32(uint8_t tag, int32_t num) {
+		writeTagU32(tag, (uint32_t)num);
+	}
+
+	void writeTagI64(uint8_t tag, int64_t num) {
+		writeTagU64(tag, (uint64_t)num);
+	}
+
+	void writeBlob(const void *data, size_t length) {
+		if (length > 0) {
+			memcpy(sink_.append(length), data, length);
+		}
+	}
+
+	// Here 'encode' writes straight into the buffer
+	template<size_t maxLength, typename Encode>
+	void writeEncoded(Encode encode) {
+		sink_.reserve(maxLength);
+		sink_.size_ += encode(sink_.buf_.get() + sink_.size_);
+	}
+
+	size_t position() {
+		return sink_.size_;
+	}
+
+	void patch(size_t pos, const unsigned char *data, size_t length) {
+		sink_.patch(pos, data, length);
+	}
+
+	// Replace the 'reserved' bytes at 'pos' with 'length' bytes from 'data',
+	// moving everything which was written after them
+	void replace(
+			size_t pos, size_t reserved,
+			const unsigned char *data, size_t length) {
+		unsigned char *ptr = sink_.buf_.get() + pos;
+		if (length != reserved) {
+			memmove(
+				ptr + length, ptr + reserved,
+				sink_.size_ - pos - reserved);
+			sink_.size_ = sink_.size_ - reserved + length;
+		}
+
+		memcpy(ptr, data, length);
+	}
+
+private:
+	BufferSink &sink_;
+};
+
+}
+
+enum class Type {
+	INT,
+	UINT,
+	NIL,
+	BOOL,
+	FLOAT32,
+	FLOAT64,
+	STRING,
+	BINARY,
+	ARRAY,
+	MAP,
+	EXTENSION,
+};
+
+namespace detail {
+
+// What a header byte says about the value it starts
+struct HeaderInfo {
+	Type type;
+
+	// False for the never-used header byte 0xc1
+	bool valid;
+
+	// Width of the big-endian length or count field after the header byte
+	uint8_t lengthWidth;
+
+	// Number of fixed-size bytes between the length field and the
+	// variable-length payload (the number itself for ints and floats,
+	// the type byte and payload for fixext, the type byte for ext)
+	uint8_t extra;
+
+	// Length or count stored in the header byte itself
+	uint8_t inlineLength;
+
+	// Whether the length is that of a variable-length payload
+	// which follows the header (strings, binaries and non-fixext extensions)
+	bool hasPayload = false;
+
+	// Value stored in the header byte itself (fixints and bools),
+	// i.e the header byte masked with the bits which hold the value.
+	// Negative fixints need sign extension.
+	uint8_t inlineValue = 0;
+};
+
+constexpr HeaderInfo makeHeaderInfo(uint8_t ch) {
+	if (ch <= 0x7f) {
+		return {Type::UINT, true, 0, 0, 0};
+	} else if (ch <= 0x8f) {
+		return {Type::MAP, true, 0, 0, (uint8_t)(ch & 0x0f)};
+	} else if (ch <= 0x9f) {
+		return {Type::ARRAY, true, 0, 0, (uint8_t)(ch & 0x0f)};
+	} else if (ch <= 0xbf) {
+		return {Type::STRING, true, 0, 0, (uint8_t)(ch & 0x1f)};
+	} else if (ch >= 0xe0) {
+		return {Type::INT, true, 0, 0, 0};
+	}
+
+	switch (ch) {
+	case 0xc0: return {Type::NIL, true, 0, 0, 0};
+	case 0xc2: return {Type::BOOL, true, 0, 0, 0};
+	case 0xc3: return {Type::BOOL, true, 0, 0, 0};
+	case 0xc4: return {Type::BINARY, true, 1, 0, 0};
+	case 0xc5: return {Type::BINARY, true, 2, 0, 0};
+	case 0xc6: return {Type::BINARY, true, 4, 0, 0};
+	case 0xc7: return {Type::EXTENSION, true, 1, 1, 0};
+	case 0xc8: return {Type::EXTENSION, true, 2, 1, 0};
+	case 0xc9: return {Type::EXTENSION, true, 4, 1, 0};
+	case 0xca: return {Type::FLOAT32, true, 0, 4, 0};
+	case 0xcb: return {Type::FLOAT64, true, 0, 8, 0};
+	case 0xcc: return {Type::UINT, true, 0, 1, 0};
+	case 0xcd: return {Type::UINT, true, 0, 2, 0};
+	case 0xce: return {Type::UINT, true, 0, 4, 0};
+	case 0xcf: return {Type::UINT, true, 0, 8, 0};
+	case 0xd0: return {Type::INT, true, 0, 1, 0};
+	case 0xd1: return {Type::INT, true, 0, 2, 0};
+	case 0xd2: return {Type::INT, true, 0, 4, 0};
+	case 0xd3: return {Type::INT, true, 0, 8, 0};
+	case 0xd4: return {Type::EXTENSION, true, 0, 1 + 1, 1};
+	case 0xd5: return {Type::EXTENSION, true, 0, 1 + 2, 2};
+	case 0xd6: return {Type::EXTENSION, true, 0, 1 + 4, 4};
+	case 0xd7: return {Type::EXTENSION, true, 0, 1 + 8, 8};
+	case 0xd8: return {Type::EXTENSION, true, 0, 1 + 16, 16};
+	case 0xd9: return {Type::STRING, true, 1, 0, 0};
+	case 0xda: return {Type::STRING, true, 2, 0, 0};
+	case 0xdb: return {Type::STRING, true, 4, 0, 0};
+	case 0xdc: return {Type::ARRAY, true, 2, 0, 0};
+	case 0xdd: return {Type::ARRAY, true, 4, 0, 0};
+	case 0xde: return {Type::MAP, true, 2, 0, 0};
+	case 0xdf: return {Type::MAP, true, 4, 0, 0};
+	default: return {Type::NIL, false, 0, 0, 0};
+	}
+}
+
+constexpr std::array<HeaderInfo, 256> makeHeaderTable() {
+	std::array<HeaderInfo, 256> table{};
+	for (int ch = 0; ch < 256; ++ch) {
+		HeaderInfo info = makeHeaderInfo((uint8_t)ch);
+		info.hasPayload =
+			info.type == Type::STRING ||
+			((info.type == Type::BINARY || info.type == Type::EXTENSION) &&
+				info.lengthWidth > 0);
+		if (info.type == Type::UINT && info.extra == 0) {
+			info.inlineValue = ch & 0x7f;
+		} else if (info.type == Type::INT && info.extra == 0) {
+			info.inlineValue = ch;
+		} else if (info.type == Type::BOOL) {
+			info.inlineValue = ch & 0x01;
+		}
+
+		table[ch] = info;
+	}
+
+	return table;
+}
+
+inline constexpr std::array<HeaderInfo, 256> headerTable = makeHeaderTable();
+
+struct Header {
+	Type type;
+
+	// Number of bytes before the payload or the first child,
+	// including any fixed-size payload
+	size_t size;
+
+	// Payload length in bytes for strings, binaries and extensions,
+	// number of values for arrays, number of key-value pairs for maps
+	uint32_t length;
+
+	// Whether 'length' bytes of payload follow the header
+	bool hasPayload;
+};
+
+// Decode the header at the start of 'data', which has 'size' bytes available
+inline Header decodeHeader(const unsigned char *data, size_t size) {
+	if (size == 0) {
+		detail::raise(ParseError(ErrorCode::UNEXPECTED_EOF, "Unexpected EOF"));
+	}
+
+	const HeaderInfo &info = headerTable[data[0]];
+	if (!info.valid) {
+		detail::raise(ParseError(
+			ErrorCode::INVALID_HEADER, "Unexpected header byte"));
+	}
+
+	Header header;
+	header.type = info.type;
+	header.size = 1 + info.lengthWidth + info.extra;
+	if (header.size > size) {
+		detail::raise(ParseError(ErrorCode::UNEXPECTED_EOF, "Unexpected EOF"));
+	}
+
+	header.length = info.inlineLength;
+	if (info.lengthWidth == 1) {
+		header.length = data[1];
+	} else if (info.lengthWidth == 2) {
+		header.length = loadBE<uint16_t>(data + 1);
+	} else if (info.lengthWidth == 4) {
+		header.length = loadBE<uint32_t>(data + 1);
+	}
+
+	header.hasPayload = info.hasPayload;
+	return header;
+}
+
+// Positive and negative fixints are the only single-byte values
+// which are numbers; as a signed byte, they're all the values >= -32
+inline bool isFixInt(unsigned char ch) {
+	return (int8_t)ch >= -32;
+}
+
+// Count the fixints at the start of 'data', up to 'max'
+inline size_t countFixInts(const unsigned char *data, size_t max) {
+	size_t count = 0;
+
+#if defined(__SSE2__)
+	const __m128i threshold = _mm_set1_epi8(-33);
+	while (max - count >= 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(data + count));
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpgt_epi8(chunk, threshold));
+		if (mask != 0xffff) {
+			return count + std::countr_one(mask);
+		}
+
+		count += 16;
+	}
+#endif
+
+	while (count < max && isFixInt(data[count])) {
+		count += 1;
+	}
+
+	return count;
+}
+
+// Get the encoded size of the value at the start of 'data',
+// which has 'size' bytes available, including all its children.
+// Returns 0 if the value is invalid or truncated.
+// Unlike skipping with a parser, this never throws and doesn't recurse.
+inline size_t valueSize(const unsigned char *data, size_t size) {
+	size_t pos = 0;
+	uint64_t pending = 1;
+	while (pending > 0) {
+		if (pos == size) {
+			return 0;
+		}
+
+		if (isFixInt(data[pos])) {
+			size_t max = size - pos < pending ? size - pos : pending;
+			size_t count = countFixInts(data + pos, max);
+			pos += count;
+			pending -= count;
+			continue;
+		}
+
+		const HeaderInfo &info = headerTable[data[pos]];
+		size_t headerSize = 1 + info.lengthWidth + info.extra;
+		if (!info.valid || headerSize > size - pos) {
+			return 0;
+		}
+
+		uint64_t length = info.inlineLength;
+		if (info.lengthWidth == 1) {
+			length = data[pos + 1];
+		} else if (info.lengthWidth == 2) {
+			length = loadBE<uint16_t>(data + pos + 1);
+		} else if (info.lengthWidth == 4) {
+			length = loadBE<uint32_t>(data + pos + 1);
+		}
+
+		pos += headerSize;
+		pending -= 1;
+		if (info.lengthWidth == 0 && info.extra > 0) {
+			// Numbers in arrays tend to come in runs with the same header,
+			// which are skipped without looking each one up
+			unsigned char header = data[pos - headerSize];
+			while (pending > 0 && headerSize <= size - pos &&
+					data[pos] == header) {
+				pos += headerSize;
+				pending -= 1;
+			}
+		} else if (info.hasPayload) {
+			if (length > size - pos) {
+				return 0;
+			}
+
+			pos += length;
+		} else if (info.type == Type::ARRAY) {
+			pending += length;
+		} else if (info.type == Type::MAP) {
+			pending += length * 2;
+		}
+	}
+
+	return pos;
+}
+
+// Decode a run of values which all start with the header byte 'header',
+// followed by a big-endian 'Payload', as used by BasicArrayParser::nextAll.
+// Decodes up to 'max' values from 'data', stopping at the first value with
+// another header or which doesn't fit in 'size' bytes,
+// and returns the number of values decoded.
+template<typename Payload, typename Out, typename Convert>
+inline size_t decodeRun(
+		const unsigned char *data, size_t size, unsigned char header,
+		Out *out, size_t max, Convert convert) {
+	constexpr size_t stride = 1 + sizeof(Payload);
+	size_t n = size / stride < max ? size / stride : max;
+	size_t i = 0;
+	while (i < n && data[i * stride] == header) {
+		out[i] = convert(loadBE<Payload>(data + i * stride + 1));
+		i += 1;
+	}
+
+	return i;
+}
+
+// Decode a run of identically-encoded floats into 'out'.
+// Returns 0 if the first value isn't a float; 'stride' is set to the size
+// of each encoded value.
+inline size_t decodeFloatRun(
+		const unsigned char *data, size_t size,
+		double *out, size_t max, size_t &stride) {
+	if (size == 0) {
+		return 0;
+	}
+
+	switch (data[0]) {
+	case 0xca:
+		stride = 5;
+		return decodeRun<uint32_t>(data, size, 0xca, out, max, [](uint32_t u) {
+			return (double)std::bit_cast<float>(u);
+		});
+	case 0xcb:
+		stride = 9;
+		return decodeRun<uint64_t>(data, size, 0xcb, out, max, [](uint64_t u) {
+			return std::bit_cast<double>(u);
+		});
+	default:
+		return 0;
+	}
+}
+
+// Decode a run of identically-encoded integers into 'out',
+// wrapping around like BasicParser::nextInt.
+// Returns 0 if the first value isn't an integer; 'stride' is set to the size
+// of each encoded value.
+inline size_t decodeIntRun(
+		const unsigned char *data, size_t size,
+		int64_t *out, size_t max, size_t &stride) {
+	if (size == 0) {
+		return 0;
+	}
+
+	auto convert = [](auto num) { return (int64_t)num; };
+	switch (data[0]) {
+	case 0xcc:
+		stride = 2;
+		return decodeRun<uint8_t>(data, size, 0xcc, out, max, convert);
+	case 0xcd:
+		stride = 3;
+		return decodeRun<uint16_t>(data, size, 0xcd, out, max, convert);
+	case 0xce:
+		stride = 5;
+		return decodeRun<uint32_t>(data, size, 0xce, out, max, convert);
+	case 0xcf:
+		stride = 9;
+		return decodeRun<uint64_t>(data, size, 0xcf, out, max, convert);
+	case 0xd0:
+		stride = 2;
+		return decodeRun<uint8_t>(data, size, 0xd0, out, max, [](uint8_t u) {
+			return (int64_t)(int8_t)u;
+		});
+	case 0xd1:
+		stride = 3;
+		return decodeRun<uint16_t>(data, size, 0xd1, out, max, [](uint16_t u) {
+			return (int64_t)(int16_t)u;
+		});
+	case 0xd2:
+		stride = 5;
+		return decodeRun<uint32_t>(data, size, 0xd2, out, max, [](uint32_t u) {
+			return (int64_t)(int32_t)u;
+		});
+	case 0xd3:
+		stride = 9;
+		return decodeRun<uint64_t>(data, size, 0xd3, out, max, convert);
+	default:
+		if (!isFixInt(data[0])) {
+			return 0;
+		}
+
+		// Positive and negative fixints are both a plain int8
+		stride = 1;
+		size_t n = countFixInts(data, size < max ? size : max);
+		for (size_t i = 0; i < n; ++i) {
+			out[i] = (int8_t)data[i];
+		}
+		return n;
+	}
+}
+
+}
+
+namespace detail {
+
+// Bulk encoding of numbers, for BasicSerializer::writeArray(std::span).
+// Each function encodes its values the same way as writing them one by one,
+// into 'out', which must have room for 9 bytes per value,
+// and returns the number of bytes written.
+
+inline size_t encodeFloats(const float *values, size_t n, unsigned char *out) {
+	for (size_t i = 0; i < n; ++i) {
+		out[i * 5] = 0xca;
+		storeBE(out + i * 5 + 1, std::bit_cast<uint32_t>(values[i]));
+	}
+
+	return n * 5;
+}
+
+inline size_t encodeFloats(const double *values, size_t n, unsigned char *out) {
+	for (size_t i = 0; i < n; ++i) {
+		out[i * 9] = 0xcb;
+		storeBE(out + i * 9 + 1, std::bit_cast<uint64_t>(values[i]));
+	}
+
+	return n * 9;
+}
+
+// Like BasicSerializer::writeInt
+inline size_t encodeInt(int64_t num, unsigned char *out) {
+	if (num >= -32 && num <= 0x7f) {
+		out[0] = num;
+		return 1;
+	} else if (num >= -128 && num <= 127) {
+		out[0] = 0xd0;
+		out[1] = num;
+		return 2;
+	} else if (num >= -32768 && num <= 32767) {
+		out[0] = 0xd1;
+		storeBE(out + 1, (uint16_t)num);
+		return 3;
+	} else if (num >= -2147483648 && num <= 2147483647) {
+		out[0] = 0xd2;
+		storeBE(out + 1, (uint32_t)num);
+		return 5;
+	} else {
+		out[0] = 0xd3;
+		storeBE(out + 1, (uint64_t)num);
+		return 9;
+	}
+}
+
+// Like BasicSerializer::writeUInt
+inline size_t encodeInt(uint64_t num, unsigned char *out) {
+	if (num <= 0x7fu) {
+		out[0] = num;
+		return 1;
+	} else if (num <= 0xffu) {
+		out[0] = 0xcc;
+		out[1] = num;
+		return 2;
+	} else if (num <= 0xffffu) {
+		out[0] = 0xcd;
+		storeBE(out + 1, (uint16_t)num);
+		return 3;
+	} else if (num <= 0xffffffffu) {
+		out[0] = 0xce;
+		storeBE(out + 1, (uint32_t)num);
+		return 5;
+	} else {
+		out[0] = 0xcf;
+		storeBE(out + 1, num);
+		return 9;
+	}
+}
+
+// Integers are encoded a block at a time. If a block's values are all
+// fixints, which is checked with a branch-free (and vectorizable) loop,
+// each value is just its low byte.
+// Otherwise, each value gets the smallest encoding that fits it.
+template<typename T>
+inline size_t encodeInts(const T *values, size_t n, unsigned char *out) {
+	using Wide = std::conditional_t<std::is_signed_v<T>, int64_t, uint64_t>;
+	constexpr size_t block = 64;
+
+	size_t pos = 0;
+	for (size_t start = 0; start < n; start += block) {
+		size_t end = n - start < block ? n : start + block;
+
+		bool fixints = true;
+		for (size_t i = start; i < end; ++i) {
+			if constexpr (std::is_signed_v<T>) {
+				fixints &= (uint64_t)(int64_t)values[i] + 32 <= 0x7f + 32;
+			} else {
+				fixints &= (uint64_t)values[i] <= 0x7f;
+			}
+		}
+
+		if (fixints) {
+			for (size_t i = start; i < end; ++i) {
+				out[pos++] = values[i];
+			}
+		} else {
+			for (size_t i = start; i < end; ++i) {
+				pos += encodeInt((Wide)values[i], out + pos);
+			}
+		}
+	}
+
+	return pos;
+}
+
+}
+
+/**
+ * A value's type together with everything in its header,
+ * as returned by 'BasicParser::nextToken'.
+ */
+struct Token {
+	Type type;
+
+	/**
+	 * For INT and UINT, the value; see 'BasicParser::nextUInt'.
+	 * For BOOL, 1 for true and 0 for false.
+	 */
+	uint64_t value = 0;
+
+	/**
+	 * For FLOAT32 and FLOAT64, the value.
+	 */
+	double floatValue = 0;
+
+	/**
+	 * For STRING, BINARY and EXTENSION, the payload length in bytes.
+	 * For ARRAY, the number of values, and for MAP,
+	 * the number of key-value pairs.
+	 */
+	size_t length = 0;
+
+	/**
+	 * For EXTENSION, the extension type.
+	 */
+	int64_t extensionType = 0;
+};
+
+/**
+ * A point in time, as stored in the MessagePack timestamp extension:
+ * seconds since the Unix epoch, plus nanoseconds.
+ */
+struct Timestamp {
+	/**
+	 * The extension type of timestamps.
+	 */
+	static constexpr int64_t EXTENSION_TYPE = -1;
+
+	int64_t seconds = 0;
+
+	/**
+	 * Always less than 1000000000, and added to 'seconds',
+	 * so half a second before the epoch is -1 seconds + 500000000 nanoseconds.
+	 */
+	uint32_t nanoseconds = 0;
+
+	bool operator==(const Timestamp &) const = default;
+
+	/**
+	 * Convert a 'std::chrono::sys_time' to a timestamp.
+	 * Precision finer than nanoseconds is truncated.
+	 */
+	template<typename Duration>
+	static Timestamp fromSysTime(std::chrono::sys_time<Duration> time) {
+		auto secs = std::chrono::floor<std::chrono::seconds>(time);
+		auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			time - secs);
+		return Timestamp{
+			(int64_t)secs.time_since_epoch().count(), (uint32_t)nanos.count()};
+	}
+
+	/**
+	 * Convert the timestamp to a 'std::chrono::sys_time'.
+	 * Nanosecond precision only covers about 292 years either side
+	 * of the epoch; timestamps outside of that range wrap around.
+	 */
+	std::chrono::sys_time<std::chrono::nanoseconds> sysTime() const {
+		uint64_t nanos = (uint64_t)seconds * 1000000000u + nanoseconds;
+		return std::chrono::sys_time<std::chrono::nanoseconds>(
+			std::chrono::nanoseconds((int64_t)nanos));
+	}
+
+	/**
+	 * Decode the payload of a timestamp extension,
+	 * in its 32-bit, 64-bit or 96-bit form.
+	 */
+	static Timestamp decode(std::span<const unsigned char> payload) {
+		Timestamp ts;
+		if (const char *err = tryDecode(payload, ts)) {
+			detail::raise(ParseError(ErrorCode::INVALID_VALUE, err));
+		}
+
+		return ts;
+	}
+
+	/**
+	 * Like 'decode', except that nothing is thrown:
+	 * returns the error message if the payload is invalid, or null.
+	 */
+	static const char *tryDecode(
+			std::span<const unsigned char> payload, Timestamp &ts) {
+		ts = Timestamp();
+		if (payload.size() == 4) {
+			ts.seconds = detail::loadBE<uint32_t>(payload.data());
+		} else if (payload.size() == 8) {
+			uint64_t data = detail::loadBE<uint64_t>(payload.data());
+			ts.seconds = data & 0x3ffffffffull;
+			ts.nanoseconds = data >> 34;
+		} else if (payload.size() == 12) {
+			ts.nanoseconds = detail::loadBE<uint32_t>(payload.data());
+			ts.seconds = (int64_t)detail::loadBE<uint64_t>(payload.data() + 4);
+		} else {
+			return "Invalid timestamp length";
+		}
+
+		if (ts.nanoseconds >= 1000000000) {
+			return "Invalid timestamp nanoseconds";
+		}
+
+		return nullptr;
+	}
+};
+
+/**
+ * A fixed set of map keys, for looking up keys without allocating
+ * or comparing against every key in turn; see 'BasicMapParser::nextKeyIndex'.
+ *
+ * The keys are indexed by a perfect hash built when the matcher is
+ * constructed, so a lookup costs one hash of the key, one table lookup
+ * and one comparison against the only key it could be.
+ * Building the hash is comparatively slow,
+ * so a matcher should be constructed once and then reused.
+ */
+class KeyMatcher {
+public:
+	/**
+	 * The index of keys which aren't in the matcher.
+	 */
+	static constexpr size_t UNKNOWN = (size_t)-1;
+
+	KeyMatcher(std::initializer_list<std::string_view> keys):
+		KeyMatcher(std::span<const std::string_view>(keys.begin(), keys.size())) {}
+
+	/**
+	 * Build a matcher for 'keys'. A key's index is its position in 'keys'.
+	 * Throws a ParseError if 'keys' contains duplicates,
+	 * since they would make the hash impossible to build.
+	 */
+	explicit KeyMatcher(std::span<const std::string_view> keys):
+			keys_(keys.begin(), keys.end()) {
+		for (const std::string &key: keys_) {
+			if (key.size() > maxLength_) {
+				maxLength_ = key.size();
+			}
+		}
+
+		std::vector<std::string_view> sorted(keys.begin(), keys.end());
+		std::sort(sorted.begin(), sorted.end());
+		if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end()) {
+			detail::raise(ParseError(
+				ErrorCode::INVALID_ARGUMENT, "Duplicate key in KeyMatcher"));
+		}
+
+		build();
+	}
+
+	/**
+	 * Get the index of 'key' in the list of keys the matcher was built from,
+	 * or UNKNOWN if it isn't one of them.
+	 */
+	size_t find(std::string_view key) const {
+		if (key.size() > maxLength_) {
+			return UNKNOWN;
+		}
+
+		uint64_t h = hash(key, seed_);
+		uint32_t index = slots_[slot(h, displacements_[h & bucketMask_])];
+		if (index == EMPTY || keys_[index] != key) {
+			return UNKNOWN;
+		}
+
+		return index;
+	}
+
+	/**
+	 * Get the number of keys.
+	 */
+	size_t size() const { return keys_.size(); }
+
+	/**
+	 * Get the length of the longest key.
+	 */
+	size_t maxLength() const { return maxLength_; }
+
+private:
+	static constexpr uint32_t EMPTY = (uint32_t)-1;
+
+	static uint64_t mix(uint64_t h) {
+		h *= 0xbf58476d1ce4e5b9ull;
+		return h ^ (h >> 32);
+	}
+
+	// Hashes a word at a time; the tail is read as two overlapping words
+	// so that every byte of the key contributes to the hash
+	static uint64_t hash(std::string_view key, uint64_t seed) {
+		const unsigned char *data = (const unsigned char *)key.data();
+		size_t length = key.size();
+		uint64_t h = seed ^ (length * 0x9e3779b97f4a7c15ull);
+		uint64_t word;
+		while (length > 8) {
+			memcpy(&word, data, 8);
+			h = mix(h ^ word);
+			data += 8;
+			length -= 8;
+		}
+
+		if (length >= 4) {
+			uint32_t lo, hi;
+			memcpy(&lo, data, 4);
+			memcpy(&hi, data + length - 4, 4);
+			word = lo | (uint64_t)hi << 32;
+		} else if (length > 0) {
+			word = data[0] | data[length / 2] << 8 | data[length - 1] << 16;
+		} else {
+			word = 0;
+		}
+
+		return mix(mix(h ^ word));
+	}
+
+	// The upper half of the hash gives a start and an odd step,
+	// so the displacements of a bucket reach every slot
+	size_t slot(uint64_t h, uint32_t displacement) const {
+		uint32_t start = h >> 32;
+		uint32_t step = (h >> 16) | 1;
+		return (start + displacement * step) & slotMask_;
+	}
+
+	// Builds the hash and displace table: keys are split into buckets
+	// by their hash, and for each bucket (largest first),
+	// a displacement is found which moves all of its keys into free slots.
+	// If some bucket can't be placed, try again with another seed,
+	// and after a few failed seeds, with a larger table.
+	void build() {
+		size_t numBuckets = 1;
+		while (numBuckets < keys_.size()) {
+			numBuckets *= 2;
+		}
+
+		size_t numSlots = numBuckets * 2;
+		std::vector<uint64_t> hashes(keys_.size());
+		std::vector<std::vector<uint32_t>> buckets;
+		std::vector<size_t> placed;
+
+		for (uint64_t attempt = 0;; ++attempt) {
+			if (attempt > 0 && attempt % 32 == 0) {
+				numSlots *= 2;
+			}
+
+			seed_ = mix(attempt + 1);
+			bucketMask_ = numBuckets - 1;
+			slotMask_ = numSlots - 1;
+			buckets.assign(numBuckets, {});
+			for (size_t i = 0; i < keys_.size(); ++i) {
+				hashes[i] = hash(keys_[i], seed_);
+				buckets[hashes[i] & bucketMask_].push_back(i);
+			}
+
+			std::vector<uint32_t> order(numBuckets);
+			for (size_t i = 0; i < numBuckets; ++i) {
+				order[i] = i;
+			}
+			std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+				return buckets[a].size() > buckets[b].size();
+			});
+
+			slots_.assign(numSlots, EMPTY);
+			displacements_.assign(numBuckets, 0);
+			if (placeBuckets(order, buckets, hashes, placed)) {
+				return;
+			}
+		}
+	}
+
+	bool placeBuckets(
+			const std::vector<uint32_t> &order,
+			const std::vector<std::vector<uint32_t>> &buckets,
+			const std::vector<uint64_t> &hashes,
+			std::vector<size_t> &placed) {
+		for (uint32_t bucket: order) {
+			if (buckets[bucket].empty()) {
+				break;
+			}
+
+			bool found = false;
+			for (uint32_t d = 0; d <= slotMask_ && !found; ++d) {
+				placed.clear();
+				found = true;
+				for (uint32_t index: buckets[bucket]) {
+					size_t s = slot(hashes[index], d);
+					if (slots_[s] != EMPTY) {
+						found = false;
+						break;
+					}
+
+					slots_[s] = index;
+					placed.push_back(s);
+				}
+
+				if (!found) {
+					for (size_t s: placed) {
+						slots_[s] = EMPTY;
+					}
+				} else {
+					displacements_[bucket] = d;
+				}
+			}
+
+			if (!found) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	std::vector<std::string> keys_;
+	std::vector<uint32_t> slots_;
+	std::vector<uint32_t> displacements_;
+	uint64_t seed_ = 0;
+	uint64_t bucketMask_ = 0;
+	uint64_t slotMask_ = 0;
+	size_t maxLength_ = 0;
+};
+
+template<typename Source, ErrorMode Mode = ErrorMode::THROW>
+class BasicMapParser;
+
+template<typename Source, ErrorMode Mode = ErrorMode::THROW>
+class BasicArrayParser;
+
+/**
+ * A MessagePack stream parser.
+ * Methods will throw a ParseError if preconditions are violated,
+ * unless the parser's 'Mode' is ErrorMode::STATUS,
+ * in which case errors are recorded in a ParseStatus.
+ *
+ * The 'Source' is what the parser reads bytes from.
+ * It's either an 'std::istream' (see 'Parser'),
+ * a 'SpanSource' (see 'SpanParser') or some other ByteSource.
+ */
+template<typename Source, ErrorMode Mode = ErrorMode::THROW>
+class BasicParser {
+public:
+	explicit BasicParser(Source &src) requires (Mode == ErrorMode::THROW):
+		r_(src) {}
+
+	/**
+	 * Create a parser which records errors in 'status'
+	 * instead of throwing them; see ParseStatus.
+	 * Its sub-parsers record their errors in the same status.
+	 */
+	BasicParser(Source &src, ParseStatus &status)
+			requires (Mode == ErrorMode::STATUS):
+		r_(src, &status) {}
+
+	/**
+	 * Check whether there are more objects available in the stream.
+	 * For unconstrained parsers, this returns 'false' only when EOF is reached.
+	 * For constrained parsers (i.e MapParser and ArrayParser),
+	 * this returns 'false' when there are no more values left to read
+	 * in the array/map.
+	 *
+	 * Preconditions: None
+	 */
+	bool hasNext() {
+		if (hasLimit_) {
+			return limit_ > 0 && !r_.stopped();
+		} else {
+			return r_.peek() >= 0 && !r_.stopped();
+		}
+	}
+
+	/**
+	 * Get the type of the next value.
+	 *
+	 * Preconditions:
+	 *   The stream cursor must be at the start of a valid object
+	 *   hasNext() == true
+	 */
+	Type nextType() {
+		if (limit_ == 0) {
+			r_.fail(ErrorCode::LENGTH_LIMIT, "Length limit exceeded");
+			return Type::NIL;
+		}
+
+		int ch = r_.peek();
+		if (ch < 0) {
+			r_.fail(ErrorCode::UNEXPECTED_EOF, "Unexpected EOF");
+			return Type::NIL;
+		}
+
+		// This is deliberately a chain of comparisons rather than
+		// a lookup in detail::headerTable: when nextType() is inlined
+		// into a switch on its result, the compiler can jump straight
+		// from the range checks to the matching case, whereas a looked-up
+		// type needs an extra indirect jump which is hard to predict
+		// in mixed-type streams
+		if (ch <= 0x7f) {
+			return Type::UINT;
+		} else if (ch <= 0x8f) {
+			return Type::MAP;
+		} else if (ch <= 0x9f) {
+			return Type::ARRAY;
+		} else if (ch <= 0xbf) {
+			return Type::STRING;
+		} else if (ch == 0xc0) {
+			return Type::NIL;
+		} else if (ch == 0xc1) {
+			// Never used
+			r_.fail(ErrorCode::INVALID_HEADER, "Unexpected header byte");
+			return Type::NIL;
+		} else if (ch <= 0xc3) {
+			return Type::BOOL;
+		} else if (ch <= 0xc6) {
+			return Type::BINARY;
+		} else if (ch <= 0xc9) {
+			return Type::EXTENSION;
+		} else if (ch == 0xca) {
+			return Type::FLOAT32;
+		} else if (ch == 0xcb) {
+			return Type::FLOAT64;
+		} else if (ch <= 0xcf) {
+			return Type::UINT;
+		} else if (ch <= 0xd3) {
+			return Type::INT;
+		} else if (ch <= 0xd8) {
+			return Type::EXTENSION;
+		} else if (ch <= 0xdb) {
+			return Type::STRING;
+		} else if (ch <= 0xdd) {
+			return Type::ARRAY;
+		} else if (ch <= 0xdf) {
+			return Type::MAP;
+		} else {
+			return Type::INT;
+		}
+	}
+
+	/**
+	 * Read the next value's header, and return its type together with
+	 * its value or length. This avoids the separate header lookups of
+	 * calling nextType() and then one of the nextX() methods.
+	 *
+	 * Ints, floats, bools and nils are consumed entirely.
+	 *
+	 * For strings, binaries and extensions, the 'length' bytes of payload
+	 * must then be consumed with 'nextPayload', 'nextPayloadView'
+	 * or 'skipPayload' before reading anything else.
+	 *
+	 * For arrays and maps, only the header is consumed,
+	 * and the values in the container are read next from the same parser,
+	 * as if they were part of the stream itself:
+	 * 'length' values for arrays, and '2 * length' keys and values for maps.
+	 *
+	 * Preconditions:
+	 *   The stream cursor must be at the start of a valid object
+	 *   hasNext() == true
+	 */
+	Token nextToken() {
+		const detail::HeaderInfo &info = nextHeader();
+		Token token;
+		token.type = info.type;
+
+		switch (info.type) {
+		case Type::INT:
+		case Type::UINT:
+			token.value = nextIntValue(info);
+			break;
+		case Type::NIL:
+			if (!info.valid) {
+				r_.fail(ErrorCode::INVALID_HEADER, "Unexpected header byte");
+			}
+			break;
+		case Type::BOOL:
+			token.value = info.inlineValue;
+			break;
+		case Type::FLOAT32:
+		case Type::FLOAT64:
+			token.floatValue = nextFloatValue(info);
+			break;
+		case Type::STRING:
+		case Type::BINARY:
+			token.length = nextLength(info);
+			break;
+		case Type::EXTENSION:
+			token.length = nextLength(info);
+			token.extensionType = nextExtensionType();
+			break;
+		case Type::ARRAY:
+			token.length = nextLength(info);
+			if (hasLimit_) {
+				limit_ += token.length;
+			}
+			break;
+		case Type::MAP:
+			token.length = nextLength(info);
+			if (hasLimit_) {
+				limit_ += token.length * 2;
+			}
+			break;
+		}
+
+		return token;
+	}
+
+	/**
+	 * Read the payload of a string, binary or extension
+	 * whose header was read with 'nextToken'.
+	 */
+	void nextPayload(std::string &str, size_t length) {
+		r_.fillContainer(str, length);
+	}
+
+	/**
+	 * Like 'nextPayload(std::string &, size_t)',
+	 * except that the payload is read into a byte vector.
+	 */
+	void nextPayload(std::vector<unsigned char> &bin, size_t length) {
+		r_.fillContainer(bin, length);
+	}
+
+	/**
+	 * Like 'nextPayload(std::string &, size_t)',
+	 * except that the payload is read into a caller-provided buffer
+	 * of at least 'length' bytes.
+	 */
+	void nextPayload(void *data, size_t length) {
+		r_.nextBlob(data, length);
+	}
+
+	/**
+	 * Like 'nextPayload(std::string &, size_t)',
+	 * except that the returned span points directly into the source's memory.
+	 * Only available when parsing from a SpanSource.
+	 */
+	std::span<const unsigned char> nextPayloadView(size_t length)
+		requires std::same_as<Source, SpanSource> {
+		const unsigned char *data = r_.take(length);
+		return std::span<const unsigned char>(data, length);
+	}
+
+	/**
+	 * Skip the payload of a string, binary or extension
+	 * whose header was read with 'nextToken'.
+	 */
+	void skipPayload(size_t length) {
+		r_.skip(length);
+	}
+
+	/**
+	 * Get the next value as an integer.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::INT || nextType() == Type::UINT
+	 *
+	 * Note: if nextType() == Type::UINT,
+	 * the int might not fit in an int64_t.
+	 * This will cause the value to wrap around.
+	 */
+	int64_t nextInt() {
+		return (int64_t)nextUInt();
+	}
+
+	/**
+	 * Get the next value as an unsigned integer.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::INT || nextType() == Type::UINT
+	 *
+	 * Note: if nextType() == Type::INT,
+	 * the int might not fit in a uint64_t.
+	 * This will cause the value to wrap around.
+	 */
+	uint64_t nextUInt() {
+		const detail::HeaderInfo &info = nextHeader();
+		if (info.type != Type::INT && info.type != Type::UINT) {
+			r_.fail(
+				ErrorCode::TYPE_MISMATCH, "Attempt to parse non-integer as integer");
+			return 0;
+		}
+
+		return nextIntValue(info);
+	}
+
+	/**
+	 * Get the next value as an integer of any type.
+	 * Unlike 'nextInt' and 'nextUInt', an integer which doesn't fit
+	 * in 'value' is an error (INVALID_VALUE) instead of wrapping around.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::INT || nextType() == Type::UINT
+	 */
+	template<std::integral T>
+	void nextInt(T &value) requires (!std::same_as<T, bool>) {
+		value = 0;
+		const detail::HeaderInfo &info = nextHeader();
+		if (info.type != Type::INT && info.type != Type::UINT) {
+			r_.fail(
+				ErrorCode::TYPE_MISMATCH, "Attempt to parse non-integer as integer");
+			return;
+		}
+
+		uint64_t num = nextIntValue(info);
+		bool fits = info.type == Type::INT ?
+			std::in_range<T>((int64_t)num) : std::in_range<T>(num);
+		if (!fits) {
+			r_.fail(ErrorCode::INVALID_VALUE, "Integer out of range");
+			return;
+		}
+
+		value = (T)num;
+	}
+
+	/**
+	 * Skip the next value if it's a nil.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::NIL
+	 */
+	void skipNil() {
+		const detail::HeaderInfo &info = nextHeader();
+		if (info.type != Type::NIL || !info.valid) {
+			r_.fail(ErrorCode::TYPE_MISMATCH, "Attempt to parse non-nil as nil");
+		}
+	}
+
+
+	/**
+	 * Get the next value as a boolean.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::BOOL
+	 */
+	bool nextBool() {
+		const detail::HeaderInfo &info = nextHeader();
+		if (info.type != Type::BOOL) {
+			r_.fail(ErrorCode::TYPE_MISMATCH, "Attempt to parse non-bool as bool");
+			return false;
+		}
+
+		return info.inlineValue != 0;
+	}
+
+	/**
+	 * Get the next value as a 32-bit float.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::FLOAT32 || nextType() == Type::FLOAT64
+	 */
+	float nextFloat32() {
+		const detail::HeaderInfo &info = nextHeader();
+		if (info.type == Type::FLOAT32) {
+			return nextF32();
+		} else if (info.type == Type::FLOAT64) {
+			return (float)nextF64();
+		} else {
+			r_.fail(ErrorCode::TYPE_MISMATCH, "Attempt to parse non-float as float");
+			return 0;
+		}
+	}
+
+	/**
+	 * Get the next value as a 64-bit float.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::FLOAT32 || nextType() == Type::FLOAT64
+	 */
+	double nextFloat64() {
+		const detail::HeaderInfo &info = nextHeader();
+		if (info.type != Type::FLOAT32 && info.type != Type::FLOAT64) {
+			r_.fail(ErrorCode::TYPE_MISMATCH, "Attempt to parse non-float as float");
+			return 0;
+		}
+
+		return nextFloatValue(info);
+	}
+
+	/**
+	 * Get the next value as a string.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::STRING
+	 */
+	void nextString(std::string &str) {
+		size_t length = nextStringHeader();
+		r_.fillContainer(str, length);
+	}
+
+	/**
+	 * Like 'nextString(std::string &)',
+	 * except that a new string is returned instead.
+	 */
+	std::string nextString() {
+		std::string str;
+		nextString(str);
+		return str;
+	}
+
+	/**
+	 * Get the next value as a byte string.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::BINARY
+	 */
+	void nextBinary(std::vector<unsigned char> &bin) {
+		size_t length = nextBinaryHeader();
+		r_.fillContainer(bin, length);
+	}
+
+	/**
+	 * Like 'nextBinary(std::vector<unsigned char> &)',
+	 * except that a new vector is returned instead.
+	 */
+	std::vector<unsigned char> nextBinary() {
+		std::vector<unsigned char> bin;
+		nextBinary(bin);
+		return bin;
+	}
+
+	/**
+	 * Get the next value as a string view which points directly into
+	 * the source's memory, without copying.
+	 * Only available when parsing from a SpanSource.
+	 * The view remains valid for as long as the source's memory does.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::STRING
+	 */
+	std::string_view nextStringView()
+		requires std::same_as<Source, SpanSource> {
+		size_t length = nextStringHeader();
+		const char *data = (const char *)r_.take(length);
+		return std::string_view(data, length);
+	}
+
+	/**
+	 * Get the next value as a byte span which points directly into
+	 * the source's memory, without copying.
+	 * Only available when parsing from a SpanSource.
+	 * The span remains valid for as long as the source's memory does.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::BINARY
+	 */
+	std::span<const unsigned char> nextBinaryView()
+		requires std::same_as<Source, SpanSource> {
+		size_t length = nextBinaryHeader();
+		const unsigned char *data = r_.take(length);
+		return std::span<const unsigned char>(data, length);
+	}
+
+	/**
+	 * Create a constrained sub-parser limited to read
+	 * only the values in the next array value.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::ARRAY
+	 */
+	BasicArrayParser<Source, Mode> nextArray();
+
+	/**
+	 * Create a constrained sub-parser limited to read
+	 * only the values in the next map value.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::MAP
+	 */
+	BasicMapParser<Source, Mode> nextMap();
+
+	/**
+	 * Read the next extension value.
+	 * Will populate 'ext' with its contents,
+	 * and return the extension value's type.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::EXTENSION
+	 */
+	int64_t nextExtension(std::vector<unsigned char> &ext) {
+		int64_t type;
+		size_t length;
+		nextExtensionHeader(type, length);
+
+		r_.fillContainer(ext, length);
+		return type;
+	}
+
+	/**
+	 * Read the next value as a timestamp extension.
+	 * Unlike 'nextExtension', this doesn't allocate.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::EXTENSION
+	 *   The extension's type is Timestamp::EXTENSION_TYPE
+	 */
+	Timestamp nextTimestamp() {
+		int64_t type;
+		size_t length;
+		nextExtensionHeader(type, length);
+		if (type != Timestamp::EXTENSION_TYPE) {
+			r_.fail(
+				ErrorCode::TYPE_MISMATCH,
+				"Attempt to parse non-timestamp as timestamp");
+			return Timestamp();
+		}
+
+		unsigned char buf[12];
+		if (length > sizeof(buf)) {
+			r_.fail(ErrorCode::INVALID_VALUE, "Invalid timestamp length");
+			return Timestamp();
+		}
+
+		if (!r_.nextBlob(buf, length)) {
+			return Timestamp();
+		}
+
+		Timestamp ts;
+		if (const char *err = Timestamp::tryDecode(
+				std::span<const unsigned char>(buf, length), ts)) {
+			r_.fail(ErrorCode::INVALID_VALUE, err);
+		}
+
+		return ts;
+	}
+
+	/**
+	 * Like 'nextExtension(std::vector<unsigned char> &)',
+	 * except that 'ext' is set to point directly into the source's memory.
+	 * Only available when parsing from a SpanSource.
+	 * The span remains valid for as long as the source's memory does.
+	 */
+	int64_t nextExtensionView(std::span<const unsigned char> &ext)
+		requires std::same_as<Source, SpanSource> {
+		int64_t type;
+		size_t length;
+		nextExtensionHeader(type, length);
+
+		const unsigned char *data = r_.take(length);
+		ext = std::span<const unsigned char>(data, length);
+		return type;
+	}
+
+	/**
+	 * Skip the next value, whatever its type.
+	 *
+	 * Preconditions:
+	 *   The stream cursor must be at the start of a valid object
+	 *   hasNext() == true
+	 */
+	void skipNext();
+
+	/**
+	 * Skip all available values.
+	 *
+	 * Preconditions:
+	 *   The stream must be a valid MessagePack stream.
+	 */
+	void skipAll() {
+		while (hasNext()) {
+			skipNext();
+		}
+	}
+
+protected:
+	explicit BasicParser(Source &src, size_t limit, ParseStatus *status):
+		r_(src, status), limit_(limit), hasLimit_(true) {}
+
+	void proceed() {
+		if (!hasLimit_) {
+			return;
+		}
+
+		if (limit_ == 0) {
+			r_.fail(ErrorCode::LENGTH_LIMIT, "Length limit exceeded");
+			return;
+		}
+
+		limit_ -= 1;
+	}
+
+	// Consume the next value's header byte and look it up
+	const detail::HeaderInfo &nextHeader() {
+		proceed();
+
+		// After an error, every value is invalid,
+		// so the caller fails without reading anything.
+		// Spans and streams need no check: they fail every read anyway.
+		if constexpr (
+				!std::same_as<Source, SpanSource> &&
+				!std::same_as<Source, std::istream>) {
+			if (r_.failed()) {
+				return detail::headerTable[0xc1];
+			}
+		}
+
+		return detail::headerTable[r_.nextU8()];
+	}
+
+	// Read the length or count of a value whose header byte has been read
+	uint32_t nextLength(const detail::HeaderInfo &info) {
+		switch (info.lengthWidth) {
+		case 1:
+			return r_.nextU8();
+		case 2:
+			return r_.nextU16();
+		case 4:
+			return r_.nextU32();
+		default:
+			return info.inlineLength;
+		}
+	}
+
+	// Read an integer whose header byte has been read
+	uint64_t nextIntValue(const detail::HeaderInfo &info) {
+		// This series of casts produces a sign-extended u64
+		if (info.type == Type::INT) {
+			switch (info.extra) {
+			case 0:
+				return (uint64_t)(int64_t)(int8_t)info.inlineValue;
+			case 1:
+				return (uint64_t)(int64_t)r_.nextI8();
+			case 2:
+				return (uint64_t)(int64_t)r_.nextI16();
+			case 4:
+				return (uint64_t)(int64_t)r_.nextI32();
+			default:
+				return (uint64_t)r_.nextI64();
+			}
+		} else {
+			switch (info.extra) {
+			case 0:
+				return info.inlineValue;
+			case 1:
+				return r_.nextU8();
+			case 2:
+				return r_.nextU16();
+			case 4:
+				return r_.nextU32();
+			default:
+				return r_.nextU64();
+			}
+		}
+	}
+
+	// Read a float whose header byte has been read
+	double nextFloatValue(const detail::HeaderInfo &info) {
+		if (info.type == Type::FLOAT32) {
+			return (double)nextF32();
+		} else {
+			return nextF64();
+		}
+	}
+
+	float nextF32() {
+		static_assert(sizeof(float) == sizeof(uint32_t));
+		float f32;
+		uint32_t u32 = r_.nextU32();
+		memcpy(&f32, &u32, 4);
+		return f32;
+	}
+
+	double nextF64() {
+		static_assert(sizeof(double) == sizeof(uint64_t));
+		double f64;
+		uint64_t u64 = r_.nextU64();
+		memcpy(&f64, &u64, 8);
+		return f64;
+	}
+
+	// The extension type is a single signed byte after the length
+	int64_t nextExtensionType() {
+		return r_.nextI8();
+	}
+
+	size_t nextStringHeader() {
+		const detail::HeaderInfo &info = nextHeader();
+		if (info.type != Type::STRING) {
+			r_.fail(
+				ErrorCode::TYPE_MISMATCH, "Attempt to parse non-string as string");
+			return 0;
+		}
+
+		return nextLength(info);
+	}
+
+	size_t nextBinaryHeader() {
+		const detail::HeaderInfo &info = nextHeader();
+		if (info.type != Type::BINARY) {
+			r_.fail(
+				ErrorCode::TYPE_MISMATCH, "Attempt to parse non-binary as binary");
+			return 0;
+		}
+
+		return nextLength(info);
+	}
+
+	void nextExtensionHeader(int64_t &type, size_t &length) {
+		const detail::HeaderInfo &info = nextHeader();
+		if (info.type != Type::EXTENSION) {
+			r_.fail(
+				ErrorCode::TYPE_MISMATCH,
+				"Attempt to parse non-extension as extension");
+			type = 0;
+			length = 0;
+			return;
+		}
+
+		length = nextLength(info);
+		type = nextExtensionType();
+	}
+
+	detail::Reader<Source, Mode> r_;
+	size_t limit_ = 1;
+	bool hasLimit_ = false;
+};
+
+template<typename Source, ErrorMode Mode>
+class BasicArrayParser: public BasicParser<Source, Mode> {
+public:
+	BasicArrayParser(Source &src, size_t limit, ParseStatus *status = nullptr):
+		BasicParser<Source, Mode>(src, limit, status) {}
+
+	/**
+	 * Get the number of values left to read from the array.
+	 * Before any values have been read, this will be
+	 * equal to the total number of values in the array.
+	 */
+	size_t arraySize() { return this->limit_; }
+
+	/**
+	 * Read the next 'out.size()' values of the array into 'out',
+	 * as if by calling 'nextFloat64' for each of them.
+	 * When parsing from a SpanSource, runs of identically-encoded floats
+	 * (such as all float64) are decoded in bulk.
+	 *
+	 * Preconditions:
+	 *   out.size() <= arraySize()
+	 *   The next 'out.size()' values are floats
+	 */
+	void nextAll(std::span<double> out) {
+		nextAllImpl(out, &detail::decodeFloatRun, [this] {
+			return this->nextFloat64();
+		});
+	}
+
+	/**
+	 * Read the next 'out.size()' values of the array into 'out',
+	 * as if by calling 'nextInt' for each of them.
+	 * When parsing from a SpanSource, runs of identically-encoded integers
+	 * (such as all fixints, or all int32) are decoded in bulk.
+	 *
+	 * Preconditions:
+	 *   out.size() <= arraySize()
+	 *   The next 'out.size()' values are integers
+	 */
+	void nextAll(std::span<int64_t> out) {
+		nextAllImpl(out, &detail::decodeIntRun, [this] {
+			return this->nextInt();
+		});
+	}
+
+	/**
+	 * Read all the remaining values of the array into 'vec',
+	 * replacing its contents. See 'nextAll'.
+	 */
+	template<typename T>
+		requires std::same_as<T, double> || std::same_as<T, int64_t>
+	void readInto(std::vector<T> &vec) {
+		vec.clear();
+		while (arraySize() > 0) {
+			// Every value is at least one byte, so a length that's larger than
+			// the input is an error; don't allocate for it up front.
+			// Streams don't know how much input is left, so grow in chunks.
+			size_t chunk = arraySize();
+			if constexpr (std::same_as<Source, SpanSource>) {
+				if (chunk > this->r_.available().size()) {
+					this->r_.fail(ErrorCode::UNEXPECTED_EOF, "Unexpected EOF");
+					return;
+				}
+			} else if (chunk > 65536) {
+				chunk = 65536;
+			}
+
+			size_t size = vec.size();
+			vec.resize(size + chunk);
+			nextAll(std::span<T>(vec.data() + size, chunk));
+			if (this->r_.failed()) {
+				return;
+			}
+		}
+	}
+
+private:
+	template<typename T, typename DecodeRun, typename Next>
+	void nextAllImpl(std::span<T> out, DecodeRun decodeRun, Next next) {
+		if (out.size() > this->limit_) {
+			this->r_.fail(ErrorCode::LENGTH_LIMIT, "Length limit exceeded");
+			std::fill(out.begin(), out.end(), 0);
+			return;
+		}
+
+		size_t i = 0;
+		if constexpr (std::same_as<Source, SpanSource>) {
+			while (i < out.size()) {
+				std::span<const unsigned char> data = this->r_.available();
+				size_t stride;
+				size_t n = decodeRun(
+					data.data(), data.size(), out.data() + i, out.size() - i, stride);
+				if (n == 0) {
+					// Not a number or truncated; let the scalar path throw
+					out[i++] = next();
+					continue;
+				}
+
+				this->r_.skip(n * stride);
+				this->limit_ -= n;
+				i += n;
+			}
+		}
+
+		for (; i < out.size(); ++i) {
+			out[i] = next();
+		}
+	}
+};
+
+template<typename Source, ErrorMode Mode>
+class BasicMapParser: public BasicParser<Source, Mode> {
+public:
+	BasicMapParser(Source &src, size_t limit, ParseStatus *status = nullptr):
+		BasicParser<Source, Mode>(src, limit * 2, status) {}
+
+	/**
+	 * Get the number of key-value pairs left to read from the map.
+	 * Before any key-value pairs have been read, this will be
+	 * equal to the total number of key-value pairs in the map.
+	 */
+	size_t mapSize() { return this->limit_ / 2; }
+
+	/**
+	 * Get the next key of the map.
+	 * Returns false if there are no more values in the map.
+	 */
+	bool nextKey(std::string &key) {
+		if (!this->hasNext()) {
+			return false;
+		}
+
+		this->nextString(key);
+		return true;
+	}
+
+	/**
+	 * Like 'nextKey(std::string &)',
+	 * except that 'key' is set to point directly into the source's memory.
+	 * Only available when parsing from a SpanSource.
+	 */
+	bool nextKey(std::string_view &key)
+		requires std::same_as<Source, SpanSource> {
+		if (!this->hasNext()) {
+			return false;
+		}
+
+		key = this->nextStringView();
+		return true;
+	}
+
+	/**
+	 * Get the next key of the map, and look it up in 'matcher'.
+	 * 'index' is set to the key's index in the matcher,
+	 * or to 'KeyMatcher::UNKNOWN' if it isn't one of the matcher's keys.
+	 * Keys which aren't strings are skipped, and are unknown.
+	 * Returns false if there are no more values in the map.
+	 *
+	 * Unlike 'nextKey', this doesn't allocate: the key is looked up
+	 * in place when parsing from a SpanSource,
+	 * and is read into a stack buffer otherwise.
+	 */
+	bool nextKeyIndex(const KeyMatcher &matcher, size_t &index) {
+		if (!this->hasNext()) {
+			return false;
+		}
+
+		if (this->nextType() != Type::STRING) {
+			this->skipNext();
+			index = KeyMatcher::UNKNOWN;
+			return true;
+		}
+
+		size_t length = this->nextStringHeader();
+		if constexpr (std::same_as<Source, SpanSource>) {
+			const char *data = (const char *)this->r_.take(length);
+			index = matcher.find(std::string_view(data, length));
+		} else if (length > matcher.maxLength()) {
+			this->r_.skip(length);
+			index = KeyMatcher::UNKNOWN;
+		} else if (length <= 64) {
+			char buf[64];
+			this->r_.nextBlob(buf, length);
+			index = matcher.find(std::string_view(buf, length));
+		} else {
+			std::string key;
+			this->r_.fillContainer(key, length);
+			index = matcher.find(key);
+		}
+
+		// A key which failed to read might look like an empty key
+		if (this->r_.failed()) {
+			index = KeyMatcher::UNKNOWN;
+		}
+
+		return true;
+	}
+};
+
+using Parser = BasicParser<std::istream>;
+using ArrayParser = BasicArrayParser<std::istream>;
+using MapParser = BasicMapParser<std::istream>;
+
+using SpanParser = BasicParser<SpanSource>;
+using SpanArrayParser = BasicArrayParser<SpanSource>;
+using SpanMapParser = BasicMapParser<SpanSource>;
+
+// Parsers which record errors in a ParseStatus instead of throwing them
+using StatusParser = BasicParser<std::istream, ErrorMode::STATUS>;
+using StatusArrayParser = BasicArrayParser<std::istream, ErrorMode::STATUS>;
+using StatusMapParser = BasicMapParser<std::istream, ErrorMode::STATUS>;
+
+using SpanStatusParser = BasicParser<SpanSource, ErrorMode::STATUS>;
+using SpanStatusArrayParser = BasicArrayParser<SpanSource, ErrorMode::STATUS>;
+using SpanStatusMapParser = BasicMapParser<SpanSource, ErrorMode::STATUS>;
+
+template<typename Source, ErrorMode Mode>
+inline BasicArrayParser<Source, Mode> BasicParser<Source, Mode>::nextArray() {
+	const detail::HeaderInfo &info = nextHeader();
+	if (info.type != Type::ARRAY) {
+		r_.fail(ErrorCode::TYPE_MISMATCH, "Attempt to parse non-array as array");
+		return BasicArrayParser<Source, Mode>(r_.source(), 0, r_.status());
+	}
+
+	return BasicArrayParser<Source, Mode>(r_.source(), nextLength(info), r_.status());
+}
+
+template<typename Source, ErrorMode Mode>
+inline BasicMapParser<Source, Mode> BasicParser<Source, Mode>::nextMap() {
+	const detail::HeaderInfo &info = nextHeader();
+	if (info.type != Type::MAP) {
+		r_.fail(ErrorCode::TYPE_MISMATCH, "Attempt to parse non-map as map");
+		return BasicMapParser<Source, Mode>(r_.source(), 0, r_.status());
+	}
+
+	return BasicMapParser<Source, Mode>(r_.source(), nextLength(info), r_.status());
+}
+
+template<typename Source, ErrorMode Mode>
+inline void BasicParser<Source, Mode>::skipNext() {
+	proceed();
+
+	// Instead of recursing into arrays and maps, keep count of how many
+	// values are left to skip, and add each container's children
+	// to the count when its header is read.
+	// This uses constant stack space however deeply the input is nested.
+	uint64_t pending = 1;
+	while (pending > 0 && !r_.stopped()) {
+		pending -= 1;
+
+		const detail::HeaderInfo &info = detail::headerTable[r_.nextU8()];
+		if (!info.valid) {
+			r_.fail(ErrorCode::INVALID_HEADER, "Unexpected header byte");
+			return;
+		}
+
+		uint32_t length = nextLength(info);
+		if (info.type == Type::ARRAY) {
+			pending += length;
+		} else if (info.type == Type::MAP) {
+			pending += (uint64_t)length * 2;
+		} else {
+			// Everything after the header is skipped in one go
+			size_t skip = info.extra;
+			if (info.hasPayload) {
+				skip += length;
+			}
+
+			if (skip > 0) {
+				r_.skip(skip);
+			}
+		}
+	}
+}
+
+/**
+ * One value in a Tape.
+ */
+struct TapeEntry {
+	/**
+	 * The offset of the value's header byte in the buffer.
+	 */
+	uint64_t offset;
+
+	/**
+	 * The index of the first entry after this value and all its children.
+	 * For scalars, this is the index of the entry itself plus one.
+	 */
+	uint64_t end;
+
+	/**
+	 * The payload length in bytes for strings, binaries and extensions,
+	 * the number of values for arrays, the number of key-value pairs
+	 * for maps, and 0 for everything else.
+	 */
+	uint32_t length;
+
+	Type type;
+};
+
+/**
+ * An index over a buffer of MessagePack values.
+ * The tape is built in one non-recursive pass over the buffer,
+ * and contains one TapeEntry per value in document order:
+ * a container is followed by its children, and a map's children
+ * alternate between keys and values.
+ * With the tape, it's possible to jump straight to any value
+ * instead of skipping over every value before it.
+ *
+ * The tape doesn't own the buffer; the memory must stay valid
+ * for as long as the tape is in use.
+ *
+ * Building the tape throws a ParseError if the buffer
+ * isn't a sequence of complete, valid MessagePack values.
+ */
+class Tape {
+public:
+	explicit Tape(std::span<const unsigned char> data): data_(data) {
+		build();
+	}
+
+	explicit Tape(std::string_view data):
+		Tape(std::span<const unsigned char>(
+			(const unsigned char *)data.data(), data.size())) {}
+
+	/**
+	 * Get the number of values in the tape.
+	 */
+	size_t size() const { return entries_.size(); }
+
+	const TapeEntry &operator[](size_t index) const {
+		return entries_[index];
+	}
+
+	/**
+	 * Get all the entries.
+	 */
+	std::span<const TapeEntry> entries() const { return entries_; }
+
+	/**
+	 * Get the index of the 'n'th child of the array or map at 'index'.
+	 * For maps, the children are keys and values,
+	 * so the 'n'th pair's key is child '2 * n' and its value is '2 * n + 1'.
+	 * This only visits the preceding siblings, not their children.
+	 *
+	 * Preconditions:
+	 *   The entry at 'index' is an array with more than 'n' values,
+	 *   or a map with more than 'n / 2' key-value pairs
+	 */
+	size_t child(size_t index, size_t n) const {
+		size_t child = index + 1;
+		while (n > 0) {
+			child = entries_[child].end;
+			n -= 1;
+		}
+
+		return child;
+	}
+
+	/**
+	 * Get the encoded bytes of the value at 'index', including any children.
+	 * A SpanParser over these bytes can be used to decode the value.
+	 */
+	std::span<const unsigned char> valueBytes(size_t index) const {
+		const TapeEntry &entry = entries_[index];
+		size_t endOffset = entry.end < entries_.size() ?
+			entries_[entry.end].offset : data_.size();
+		return data_.subspan(entry.offset, endOffset - entry.offset);
+	}
+
+	/**
+	 * Get the payload of the string, binary or extension at 'index'.
+	 * For extensions, this excludes the extension type byte.
+	 */
+	std::span<const unsigned char> payload(size_t index) const {
+		const TapeEntry &entry = entries_[index];
+		detail::Header header = detail::decodeHeader(
+			data_.data() + entry.offset, data_.size() - entry.offset);
+		size_t offset = entry.offset + header.size;
+		if (!header.hasPayload) {
+			// The payload of a fixext is part of the fixed-size header
+			offset -= entry.length;
+		}
+
+		return data_.subspan(offset, entry.length);
+	}
+
+private:
+	struct Frame {
+		size_t entry;
+		uint64_t remaining;
+	};
+
+	void build() {
+		const unsigned char *data = data_.data();
+		size_t size = data_.size();
+		size_t pos = 0;
+		std::vector<Frame> stack;
+
+		while (true) {
+			while (!stack.empty() && stack.back().remaining == 0) {
+				entries_[stack.back().entry].end = entries_.size();
+				stack.pop_back();
+			}
+
+			if (pos == size) {
+				if (!stack.empty()) {
+					detail::raise(ParseError(
+						ErrorCode::UNEXPECTED_EOF, "Unexpected EOF"));
+				}
+
+				break;
+			}
+
+			// Runs of fixints are common in arrays of small numbers,
+			// and don't need the table lookup
+			if (detail::isFixInt(data[pos])) {
+				size_t max = size - pos;
+				if (!stack.empty() && stack.back().remaining < max) {
+					max = stack.back().remaining;
+				}
+
+				size_t count = detail::countFixInts(data + pos, max);
+				for (size_t i = 0; i < count; ++i) {
+					size_t index = entries_.size();
+					Type type = data[pos] <= 0x7f ? Type::UINT : Type::INT;
+					entries_.push_back({pos, index + 1, 0, type});
+					pos += 1;
+				}
+
+				if (!stack.empty()) {
+					stack.back().remaining -= count;
+				}
+
+				continue;
+			}
+
+			if (!stack.empty()) {
+				stack.back().remaining -= 1;
+			}
+
+			detail::Header header = detail::decodeHeader(data + pos, size - pos);
+			size_t index = entries_.size();
+			entries_.push_back({pos, index + 1, header.length, header.type});
+			pos += header.size;
+
+			if (header.type == Type::ARRAY || header.type == Type::MAP) {
+				uint64_t remaining = header.length;
+				if (header.type == Type::MAP) {
+					remaining *= 2;
+				}
+
+				if (remaining > 0) {
+					stack.push_back({index, remaining});
+				}
+			} else if (header.hasPayload) {
+				if (header.length > size - pos) {
+					detail::raise(ParseError(
+						ErrorCode::UNEXPECTED_EOF, "Unexpected EOF"));
+				}
+
+				pos += header.length;
+			}
+		}
+	}
+
+	std::span<const unsigned char> data_;
+	std::vector<TapeEntry> entries_;
+};
+
+namespace detail {
+
+// The child offsets memoized by a MsgView, shared between the view
+// and all the views derived from it
+struct ViewCache {
+	std::mutex mutex;
+
+	// For each container visited, the start of each child found so far
+	// (alternating keys and values for maps),
+	// followed by the end of the last child found
+	std::unordered_map<
+		const unsigned char *, std::vector<const unsigned char *>> children;
+};
+
+}
+
+/**
+ * A read-only view of an encoded MessagePack value in memory.
+ * Values are decoded lazily: looking up 'view["a"][3]' only decodes
+ * the headers and keys on the way to the requested value,
+ * and skips over everything else without decoding it.
+ * Keys are compared directly against the encoded bytes,
+ * so looking up a key doesn't allocate.
+ *
+ * The start of each child of an array or map is memoized
+ * the first time it's found, so repeated lookups in the same container
+ * don't skip over the same values again.
+ * Copying a view is cheap, and a view and all the views derived from it
+ * can be used from multiple threads at once.
+ *
+ * The view doesn't own the memory; the memory must stay valid
+ * for as long as the view and any views derived from it are in use.
+ *
+ * Methods will throw a ParseError if preconditions are violated
+ * or if the encoded value is invalid.
+ */
+class MsgView {
+public:
+	explicit MsgView(std::span<const unsigned char> data):
+		begin_(data.data()), end_(data.data() + data.size()),
+		cache_(std::make_shared<detail::ViewCache>()) {}
+
+	explicit MsgView(std::string_view data):
+		MsgView(std::span<const unsigned char>(
+			(const unsigned char *)data.data(), data.size())) {}
+
+	/**
+	 * Get the type of the value.
+	 */
+	Type type() const {
+		return header().type;
+	}
+
+	/**
+	 * Get the number of values in an array, the number of key-value pairs
+	 * in a map, or the length in bytes of a string, binary or extension.
+	 *
+	 * Preconditions:
+	 *   type() is one of ARRAY, MAP, STRING, BINARY or EXTENSION
+	 */
+	size_t size() const {
+		detail::Header h = header();
+		switch (h.type) {
+		case Type::ARRAY:
+		case Type::MAP:
+		case Type::STRING:
+		case Type::BINARY:
+		case Type::EXTENSION:
+			return h.length;
+		default:
+			detail::raise(ParseError(
+				ErrorCode::TYPE_MISMATCH, "Attempt to get size of scalar"));
+		}
+	}
+
+	/**
+	 * Get the value at 'index' in an array.
+	 *
+	 * Preconditions:
+	 *   type() == Type::ARRAY
+	 *   index < size()
+	 */
+	MsgView operator[](size_t index) const {
+		detail::Header h = header();
+		if (h.type != Type::ARRAY) {
+			detail::raise(ParseError(
+				ErrorCode::TYPE_MISMATCH, "Attempt to index non-array"));
+		}
+
+		if (index >= h.length) {
+			detail::raise(ParseError(
+				ErrorCode::NOT_FOUND, "Index out of range"));
+		}
+
+		return child(h, index);
+	}
+
+	/**
+	 * Get the value associated with 'key' in a map.
+	 * If the key occurs more than once, the first one wins.
+	 *
+	 * Preconditions:
+	 *   type() == Type::MAP
+	 *   The map contains 'key'
+	 */
+	MsgView operator[](std::string_view key) const {
+		std::optional<MsgView> val = find(key);
+		if (!val) {
+			detail::raise(ParseError(ErrorCode::NOT_FOUND, "Key not found"));
+		}
+
+		return *val;
+	}
+
+	/**
+	 * Like 'operator[](std::string_view)',
+	 * except that std::nullopt is returned if the map doesn't contain 'key'.
+	 * Keys which aren't strings never match.
+	 *
+	 * Preconditions:
+	 *   type() == Type::MAP
+	 */
+	std::optional<MsgView> find(std::string_view key) const {
+		detail::Header h = header();
+		if (h.type != Type::MAP) {
+			detail::raise(ParseError(
+				ErrorCode::TYPE_MISMATCH, "Attempt to look up key in non-map"));
+		}
+
+		for (size_t i = 0; i < h.length; ++i) {
+			MsgView k = child(h, i * 2);
+			detail::Header kh = k.header();
+			if (kh.type != Type::STRING || kh.length != key.size()) {
+				continue;
+			}
+
+			if (kh.length > (size_t)(k.end_ - k.begin_) - kh.size) {
+				detail::raise(ParseError(
+					ErrorCode::UNEXPECTED_EOF, "Unexpected EOF"));
+			}
+
+			if (memcmp(k.begin_ + kh.size, key.data(), key.size()) == 0) {
+				return child(h, i * 2 + 1);
+			}
+		}
+
+		return std::nullopt;
+	}
+
+	/**
+	 * Get the key of the key-value pair at 'index' in a map.
+	 *
+	 * Preconditions:
+	 *   type() == Type::MAP
+	 *   index < size()
+	 *   The key is a string
+	 */
+	std::string_view keyAt(size_t index) const {
+		return pairChild(index * 2).asString();
+	}
+
+	/**
+	 * Get the value of the key-value pair at 'index' in a map.
+	 *
+	 * Preconditions:
+	 *   type() == Type::MAP
+	 *   index < size()
+	 */
+	MsgView valueAt(size_t index) const {
+		return pairChild(index * 2 + 1);
+	}
+
+	/**
+	 * Check whether the value is nil.
+	 */
+	bool isNil() const {
+		return type() == Type::NIL;
+	}
+
+	/**
+	 * Get the value as an integer.
+	 * See 'BasicParser::nextInt'.
+	 */
+	int64_t asInt() const {
+		return parse([](SpanParser &p) { return p.nextInt(); });
+	}
+
+	/**
+	 * Get the value as an unsigned integer.
+	 * See 'BasicParser::nextUInt'.
+	 */
+	uint64_t asUInt() const {
+		return parse([](SpanParser &p) { return p.nextUInt(); });
+	}
+
+	/**
+	 * Get the value as a boolean.
+	 * See 'BasicParser::nextBool'.
+	 */
+	bool asBool() const {
+		return parse([](SpanParser &p) { return p.nextBool(); });
+	}
+
+	/**
+	 * Get the value as a 32-bit float.
+	 * See 'BasicParser::nextFloat32'.
+	 */
+	float asFloat32() const {
+		return parse([](SpanParser &p) { return p.nextFloat32(); });
+	}
+
+	/**
+	 * Get the value as a 64-bit float.
+	 * See 'BasicParser::nextFloat64'.
+	 */
+	double asFloat64() const {
+		return parse([](SpanParser &p) { return p.nextFloat64(); });
+	}
+
+	/**
+	 * Get the value as a string view which points into the view's memory.
+	 * See 'BasicParser::nextStringView'.
+	 */
+	std::string_view asString() const {
+		return parse([](SpanParser &p) { return p.nextStringView(); });
+	}
+
+	/**
+	 * Get the value as a byte span which points into the view's memory.
+	 * See 'BasicParser::nextBinaryView'.
+	 */
+	std::span<const unsigned char> asBinary() const {
+		return parse([](SpanParser &p) { return p.nextBinaryView(); });
+	}
+
+	/**
+	 * Get the value as an extension, with 'ext' pointing into
+	 * the view's memory, and return the extension type.
+	 * See 'BasicParser::nextExtensionView'.
+	 */
+	int64_t asExtension(std::span<const unsigned char> &ext) const {
+		return parse([&](SpanParser &p) { return p.nextExtensionView(ext); });
+	}
+
+	/**
+	 * Get the value as a timestamp.
+	 * See 'BasicParser::nextTimestamp'.
+	 */
+	Timestamp asTimestamp() const {
+		return parse([](SpanParser &p) { return p.nextTimestamp(); });
+	}
+
+	/**
+	 * Get the encoded bytes of the value, including any children.
+	 */
+	std::span<const unsigned char> bytes() const {
+		SpanSource src(std::span<const unsigned char>(begin_, end_));
+		SpanParser parser(src);
+		parser.skipNext();
+		return std::span<const unsigned char>(begin_, src.position());
+	}
+
+private:
+	MsgView(
+			const unsigned char *begin, const unsigned char *end,
+			std::shared_ptr<detail::ViewCache> cache):
+		begin_(begin), end_(end), cache_(std::move(cache)) {}
+
+	detail::Header header() const {
+		return detail::decodeHeader(begin_, end_ - begin_);
+	}
+
+	template<typename Func>
+	std::invoke_result_t<Func, SpanParser &> parse(Func func) const {
+		SpanSource src(std::span<const unsigned char>(begin_, end_));
+		SpanParser parser(src);
+		return func(parser);
+	}
+
+	MsgView pairChild(size_t index) const {
+		detail::Header h = header();
+		if (h.type != Type::MAP) {
+			detail::raise(ParseError(
+				ErrorCode::TYPE_MISMATCH, "Attempt to index non-map"));
+		}
+
+		if (index / 2 >= h.length) {
+			detail::raise(ParseError(
+				ErrorCode::NOT_FOUND, "Index out of range"));
+		}
+
+		return child(h, index);
+	}
+
+	// Find the start of child number 'index',
+	// skipping forward from the last child found so far
+	MsgView child(const detail::Header &h, size_t index) const {
+		std::lock_guard<std::mutex> lock(cache_->mutex);
+		std::vector<const unsigned char *> &starts = cache_->children[begin_];
+		if (starts.empty()) {
+			starts.push_back(begin_ + h.size);
+		}
+
+		while (starts.size() <= index) {
+			const unsigned char *start = starts.back();
+			SpanSource src(std::span<const unsigned char>(start, end_));
+			SpanParser parser(src);
+			parser.skipNext();
+			starts.push_back(start + src.position());
+		}
+
+		return MsgView(starts[index], end_, cache_);
+	}
+
+	const unsigned char *begin_;
+	const unsigned char *end_;
+	std::shared_ptr<detail::ViewCache> cache_;
+};
+
+/**
+ * Event handler for a PushParser, with methods which do nothing.
+ * Handlers derive from this, and define the methods they're interested in.
+ * The methods are found at compile time, so they don't need to be virtual.
+ *
+ * Strings, binaries and extension payloads are only valid
+ * for the duration of the call.
+ */
+struct PushHandler {
+	void onNil() {}
+	void onBool(bool) {}
+	void onInt(int64_t) {}
+	void onUInt(uint64_t) {}
+	void onFloat32(float) {}
+	void onFloat64(double) {}
+	void onString(std::string_view) {}
+	void onBinary(std::span<const unsigned char>) {}
+	void onExtension(int64_t, std::span<const unsigned char>) {}
+
+	// Called with the number of values, before the array's values
+	void onArrayBegin(size_t) {}
+	void onArrayEnd() {}
+
+	// Called with the number of key-value pairs, before the keys and values
+	void onMapBegin(size_t) {}
+	void onMapEnd() {}
+
+	// Called after each complete top-level value
+	void onComplete() {}
+};
+
+namespace detail {
+
+// A header decoded by the PushParser
+struct PushHeader {
+	Type type = Type::NIL;
+	uint64_t value = 0;
+	uint64_t length = 0;
+	int64_t extensionType = 0;
+
+	// Set if the header is invalid
+	ErrorCode error = ErrorCode::NONE;
+	const char *message = nullptr;
+};
+
+// Read the value of an int or float whose header is 'info',
+// from the bytes following the header byte
+inline uint64_t pushValue(const HeaderInfo &info, const unsigned char *ptr) {
+	switch (info.extra) {
+	case 0:
+		return info.type == Type::INT ?
+			(uint64_t)(int64_t)(int8_t)info.inlineValue : info.inlineValue;
+	case 1:
+		return info.type == Type::INT ? (uint64_t)(int64_t)(int8_t)*ptr : *ptr;
+	case 2:
+		return info.type == Type::INT ?
+			(uint64_t)(int64_t)(int16_t)loadBE<uint16_t>(ptr) :
+			loadBE<uint16_t>(ptr);
+	case 4:
+		return info.type == Type::INT ?
+			(uint64_t)(int64_t)(int32_t)loadBE<uint32_t>(ptr) :
+			loadBE<uint32_t>(ptr);
+	default:
+		return loadBE<uint64_t>(ptr);
+	}
+}
+
+// Decode the header at the start of 'data', including the lengths
+// and extension types, and the values of ints, floats and bools.
+// Returns the size of the header,
+// or 0 if 'size' bytes aren't enough to hold all of it
+// or if the header is invalid (which sets 'header.error').
+inline size_t decodePushHeader(
+		const unsigned char *data, size_t size, PushHeader &header) {
+	const HeaderInfo &info = headerTable[data[0]];
+	if (!info.valid) {
+		header.error = ErrorCode::INVALID_HEADER;
+		header.message = "Unexpected header byte";
+		return 0;
+	}
+
+	size_t headerSize = 1 + info.lengthWidth;
+	if (size < headerSize) {
+		return 0;
+	}
+
+	header.type = info.type;
+	switch (info.lengthWidth) {
+	case 1:
+		header.length = data[1];
+		break;
+	case 2:
+		header.length = loadBE<uint16_t>(data + 1);
+		break;
+	case 4:
+		header.length = loadBE<uint32_t>(data + 1);
+		break;
+	default:
+		header.length = info.inlineLength;
+		break;
+	}
+
+	switch (info.type) {
+	case Type::INT:
+	case Type::UINT:
+	case Type::FLOAT32:
+	case Type::FLOAT64:
+		if (size < headerSize + info.extra) {
+			return 0;
+		}
+
+		header.value = pushValue(info, data + headerSize);
+		return headerSize + info.extra;
+	case Type::BOOL:
+		header.value = info.inlineValue;
+		return headerSize;
+	case Type::EXTENSION:
+		// The extension type is a single signed byte after the length
+		if (size <= headerSize) {
+			return 0;
+		}
+
+		header.extensionType = (int8_t)data[headerSize];
+		return headerSize + 1;
+	default:
+		return headerSize;
+	}
+}
+
+}
+
+/**
+ * An incremental MessagePack parser, for input which arrives in pieces,
+ * such as from a non-blocking socket.
+ * Each piece of input is passed to 'feed', which calls the Handler's methods
+ * (see PushHandler) for every value which is completed by it.
+ *
+ * Between calls, the parser only keeps the stack of open containers,
+ * and any incomplete header or payload;
+ * nothing is parsed more than once.
+ * Payloads which are entirely contained in a piece of input are passed
+ * to the handler without copying; others are collected in a buffer first.
+ *
+ * Methods will throw a ParseError if the input is invalid,
+ * or record it in a ParseStatus if the parser was given one,
+ * after which the parser must be 'reset' before it's used again.
+ */
+template<typename Handler>
+class PushParser {
+public:
+	explicit PushParser(Handler &handler): handler_(handler) {}
+
+	/**
+	 * Create a parser which records errors in 'status'
+	 * instead of throwing them. After an error, input is ignored
+	 * until both the parser and the status are reset.
+	 */
+	PushParser(Handler &handler, ParseStatus &status):
+		handler_(handler), status_(&status) {}
+
+	/**
+	 * Parse the next piece of input.
+	 */
+	void feed(std::span<const unsigned char> data) {
+		if (status_ && !status_->ok()) {
+			return;
+		}
+
+		const unsigned char *ptr = data.data();
+		const unsigned char *end = ptr + data.size();
+		position_ += data.size();
+
+		while (ptr != end) {
+			if (payloadLeft_ > 0) {
+				size_t n = (size_t)(end - ptr) < payloadLeft_ ?
+					end - ptr : payloadLeft_;
+				payload_.insert(payload_.end(), ptr, ptr + n);
+				ptr += n;
+				payloadLeft_ -= n;
+				if (payloadLeft_ > 0) {
+					return;
+				}
+
+				emitPayload(payload_);
+				payload_.clear();
+				continue;
+			}
+
+			detail::PushHeader header;
+			if (headerSize_ == 0) {
+				size_t size = detail::decodePushHeader(ptr, end - ptr, header);
+				if (header.error != ErrorCode::NONE) {
+					fail(header, end - ptr);
+					return;
+				} else if (size == 0) {
+					// The rest of the input is shorter than a header
+					headerSize_ = end - ptr;
+					memcpy(header_, ptr, headerSize_);
+					return;
+				}
+
+				ptr += size;
+			} else {
+				// Complete the partial header a byte at a time;
+				// headers are at most 14 bytes long
+				size_t size = 0;
+				while (size == 0) {
+					if (ptr == end) {
+						return;
+					}
+
+					header_[headerSize_++] = *ptr++;
+					size = detail::decodePushHeader(header_, headerSize_, header);
+					if (header.error != ErrorCode::NONE) {
+						fail(header, end - ptr + headerSize_);
+						return;
+					}
+				}
+
+				headerSize_ = 0;
+			}
+
+			if (
+					header.type == Type::STRING ||
+					header.type == Type::BINARY ||
+					header.type == Type::EXTENSION) {
+				payloadType_ = header.type;
+				extensionType_ = header.extensionType;
+				if (header.length <= (uint64_t)(end - ptr)) {
+					emitPayload(std::span<const unsigned char>(ptr, header.length));
+					ptr += header.length;
+				} else {
+					payload_.assign(ptr, end);
+					payloadLeft_ = header.length - (end - ptr);
+					return;
+				}
+			} else {
+				emitHeader(header);
+			}
+		}
+	}
+
+	void feed(std::string_view data) {
+		feed(std::span<const unsigned char>(
+			(const unsigned char *)data.data(), data.size()));
+	}
+
+	/**
+	 * Check whether the parser is between top-level values,
+	 * i.e whether the input so far has been a sequence of complete values.
+	 */
+	bool atBoundary() const {
+		return stack_.empty() && headerSize_ == 0 && payloadLeft_ == 0;
+	}
+
+	/**
+	 * Get the number of containers which are currently open.
+	 */
+	size_t depth() const { return stack_.size(); }
+
+	/**
+	 * Throw a ParseError (or record it in the status)
+	 * if the input ended in the middle of a value.
+	 */
+	void finish() {
+		if (!atBoundary()) {
+			detail::report(
+				status_, ErrorCode::UNEXPECTED_EOF, "Unexpected EOF", position_);
+		}
+	}
+
+	/**
+	 * Discard all state, to start parsing a new stream.
+	 */
+	void reset() {
+		stack_.clear();
+		payload_.clear();
+		payloadLeft_ = 0;
+		headerSize_ = 0;
+		position_ = 0;
+	}
+
+private:
+	struct Frame {
+		uint64_t remaining;
+		bool isMap;
+	};
+
+	// Report an invalid header, which starts 'left' bytes
+	// before the end of the input fed so far
+	void fail(const detail::PushHeader &header, size_t left) {
+		detail::report(status_, header.error, header.message, position_ - left);
+	}
+
+	void emitPayload(std::span<const unsigned char> payload) {
+		if (payloadType_ == Type::STRING) {
+			handler_.onString(std::string_view(
+				(const char *)payload.data(), payload.size()));
+		} else if (payloadType_ == Type::BINARY) {
+			handler_.onBinary(payload);
+		} else {
+			handler_.onExtension(extensionType_, payload);
+		}
+
+		completeValue();
+	}
+
+	void emitHeader(const detail::PushHeader &header) {
+		switch (header.type) {
+		case Type::NIL:
+			handler_.onNil();
+			break;
+		case Type::BOOL:
+			handler_.onBool(header.value != 0);
+			break;
+		case Type::INT:
+			handler_.onInt((int64_t)header.value);
+			break;
+		case Type::UINT:
+			handler_.onUInt(header.value);
+			break;
+		case Type::FLOAT32:
+			handler_.onFloat32(std::bit_cast<float>((uint32_t)header.value));
+			break;
+		case Type::FLOAT64:
+			handler_.onFloat64(std::bit_cast<double>(header.value));
+			break;
+		case Type::ARRAY:
+			handler_.onArrayBegin(header.length);
+			if (header.length > 0) {
+				stack_.push_back(Frame{header.length, false});
+				return;
+			}
+
+			handler_.onArrayEnd();
+			break;
+		case Type::MAP:
+			handler_.onMapBegin(header.length);
+			if (header.length > 0) {
+				stack_.push_back(Frame{header.length * 2, true});
+				return;
+			}
+
+			handler_.onMapEnd();
+			break;
+		default:
+			break;
+		}
+
+		completeValue();
+	}
+
+	// A value is complete; close every container it completes in turn
+	void completeValue() {
+		while (!stack_.empty()) {
+			Frame &top = stack_.back();
+			if (--top.remaining > 0) {
+				return;
+			}
+
+			bool isMap = top.isMap;
+			stack_.pop_back();
+			if (isMap) {
+				handler_.onMapEnd();
+			} else {
+				handler_.onArrayEnd();
+			}
+		}
+
+		handler_.onComplete();
+	}
+
+	Handler &handler_;
+	ParseStatus *status_ = nullptr;
+	std::vector<Frame> stack_;
+
+	// The number of bytes fed so far
+	size_t position_ = 0;
+
+	// A header which was cut off at the end of the last piece of input
+	unsigned char header_[16];
+	size_t headerSize_ = 0;
+
+	// A payload which was cut off at the end of the last piece of input
+	std::vector<unsigned char> payload_;
+	uint64_t payloadLeft_ = 0;
+	Type payloadType_ = Type::NIL;
+	int64_t extensionType_ = 0;
+};
+
+class ArrayBuilder;
+class MapBuilder;
+class BufferArrayBuilder;
+class BufferMapBuilder;
+
+/**
+ * A MessagePack stream writer.
+ *
+ * The 'Sink' is what the serializer writes bytes to.
+ * It's either an 'std::ostream' (see 'Serializer'),
+ * a 'BufferSink' (see 'BufferSerializer') or some other ByteSink.
+ */
+template<typename Sink>
+class BasicSerializer {
+public:
+	explicit BasicSerializer(Sink &sink):
+		w_(sink) {}
+
+	/**
+	 * Write an integer value.
+	 */
+	void writeInt(int64_t num) {
+		proceed();
+
+		if (num >= 0 && num <= 0x7f) {
+			w_.writeU8(num);
+		} else if (num >= -32 && num < 0) {
+			w_.writeI8(num);
+		} else if (num >= -128 && num <= 127) {
+			w_.writeTagI8(0xd0, num);
+		} else if (num >= -32768 && num <= 32767) {
+			w_.writeTagI16(0xd1, num);
+		} else if (num >= -2147483648 && num <= 2147483647) {
+			w_.writeTagI32(0xd2, num);
+		} else {
+			w_.writeTagI64(0xd3, num);
+		}
+	}
+
+	/**
+	 * Write an unsigned integer value.
+	 */
+	void writeUInt(uint64_t num) {
+		proceed();
+
+		if (num <= 0x7fu) {
+			w_.writeU8(num);
+		} else if (num <= 0xffu) {
+			w_.writeTagU8(0xcc, num);
+		} else if (num <= 0xffffu) {
+			w_.writeTagU16(0xcd, num);
+		} else if (num <= 0xffffffffu) {
+			w_.writeTagU32(0xce, num);
+		} else {
+			w_.writeTagU64(0xcf, num);
+		}
+	}
+
+	/**
+	 * Write a nil value.
+	 */
+	void writeNil() {
+		proceed();
+		w_.writeU8(0xc0);
+	}
+
+	/**
+	 * Write a bool value.
+	 */
+	void writeBool(bool b) {
+		proceed();
+		w_.writeU8(b ? 0xc3 : 0xc2);
+	}
+
+	/**
+	 * Write a 32-bit floating point value.
+	 */
+	void writeFloat32(float f) {
+		proceed();
+		static_assert(sizeof(float) == sizeof(uint32_t));
+		uint32_t num;
+		memcpy(&num, &f, sizeof(num));
+		w_.writeTagU32(0xca, num);
+	}
+
+	/**
+	 * Write a 64-bit floating point value.
+	 */
+	void writeFloat64(double d) {
+		proceed();
+		static_assert(sizeof(double) == sizeof(uint64_t));
+		uint64_t num;
+		memcpy(&num, &d, sizeof(num));
+		w_.writeTagU64(0xcb, num);
+	}
+
+	/**
+	 * Write a string value.
+	 * The string must be smaller than 2^32-1 bytes long.
+	 */
+	void writeString(std::string_view sv) {
+		proceed();
+		size_t length = sv.size();
+		if (length <= 0x1fu) {
+			w_.writeU8(0xa0u | length);
+		} else if (length <= 0xffu) {
+			w_.writeTagU8(0xd9, length);
+		} else if (length <= 0xffffu) {
+			w_.writeTagU16(0xda, length);
+		} else if (length <= 0xffffffffu) {
+			w_.writeTagU32(0xdb, length);
+		} else {
+			detail::raise(SerializeError("String too long"));
+		}
+
+		w_.writeBlob((const void *)sv.data(), length);
+	}
+
+	/**
+	 * Write a byte string value.
+	 * The byte string must be smaller than 2^32-1 bytes long.
+	 */
+	void writeBinary(std::span<const unsigned char> bv) {
+		proceed();
+		size_t length = bv.size();
+		if (length <= 0xffu) {
+			w_.writeTagU8(0xc4, length);
+		} else if (length <= 0xffffu) {
+			w_.writeTagU16(0xc5, length);
+		} else if (length <= 0xffffffffu) {
+			w_.writeTagU32(0xc6, length);
+		} else {
+			detail::raise(SerializeError("Binary too long"));
+		}
+
+		w_.writeBlob(bv.data(), length);
+	}
+
+	/**
+	 * Write an array value.
+	 * Will clear the ArrayBuilder.
+	 * The ArrayBuilder can be re-used to create another array value.
+	 */
+	void writeArray(ArrayBuilder &ab);
+
+	/**
+	 * Write an array value which was built in place by a BufferArrayBuilder.
+	 * This fills in the header which was reserved when the builder was created.
+	 * The builder can't be used after this.
+	 */
+	void writeArray(BufferArrayBuilder &ab)
+		requires std::same_as<Sink, BufferSink>;
+
+	/**
+	 * Write an array of numbers.
+	 * This writes the same bytes as 'beginArray' followed by
+	 * 'writeFloat64', 'writeFloat32', 'writeInt' or 'writeUInt'
+	 * for each value, but writes the header once
+	 * and encodes the values in bulk.
+	 */
+	void writeArray(std::span<const double> values) {
+		writeArrayBulk(values);
+	}
+
+	void writeArray(std::span<const float> values) {
+		writeArrayBulk(values);
+	}
+
+	void writeArray(std::span<const int64_t> values) {
+		writeArrayBulk(values);
+	}
+
+	void writeArray(std::span<const int32_t> values) {
+		writeArrayBulk(values);
+	}
+
+	void writeArray(std::span<const uint64_t> values) {
+		writeArrayBulk(values);
+	}
+
+	void writeArray(std::span<const uint32_t> values) {
+		writeArrayBulk(values);
+	}
+
+	/**
+	 * Begin writing an array value.
+	 * Returns a sub-serializer which array values must be written to.
+	 * Exactly 'n' values must be written to the sub-serializer,
+	 * and then 'endArray' must be called.
+	 */
+	BasicSerializer beginArray(size_t n) {
+		proceed();
+		nesting_ = true;
+		nestingLength_ = n;
+		writeArrayHeader(n);
+		return BasicSerializer(w_.sink());
+	}
+
+	/**
+	 * Begin writing an array value of unknown length.
+	 * Returns a sub-serializer which array values must be written to,
+	 * and then 'endArray' must be called.
+	 * A header with a 32-bit length is written, and the length is
+	 * filled in by 'endArray', so the sink must be seekable:
+	 * an 'std::ostream' which supports 'tellp'/'seekp',
+	 * a 'BufferSink' or some other SeekableSink.
+	 */
+	BasicSerializer beginArrayDeferred()
+		requires std::same_as<Sink, std::ostream> || SeekableSink<Sink> {
+		size_t pos = w_.position();
+		proceed();
+		nesting_ = true;
+		deferred_ = true;
+		deferredPos_ = pos;
+		w_.writeTagU32(0xdd, 0);
+		return BasicSerializer(w_.sink());
+	}
+
+	/**
+	 * Complete writing an array that was started by 'beginArray'
+	 * or 'beginArrayDeferred'.
+	 * If it was started by 'beginArray', the same amount of values
+	 * must have been written to the serializer
+	 * as were passed to the 'beginArray' method.
+	 */
+	void endArray(BasicSerializer &sub) {
+		if constexpr (std::same_as<Sink, std::ostream> || SeekableSink<Sink>) {
+			if (deferred_) {
+				endDeferred(sub.written());
+				return;
+			}
+		}
+
+		if (sub.written() != nestingLength_) {
+			detail::raise(SerializeError(
+				"beginArray/endArray length mismatch"));
+		}
+
+		nesting_ = false;
+	}
+
+	/**
+	 * Write a map value.
+	 * Will clear the MapBuilder.
+	 * The MapBuilder can be re-used to create another array value.
+	 */
+	void writeMap(MapBuilder &mb);
+
+	/**
+	 * Write a map value which was built in place by a BufferMapBuilder.
+	 * This fills in the header which was reserved when the builder was created.
+	 * The builder can't be used after this.
+	 */
+	void writeMap(BufferMapBuilder &mb)
+		requires std::same_as<Sink, BufferSink>;
+
+	/**
+	 * Begin writing a map value.
+	 * Returns a sub-serializer which map key/value pairs must be written to.
+	 * Exactly 'n' keys and 'n' values must be written to the sub-serializer,
+	 * and then 'endMap' must be called.
+	 */
+	BasicSerializer beginMap(size_t n) {
+		proceed();
+		nesting_ = true;
+		nestingLength_ = n * 2;
+		writeMapHeader(n);
+		return BasicSerializer(w_.sink());
+	}
+
+	/**
+	 * Begin writing a map value of unknown length.
+	 * Returns a sub-serializer which map key/value pairs must be written to,
+	 * and then 'endMap' must be called.
+	 * See 'beginArrayDeferred' for the requirements on the sink.
+	 */
+	BasicSerializer beginMapDeferred()
+		requires std::same_as<Sink, std::ostream> || SeekableSink<Sink> {
+		size_t pos = w_.position();
+		proceed();
+		nesting_ = true;
+		deferred_ = true;
+		deferredPos_ = pos;
+		w_.writeTagU32(0xdf, 0);
+		return BasicSerializer(w_.sink());
+	}
+
+	/**
+	 * Complete writing a map that was started by 'beginMap'
+	 * or 'beginMapDeferred'.
+	 * If it was started by 'beginMap', the same amount of keys and values
+	 * must have been written to the serializer
+	 * as were passed to the 'beginMap' method.
+	 */
+	void endMap(BasicSerializer &sub) {
+		if constexpr (std::same_as<Sink, std::ostream> || SeekableSink<Sink>) {
+			if (deferred_) {
+				if (sub.written() % 2 != 0) {
+					detail::raise(SerializeError("Odd number of values in map"));
+				}
+
+				endDeferred(sub.written() / 2);
+				return;
+			}
+		}
+
+		if (sub.written() != nestingLength_) {
+			detail::raise(SerializeError("beginMap/endMap length mismatch"));
+		}
+
+		nesting_ = false;
+	}
+
+	/**
+	 * Write an extension.
+	 * The type must fit in a signed byte (-128 to 127).
+	 */
+	void writeExtension(int64_t type, std::span<const unsigned char> ext) {
+		if (type < -128 || type > 127) {
+			detail::raise(SerializeError("Extension type out of range"));
+		}
+
+		proceed();
+		size_t length = ext.size();
+		if (length == 1) {
+			w_.writeU8(0xd4);
+		} else if (length == 2) {
+			w_.writeU8(0xd5);
+		} else if (length == 4) {
+			w_.writeU8(0xd6);
+		} else if (length == 8) {
+			w_.writeU8(0xd7);
+		} else if (length == 16) {
+			w_.writeU8(0xd8);
+		} else if (length <= 0xffu) {
+			w_.writeTagU8(0xc7, length);
+		} else if (length <= 0xffffu) {
+			w_.writeTagU16(0xc8, length);
+		} else if (length <= 0xffffffffu) {
+			w_.writeTagU32(0xc9, length);
+		} else {
+			detail::raise(SerializeError("Extension too long"));
+		}
+
+		w_.writeI8((int8_t)type);
+		w_.writeBlob(ext.data(), length);
+	}
+
+	/**
+	 * Write a timestamp extension, in the smallest of its forms which
+	 * can hold the timestamp.
+	 */
+	void writeTimestamp(Timestamp ts) {
+		if (ts.nanoseconds >= 1000000000) {
+			detail::raise(SerializeError("Invalid timestamp nanoseconds"));
+		}
+
+		proceed();
+		if ((uint64_t)ts.seconds >> 34 == 0) {
+			uint64_t data = (uint64_t)ts.nanoseconds << 34 | ts.seconds;
+			if (data >> 32 == 0) {
+				w_.writeTagU8(0xd6, 0xff);
+				w_.writeU32(data);
+			} else {
+				w_.writeTagU8(0xd7, 0xff);
+				w_.writeU64(data);
+			}
+		} else {
+			w_.writeTagU8(0xc7, 12);
+			w_.writeU8(0xff);
+			w_.writeU32(ts.nanoseconds);
+			w_.writeI64(ts.seconds);
+		}
+	}
+
+	/**
+	 * Write a 'std::chrono::sys_time' as a timestamp extension.
+	 */
+	template<typename Duration>
+	void writeTimestamp(std::chrono::sys_time<Duration> time) {
+		writeTimestamp(Timestamp::fromSysTime(time));
+	}
+
+	/**
+	 * Write a single value which is already encoded as MessagePack,
+	 * such as a map key that was encoded at compile time.
+	 *
+	 * Preconditions:
+	 *   'encoded' contains exactly one complete, valid value
+	 */
+	void writeEncoded(std::span<const unsigned char> encoded) {
+		proceed();
+		w_.writeBlob(encoded.data(), encoded.size());
+	}
+
+	/**
+	 * Get the number of values written to the serializer so far.
+	 */
+	size_t written() { return written_; }
+
+protected:
+	void proceed() {
+		if (nesting_) {
+			detail::raise(SerializeError("Missing call to endArray/endMap"));
+		}
+
+		written_ += 1;
+	}
+
+	// Values are encoded a chunk at a time, with room for the largest
+	// encoding of every value in the chunk
+	template<typename T>
+	void writeArrayBulk(std::span<const T> values) {
+		proceed();
+		writeArrayHeader(values.size());
+
+		constexpr size_t chunk = 256;
+		for (size_t start = 0; start < values.size(); start += chunk) {
+			size_t n = values.size() - start < chunk ? values.size() - start : chunk;
+			w_.template writeEncoded<chunk * 9>([&](unsigned char *out) {
+				if constexpr (std::is_floating_point_v<T>) {
+					return detail::encodeFloats(values.data() + start, n, out);
+				} else {
+					return detail::encodeInts(values.data() + start, n, out);
+				}
+			});
+		}
+	}
+
+	void writeArrayHeader(size_t length) {
+		if (length <= 0x0fu) {
+			w_.writeU8(0x90u | length);
+		} else if (length <= 0xffffu) {
+			w_.writeTagU16(0xdc, length);
+		} else if (length <= 0xffffffffu) {
+			w_.writeTagU32(0xdd, length);
+		} else {
+			detail::raise(SerializeError("Array too long"));
+		}
+	}
+
+	void writeMapHeader(size_t length) {
+		if (length <= 0x0fu) {
+			w_.writeU8(0x80u | length);
+		} else if (length <= 0xffffu) {
+			w_.writeTagU16(0xde, length);
+		} else if (length <= 0xffffffffu) {
+			w_.writeTagU32(0xdf, length);
+		} else {
+			detail::raise(SerializeError("Array too long"));
+		}
+	}
+
+	// Fill in the length of a header written by 'beginArrayDeferred'
+	// or 'beginMapDeferred'
+	void endDeferred(size_t length) {
+		if (length > 0xffffffffu) {
+			detail::raise(SerializeError("Container too long"));
+		}
+
+		unsigned char buf[4];
+		detail::storeBE<uint32_t>(buf, length);
+		w_.patch(deferredPos_ + 1, buf, sizeof(buf));
+		nesting_ = false;
+		deferred_ = false;
+	}
+
+	// Reserve room for a header of the largest size in place,
+	// to be filled in with 'endInPlace' when the length is known.
+	// Returns the position of the header.
+	size_t beginInPlace() {
+		proceed();
+		nesting_ = true;
+		size_t pos = w_.position();
+		w_.writeTagU32(0, 0);
+		return pos;
+	}
+
+	// Fill in a header reserved by 'beginInPlace' with the smallest header
+	// which fits 'length', moving the contents back if necessary
+	void endInPlace(
+			size_t pos, size_t length,
+			uint8_t fixTag, uint8_t tag16, uint8_t tag32) {
+		unsigned char header[5];
+		size_t headerLength;
+		if (length <= 0x0fu) {
+			header[0] = fixTag | length;
+			headerLength = 1;
+		} else if (length <= 0xffffu) {
+			header[0] = tag16;
+			detail::storeBE<uint16_t>(header + 1, length);
+			headerLength = 3;
+		} else if (length <= 0xffffffffu) {
+			header[0] = tag32;
+			detail::storeBE<uint32_t>(header + 1, length);
+			headerLength = 5;
+		} else {
+			detail::raise(SerializeError("Container too long"));
+		}
+
+		w_.replace(pos, 5, header, headerLength);
+		nesting_ = false;
+	}
+
+	friend class BufferArrayBuilder;
+	friend class BufferMapBuilder;
+
+	detail::Writer<Sink> w_;
+	size_t written_ = 0;
+	bool nesting_ = false;
+	size_t nestingLength_ = 0;
+	bool deferred_ = false;
+	size_t deferredPos_ = 0;
+};
+
+using Serializer = BasicSerializer<std::ostream>;
+using BufferSerializer = BasicSerializer<BufferSink>;
+
+/**
+ * A specialized serializer for array values,
+ * which writes its values to an internal buffer.
+ */
+class ArrayBuilder: public Serializer {
+public:
+	ArrayBuilder(): Serializer(ss_) {}
+
+	/**
+	 * Get the underlying buffer.
+	 * This moves the buffer out of the underlying string stream.
+	 */
+	std::string consume() {
+		std::string s = std::move(ss_).str();
+		ss_ = {};
+		written_ = 0;
+		return s;
+	}
+
+	/**
+	 * Set the underlying buffer.
+	 * Allows re-using a buffer between array/map builders.
+	 * The buffer will be cleared (i.e size() set to 0),
+	 * but the capacity will be kept.
+	 */
+	void setBuffer(std::string &&str) {
+		str.clear();
+		ss_.str(std::move(str));
+	}
+
+	/**
+	 * Clear the internal buffer.
+	 */
+	void clear() {
+		setBuffer(consume());
+	}
+
+private:
+	std::stringstream ss_;
+};
+
+
+/**
+ * A specialized serializer for map keys and values,
+ * which writes its keys and values to an internal buffer.
+ */
+class MapBuilder: public Serializer {
+public:
+	MapBuilder(): Serializer(ss_) {}
+
+	/**
+	 * Get the underlying buffer.
+	 * This moves the buffer out of the underlying string stream.
+	 */
+	std::string consume() {
+		std::string s = std::move(ss_).str();
+		ss_ = {};
+		written_ = 0;
+		return s;
+	}
+
+	/**
+	 * Set the underlying buffer.
+	 * Allows re-using a buffer between array/map builders.
+	 * The buffer will be cleared (i.e size() set to 0),
+	 * but the capacity will be kept.
+	 */
+	void setBuffer(std::string &&str) {
+		str.clear();
+		ss_.str(std::move(str));
+	}
+
+	/**
+	 * Clear the internal buffer.
+	 */
+	void clear() {
+		setBuffer(consume());
+	}
+
+private:
+	std::stringstream ss_;
+};
+
+template<typename Sink>
+inline void BasicSerializer<Sink>::writeArray(ArrayBuilder &ab) {
+	proceed();
+	writeArrayHeader(ab.written());
+	std::string s = ab.consume();
+	w_.writeBlob(s.data(), s.size());
+	ab.setBuffer(std::move(s));
+}
+
+template<typename Sink>
+inline void BasicSerializer<Sink>::writeMap(MapBuilder &mb) {
+	if (mb.written() % 2 != 0) {
+		detail::raise(SerializeError("Odd number of values in map"));
+	}
+
+	proceed();
+	writeMapHeader(mb.written() / 2);
+	std::string s = mb.consume();
+	w_.writeBlob(s.data(), s.size());
+	mb.setBuffer(std::move(s));
+}
+
+/**
+ * A specialized serializer for array values of unknown length,
+ * which writes its values directly into its parent's BufferSink.
+ * Unlike ArrayBuilder, this requires no intermediate buffer and no copying:
+ * the array header is reserved when the builder is created,
+ * and is filled in by the parent's 'writeArray'.
+ * If the real header is smaller than the reserved one,
+ * the array's contents are moved back to close the gap.
+ *
+ * Nothing may be written to the parent while the builder is in use.
+ */
+class BufferArrayBuilder: public BufferSerializer {
+public:
+	explicit BufferArrayBuilder(BufferSerializer &parent):
+		BufferSerializer(parent.w_.sink()),
+		parent_(&parent), headerPos_(parent.beginInPlace()) {}
+
+private:
+	friend class BasicSerializer<BufferSink>;
+
+	BufferSerializer *parent_;
+	size_t headerPos_;
+};
+
+/**
+ * A specialized serializer for map keys and values of unknown length,
+ * which writes its keys and values directly into its parent's BufferSink.
+ * See BufferArrayBuilder.
+ */
+class BufferMapBuilder: public BufferSerializer {
+public:
+	explicit BufferMapBuilder(BufferSerializer &parent):
+		BufferSerializer(parent.w_.sink()),
+		parent_(&parent), headerPos_(parent.beginInPlace()) {}
+
+private:
+	friend class BasicSerializer<BufferSink>;
+
+	BufferSerializer *parent_;
+	size_t headerPos_;
+};
+
+template<typename Sink>
+inline void BasicSerializer<Sink>::writeArray(BufferArrayBuilder &ab)
+	requires std::same_as<Sink, BufferSink> {
+	if (ab.parent_ != this) {
+		detail::raise(SerializeError(
+			"Builder belongs to a different serializer"));
+	}
+
+	if (ab.nesting_) {
+		detail::raise(SerializeError("Missing call to endArray/endMap"));
+	}
+
+	ab.parent_ = nullptr;
+	endInPlace(ab.headerPos_, ab.written(), 0x90, 0xdc, 0xdd);
+}
+
+template<typename Sink>
+inline void BasicSerializer<Sink>::writeMap(BufferMapBuilder &mb)
+	requires std::same_as<Sink, BufferSink> {
+	if (mb.parent_ != this) {
+		detail::raise(SerializeError(
+			"Builder belongs to a different serializer"));
+	}
+
+	if (mb.nesting_) {
+		detail::raise(SerializeError("Missing call to endArray/endMap"));
+	}
+
+	if (mb.written() % 2 != 0) {
+		detail::raise(SerializeError("Odd number of values in map"));
+	}
+
+	mb.parent_ = nullptr;
+	endInPlace(mb.headerPos_, mb.written() / 2, 0x80, 0xde, 0xdf);
+}
+
+/**
+ * A string literal which can be used as a template argument,
+ * for naming the fields of a Field list.
+ */
+template<size_t N>
+struct FixedString {
+	constexpr FixedString(const char (&str)[N]) {
+		for (size_t i = 0; i < N; ++i) {
+			data[i] = str[i];
+		}
+	}
+
+	constexpr std::string_view view() const {
+		return std::string_view(data, N - 1);
+	}
+
+	char data[N];
+};
+
+namespace detail {
+
+template<typename T>
+struct MemberTraits;
+
+template<typename Class, typename T>
+struct MemberTraits<T Class::*> {
+	using Type = T;
+};
+
+constexpr size_t encodedStringSize(size_t length) {
+	if (length <= 0x1fu) {
+		return length + 1;
+	} else if (length <= 0xffu) {
+		return length + 2;
+	} else if (length <= 0xffffu) {
+		return length + 3;
+	} else {
+		return length + 5;
+	}
+}
+
+template<size_t Size>
+constexpr std::array<unsigned char, Size> encodeString(std::string_view str) {
+	std::array<unsigned char, Size> out{};
+	size_t length = str.size();
+	size_t pos = 0;
+	if (length <= 0x1fu) {
+		out[pos++] = 0xa0u | length;
+	} else if (length <= 0xffu) {
+		out[pos++] = 0xd9;
+		out[pos++] = length;
+	} else if (length <= 0xffffu) {
+		out[pos++] = 0xda;
+		out[pos++] = length >> 8;
+		out[pos++] = length;
+	} else {
+		out[pos++] = 0xdb;
+		out[pos++] = length >> 24;
+		out[pos++] = length >> 16;
+		out[pos++] = length >> 8;
+		out[pos++] = length;
+	}
+
+	for (char ch: str) {
+		out[pos++] = ch;
+	}
+
+	return out;
+}
+
+}
+
+/**
+ * One field of a struct binding: the member 'Member',
+ * stored in the map under the key 'Name'.
+ * The key is encoded at compile time.
+ */
+template<FixedString Name, auto Member>
+struct Field {
+	using Type = typename detail::MemberTraits<decltype(Member)>::Type;
+
+	static constexpr auto member = Member;
+	static constexpr std::string_view name = Name.view();
+	static constexpr std::array<
+		unsigned char, detail::encodedStringSize(name.size())> encodedName =
+			detail::encodeString<detail::encodedStringSize(name.size())>(name);
+};
+
+/**
+ * The list of fields of a struct binding.
+ */
+template<typename... Fields>
+struct FieldList {};
+
+/**
+ * Binds a struct to its MessagePack map representation,
+ * by providing a member type 'Type' which is a FieldList.
+ * By default, the struct's own 'MsgStreamFields' member type is used:
+ *
+ *   struct Point {
+ *       int x;
+ *       int y;
+ *
+ *       using MsgStreamFields = MsgStream::FieldList<
+ *           MsgStream::Field<"x", &Point::x>,
+ *           MsgStream::Field<"y", &Point::y>>;
+ *   };
+ *
+ * Structs which can't be changed can be bound
+ * by specializing 'Fields' instead.
+ *
+ * Field types can be bools, integers, floats, doubles, 'std::string',
+ * 'Timestamp', 'std::vector<unsigned char>' (as binary),
+ * 'std::vector' (as array), 'std::optional' (as nil when empty)
+ * and other bound structs.
+ */
+template<typename T>
+struct Fields {};
+
+template<typename T>
+	requires requires { typename T::MsgStreamFields; }
+struct Fields<T> {
+	using Type = typename T::MsgStreamFields;
+};
+
+template<typename T>
+concept Bound = requires { typename Fields<T>::Type; };
+
+namespace detail {
+
+template<typename T>
+struct Codec;
+
+template<>
+struct Codec<bool> {
+	template<typename Sink>
+	static void write(BasicSerializer<Sink> &s, bool value) {
+		s.writeBool(value);
+	}
+
+	template<typename Source, ErrorMode Mode>
+	static void read(BasicParser<Source, Mode> &p, bool &value) {
+		value = p.nextBool();
+	}
+};
+
+template<std::signed_integral T>
+struct Codec<T> {
+	template<typename Sink>
+	static void write(BasicSerializer<Sink> &s, T value) {
+		s.writeInt(value);
+	}
+
+	template<typename Source, ErrorMode Mode>
+	static void read(BasicParser<Source, Mode> &p, T &value) {
+		p.nextInt(value);
+	}
+};
+
+template<std::unsigned_integral T>
+struct Codec<T> {
+	template<typename Sink>
+	static void write(BasicSerializer<Sink> &s, T value) {
+		s.writeUInt(value);
+	}
+
+	template<typename Source, ErrorMode Mode>
+	static void read(BasicParser<Source, Mode> &p, T &value) {
+		p.nextInt(value);
+	}
+};
+
+template<>
+struct Codec<float> {
+	template<typename Sink>
+	static void write(BasicSerializer<Sink> &s, float value) {
+		s.writeFloat32(value);
+	}
+
+	template<typename Source, ErrorMode Mode>
+	static void read(BasicParser<Source, Mode> &p, float &value) {
+		value = p.nextFloat32();
+	}
+};
+
+template<>
+struct Codec<double> {
+	template<typename Sink>
+	static void write(BasicSerializer<Sink> &s, double value) {
+		s.writeFloat64(value);
+	}
+
+	template<typename Source, ErrorMode Mode>
+	static void read(BasicParser<Source, Mode> &p, double &value) {
+		value = p.nextFloat64();
+	}
+};
+
+template<>
+struct Codec<std::string> {
+	template<typename Sink>
+	static void write(BasicSerializer<Sink> &s, const std::string &value) {
+		s.writeString(value);
+	}
+
+	template<typename Source, ErrorMode Mode>
+	static void read(BasicParser<Source, Mode> &p, std::string &value) {
+		p.nextString(value);
+	}
+};
+
+template<>
+struct Codec<std::vector<unsigned char>> {
+	template<typename Sink>
+	static void write(
+			BasicSerializer<Sink> &s, const std::vector<unsigned char> &value) {
+		s.writeBinary(value);
+	}
+
+	template<typename Source, ErrorMode Mode>
+	static void read(BasicParser<Source, Mode> &p, std::vector<unsigned char> &value) {
+		p.nextBinary(value);
+	}
+};
+
+template<>
+struct Codec<Timestamp> {
+	template<typename Sink>
+	static void write(BasicSerializer<Sink> &s, Timestamp value) {
+		s.writeTimestamp(value);
+	}
+
+	template<typename Source, ErrorMode Mode>
+	static void read(BasicParser<Source, Mode> &p, Timestamp &value) {
+		value = p.nextTimestamp();
+	}
+};
+
+template<typename T>
+struct Codec<std::vector<T>> {
+	template<typename Sink>
+	static void write(BasicSerializer<Sink> &s, const std::vector<T> &value) {
+		BasicSerializer<Sink> sub = s.beginArray(value.size());
+		for (const T &item: value) {
+			Codec<T>::write(sub, item);
+		}
+		s.endArray(sub);
+	}
+
+	template<typename Source, ErrorMode Mode>
+	static void read(BasicParser<Source, Mode> &p, std::vector<T> &value) {
+		BasicArrayParser<Source, Mode> arr = p.nextArray();
+		value.clear();
+		while (arr.hasNext()) {
+			value.emplace_back();
+			Codec<T>::read(arr, value.back());
+		}
+	}
+};
+
+template<typename T>
+struct Codec<std::optional<T>> {
+	template<typename Sink>
+	static void write(BasicSerializer<Sink> &s, const std::optional<T> &value) {
+		if (value) {
+			Codec<T>::write(s, *value);
+		} else {
+			s.writeNil();
+		}
+	}
+
+	template<typename Source, ErrorMode Mode>
+	static void read(BasicParser<Source, Mode> &p, std::optional<T> &value) {
+		if (p.nextType() == Type::NIL) {
+			p.skipNil();
+			value.reset();
+		} else {
+			Codec<T>::read(p, value.emplace());
+		}
+	}
+};
+
+template<typename... Fs>
+constexpr size_t maxNameLength(FieldList<Fs...>) {
+	size_t length = 0;
+	((length = Fs::name.size() > length ? Fs::name.size() : length), ...);
+	return length;
+}
+
+// Reads the value of the field named 'key', if there is one.
+// The length comparisons are against constants, so each field
+// only costs a compare of the key's length and first bytes.
+template<typename Source, ErrorMode Mode, typename T, typename... Fs>
+inline bool readField(
+		BasicParser<Source, Mode> &p, T &obj, std::string_view key, FieldList<Fs...>) {
+	return ((
+		key.size() == Fs::name.size() &&
+		memcmp(key.data(), Fs::name.data(), Fs::name.size()) == 0 &&
+		(Codec<typename Fs::Type>::read(p, obj.*Fs::member), true)) || ...);
+}
+
+template<Bound T>
+struct Codec<T> {
+	using List = typename Fields<T>::Type;
+
+	template<typename Sink>
+	static void write(BasicSerializer<Sink> &s, const T &obj) {
+		writeFields(s, obj, List{});
+	}
+
+	// Keys which aren't strings or don't name a field are skipped,
+	// along with their values. Fields which are missing from the map
+	// are left untouched.
+	template<typename Source, ErrorMode Mode>
+	static void read(BasicParser<Source, Mode> &p, T &obj) {
+		constexpr size_t maxLength = maxNameLength(List{});
+		BasicMapParser<Source, Mode> map = p.nextMap();
+		while (map.hasNext()) {
+			if (map.nextType() != Type::STRING) {
+				map.skipNext();
+				map.skipNext();
+				continue;
+			}
+
+			// No key longer than the longest field name can match,
+			// so the rest can be read into a fixed-size buffer
+			char buf[maxLength + 1];
+			std::string_view key;
+			if constexpr (std::same_as<Source, SpanSource>) {
+				key = map.nextStringView();
+			} else {
+				size_t length = map.nextToken().length;
+				if (length > maxLength) {
+					map.skipPayload(length);
+					map.skipNext();
+					continue;
+				}
+
+				map.nextPayload(buf, length);
+				key = std::string_view(buf, length);
+			}
+
+			if (!readField(map, obj, key, List{})) {
+				map.skipNext();
+			}
+		}
+	}
+
+private:
+	template<typename Sink, typename... Fs>
+	static void writeFields(
+			BasicSerializer<Sink> &s, const T &obj, FieldList<Fs...>) {
+		BasicSerializer<Sink> sub = s.beginMap(sizeof...(Fs));
+		((
+			sub.writeEncoded(Fs::encodedName),
+			Codec<typename Fs::Type>::write(sub, obj.*Fs::member)), ...);
+		s.endMap(sub);
+	}
+};
+
+}
+
+/**
+ * Write a bound struct as a map from field names to values.
+ * See 'Fields'.
+ */
+template<typename Sink, Bound T>
+inline void serialize(BasicSerializer<Sink> &s, const T &obj) {
+	detail::Codec<T>::write(s, obj);
+}
+
+/**
+ * Read a map into a bound struct.
+ * Fields which aren't in the map keep their current values,
+ * and keys which don't name a field are skipped.
+ * See 'Fields'.
+ *
+ * Preconditions:
+ *   hasNext() == true
+ *   nextType() == Type::MAP
+ */
+template<typename Source, ErrorMode Mode, Bound T>
+inline void deserialize(BasicParser<Source, Mode> &p, T &obj) {
+	detail::Codec<T>::read(p, obj);
+}
+
+/**
+ * Options for 'parseParallel'.
+ */
+struct ParallelOptions {
+	// Number of worker threads, or 0 for one per hardware thread
+	unsigned threads = 0;
+
+	// Approximate size of each chunk in bytes.
+	// Chunks always end on a top-level value boundary,
+	// so a chunk is larger if a single value is.
+	size_t chunkSize = 1024 * 1024;
+
+	// Whether results are delivered in the order of their chunks,
+	// or as soon as they're ready
+	bool ordered = true;
+
+	// Maximum number of chunks which are being parsed or waiting to be
+	// delivered, or 0 for four per thread.
+	// This bounds how many results are held in memory at once.
+	size_t window = 0;
+};
+
+namespace detail {
+
+// Find the end of the chunk which starts at 'begin', by skipping
+// top-level values until at least 'target' bytes are covered.
+// An invalid or truncated value extends the chunk to the end of the data,
+// so that the chunk's parser reports the error.
+inline size_t findChunkEnd(
+		const unsigned char *data, size_t size, size_t begin, size_t target) {
+	size_t pos = begin;
+	while (pos < size && pos - begin < target) {
+		size_t n = valueSize(data + pos, size - pos);
+		if (n == 0) {
+			return size;
+		}
+
+		pos += n;
+	}
+
+	return pos;
+}
+
+template<typename Result, typename Process>
+class ParallelParse {
+public:
+	ParallelParse(
+			std::span<const unsigned char> data, Process &process,
+			const ParallelOptions &options):
+			data_(data), process_(process),
+			chunkSize_(options.chunkSize > 0 ? options.chunkSize : 1),
+			ordered_(options.ordered) {
+		threads_ = options.threads;
+		if (threads_ == 0) {
+			threads_ = std::thread::hardware_concurrency();
+		}
+		if (threads_ == 0) {
+			threads_ = 1;
+		}
+
+		window_ = options.window > 0 ? options.window : threads_ * 4;
+	}
+
+	template<typename Deliver>
+	void run(Deliver &deliver) {
+		// Stops and joins the workers however delivery ends
+		struct Workers {
+			ParallelParse &pp;
+			std::vector<std::thread> threads;
+
+			~Workers() {
+				{
+					std::lock_guard<std::mutex> lock(pp.mutex_);
+					pp.stop_ = true;
+				}
+				pp.cond_.notify_all();
+				for (std::thread &thread: threads) {
+					thread.join();
+				}
+			}
+		};
+
+		Workers workers{*this, {}};
+		for (unsigned i = 0; i < threads_; ++i) {
+			workers.threads.emplace_back([this] { work(); });
+		}
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (true) {
+			cond_.wait(lock, [this] { return deliverable() || finished(); });
+			if (!deliverable()) {
+				return;
+			}
+
+			auto it = ordered_ ? ready_.find(delivered_) : ready_.begin();
+			Slot slot = std::move(it->second);
+			ready_.erase(it);
+			lock.unlock();
+
+#ifndef MSGSTREAM_NO_EXCEPTIONS
+			if (slot.error) {
+				std::rethrow_exception(slot.error);
+			}
+#endif
+			deliver(std::move(*slot.result));
+
+			lock.lock();
+			delivered_ += 1;
+			cond_.notify_all();
+		}
+	}
+
+private:
+	struct Slot {
+		std::optional<Result> result;
+#ifndef MSGSTREAM_NO_EXCEPTIONS
+		std::exception_ptr error;
+#endif
+	};
+
+	bool deliverable() const {
+		if (ordered_) {
+			return ready_.count(delivered_) > 0;
+		}
+
+		return !ready_.empty();
+	}
+
+	bool finished() const {
+		return !splitting_ && pos_ == data_.size() && delivered_ == taken_;
+	}
+
+	void work() {
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (true) {
+			// Only one worker splits at a time, since each chunk
+			// starts where the previous one ends
+			cond_.wait(lock, [this] {
+				return stop_ || (!splitting_ &&
+					(pos_ == data_.size() || taken_ - delivered_ < window_));
+			});
+			if (stop_ || pos_ == data_.size()) {
+				return;
+			}
+
+			size_t index = taken_;
+			size_t begin = pos_;
+			splitting_ = true;
+			lock.unlock();
+
+			size_t end = findChunkEnd(
+				data_.data(), data_.size(), begin, chunkSize_);
+
+			lock.lock();
+			pos_ = end;
+			taken_ += 1;
+			splitting_ = false;
+			cond_.notify_all();
+			lock.unlock();
+
+			Slot slot = parse(begin, end);
+
+			lock.lock();
+			ready_.emplace(index, std::move(slot));
+			cond_.notify_all();
+		}
+	}
+
+	Slot parse(size_t begin, size_t end) {
+		Slot slot;
+#ifndef MSGSTREAM_NO_EXCEPTIONS
+		try {
+#endif
+			SpanSource src(data_.subspan(begin, end - begin));
+			SpanParser parser(src);
+			slot.result.emplace(process_(parser));
+#ifndef MSGSTREAM_NO_EXCEPTIONS
+		} catch (...) {
+			slot.error = std::current_exception();
+		}
+#endif
+		return slot;
+	}
+
+	std::span<const unsigned char> data_;
+	Process &process_;
+	size_t chunkSize_;
+	bool ordered_;
+	unsigned threads_;
+	size_t window_;
+
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	bool stop_ = false;
+	bool splitting_ = false;
+
+	// Where the next chunk starts
+	size_t pos_ = 0;
+
+	// Number of chunks split off, and number delivered
+	size_t taken_ = 0;
+	size_t delivered_ = 0;
+
+	// Parsed chunks waiting to be delivered, by chunk index
+	std::map<size_t, Slot> ready_;
+};
+
+}
+
+/**
+ * Parse a buffer of concatenated top-level values on several threads,
+ * such as a log file mapped with 'MappedFile'.
+ *
+ * The buffer is split into chunks of whole top-level values,
+ * of about 'options.chunkSize' bytes each, by skipping over the values
+ * without decoding them. Worker threads take chunks in turn,
+ * and call 'process' with a 'SpanParser' over each chunk;
+ * each result is passed to 'deliver' on the calling thread,
+ * in input order if 'options.ordered' is true (the default),
+ * or otherwise as soon as it's ready:
+ *
+ *   size_t total = 0;
+ *   MsgStream::parseParallel(file.data(),
+ *       [](MsgStream::SpanParser &parser) {
+ *           size_t count = 0;
+ *           while (parser.hasNext()) {
+ *               parser.skipNext();
+ *               count += 1;
+ *           }
+ *           return count;
+ *       },
+ *       [&](size_t count) { total += count; });
+ *
+ * 'process' is called from several threads at once,
+ * and must return a value; 'deliver' is only called from the calling thread.
+ * Splitting is sequential (each chunk starts where the previous one ends),
+ * but skipping is much faster than parsing, so it's rarely the bottleneck.
+ *
+ * If 'process' or 'deliver' throws, the workers are stopped and joined,
+ * and the exception is rethrown. When ordered, the results of all the
+ * chunks before the one which failed are delivered first.
+ * An invalid or truncated value leaves the rest of the buffer
+ * in a single chunk, whose parser then reports the error.
+ */
+template<typename Process, typename Deliver>
+inline void parseParallel(
+		std::span<const unsigned char> data, Process process, Deliver deliver,
+		const ParallelOptions &options = ParallelOptions()) {
+	using Result = std::invoke_result_t<Process &, SpanParser &>;
+	static_assert(!std::is_void_v<Result>,
+		"parseParallel's process function must return a value");
+
+	detail::ParallelParse<Result, Process> pp(data, process, options);
+	pp.run(deliver);
+}
+
+template<typename T = void>
+class Task;
+
+namespace detail {
+
+class TaskPromiseBase {
+public:
+	// Tasks are lazy, and only start running when they're awaited
+	std::suspend_always initial_suspend() noexcept { return {}; }
+
+	// A task which finished after suspending resumes whoever awaited it.
+	// If it finished without suspending, the awaiter is still in
+	// Task::await_suspend, and just carries on from there:
+	// that doesn't rely on the compiler turning the resumption
+	// into a tail call (which it doesn't at -O0), so awaiting
+	// many tasks in a loop can't grow the stack.
+	struct FinalAwaiter {
+		bool await_ready() noexcept { return false; }
+
+		template<typename Promise>
+		std::coroutine_handle<> await_suspend(
+				std::coroutine_handle<Promise> h) noexcept {
+			TaskPromiseBase &promise = h.promise();
+			if (promise.handedOff.exchange(true, std::memory_order_acq_rel)) {
+				return promise.continuation;
+			}
+
+			return std::noop_coroutine();
+		}
+
+		void await_resume() noexcept {}
+	};
+
+	FinalAwaiter final_suspend() noexcept { return {}; }
+
+	void unhandled_exception() {
+#ifdef MSGSTREAM_NO_EXCEPTIONS
+		abort();
+#else
+		exception_ = std::current_exception();
+#endif
+	}
+
+	void rethrow() {
+#ifndef MSGSTREAM_NO_EXCEPTIONS
+		if (exception_) {
+			std::rethrow_exception(exception_);
+		}
+#endif
+	}
+
+	std::coroutine_handle<> continuation = std::noop_coroutine();
+
+	// Set by whichever of the awaiter and the finished task gets there
+	// second, which is the one that resumes the awaiter
+	std::atomic<bool> handedOff = false;
+
+private:
+#ifndef MSGSTREAM_NO_EXCEPTIONS
+	std::exception_ptr exception_;
+#endif
+};
+
+template<typename T>
+class TaskPromise: public TaskPromiseBase {
+public:
+	Task<T> get_return_object();
+
+	template<typename U>
+	void return_value(U &&value) {
+		value_.emplace(std::forward<U>(value));
+	}
+
+	T result() {
+		rethrow();
+		return std::move(*value_);
+	}
+
+private:
+	std::optional<T> value_;
+};
+
+template<>
+class TaskPromise<void>: public TaskPromiseBase {
+public:
+	Task<void> get_return_object();
+
+	void return_void() {}
+
+	void result() {
+		rethrow();
+	}
+};
+
+}
+
+/**
+ * A coroutine which produces a 'T', as used by the async parser
+ * and serializer, and for writing coroutines which use them.
+ *
+ * Tasks are lazy: a task starts running when it's awaited with 'co_await',
+ * and resumes its awaiter once it's done. Exceptions thrown by the task
+ * are rethrown by 'co_await'.
+ *
+ * A task which isn't awaited by another coroutine, such as the one
+ * handling a connection, is started with 'start()' instead.
+ * It then runs until it has to wait for its stream,
+ * and is resumed by the stream once it's ready again.
+ */
+template<typename T>
+class Task {
+public:
+	using promise_type = detail::TaskPromise<T>;
+
+	Task() = default;
+
+	Task(Task &&other) noexcept:
+		handle_(std::exchange(other.handle_, nullptr)) {}
+
+	Task &operator=(Task &&other) noexcept {
+		if (this != &other) {
+			if (handle_) {
+				handle_.destroy();
+			}
+
+			handle_ = std::exchange(other.handle_, nullptr);
+		}
+
+		return *this;
+	}
+
+	~Task() {
+		if (handle_) {
+			handle_.destroy();
+		}
+	}
+
+	/**
+	 * Start running a task which isn't awaited.
+	 */
+	void start() {
+		handle_.resume();
+	}
+
+	/**
+	 * Check whether the task has finished.
+	 */
+	bool done() const {
+		return handle_.done();
+	}
+
+	/**
+	 * Get the result of a finished task,
+	 * or rethrow the exception which it finished with.
+	 */
+	T result() {
+		return handle_.promise().result();
+	}
+
+	bool await_ready() const noexcept {
+		return false;
+	}
+
+	bool await_suspend(std::coroutine_handle<> awaiter) noexcept {
+		promise_type &promise = handle_.promise();
+		promise.continuation = awaiter;
+		handle_.resume();
+		return !promise.handedOff.exchange(true, std::memory_order_acq_rel);
+	}
+
+	T await_resume() {
+		return handle_.promise().result();
+	}
+
+private:
+	friend promise_type;
+
+	explicit Task(std::coroutine_handle<promise_type> handle):
+		handle_(handle) {}
+
+	std::coroutine_handle<promise_type> handle_;
+};
+
+namespace detail {
+
+template<typename T>
+inline Task<T> TaskPromise<T>::get_return_object() {
+	return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+	return Task<void>(
+		std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+}
+
+/**
+ * A byte source which an async parser can read from,
+ * without blocking when no input is ready.
+ * Sources must provide these methods:
+ *
+ *   size_t readSome(void *data, size_t length):
+ *     Read up to 'length' bytes of the input which is available now
+ *     into 'data', returning the number of bytes read.
+ *     Returns 0 if no input is available yet, or at the end of input.
+ *   bool atEnd():
+ *     Check whether the end of input has been reached.
+ *   void awaitReadable(std::coroutine_handle<> h):
+ *     Resume 'h' once more input is available, or the input has ended.
+ *     Typically, an event loop would resume 'h' when its socket is readable.
+ *
+ * Only one coroutine waits for a source at a time.
+ */
+template<typename T>
+concept AsyncByteSource = requires(
+		T &src, void *data, size_t length, std::coroutine_handle<> h) {
+	{ src.readSome(data, length) } -> std::convertible_to<size_t>;
+	{ src.atEnd() } -> std::convertible_to<bool>;
+	src.awaitReadable(h);
+};
+
+/**
+ * A byte sink which an async serializer can write to,
+ * without blocking when the sink is full.
+ * Sinks must provide these methods:
+ *
+ *   size_t writeSome(const void *data, size_t length):
+ *     Write as many of the 'length' bytes from 'data' as possible now,
+ *     returning the number of bytes written, which may be 0.
+ *     Failures should be reported by throwing an exception.
+ *   void awaitWritable(std::coroutine_handle<> h):
+ *     Resume 'h' once more bytes can be written.
+ */
+template<typename T>
+concept AsyncByteSink = requires(
+		T &sink, const void *data, size_t length, std::coroutine_handle<> h) {
+	{ sink.writeSome(data, length) } -> std::convertible_to<size_t>;
+	sink.awaitWritable(h);
+};
+
+/**
+ * An in-memory pipe, which is both an AsyncByteSource (its reading end)
+ * and an AsyncByteSink (its writing end).
+ * Up to 'capacity' bytes can be buffered in the pipe.
+ *
+ * A coroutine waiting for the pipe is resumed straight from the call
+ * which lets it continue: 'writeSome' or 'close' for the reader,
+ * and 'readSome' for the writer.
+ * Pipes are for one reader and one writer on the same thread,
+ * such as in tests, or between coroutines on an event loop.
+ */
+class AsyncPipe {
+public:
+	explicit AsyncPipe(size_t capacity = 64 * 1024):
+		capacity_(capacity) {}
+
+	/**
+	 * Get the number of bytes which are buffered in the pipe.
+	 */
+	size_t size() const {
+		return buf_.size() - start_;
+	}
+
+	size_t readSome(void *data, size_t length) {
+		size_t n = length < size() ? length : size();
+		if (n == 0) {
+			return 0;
+		}
+
+		memcpy(data, buf_.data() + start_, n);
+		start_ += n;
+		if (start_ == buf_.size()) {
+			buf_.clear();
+			start_ = 0;
+		}
+
+		wake(writer_);
+		return n;
+	}
+
+	bool atEnd() const {
+		return closed_ && size() == 0;
+	}
+
+	void awaitReadable(std::coroutine_handle<> h) {
+		reader_ = h;
+	}
+
+	size_t writeSome(const void *data, size_t length) {
+		size_t room = capacity_ - size();
+		size_t n = length < room ? length : room;
+		if (start_ > 0 && buf_.size() + n > capacity_) {
+			buf_.erase(buf_.begin(), buf_.begin() + start_);
+			start_ = 0;
+		}
+
+		const unsigned char *ptr = (const unsigned char *)data;
+		buf_.insert(buf_.end(), ptr, ptr + n);
+		if (n > 0) {
+			wake(reader_);
+		}
+
+		return n;
 	}
 
-	/**
-	 * Like 'nextBinary(std::vector<unsigned char> &)',
-	 * except that a new vector is returned instead.
-	 */
-	std::vector<unsigned char> nextBinary() {
-		std::vector<unsigned char> bin;
-		nextBinary(bin);
-		return bin;
+	void awaitWritable(std::coroutine_handle<> h) {
+		writer_ = h;
 	}
 
 	/**
-	 * Create a constrained sub-parser limited to read
-	 * only the values in the next array value.
-	 *
-	 * Preconditions:
-	 *   hasNext() == true
-	 *   nextType() == Type::ARRAY
+	 * Close the writing end. The reader sees the end of input
+	 * once it has read the bytes which are still buffered.
 	 */
-	ArrayParser nextArray();
+	void close() {
+		closed_ = true;
+		wake(reader_);
+	}
 
-	/**
-	 * Create a constrained sub-parser limited to read
-	 * only the values in the next map value.
-	 *
-	 * Preconditions:
-	 *   hasNext() == true
-	 *   nextType() == Type::MAP
-	 */
-	MapParser nextMap();
+private:
+	static void wake(std::coroutine_handle<> &h) {
+		if (h) {
+			std::exchange(h, nullptr).resume();
+		}
+	}
 
-	/**
-	 * Read the next extension value.
-	 * Will populate 'ext' with its contents,
-	 * and return the extension value's type.
-	 *
-	 * Preconditions:
-	 *   hasNext() == true
-	 *   nextType() == Type::EXTENSION
-	 */
-	int64_t nextExtension(std::vector<unsigned char> &ext) {
-		int64_t type;
-		size_t length;
-		nextExtensionHeader(type, length);
+	size_t capacity_;
+	std::vector<unsigned char> buf_;
+	size_t start_ = 0;
+	bool closed_ = false;
+	std::coroutine_handle<> reader_;
+	std::coroutine_handle<> writer_;
+};
 
-		r_.fillContainer(ext, length);
-		return type;
+namespace detail {
+
+// Awaitable which first tries to complete an operation on what's already
+// buffered, and otherwise suspends to run a task which waits for more.
+// Most values are decoded in 'tryNow', without allocating a coroutine frame.
+template<typename TryNow, typename Wait, typename Done>
+class AsyncAwaiter {
+public:
+	AsyncAwaiter(TryNow tryNow, Wait wait, Done done):
+		tryNow_(tryNow), wait_(wait), done_(done) {}
+
+	bool await_ready() {
+		return tryNow_();
 	}
 
-	/**
-	 * Skip the next value, whatever its type.
-	 *
-	 * Preconditions:
-	 *   The stream cursor must be at the start of a valid object
-	 *   hasNext() == true
-	 */
-	void skipNext();
+	bool await_suspend(std::coroutine_handle<> h) {
+		task_ = wait_();
+		waited_ = true;
+		return task_.await_suspend(h);
+	}
 
-	/**
-	 * Skip all available values.
-	 *
-	 * Preconditions:
-	 *   The stream must be a valid MessagePack stream.
-	 */
-	void skipAll() {
-		while (hasNext()) {
-			skipNext();
+	auto await_resume() {
+		if (waited_) {
+			task_.await_resume();
 		}
+
+		return done_();
 	}
 
-protected:
-	explicit Parser(std::istream &is, size_t limit):
-		r_(is), limit_(limit), hasLimit_(true) {}
+private:
+	TryNow tryNow_;
+	Wait wait_;
+	Done done_;
+	Task<void> task_;
+	bool waited_ = false;
+};
 
-	void proceed() {
-		if (!hasLimit_) {
-			return;
+// The buffer shared by an async parser and its sub-parsers
+template<typename Source>
+class AsyncReader {
+public:
+	static_assert(
+		AsyncByteSource<Source>, "Async parser source must be an AsyncByteSource");
+
+	// The buffer must hold the largest header,
+	// an ext 32 header with its extension type
+	AsyncReader(Source &src, size_t bufferSize):
+		src_(src), buf_(bufferSize < 16 ? 16 : bufferSize) {}
+
+	const unsigned char *data() const {
+		return buf_.data() + start_;
+	}
+
+	size_t buffered() const {
+		return end_ - start_;
+	}
+
+	void consume(size_t length) {
+		start_ += length;
+	}
+
+	// Awaitable which reads more input into the buffer,
+	// waiting for the source if there's none yet.
+	// Its result is false at the end of input.
+	class More {
+	public:
+		explicit More(AsyncReader &r): r_(r) {}
+
+		bool await_ready() {
+			read_ = r_.readAvailable();
+			return read_ || r_.src_.atEnd();
 		}
 
-		if (limit_ == 0) {
-			throw ParseError("Length limit exceeded");
+		void await_suspend(std::coroutine_handle<> h) {
+			r_.src_.awaitReadable(h);
 		}
 
+		bool await_resume() {
+			return read_ || r_.readAvailable() || !r_.src_.atEnd();
+		}
 
-		limit_ -= 1;
+	private:
+		AsyncReader &r_;
+		bool read_ = false;
+	};
+
+	More more() {
+		return More(*this);
 	}
 
-	size_t nextStringHeader() {
-		proceed();
+	// Make sure that at least one byte is buffered,
+	// unless the input has ended
+	bool tryPeek() {
+		return buffered() > 0 || readAvailable() || src_.atEnd();
+	}
 
-		uint8_t ch = r_.nextU8();
-		if (ch >= 0xa0 && ch <= 0xbf) {
-			return ch & 0x1f;
-		} else if (ch == 0xd9) {
-			return r_.nextU8();
-		} else if (ch == 0xda) {
-			return r_.nextU16();
-		} else if (ch == 0xdb) {
-			return r_.nextU32();
-		} else {
-			throw ParseError("Attempt to parse non-string as string");
+	Task<void> fillPeek() {
+		bool more = true;
+		while (buffered() == 0 && more) {
+			more = co_await this->more();
 		}
 	}
 
-	size_t nextBinaryHeader() {
-		proceed();
+	// Decode the next header if all of it is buffered, or if it's invalid.
+	// Returns false if more input is needed.
+	bool tryHeader() {
+		header_ = PushHeader();
+		if (buffered() == 0) {
+			return false;
+		}
 
-		uint8_t ch = r_.nextU8();
-		if (ch == 0xc4) {
-			return r_.nextU8();
-		} else if (ch == 0xc5) {
-			return r_.nextU16();
-		} else if (ch == 0xc6) {
-			return r_.nextU32();
-		} else {
-			throw ParseError("Attempt to parse non-binary as binary");
+		size_t size = decodePushHeader(data(), buffered(), header_);
+		consume(size);
+		return size > 0 || header_.error != ErrorCode::NONE;
+	}
+
+	Task<void> fillHeader() {
+		while (!tryHeader()) {
+			bool more = co_await this->more();
+			if (!more) {
+				header_.error = ErrorCode::UNEXPECTED_EOF;
+				header_.message = "Unexpected EOF";
+				co_return;
+			}
 		}
 	}
 
-	void nextExtensionHeader(int64_t &type, size_t &length) {
-		if (limit_ == 0) {
-			throw ParseError("Length limit exceeded");
-		}
-
-		uint8_t ch = r_.nextU8();
-		if (ch == 0xd4) {
-			length = 1;
-		} else if (ch == 0xd5) {
-			length = 2;
-		} else if (ch == 0xd6) {
-			length = 4;
-		} else if (ch == 0xd7) {
-			length = 8;
-		} else if (ch == 0xd8) {
-			length = 16;
-		} else if (ch == 0xc7) {
-			length = r_.nextU8();
-		} else if (ch == 0xc8) {
-			length = r_.nextU16();
-		} else if (ch == 0xc9) {
-			length = r_.nextU32();
-		} else {
-			throw ParseError("Attempt to parse non-extension as extension");
+	// Like tryHeader(), except that for strings, binaries and extensions,
+	// this only succeeds once their payload is buffered too.
+	// The payload is then in 'payload()' until the next read.
+	bool tryValue() {
+		header_ = PushHeader();
+		if (buffered() == 0) {
+			return false;
+		}
+
+		size_t size = decodePushHeader(data(), buffered(), header_);
+		if (size == 0) {
+			return header_.error != ErrorCode::NONE;
+		}
+
+		size_t length = hasPayload(header_.type) ? header_.length : 0;
+		if (buffered() - size < length) {
+			return false;
 		}
 
-		type = nextInt();
+		payload_ = std::span<const unsigned char>(data() + size, length);
+		consume(size + length);
+		return true;
 	}
 
-	detail::Reader r_;
-	size_t limit_ = 1;
-	bool hasLimit_ = false;
-};
+	// Read a value whose payload doesn't fit in the buffer
+	// into 'scratch_', as it arrives
+	Task<void> fillValue() {
+		co_await fillHeader();
+		payload_ = std::span<const unsigned char>();
+		if (header_.error != ErrorCode::NONE || !hasPayload(header_.type)) {
+			co_return;
+		}
 
-class ArrayParser: public Parser {
-public:
-	ArrayParser(std::istream &is, size_t limit): Parser(is, limit) {}
+		scratch_.clear();
+		auto out = [this](const unsigned char *data, size_t length) {
+			scratch_.insert(scratch_.end(), data, data + length);
+		};
+		co_await readPayload(header_.length, out);
+		payload_ = scratch_;
+	}
 
-	/**
-	 * Get the number of values left to read from the array.
-	 * Before any values have been read, this will be
-	 * equal to the total number of values in the array.
-	 */
-	size_t arraySize() { return limit_; }
-};
+	const PushHeader &header() const {
+		if (header_.error != ErrorCode::NONE) {
+			raise(ParseError(header_.error, header_.message));
+		}
 
-class MapParser: public Parser {
-public:
-	MapParser(std::istream &is, size_t limit): Parser(is, limit * 2) {}
+		return header_;
+	}
 
-	/**
-	 * Get the number of key-value pairs left to read from the map.
-	 * Before any key-value pairs have been read, this will be
-	 * equal to the total number of key-value pairs in the map.
-	 */
-	size_t mapSize() { return limit_ / 2; }
+	std::span<const unsigned char> payload() const {
+		return payload_;
+	}
 
-	/**
-	 * Get the next key of the map.
-	 * Returns false if there are no more values in the map.
-	 */
-	bool nextKey(std::string &key) {
-		if (!hasNext()) {
+	// Pass the next 'length' bytes to 'out' if they're all buffered
+	template<typename Out>
+	bool tryPayload(size_t length, Out &out) {
+		if (buffered() < length) {
 			return false;
 		}
 
-		nextString(key);
+		out(data(), length);
+		consume(length);
 		return true;
 	}
-};
 
-inline ArrayParser Parser::nextArray() {
-	proceed();
+	// Pass the next 'length' bytes to 'out', in pieces as they arrive,
+	// so that a hostile length can't make the buffer grow
+	template<typename Out>
+	Task<void> readPayload(size_t length, Out &out) {
+		for (;;) {
+			size_t n = length < buffered() ? length : buffered();
+			out(data(), n);
+			consume(n);
+			length -= n;
+			if (length == 0) {
+				co_return;
+			}
 
-	uint8_t ch = r_.nextU8();
-	size_t length;
-	if (ch >= 0x90 && ch <= 0x9f) {
-		length = ch & 0x0f;
-	} else if (ch == 0xdc) {
-		length = r_.nextU16();
-	} else if (ch == 0xdd) {
-		length = r_.nextU32();
-	} else {
-		throw ParseError("Attempt to parse non-array as array");
+			bool more = co_await this->more();
+			if (!more) {
+				raise(ParseError(ErrorCode::UNEXPECTED_EOF, "Unexpected EOF"));
+			}
+		}
 	}
 
-	return ArrayParser(r_.is_, length);
-}
+private:
+	// Read whatever input is available without waiting,
+	// after moving the unconsumed bytes to the start of the buffer.
+	// Returns false if there was none.
+	bool readAvailable() {
+		if (start_ > 0) {
+			memmove(buf_.data(), buf_.data() + start_, end_ - start_);
+			end_ -= start_;
+			start_ = 0;
+		}
 
-inline MapParser Parser::nextMap() {
-	proceed();
+		size_t n = src_.readSome(buf_.data() + end_, buf_.size() - end_);
+		end_ += n;
+		return n > 0;
+	}
 
-	uint8_t ch = r_.nextU8();
-	size_t length;
-	if (ch >= 0x80 && ch <= 0x8f) {
-		length = ch & 0x0f;
-	} else if (ch == 0xde) {
-		length = r_.nextU16();
-	} else if (ch == 0xdf) {
-		length = r_.nextU32();
-	} else {
-		throw ParseError("Attempt to parse non-map as map");
+	static bool hasPayload(Type type) {
+		return
+			type == Type::STRING || type == Type::BINARY ||
+			type == Type::EXTENSION;
 	}
 
-	return MapParser(r_.is_, length);
-}
+	Source &src_;
+	std::vector<unsigned char> buf_;
+	size_t start_ = 0;
+	size_t end_ = 0;
+	PushHeader header_;
+	std::span<const unsigned char> payload_;
+	std::vector<unsigned char> scratch_;
+};
+
+template<typename Sink>
+struct AsyncWritable {
+	Sink &sink;
+
+	bool await_ready() { return false; }
+	void await_suspend(std::coroutine_handle<> h) { sink.awaitWritable(h); }
+	void await_resume() {}
+};
 
-inline void Parser::skipNext() {
-	switch (nextType()) {
-	case Type::INT:
-	case Type::UINT:
-		nextUInt();
-		break;
-	case Type::NIL:
-		skipNil();
-		break;
-	case Type::BOOL:
-		nextBool();
-		break;
-	case Type::FLOAT32:
-	case Type::FLOAT64:
-		nextFloat32();
-		break;
-	case Type::STRING:
-		r_.skip(nextStringHeader());
-		break;
-	case Type::BINARY:
-		r_.skip(nextBinaryHeader());
-		break;
-	case Type::ARRAY:
-		nextArray().skipAll();
-		break;
-	case Type::MAP:
-		nextMap().skipAll();
-		break;
-	case Type::EXTENSION: {
-		int64_t type;
-		size_t length;
-		nextExtensionHeader(type, length);
-		r_.skip(length);
-	}
-		break;
-	}
 }
 
-class ArrayBuilder;
-class MapBuilder;
+template<typename Source>
+class AsyncArrayParser;
+
+template<typename Source>
+class AsyncMapParser;
 
 /**
- * A MessagePack stream writer.
+ * A MessagePack parser for use in coroutines,
+ * which reads from an AsyncByteSource, and waits for it
+ * instead of blocking whenever input isn't ready yet.
+ * This lets a whole message be decoded by straight-line code,
+ * while the thread serves other connections in the meantime.
+ *
+ * The API mirrors BasicParser, except that each method returns
+ * something to 'co_await' for the result:
+ *
+ *   MsgStream::Task<void> handle(Connection &conn) {
+ *       MsgStream::AsyncParser<Connection> parser(conn);
+ *       auto request = co_await parser.nextArray();
+ *       int64_t id = co_await request.nextInt();
+ *       std::string method = co_await request.nextString();
+ *       // ...
+ *   }
+ *
+ * (GCC 12 miscompiles coroutines with a 'co_await' in the condition
+ * of an 'if' or a loop, such as 'while (co_await parser.hasNext())';
+ * assign the result to a variable first.)
+ *
+ * Input is read into a buffer, from which values are decoded without
+ * suspending whenever they're already complete, payload included;
+ * other than in 'skipNext' and 'skipAll', coroutine frames are only
+ * allocated to wait for more input.
+ *
+ * Errors are thrown as a ParseError from 'co_await'.
+ * Unlike BasicParser, async parsers have no STATUS mode.
  */
-class Serializer {
+template<typename Source>
+class BasicAsyncParser {
 public:
-	explicit Serializer(std::ostream &os):
-		w_(os) {}
-
 	/**
-	 * Write an integer value.
+	 * Check whether there are more values available, like
+	 * 'BasicParser::hasNext', waiting for input if needed.
 	 */
-	void writeInt(int64_t num) {
-		proceed();
+	auto hasNext() {
+		return detail::AsyncAwaiter(
+			[this] { return hasLimit_ || r_->tryPeek(); },
+			[this] { return r_->fillPeek(); },
+			[this] { return hasLimit_ ? limit_ > 0 : r_->buffered() > 0; });
+	}
 
-		if (num >= 0 && num <= 0x7f) {
-			w_.writeU8(num);
-		} else if (num >= -32 && num < -1) {
-			w_.writeI8(num);
-		} else if (num >= -128 && num <= 127) {
-			w_.writeU8(0xd0);
-			w_.writeI8(num);
-		} else if (num >= -32768 && num <= 32767) {
-			w_.writeU8(0xd1);
-			w_.writeI16(num);
-		} else if (num >= -2147483648 && num <= 2147483647) {
-			w_.writeU8(0xd2);
-			w_.writeI32(num);
-		} else {
-			w_.writeU8(0xd3);
-			w_.writeI64(num);
-		}
+	/**
+	 * Get the type of the next value, waiting for input if needed.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 */
+	auto nextType() {
+		return detail::AsyncAwaiter(
+			[this] { return r_->tryPeek(); },
+			[this] { return r_->fillPeek(); },
+			[this] {
+				if (hasLimit_ && limit_ == 0) {
+					detail::raise(ParseError(
+						ErrorCode::LENGTH_LIMIT, "Length limit exceeded"));
+				} else if (r_->buffered() == 0) {
+					detail::raise(ParseError(
+						ErrorCode::UNEXPECTED_EOF, "Unexpected EOF"));
+				}
+
+				const detail::HeaderInfo &info = detail::headerTable[*r_->data()];
+				if (!info.valid) {
+					detail::raise(ParseError(
+						ErrorCode::INVALID_HEADER, "Unexpected header byte"));
+				}
+
+				return info.type;
+			});
 	}
 
 	/**
-	 * Write an unsigned integer value.
+	 * Get the next value as an integer; see 'BasicParser::nextInt'.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::INT || nextType() == Type::UINT
 	 */
-	void writeUInt(uint64_t num) {
+	auto nextInt() {
 		proceed();
+		return header([](const detail::PushHeader &header) {
+			return (int64_t)intValue(header);
+		});
+	}
 
-		if (num <= 0x7fu) {
-			w_.writeU8(num);
-		} else if (num <= 0xffu) {
-			w_.writeU8(0xcc);
-			w_.writeU8(num);
-		} else if (num <= 0xffffu) {
-			w_.writeU8(0xcd);
-			w_.writeU16(num);
-		} else if (num <= 0xffffffffu) {
-			w_.writeU8(0xce);
-			w_.writeU32(num);
-		} else {
-			w_.writeU8(0xcf);
-			w_.writeU64(num);
-		}
+	/**
+	 * Get the next value as an unsigned integer;
+	 * see 'BasicParser::nextUInt'.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::INT || nextType() == Type::UINT
+	 */
+	auto nextUInt() {
+		proceed();
+		return header([](const detail::PushHeader &header) {
+			return intValue(header);
+		});
 	}
 
 	/**
-	 * Write a nil value.
+	 * Skip the next value if it's a nil.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::NIL
 	 */
-	void writeNil() {
+	auto skipNil() {
 		proceed();
-		w_.writeU8(0xc0);
+		return header([](const detail::PushHeader &header) {
+			expectType(header, Type::NIL, "Attempt to parse non-nil as nil");
+		});
 	}
 
 	/**
-	 * Write a bool value.
+	 * Get the next value as a boolean.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::BOOL
 	 */
-	void writeBool(bool b) {
+	auto nextBool() {
 		proceed();
-		w_.writeU8(b ? 0xc3 : 0xc2);
+		return header([](const detail::PushHeader &header) {
+			expectType(header, Type::BOOL, "Attempt to parse non-bool as bool");
+			return header.value != 0;
+		});
 	}
 
 	/**
-	 * Write a 32-bit floating point value.
+	 * Get the next value as a 32-bit float.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::FLOAT32 || nextType() == Type::FLOAT64
 	 */
-	void writeFloat32(float f) {
+	auto nextFloat32() {
 		proceed();
-		static_assert(sizeof(float) == sizeof(uint32_t));
-		uint32_t num;
-		memcpy(&num, &f, sizeof(num));
-		w_.writeU8(0xca);
-		w_.writeU32(num);
+		return header([](const detail::PushHeader &header) {
+			return (float)floatValue(header);
+		});
+	}
+
+	/**
+	 * Get the next value as a 64-bit float.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::FLOAT32 || nextType() == Type::FLOAT64
+	 */
+	auto nextFloat64() {
+		proceed();
+		return header([](const detail::PushHeader &header) {
+			return floatValue(header);
+		});
 	}
 
 	/**
-	 * Write a 64-bit floating point value.
+	 * Get the next value as a string.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::STRING
 	 */
-	void writeFloat64(double d) {
+	auto nextString() {
 		proceed();
-		static_assert(sizeof(double) == sizeof(uint64_t));
-		uint64_t num;
-		memcpy(&num, &d, sizeof(num));
-		w_.writeU8(0xcb);
-		w_.writeU64(num);
+		return value([](
+				const detail::PushHeader &header,
+				std::span<const unsigned char> payload) {
+			expectType(header, Type::STRING, "Attempt to parse non-string as string");
+			return std::string((const char *)payload.data(), payload.size());
+		});
 	}
 
 	/**
-	 * Write a string value.
-	 * The string must be smaller than 2^32-1 bytes long.
+	 * Get the next value as a byte string.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::BINARY
 	 */
-	void writeString(std::string_view sv) {
+	auto nextBinary() {
 		proceed();
-		size_t length = sv.size();
-		if (length <= 0x1fu) {
-			w_.writeU8(0xa0u | length);
-		} else if (length <= 0xffu) {
-			w_.writeU8(0xd9);
-			w_.writeU8(length);
-		} else if (length <= 0xffffu) {
-			w_.writeU8(0xda);
-			w_.writeU16(length);
-		} else if (length <= 0xffffffffu) {
-			w_.writeU8(0xdb);
-			w_.writeU32(length);
-		} else {
-			throw SerializeError("String too long");
-		}
-
-		w_.writeBlob((const void *)sv.data(), length);
+		return value([](
+				const detail::PushHeader &header,
+				std::span<const unsigned char> payload) {
+			expectType(header, Type::BINARY, "Attempt to parse non-binary as binary");
+			return std::vector<unsigned char>(payload.begin(), payload.end());
+		});
 	}
 
 	/**
-	 * Write a byte string value.
-	 * The byte string must be smaller than 2^32-1 bytes long.
+	 * Create a constrained sub-parser limited to read
+	 * only the values in the next array value.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::ARRAY
 	 */
-	void writeBinary(std::span<const unsigned char> bv) {
+	auto nextArray() {
 		proceed();
-		size_t length = bv.size();
-		if (length <= 0xffu) {
-			w_.writeU8(0xc4);
-			w_.writeU8(length);
-		} else if (length <= 0xffffu) {
-			w_.writeU8(0xc5);
-			w_.writeU16(length);
-		} else if (length <= 0xffffffffu) {
-			w_.writeU8(0xc6);
-			w_.writeU32(length);
-		} else {
-			throw SerializeError("Binary too long");
-		}
-
-		w_.writeBlob(bv.data(), length);
+		return header([r = r_](const detail::PushHeader &header) {
+			expectType(header, Type::ARRAY, "Attempt to parse non-array as array");
+			return AsyncArrayParser<Source>(*r, header.length);
+		});
 	}
 
 	/**
-	 * Write an array value.
-	 * Will clear the ArrayBuilder.
-	 * The ArrayBuilder can be re-used to create another array value.
+	 * Create a constrained sub-parser limited to read
+	 * only the values in the next map value.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::MAP
 	 */
-	void writeArray(ArrayBuilder &ab);
+	auto nextMap() {
+		proceed();
+		return header([r = r_](const detail::PushHeader &header) {
+			expectType(header, Type::MAP, "Attempt to parse non-map as map");
+			return AsyncMapParser<Source>(*r, header.length);
+		});
+	}
 
 	/**
-	 * Begin writing an array value.
-	 * Returns a sub-serializer which array values must be written to.
-	 * Exactly 'n' values must be written to the sub-serializer,
-	 * and then 'endArray' must be called.
+	 * Read the next extension value into 'ext',
+	 * and return the extension value's type.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::EXTENSION
 	 */
-	Serializer beginArray(size_t n) {
+	auto nextExtension(std::vector<unsigned char> &ext) {
 		proceed();
-		nesting_ = true;
-		nestingLength_ = n;
-		writeArrayHeader(n);
-		return Serializer(w_.os_);
+		return value([&ext](
+				const detail::PushHeader &header,
+				std::span<const unsigned char> payload) {
+			expectType(
+				header, Type::EXTENSION,
+				"Attempt to parse non-extension as extension");
+			ext.assign(payload.begin(), payload.end());
+			return header.extensionType;
+		});
 	}
 
 	/**
-	 * Complete writing an array that was started by 'beginArray'.
-	 * The same amount of values must have been written to the serializer
-	 * as were passed to the 'beginArray' method.
+	 * Read the next value as a timestamp extension.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
+	 *   nextType() == Type::EXTENSION
+	 *   The extension's type is Timestamp::EXTENSION_TYPE
 	 */
-	void endArray(Serializer &sub) {
-		if (sub.written() != nestingLength_) {
-			throw SerializeError("beginArray/endArray length mismatch");
-		}
+	auto nextTimestamp() {
+		proceed();
+		return value([](
+				const detail::PushHeader &header,
+				std::span<const unsigned char> payload) {
+			expectType(
+				header, Type::EXTENSION,
+				"Attempt to parse non-extension as extension");
+			if (header.extensionType != Timestamp::EXTENSION_TYPE) {
+				detail::raise(ParseError(
+					ErrorCode::TYPE_MISMATCH,
+					"Attempt to parse non-timestamp as timestamp"));
+			}
 
-		nesting_ = false;
-	}
+			Timestamp ts;
+			if (const char *err = Timestamp::tryDecode(payload, ts)) {
+				detail::raise(ParseError(ErrorCode::INVALID_VALUE, err));
+			}
 
-	/**
-	 * Write a map value.
-	 * Will clear the MapBuilder.
-	 * The MapBuilder can be re-used to create another array value.
-	 */
-	void writeMap(MapBuilder &mb);
+			return ts;
+		});
+	}
 
 	/**
-	 * Begin writing a map value.
-	 * Returns a sub-serializer which map key/value pairs must be written to.
-	 * Exactly 'n' keys and 'n' values must be written to the sub-serializer,
-	 * and then 'endMap' must be called.
+	 * Skip the next value, whatever its type.
+	 * Like 'BasicParser::skipNext', this doesn't recurse into containers.
+	 *
+	 * Preconditions:
+	 *   hasNext() == true
 	 */
-	Serializer beginMap(size_t n) {
+	Task<void> skipNext() {
 		proceed();
-		nesting_ = true;
-		nestingLength_ = n * 2;
-		writeMapHeader(n);
-		return Serializer(w_.os_);
+		auto discard = [](const unsigned char *, size_t) {};
+		uint64_t pending = 1;
+		while (pending > 0) {
+			pending -= 1;
+
+			detail::PushHeader h = co_await nextHeader();
+			switch (h.type) {
+			case Type::ARRAY:
+				pending += h.length;
+				break;
+			case Type::MAP:
+				pending += h.length * 2;
+				break;
+			case Type::STRING:
+			case Type::BINARY:
+			case Type::EXTENSION:
+				co_await payload(h.length, discard);
+				break;
+			default:
+				break;
+			}
+		}
 	}
 
 	/**
-	 * Complete writing a mwp that was started by 'beginMap'.
-	 * The same amount of keys and values must have been written to the serializer
-	 * as were passed to the 'beginMap' method.
+	 * Skip all the remaining values.
 	 */
-	void endMap(Serializer &sub) {
-		if (sub.written() != nestingLength_) {
-			throw SerializeError("beginMap/endMap length mismatch");
-		}
+	Task<void> skipAll() {
+		for (;;) {
+			bool more = co_await hasNext();
+			if (!more) {
+				break;
+			}
 
-		nesting_ = false;
+			co_await skipNext();
+		}
 	}
 
-	/**
-	 * Write an extension.
-	 */
-	void writeExtension(int64_t type, std::span<const unsigned char> ext) {
-		// Incrementing written_ will happen in writeInt()
-		if (nesting_) {
-			throw SerializeError("Missing call to endArray/endMap");
+protected:
+	BasicAsyncParser(detail::AsyncReader<Source> *r, size_t limit, bool hasLimit):
+		r_(r), limit_(limit), hasLimit_(hasLimit) {}
+
+	void proceed() {
+		if (!hasLimit_) {
+			return;
 		}
 
-		size_t length = ext.size();
-		if (length == 1) {
-			w_.writeU8(0xd4);
-		} else if (length == 2) {
-			w_.writeU8(0xd5);
-		} else if (length == 4) {
-			w_.writeU8(0xd6);
-		} else if (length == 8) {
-			w_.writeU8(0xd7);
-		} else if (length == 16) {
-			w_.writeU8(0xd8);
-		} else if (length <= 0xffu) {
-			w_.writeU8(0xc7);
-			w_.writeU8(length);
-		} else if (length <= 0xffffu) {
-			w_.writeU8(0xc8);
-			w_.writeU16(length);
-		} else if (length <= 0xffffffffu) {
-			w_.writeU8(0xc9);
-			w_.writeU32(length);
-		} else {
-			throw SerializeError("Extension too long");
+		if (limit_ == 0) {
+			detail::raise(ParseError(
+				ErrorCode::LENGTH_LIMIT, "Length limit exceeded"));
 		}
 
-		writeInt(type);
-		w_.writeBlob(ext.data(), length);
+		limit_ -= 1;
 	}
 
-	/**
-	 * Get the number of values written to the serializer so far.
-	 */
-	size_t written() { return written_; }
+	// Awaitable for the next value, whose result is
+	// 'convert(header, payload)'
+	template<typename Convert>
+	auto value(Convert convert) {
+		detail::AsyncReader<Source> *r = r_;
+		return detail::AsyncAwaiter(
+			[r] { return r->tryValue(); },
+			[r] { return r->fillValue(); },
+			[r, convert] { return convert(r->header(), r->payload()); });
+	}
 
-protected:
-	void proceed() {
-		if (nesting_) {
-			throw SerializeError("Missing call to endArray/endMap");
-		}
+	// Awaitable for the next value's header, whose result is
+	// 'convert(header)'. Any payload is left to be read.
+	template<typename Convert>
+	auto header(Convert convert) {
+		detail::AsyncReader<Source> *r = r_;
+		return detail::AsyncAwaiter(
+			[r] { return r->tryHeader(); },
+			[r] { return r->fillHeader(); },
+			[r, convert] { return convert(r->header()); });
+	}
 
-		written_ += 1;
+	auto nextHeader() {
+		return header([](const detail::PushHeader &header) {
+			return header;
+		});
 	}
 
-	void writeArrayHeader(size_t length) {
-		if (length <= 0x0fu) {
-			w_.writeU8(0x90u | length);
-		} else if (length <= 0xffffu) {
-			w_.writeU8(0xdc);
-			w_.writeU16(length);
-		} else if (length <= 0xffffffffu) {
-			w_.writeU8(0xdd);
-			w_.writeU32(length);
-		} else {
-			throw SerializeError("Array too long");
+	// Awaitable which passes the next 'length' bytes to 'out'
+	template<typename Out>
+	auto payload(size_t length, Out &out) {
+		detail::AsyncReader<Source> *r = r_;
+		return detail::AsyncAwaiter(
+			[r, length, &out] { return r->tryPayload(length, out); },
+			[r, length, &out] { return r->readPayload(length, out); },
+			[] {});
+	}
+
+	static void expectType(
+			const detail::PushHeader &header, Type type, const char *msg) {
+		if (header.type != type) {
+			detail::raise(ParseError(ErrorCode::TYPE_MISMATCH, msg));
 		}
 	}
 
-	void writeMapHeader(size_t length) {
-		if (length <= 0x0fu) {
-			w_.writeU8(0x80u | length);
-		} else if (length <= 0xffffu) {
-			w_.writeU8(0xde);
-			w_.writeU16(length);
-		} else if (length <= 0xffffffffu) {
-			w_.writeU8(0xdf);
-			w_.writeU32(length);
-		} else {
-			throw SerializeError("Array too long");
+	static uint64_t intValue(const detail::PushHeader &header) {
+		if (header.type != Type::INT && header.type != Type::UINT) {
+			detail::raise(ParseError(
+				ErrorCode::TYPE_MISMATCH, "Attempt to parse non-integer as integer"));
 		}
+
+		return header.value;
 	}
 
-	detail::Writer w_;
-	size_t written_ = 0;
-	bool nesting_ = false;
-	size_t nestingLength_ = 0;
+	static double floatValue(const detail::PushHeader &header) {
+		if (header.type == Type::FLOAT32) {
+			return (double)std::bit_cast<float>((uint32_t)header.value);
+		} else if (header.type == Type::FLOAT64) {
+			return std::bit_cast<double>(header.value);
+		}
+
+		detail::raise(ParseError(
+			ErrorCode::TYPE_MISMATCH, "Attempt to parse non-float as float"));
+	}
+
+	detail::AsyncReader<Source> *r_;
+	size_t limit_;
+	bool hasLimit_;
 };
 
 /**
- * A specialized serializer for array values,
- * which writes its values to an internal buffer.
+ * The top-level async parser, which owns the buffer
+ * shared with its sub-parsers. See BasicAsyncParser.
+ *
+ * The parser mustn't be moved, since its sub-parsers point to it,
+ * and must outlive them.
  */
-class ArrayBuilder: public Serializer {
+template<typename Source>
+class AsyncParser: public BasicAsyncParser<Source> {
 public:
-	ArrayBuilder(): Serializer(ss_) {}
+	explicit AsyncParser(Source &src, size_t bufferSize = 16 * 1024):
+		BasicAsyncParser<Source>(&reader_, 1, false),
+		reader_(src, bufferSize) {}
 
-	/**
-	 * Get the underlying buffer.
-	 * This moves the buffer out of the underlying string stream.
-	 */
-	std::string consume() {
-		std::string s = std::move(ss_).str();
-		ss_ = {};
-		written_ = 0;
-		return s;
-	}
+	AsyncParser(const AsyncParser &) = delete;
+	AsyncParser &operator=(const AsyncParser &) = delete;
+
+private:
+	detail::AsyncReader<Source> reader_;
+};
+
+template<typename Source>
+class AsyncArrayParser: public BasicAsyncParser<Source> {
+public:
+	AsyncArrayParser(detail::AsyncReader<Source> &r, size_t limit):
+		BasicAsyncParser<Source>(&r, limit, true) {}
 
 	/**
-	 * Set the underlying buffer.
-	 * Allows re-using a buffer between array/map builders.
-	 * The buffer will be cleared (i.e size() set to 0),
-	 * but the capacity will be kept.
+	 * Get the number of values left to read from the array.
 	 */
-	void setBuffer(std::string &&str) {
-		str.clear();
-		ss_.str(std::move(str));
-	}
+	size_t arraySize() { return this->limit_; }
+};
+
+template<typename Source>
+class AsyncMapParser: public BasicAsyncParser<Source> {
+public:
+	AsyncMapParser(detail::AsyncReader<Source> &r, size_t limit):
+		BasicAsyncParser<Source>(&r, limit * 2, true) {}
 
 	/**
-	 * Clear the internal buffer.
+	 * Get the number of key-value pairs left to read from the map.
 	 */
-	void clear() {
-		setBuffer(consume());
-	}
+	size_t mapSize() { return this->limit_ / 2; }
+};
 
-private:
-	std::stringstream ss_;
+namespace detail {
+
+// Holds an AsyncSerializer's buffer, so that it's constructed
+// before the BasicSerializer which writes to it
+struct AsyncSerializerBuffer {
+	BufferSink buffer_;
 };
 
+}
 
 /**
- * A specialized serializer for map keys and values,
- * which writes its keys and values to an internal buffer.
+ * A serializer for coroutines, which writes to an AsyncByteSink.
+ *
+ * Values are written to an internal buffer with the usual
+ * BasicSerializer methods, which never wait.
+ * 'flush()' then writes the buffered bytes to the sink,
+ * waiting for it whenever it's full:
+ *
+ *   serializer.writeInt(id);
+ *   serializer.writeString(result);
+ *   co_await serializer.flush();
+ *
+ * Arrays and maps started with 'beginArrayDeferred'/'beginMapDeferred'
+ * must be ended before flushing.
  */
-class MapBuilder: public Serializer {
+template<typename Sink>
+class AsyncSerializer:
+		private detail::AsyncSerializerBuffer,
+		public BasicSerializer<BufferSink> {
 public:
-	MapBuilder(): Serializer(ss_) {}
+	static_assert(
+		AsyncByteSink<Sink>, "Async serializer sink must be an AsyncByteSink");
 
-	/**
-	 * Get the underlying buffer.
-	 * This moves the buffer out of the underlying string stream.
-	 */
-	std::string consume() {
-		std::string s = std::move(ss_).str();
-		ss_ = {};
-		written_ = 0;
-		return s;
-	}
+	explicit AsyncSerializer(Sink &sink):
+		BasicSerializer<BufferSink>(buffer_), sink_(sink) {}
 
 	/**
-	 * Set the underlying buffer.
-	 * Allows re-using a buffer between array/map builders.
-	 * The buffer will be cleared (i.e size() set to 0),
-	 * but the capacity will be kept.
+	 * Get the number of bytes waiting to be flushed.
 	 */
-	void setBuffer(std::string &&str) {
-		str.clear();
-		ss_.str(std::move(str));
+	size_t buffered() const {
+		return buffer_.size();
 	}
 
 	/**
-	 * Clear the internal buffer.
+	 * Write all the buffered bytes to the sink.
 	 */
-	void clear() {
-		setBuffer(consume());
+	Task<void> flush() {
+		std::span<const unsigned char> data = buffer_.data();
+		size_t done = 0;
+		while (done < data.size()) {
+			size_t n = sink_.writeSome(data.data() + done, data.size() - done);
+			done += n;
+			if (n == 0) {
+				co_await detail::AsyncWritable<Sink>{sink_};
+			}
+		}
+
+		buffer_.clear();
 	}
 
 private:
-	std::stringstream ss_;
+	Sink &sink_;
 };
 
-inline void Serializer::writeArray(ArrayBuilder &ab) {
-	proceed();
-	writeArrayHeader(ab.written());
-	std::string s = ab.consume();
-	w_.writeBlob(s.data(), s.size());
-	ab.setBuffer(std::move(s));
-}
-
-inline void Serializer::writeMap(MapBuilder &mb) {
-	if (mb.written() % 2 != 0) {
-		throw SerializeError("Odd number of values in map");
-	}
-
-	proceed();
-	writeMapHeader(mb.written() / 2);
-	std::string s = mb.consume();
-	w_.writeBlob(s.data(), s.size());
-	mb.setBuffer(std::move(s));
-}
-
 }
 
 #endif // LIBMSGSTREAM_HEADER
@@ -0,0 +1,99 @@
+// Built with -fno-exceptions, to check that msgstream.h compiles without
+// exceptions and that errors are reported through ParseStatus instead
+#include "../msgstream.h"
+#include <sstream>
+#include <iostream>
+#include <string>
+
+static int failures = 0;
+
+static void check(bool ok, const char *msg) {
+	if (!ok) {
+		std::cout << "FAIL! " << msg << '\n';
+		failures += 1;
+	}
+}
+
+struct Point {
+	int x = 0;
+	int y = 0;
+
+	using MsgStreamFields = MsgStream::FieldList<
+		MsgStream::Field<"x", &Point::x>,
+		MsgStream::Field<"y", &Point::y>>;
+};
+
+struct CountingHandler: MsgStream::PushHandler {
+	int values = 0;
+
+	void onComplete() { values += 1; }
+};
+
+static MsgStream::Task<int64_t> readIntAsync(MsgStream::AsyncPipe &pipe) {
+	MsgStream::AsyncParser<MsgStream::AsyncPipe> parser(pipe);
+	int64_t num = co_await parser.nextInt();
+	co_return num;
+}
+
+int main() {
+	using MsgStream::ErrorCode;
+
+	MsgStream::BufferSink sink;
+	MsgStream::BufferSerializer serializer(sink);
+	serializer.writeInt(-1);
+	MsgStream::serialize(serializer, Point{3, 4});
+	std::string bin((const char *)sink.data().data(), sink.size());
+
+	MsgStream::ParseStatus status;
+	MsgStream::SpanSource src(bin);
+	MsgStream::SpanStatusParser parser(src, status);
+	check(parser.nextInt() == -1, "Incorrect int");
+	Point point;
+	MsgStream::deserialize(parser, point);
+	check(point.x == 3 && point.y == 4, "Incorrect point");
+	check(status.ok() && !parser.hasNext(), "Valid input failed");
+
+	// Truncated input
+	MsgStream::SpanSource truncatedSrc(std::string_view(bin).substr(0, 4));
+	MsgStream::SpanStatusParser truncated(truncatedSrc, status);
+	truncated.nextInt();
+	MsgStream::deserialize(truncated, point);
+	check(status.code == ErrorCode::UNEXPECTED_EOF, "Incorrect EOF status");
+	check(status.offset == 4, "Incorrect EOF offset");
+
+	// Type mismatch in a stream
+	status.clear();
+	std::stringstream ss(bin);
+	MsgStream::StatusParser streamParser(ss, status);
+	streamParser.nextString();
+	check(status.code == ErrorCode::TYPE_MISMATCH, "Incorrect mismatch status");
+	check(!streamParser.hasNext(), "Parser continued after error");
+
+	status.clear();
+	CountingHandler handler;
+	MsgStream::PushParser push(handler, status);
+	push.feed(bin);
+	push.feed(std::string_view("\xc1", 1));
+	check(handler.values == 2, "Incorrect push parser values");
+	check(status.code == ErrorCode::INVALID_HEADER, "Incorrect push status");
+
+	MsgStream::AsyncPipe pipe;
+	MsgStream::Task<int64_t> task = readIntAsync(pipe);
+	task.start();
+	pipe.writeSome(bin.data(), bin.size());
+	check(task.done() && task.result() == -1, "Incorrect async int");
+
+	int64_t sum = 0;
+	MsgStream::parseParallel(
+		std::span((const unsigned char *)bin.data(), 1),
+		[](MsgStream::SpanParser &p) { return p.nextInt(); },
+		[&](int64_t num) { sum += num; });
+	check(sum == -1, "Incorrect parallel int");
+
+	if (failures > 0) {
+		return 1;
+	}
+
+	std::cout << "Success!\n";
+	return 0;
+}
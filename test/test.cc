@@ -1,7 +1,11 @@
 #include "../msgstream.h"
 #include <sstream>
+#include <algorithm>
 #include <stdexcept>
+#include <type_traits>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include <json/json.h>
 #include <iostream>
 #include <fstream>
@@ -83,11 +87,17 @@ static void assertEqual(const T &actual, const T &expected, const char *msg) {
 	throw std::runtime_error(ss.str());
 }
 
-static void assertArraysEqual(MsgStream::ArrayParser parser, Json::Value &arr);
+template<typename Source>
+static void assertArraysEqual(
+	MsgStream::BasicArrayParser<Source> parser, Json::Value &arr);
 
-static void assertMapsEqual(MsgStream::MapParser parser, Json::Value &arr);
+template<typename Source>
+static void assertMapsEqual(
+	MsgStream::BasicMapParser<Source> parser, Json::Value &arr);
 
-static void assertValuesEqual(MsgStream::Parser &parser, Json::Value &val) {
+template<typename Source>
+static void assertValuesEqual(
+	MsgStream::BasicParser<Source> &parser, Json::Value &val) {
 	using Type = MsgStream::Type;
 	switch (parser.nextType()) {
 	case Type::INT:
@@ -129,7 +139,9 @@ static void assertValuesEqual(MsgStream::Parser &parser, Json::Value &val) {
 	}
 }
 
-static void assertArraysEqual(MsgStream::ArrayParser parser, Json::Value &arr) {
+template<typename Source>
+static void assertArraysEqual(
+	MsgStream::BasicArrayParser<Source> parser, Json::Value &arr) {
 	if (!arr.isArray()) {
 		throw std::runtime_error("Invalid value: Expected non-array");
 	}
@@ -145,7 +157,9 @@ static void assertArraysEqual(MsgStream::ArrayParser parser, Json::Value &arr) {
 	}
 }
 
-static void assertMapsEqual(MsgStream::MapParser parser, Json::Value &obj) {
+template<typename Source>
+static void assertMapsEqual(
+	MsgStream::BasicMapParser<Source> parser, Json::Value &obj) {
 	if (!obj.isObject()) {
 		throw std::runtime_error("Invalid value: Expected non-object");
 	}
@@ -173,11 +187,125 @@ static void assertMapsEqual(MsgStream::MapParser parser, Json::Value &obj) {
 	}
 }
 
+// Each backend's source is created from a byte string by a SourceHolder.
+// The holder owns whatever the source needs to stay alive.
+struct StreamSourceHolder {
+	explicit StreamSourceHolder(std::string bin): ss(std::move(bin)) {}
+
+	std::istream &source() { return ss; }
+
+	std::stringstream ss;
+};
+
+struct SpanSourceHolder {
+	explicit SpanSourceHolder(std::string bin):
+		bin(std::move(bin)), src(this->bin) {}
+
+	MsgStream::SpanSource &source() { return src; }
+
+	std::string bin;
+	MsgStream::SpanSource src;
+};
+
+struct StreambufSourceHolder {
+	explicit StreambufSourceHolder(std::string bin):
+		buf(std::move(bin)), src(buf) {}
+
+	MsgStream::StreambufSource &source() { return src; }
+
+	std::stringbuf buf;
+	MsgStream::StreambufSource src;
+};
+
+// A user-defined source which only hands out a few bytes per 'read' call,
+// like a ring buffer or a socket would
+class TrickleSource {
+public:
+	explicit TrickleSource(std::string bin): bin_(std::move(bin)) {}
+
+	int peek() {
+		return pos_ == bin_.size() ? -1 : (unsigned char)bin_[pos_];
+	}
+
+	size_t read(void *data, size_t length) {
+		unsigned char *ptr = (unsigned char *)data;
+		size_t done = 0;
+		while (done < length && pos_ < bin_.size()) {
+			size_t n = std::min({length - done, bin_.size() - pos_, (size_t)3});
+			memcpy(ptr + done, &bin_[pos_], n);
+			pos_ += n;
+			done += n;
+		}
+
+		return done;
+	}
+
+	size_t skip(size_t length) {
+		size_t n = std::min(length, bin_.size() - pos_);
+		pos_ += n;
+		return n;
+	}
+
+private:
+	std::string bin_;
+	size_t pos_ = 0;
+};
+
+static_assert(MsgStream::ByteSource<TrickleSource>);
+
+struct TrickleSourceHolder {
+	explicit TrickleSourceHolder(std::string bin): src(std::move(bin)) {}
+
+	TrickleSource &source() { return src; }
+
+	TrickleSource src;
+};
+
+struct FdSourceHolder {
+	explicit FdSourceHolder(std::string bin): file(tmpfile()), src(fileno(file)) {
+		fwrite(bin.data(), 1, bin.size(), file);
+		fflush(file);
+		rewind(file);
+	}
+
+	~FdSourceHolder() {
+		fclose(file);
+	}
+
+	MsgStream::FdSource &source() { return src; }
+
+	FILE *file;
+	MsgStream::FdSource src;
+};
+
+struct MappedFileSourceHolder {
+	explicit MappedFileSourceHolder(std::string bin):
+		file(tmpfile()), mapped(writeAndMap(file, bin)), src(mapped.data()) {}
+
+	~MappedFileSourceHolder() {
+		fclose(file);
+	}
+
+	static MsgStream::MappedFile writeAndMap(FILE *file, const std::string &bin) {
+		fwrite(bin.data(), 1, bin.size(), file);
+		fflush(file);
+		rewind(file);
+		return MsgStream::MappedFile(fileno(file));
+	}
+
+	MsgStream::SpanSource &source() { return src; }
+
+	FILE *file;
+	MsgStream::MappedFile mapped;
+	MsgStream::SpanSource src;
+};
+
+template<typename Holder>
 static void check(std::string bin, Json::Value &val, Stats &stats) {
 	stats.numTotalChecks += 1;
 
-	std::stringstream ss(std::move(bin));
-	MsgStream::Parser parser(ss);
+	Holder holder(std::move(bin));
+	MsgStream::BasicParser parser(holder.source());
 
 	auto assertNotDone = [&] {
 		if (!parser.hasNext()) {
@@ -187,10 +315,11 @@ static void check(std::string bin, Json::Value &val, Stats &stats) {
 
 	auto assertIsDone = [&] {
 		if (parser.hasNext()) {
+			int next = holder.source().peek();
 			throw std::runtime_error(
 				std::string("There's trailing garbage: ") +
-				encodeHexChar(ss.peek() >> 4) +
-				encodeHexChar(ss.peek() & 0x0f));
+				encodeHexChar(next >> 4) +
+				encodeHexChar(next & 0x0f));
 		}
 	};
 
@@ -248,6 +377,31 @@ static void check(std::string bin, Json::Value &val, Stats &stats) {
 		assertArraysEqual(parser.nextArray(), val["array"]);
 	} else if (val.isMember("map")) {
 		assertMapsEqual(parser.nextMap(), val["map"]);
+	} else if (val.isMember("timestamp")) {
+		MsgStream::Timestamp expected{
+			val["timestamp"][0].asInt64(),
+			(uint32_t)val["timestamp"][1].asUInt()};
+		MsgStream::Timestamp actual = parser.nextTimestamp();
+		assertEqual(
+			actual.seconds, expected.seconds, "Incorrect timestamp seconds");
+		assertEqual(
+			actual.nanoseconds, expected.nanoseconds,
+			"Incorrect timestamp nanoseconds");
+		if (actual.seconds > -9'000'000'000 && actual.seconds < 9'000'000'000) {
+			assertEqual(
+				MsgStream::Timestamp::fromSysTime(actual.sysTime()) == actual,
+				true, "Timestamp doesn't survive sys_time conversion");
+		}
+
+		// The first encoding in the suite is the smallest one
+		MsgStream::BufferSink sink;
+		MsgStream::BufferSerializer serializer(sink);
+		serializer.writeTimestamp(actual);
+		assertEqual(
+			bytesToHex(std::string(
+				(const char *)sink.data().data(), sink.size())),
+			bytesToHex(hexToBytes(val["msgpack"][0].asCString())),
+			"Incorrect timestamp encoding");
 	} else if (val.isMember("ext")) {
 		auto expected = hexToBytes(val["ext"][1].asCString());
 		int64_t expectedType = val["ext"][0].asInt64();
@@ -276,7 +430,10 @@ static void check(std::string bin, Json::Value &val, Stats &stats) {
 	stats.numPassedChecks += 1;
 }
 
-static void roundtripValue(MsgStream::Parser &i, MsgStream::Serializer &o) {
+template<typename Source, typename Sink>
+static void roundtripValue(
+		MsgStream::BasicParser<Source> &i, MsgStream::BasicSerializer<Sink> &o,
+		bool deferred = false) {
 	using Type = MsgStream::Type;
 	switch (i.nextType()) {
 	case Type::INT:
@@ -299,128 +456,2247 @@ static void roundtripValue(MsgStream::Parser &i, MsgStream::Serializer &o) {
 		o.writeFloat64(i.nextFloat64());
 		break;
 	case Type::STRING:
-		o.writeString(i.nextString());
+		if constexpr (std::is_same_v<Source, MsgStream::SpanSource>) {
+			o.writeString(i.nextStringView());
+		} else {
+			o.writeString(i.nextString());
+		}
 		break;
 	case Type::BINARY:
-		o.writeBinary(i.nextBinary());
+		if constexpr (std::is_same_v<Source, MsgStream::SpanSource>) {
+			o.writeBinary(i.nextBinaryView());
+		} else {
+			o.writeBinary(i.nextBinary());
+		}
 		break;
 	case Type::ARRAY: {
 		auto ai = i.nextArray();
-		auto ao = o.beginArray(ai.arraySize());
-		while (ai.hasNext()) {
-			roundtripValue(ai, ao);
+		if (deferred) {
+			auto ao = o.beginArrayDeferred();
+			while (ai.hasNext()) {
+				roundtripValue(ai, ao, deferred);
+			}
+			o.endArray(ao);
+		} else if constexpr (std::is_same_v<Sink, MsgStream::BufferSink>) {
+			// Exercise in-place building, which must produce the same bytes
+			MsgStream::BufferArrayBuilder ao(o);
+			while (ai.hasNext()) {
+				roundtripValue(ai, ao);
+			}
+			o.writeArray(ao);
+		} else {
+			auto ao = o.beginArray(ai.arraySize());
+			while (ai.hasNext()) {
+				roundtripValue(ai, ao);
+			}
+			o.endArray(ao);
 		}
-		o.endArray(ao);
 	}
 		break;
 	case Type::MAP: {
 		auto mi = i.nextMap();
-		auto mo = o.beginMap(mi.mapSize());
-		std::string key;
-		while (mi.hasNext()) {
-			mi.nextString(key);
-			mo.writeString(key);
-			roundtripValue(mi, mo);
+		std::conditional_t<
+			std::is_same_v<Source, MsgStream::SpanSource>,
+			std::string_view, std::string> key;
+		if (deferred) {
+			auto mo = o.beginMapDeferred();
+			while (mi.nextKey(key)) {
+				mo.writeString(key);
+				roundtripValue(mi, mo, deferred);
+			}
+			o.endMap(mo);
+		} else if constexpr (std::is_same_v<Sink, MsgStream::BufferSink>) {
+			MsgStream::BufferMapBuilder mo(o);
+			while (mi.nextKey(key)) {
+				mo.writeString(key);
+				roundtripValue(mi, mo);
+			}
+			o.writeMap(mo);
+		} else {
+			auto mo = o.beginMap(mi.mapSize());
+			while (mi.nextKey(key)) {
+				mo.writeString(key);
+				roundtripValue(mi, mo);
+			}
+			o.endMap(mo);
 		}
-		o.endMap(mo);
 	}
 		break;
-	case Type::EXTENSION: {
-		std::vector<unsigned char> ext;
-		int64_t type = i.nextExtension(ext);
-		o.writeExtension(type, ext);
+	case Type::EXTENSION:
+		if constexpr (std::is_same_v<Source, MsgStream::SpanSource>) {
+			std::span<const unsigned char> ext;
+			int64_t type = i.nextExtensionView(ext);
+			o.writeExtension(type, ext);
+		} else {
+			std::vector<unsigned char> ext;
+			int64_t type = i.nextExtension(ext);
+			o.writeExtension(type, ext);
+		}
+		break;
+	}
+}
+
+// Like 'roundtripValue', but reading the input as a flat stream of tokens
+template<typename Source, typename Sink>
+static void roundtripTokens(
+		MsgStream::BasicParser<Source> &i, MsgStream::BasicSerializer<Sink> &o) {
+	using Type = MsgStream::Type;
+	MsgStream::Token token = i.nextToken();
+	switch (token.type) {
+	case Type::INT:
+		o.writeInt((int64_t)token.value);
+		break;
+	case Type::UINT:
+		o.writeUInt(token.value);
+		break;
+	case Type::NIL:
+		o.writeNil();
+		break;
+	case Type::BOOL:
+		o.writeBool(token.value != 0);
+		break;
+	case Type::FLOAT32:
+		o.writeFloat32((float)token.floatValue);
+		break;
+	case Type::FLOAT64:
+		o.writeFloat64(token.floatValue);
+		break;
+	case Type::STRING: {
+		std::string str;
+		i.nextPayload(str, token.length);
+		o.writeString(str);
+	}
+		break;
+	case Type::BINARY: {
+		std::vector<unsigned char> bin;
+		i.nextPayload(bin, token.length);
+		o.writeBinary(bin);
+	}
+		break;
+	case Type::ARRAY: {
+		auto ao = o.beginArray(token.length);
+		for (size_t n = 0; n < token.length; ++n) {
+			roundtripTokens(i, ao);
+		}
+		o.endArray(ao);
+	}
+		break;
+	case Type::MAP: {
+		auto mo = o.beginMap(token.length);
+		for (size_t n = 0; n < token.length * 2; ++n) {
+			roundtripTokens(i, mo);
+		}
+		o.endMap(mo);
 	}
 		break;
+	case Type::EXTENSION:
+		if constexpr (std::is_same_v<Source, MsgStream::SpanSource>) {
+			o.writeExtension(token.extensionType, i.nextPayloadView(token.length));
+		} else {
+			std::vector<unsigned char> ext;
+			i.nextPayload(ext, token.length);
+			o.writeExtension(token.extensionType, ext);
+		}
+		break;
 	}
 }
 
+template<typename Holder>
 static std::string roundtrip(std::string bin) {
-	std::stringstream is(std::move(bin));
+	Holder streamHolder(bin);
 	std::stringstream os;
+	MsgStream::BasicParser streamParser(streamHolder.source());
+	MsgStream::Serializer streamSerializer(os);
+	while (streamParser.hasNext()) {
+		roundtripValue(streamParser, streamSerializer);
+	}
+
+	// All sinks must produce exactly the same bytes
+	Holder bufferHolder(bin);
+	MsgStream::BufferSink sink;
+	MsgStream::BasicParser bufferParser(bufferHolder.source());
+	MsgStream::BufferSerializer bufferSerializer(sink);
+	while (bufferParser.hasNext()) {
+		roundtripValue(bufferParser, bufferSerializer);
+	}
+
+	Holder streambufHolder(bin);
+	std::stringbuf buf;
+	MsgStream::StreambufSink streambufSink(buf);
+	MsgStream::BasicParser streambufParser(streambufHolder.source());
+	MsgStream::BasicSerializer streambufSerializer(streambufSink);
+	while (streambufParser.hasNext()) {
+		roundtripValue(streambufParser, streambufSerializer);
+	}
+
+	// Tokens are read from inside an array, so that the parser's
+	// remaining value count has to account for nested containers
+	Holder tokenHolder("\x91" + bin);
+	std::stringstream tokenOs;
+	MsgStream::BasicParser tokenParser(tokenHolder.source());
+	auto tokenArray = tokenParser.nextArray();
+	MsgStream::Serializer tokenSerializer(tokenOs);
+	roundtripTokens(tokenArray, tokenSerializer);
+	if (tokenArray.hasNext()) {
+		throw std::runtime_error("Token parser has values left over");
+	}
+
+	std::string streamed = std::move(os).str();
+	std::string buffered((const char *)sink.data().data(), sink.size());
+	if (streamed != tokenOs.str()) {
+		throw std::runtime_error(
+			"Token roundtrip differs from ostream output: " +
+			bytesToHex(tokenOs.str()));
+	}
+
+	if (streamed != buffered) {
+		throw std::runtime_error(
+			"BufferSink output differs from ostream output: " +
+			bytesToHex(buffered));
+	}
 
-	MsgStream::Parser parser(is);
-	MsgStream::Serializer serializer(os);
+	if (streamed != buf.str()) {
+		throw std::runtime_error(
+			"StreambufSink output differs from ostream output: " +
+			bytesToHex(buf.str()));
+	}
+
+	return streamed;
+}
 
+// Roundtrip with all containers written with unknown lengths.
+// This produces different bytes (all container headers are 32-bit),
+// so the results are checked rather than compared.
+template<typename Holder, typename Sink>
+static void roundtripDeferred(std::string bin, Sink &sink) {
+	Holder holder(std::move(bin));
+	MsgStream::BasicParser parser(holder.source());
+	MsgStream::BasicSerializer<Sink> serializer(sink);
 	while (parser.hasNext()) {
-		roundtripValue(parser, serializer);
+		roundtripValue(parser, serializer, true);
 	}
+}
+
+template<typename Holder>
+static std::vector<std::string> roundtripDeferred(std::string bin) {
+	std::stringstream os;
+	roundtripDeferred<Holder, std::ostream>(bin, os);
+
+	std::stringbuf buf;
+	MsgStream::StreambufSink streambufSink(buf);
+	roundtripDeferred<Holder>(bin, streambufSink);
 
-	return std::move(os).str();
+	MsgStream::BufferSink bufferSink;
+	roundtripDeferred<Holder>(bin, bufferSink);
+
+	return {
+		std::move(os).str(),
+		std::move(buf).str(),
+		std::string(
+			(const char *)bufferSink.data().data(), bufferSink.size()),
+	};
 }
 
-static void runTest(Json::Value &val, Stats &stats) {
-	stats.numTotalTests += 1;
+// Walk a value with a parser and make sure the tape agrees about
+// the type, offset and extent of it and all its children.
+// Returns the index of the entry after the value.
+static size_t assertTapeMatches(
+		const MsgStream::Tape &tape, size_t index,
+		MsgStream::SpanSource &src, MsgStream::SpanParser &parser) {
+	if (index >= tape.size()) {
+		throw std::runtime_error("Tape has too few entries");
+	}
 
-	auto &msgpacks = val["msgpack"];
-	if (!msgpacks.isArray()) {
-		std::cout << "FAIL! Key 'msgpack' is not an array\n";
-		return;
+	auto &entry = tape[index];
+	size_t offset = src.position();
+	assertEqual<uint64_t>(entry.offset, offset, "Incorrect tape offset");
+	assertEqual(
+		(int)entry.type, (int)parser.nextType(), "Incorrect tape type");
+
+	size_t end = index + 1;
+	if (entry.type == MsgStream::Type::ARRAY) {
+		auto arr = parser.nextArray();
+		assertEqual<size_t>(
+			entry.length, arr.arraySize(), "Incorrect tape array size");
+		while (arr.hasNext()) {
+			end = assertTapeMatches(tape, end, src, arr);
+		}
+	} else if (entry.type == MsgStream::Type::MAP) {
+		auto map = parser.nextMap();
+		assertEqual<size_t>(
+			entry.length, map.mapSize(), "Incorrect tape map size");
+		while (map.hasNext()) {
+			end = assertTapeMatches(tape, end, src, map);
+		}
+	} else if (entry.type == MsgStream::Type::STRING) {
+		auto str = parser.nextStringView();
+		auto payload = tape.payload(index);
+		assertEqual<std::string_view>(
+			std::string_view((const char *)payload.data(), payload.size()),
+			str, "Incorrect tape string payload");
+	} else if (entry.type == MsgStream::Type::BINARY) {
+		auto bin = parser.nextBinaryView();
+		assertEqual(
+			(const void *)tape.payload(index).data(), (const void *)bin.data(),
+			"Incorrect tape binary payload");
+		assertEqual<size_t>(
+			entry.length, bin.size(), "Incorrect tape binary length");
+	} else if (entry.type == MsgStream::Type::EXTENSION) {
+		std::span<const unsigned char> ext;
+		parser.nextExtensionView(ext);
+		assertEqual(
+			(const void *)tape.payload(index).data(), (const void *)ext.data(),
+			"Incorrect tape extension payload");
+		assertEqual<size_t>(
+			entry.length, ext.size(), "Incorrect tape extension length");
+	} else {
+		parser.skipNext();
+	}
+
+	assertEqual<uint64_t>(entry.end, end, "Incorrect tape subtree end");
+	assertEqual(
+		tape.valueBytes(index).size(), src.position() - offset,
+		"Incorrect tape value size");
+	return end;
+}
+
+static void checkTape(const std::string &bin) {
+	MsgStream::Tape tape(bin);
+	MsgStream::SpanSource src(bin);
+	MsgStream::SpanParser parser(src);
+
+	size_t index = 0;
+	while (parser.hasNext()) {
+		index = assertTapeMatches(tape, index, src, parser);
+	}
+
+	assertEqual(index, tape.size(), "Tape has too many entries");
+
+	// Skipping top-level values should land on the same boundaries
+	// as the tape's subtree ends
+	MsgStream::SpanSource skipSrc(bin);
+	MsgStream::SpanParser skipParser(skipSrc);
+	std::stringstream ss(bin);
+	MsgStream::Parser streamParser(ss);
+	index = 0;
+	while (skipParser.hasNext()) {
+		size_t begin = skipSrc.position();
+		size_t size = MsgStream::detail::valueSize(
+			(const unsigned char *)bin.data() + begin, bin.size() - begin);
+		skipParser.skipNext();
+		assertEqual(size, skipSrc.position() - begin, "Incorrect value size");
+		assertEqual(
+			MsgStream::detail::valueSize(
+				(const unsigned char *)bin.data() + begin, size - 1),
+			(size_t)0, "Truncated value has a size");
+		streamParser.skipNext();
+		index = tape[index].end;
+		size_t expected = index < tape.size() ? tape[index].offset : bin.size();
+		assertEqual(skipSrc.position(), expected, "Incorrect skip position");
+		assertEqual<size_t>(
+			ss.tellg(), expected, "Incorrect skip position (istream)");
+	}
+}
+
+// Compare a view against a JSON value using only random access
+static void assertViewEqual(const MsgStream::MsgView &view, Json::Value &val) {
+	using Type = MsgStream::Type;
+	switch (view.type()) {
+	case Type::INT:
+		assertEqual(view.asInt(), val.asInt64(), "Invalid int value");
+		break;
+	case Type::UINT:
+		assertEqual(view.asUInt(), val.asUInt64(), "Invalid uint value");
+		break;
+	case Type::NIL:
+		if (!val.isNull()) {
+			throw std::runtime_error("Invalid value: Expected non-null");
+		}
+		break;
+	case Type::BOOL:
+		assertEqual(view.asBool(), val.asBool(), "Invalid value");
+		break;
+	case Type::FLOAT32:
+	case Type::FLOAT64:
+		assertEqual(view.asFloat64(), val.asDouble(), "Invalid value");
+		break;
+	case Type::STRING:
+		assertEqual<std::string_view>(
+			view.asString(), val.asString(), "Invalid value");
+		break;
+	case Type::ARRAY:
+		if (!val.isArray()) {
+			throw std::runtime_error("Invalid value: Expected non-array");
+		}
+
+		assertEqual<size_t>(view.size(), val.size(), "Invalid array size");
+
+		// Walk backwards, so that the last lookup finds all the children
+		// and the rest are served from the memoized offsets
+		for (size_t i = view.size(); i > 0; --i) {
+			assertViewEqual(view[i - 1], val[(Json::ArrayIndex)(i - 1)]);
+		}
+		break;
+	case Type::MAP:
+		if (!val.isObject()) {
+			throw std::runtime_error("Invalid value: Expected non-object");
+		}
+
+		assertEqual<size_t>(view.size(), val.size(), "Invalid map size");
+		for (size_t i = 0; i < view.size(); ++i) {
+			std::string key(view.keyAt(i));
+			if (!val.isMember(key)) {
+				throw std::runtime_error(
+					"Invalid value: Unexpected object key '" + key + "'");
+			}
+
+			assertViewEqual(view[key], val[key]);
+		}
+
+		if (view.find("this key doesn't exist")) {
+			throw std::runtime_error("Invalid value: Found a nonexistent key");
+		}
+		break;
+	case Type::BINARY:
+	case Type::EXTENSION:
+		throw std::runtime_error(
+			"Invalid value: Got binary or extension "
+			"when comparing against JSON object");
+	}
+}
+
+static void checkView(const std::string &bin, Json::Value &val) {
+	MsgStream::MsgView view(bin);
+	assertEqual(view.bytes().size(), bin.size(), "Incorrect view size");
+
+	if (val.isMember("nil")) {
+		assertEqual(view.isNil(), true, "Incorrect nil value");
+	} else if (val.isMember("bool")) {
+		assertEqual(view.asBool(), val["bool"].asBool(), "Incorrect boolean value");
+	} else if (val.isMember("binary")) {
+		auto expected = hexToBytes(val["binary"].asCString());
+		auto actual = view.asBinary();
+		assertEqual<std::string_view>(
+			std::string_view((const char *)actual.data(), actual.size()),
+			expected, "Incorrect binary");
+	} else if (val.isMember("number") || val.isMember("bignum")) {
+		Json::Value num;
+		if (val.isMember("number")) {
+			num = val["number"];
+		} else {
+			std::stringstream{val["bignum"].asString()} >> num;
+		}
+
+		assertViewEqual(view, num);
+	} else if (val.isMember("string")) {
+		assertViewEqual(view, val["string"]);
+	} else if (val.isMember("array")) {
+		assertViewEqual(view, val["array"]);
+	} else if (val.isMember("map")) {
+		assertViewEqual(view, val["map"]);
+	} else if (val.isMember("timestamp")) {
+		MsgStream::Timestamp ts = view.asTimestamp();
+		assertEqual(
+			ts.seconds, val["timestamp"][0].asInt64(),
+			"Incorrect timestamp seconds");
+		assertEqual(
+			ts.nanoseconds, (uint32_t)val["timestamp"][1].asUInt(),
+			"Incorrect timestamp nanoseconds");
+	} else if (val.isMember("ext")) {
+		auto expected = hexToBytes(val["ext"][1].asCString());
+		std::span<const unsigned char> actual;
+		assertEqual(
+			view.asExtension(actual), val["ext"][0].asInt64(),
+			"Incorrect extension: types differ");
+		assertEqual<std::string_view>(
+			std::string_view((const char *)actual.data(), actual.size()),
+			expected, "Incorrect extension: values differ");
 	}
+}
 
+static bool runRandomAccessChecks(Json::Value &val, Stats &stats) {
+	auto &msgpacks = val["msgpack"];
 	for (Json::ArrayIndex i = 0; i < msgpacks.size(); ++i) {
 		auto &msgpackHex = msgpacks[i];
 		std::string bin = hexToBytes(msgpackHex.asCString());
 
-		try {
-			check(bin, val, stats);
-		} catch (std::exception &ex) {
-			std::cout
-				<< "FAIL! Check " << (i + 1) << '/' << msgpacks.size() << '\n'
-				<< "   -- Err: " << ex.what() << '\n'
-				<< "   -- msgpack: " << bytesToHex(bin) << '\n'
-				<< '\n';
-			return;
-		}
-
-		std::string roundtripped;
-		try {
-			roundtripped = roundtrip(bin);
-		} catch (std::exception &ex) {
-			std::cout
-				<< "FAIL! Check " << (i + 1) << '/' << msgpacks.size() << '\n'
-				<< "   -- Roundtrip err: " << ex.what() << '\n'
-				<< "   -- msgpack: " << bytesToHex(bin) << '\n'
-				<< '\n';
-			return;
+		// Repeating the value makes long runs of top-level values,
+		// which exercises the fixint run scanning
+		std::string repeated;
+		for (int n = 0; n < 40; ++n) {
+			repeated += bin;
 		}
 
+		stats.numTotalChecks += 1;
 		try {
-			check(roundtripped, val, stats);
+			checkTape(bin);
+			checkTape(repeated);
+			checkView(bin, val);
 		} catch (std::exception &ex) {
 			std::cout
 				<< "FAIL! Check " << (i + 1) << '/' << msgpacks.size()
-				<< " (roundtripped)\n"
+				<< " (random access)\n"
 				<< "   -- Err: " << ex.what() << '\n'
-				<< "   -- Old msgpack: " << bytesToHex(bin) << '\n'
-				<< "   -- New msgpack: " << bytesToHex(roundtripped) << '\n'
+				<< "   -- msgpack: " << bytesToHex(bin) << '\n'
 				<< '\n';
-			return;
+			return false;
 		}
 
+		stats.numPassedChecks += 1;
 	}
 
-	std::cout << "OK!\n";
-	stats.numPassedTests += 1;
-	return;
+	return true;
 }
 
-int main(int argc, char **argv) {
-	if (argc != 2) {
-		std::cerr << "Usage: " << argv[0] << " <test json>\n";
-		return 1;
+// Records the push parser's events as text
+struct TraceHandler: MsgStream::PushHandler {
+	std::string trace;
+
+	void onNil() { trace += "nil "; }
+	void onBool(bool b) { trace += b ? "true " : "false "; }
+	void onInt(int64_t num) { trace += "i" + std::to_string(num) + ' '; }
+	void onUInt(uint64_t num) { trace += "u" + std::to_string(num) + ' '; }
+	void onFloat32(float num) { trace += "f" + std::to_string(num) + ' '; }
+	void onFloat64(double num) { trace += "d" + std::to_string(num) + ' '; }
+
+	void onString(std::string_view str) {
+		trace += "s:" + bytesToHex(str) + ' ';
 	}
 
-	std::ifstream is(argv[1]);
-	if (!is) {
-		std::cerr << "Failed to open " << argv[1] << '\n';
-		return 1;
+	void onBinary(std::span<const unsigned char> bin) {
+		trace += "b:" + bytesToHex(
+			std::string_view((const char *)bin.data(), bin.size())) + ' ';
 	}
 
-	Json::Value groups;
-	is >> groups;
-	is.close();
+	void onExtension(int64_t type, std::span<const unsigned char> ext) {
+		trace += "x" + std::to_string(type) + ':' + bytesToHex(
+			std::string_view((const char *)ext.data(), ext.size())) + ' ';
+	}
 
-	Stats stats;
+	void onArrayBegin(size_t n) { trace += '[' + std::to_string(n) + ' '; }
+	void onArrayEnd() { trace += "] "; }
+	void onMapBegin(size_t n) { trace += '{' + std::to_string(n) + ' '; }
+	void onMapEnd() { trace += "} "; }
+	void onComplete() { trace += "; "; }
+};
+
+// Produces the same trace as TraceHandler, by walking a value with a parser
+static void traceValue(MsgStream::SpanParser &parser, TraceHandler &out) {
+	using Type = MsgStream::Type;
+	switch (parser.nextType()) {
+	case Type::NIL:
+		parser.skipNil();
+		out.onNil();
+		break;
+	case Type::BOOL:
+		out.onBool(parser.nextBool());
+		break;
+	case Type::INT:
+		out.onInt(parser.nextInt());
+		break;
+	case Type::UINT:
+		out.onUInt(parser.nextUInt());
+		break;
+	case Type::FLOAT32:
+		out.onFloat32(parser.nextFloat32());
+		break;
+	case Type::FLOAT64:
+		out.onFloat64(parser.nextFloat64());
+		break;
+	case Type::STRING:
+		out.onString(parser.nextStringView());
+		break;
+	case Type::BINARY:
+		out.onBinary(parser.nextBinaryView());
+		break;
+	case Type::EXTENSION: {
+		std::span<const unsigned char> ext;
+		int64_t type = parser.nextExtensionView(ext);
+		out.onExtension(type, ext);
+	}
+		break;
+	case Type::ARRAY: {
+		auto arr = parser.nextArray();
+		out.onArrayBegin(arr.arraySize());
+		while (arr.hasNext()) {
+			traceValue(arr, out);
+		}
+		out.onArrayEnd();
+	}
+		break;
+	case Type::MAP: {
+		auto map = parser.nextMap();
+		out.onMapBegin(map.mapSize());
+		while (map.hasNext()) {
+			traceValue(map, out);
+		}
+		out.onMapEnd();
+	}
+		break;
+	}
+}
+
+// Feed 'bin' to a push parser in pieces of 'chunk' bytes,
+// and check that it produces the same events as the pull parser
+static void checkPush(const std::string &bin, const std::string &expected) {
+	for (size_t chunk: {(size_t)1, (size_t)2, (size_t)3, (size_t)7, bin.size()}) {
+		TraceHandler handler;
+		MsgStream::PushParser parser(handler);
+		for (size_t pos = 0; pos < bin.size(); pos += chunk) {
+			parser.feed(std::string_view(bin).substr(pos, chunk));
+		}
+
+		parser.finish();
+		assertEqual(handler.trace, expected, "Incorrect push parser events");
+	}
+}
+
+// Feed all but the last byte of a multi-byte value,
+// which must leave the push parser in the middle of the value
+static void checkPushTruncated(const std::string &bin) {
+	if (bin.size() < 2) {
+		return;
+	}
+
+	TraceHandler handler;
+	MsgStream::PushParser parser(handler);
+	parser.feed(std::string_view(bin).substr(0, bin.size() - 1));
+	assertEqual(parser.atBoundary(), false, "Truncated input completed");
+	assertEqual(
+		handler.trace.find(';') == std::string::npos, true,
+		"Truncated input completed");
+}
+
+static bool runPushChecks(Json::Value &val, Stats &stats) {
+	auto &msgpacks = val["msgpack"];
+	for (Json::ArrayIndex i = 0; i < msgpacks.size(); ++i) {
+		auto &msgpackHex = msgpacks[i];
+		std::string bin = hexToBytes(msgpackHex.asCString());
+
+		stats.numTotalChecks += 1;
+		try {
+			TraceHandler expected;
+			MsgStream::SpanSource src(bin);
+			MsgStream::SpanParser parser(src);
+			traceValue(parser, expected);
+			expected.onComplete();
+
+			checkPush(bin, expected.trace);
+			checkPush(bin + bin + bin, expected.trace + expected.trace + expected.trace);
+			checkPushTruncated(bin);
+		} catch (std::exception &ex) {
+			std::cout
+				<< "FAIL! Check " << (i + 1) << '/' << msgpacks.size()
+				<< " (push parser)\n"
+				<< "   -- Err: " << ex.what() << '\n'
+				<< "   -- msgpack: " << bytesToHex(bin) << '\n'
+				<< '\n';
+			return false;
+		}
+
+		stats.numPassedChecks += 1;
+	}
+
+	return true;
+}
+
+using AsyncParser = MsgStream::BasicAsyncParser<MsgStream::AsyncPipe>;
+
+// Produces the same trace as TraceHandler, with an async parser.
+// Results of 'co_await' are assigned to variables before they're tested,
+// which GCC 12 needs.
+static MsgStream::Task<void> traceAsync(AsyncParser &parser, TraceHandler &out) {
+	using Type = MsgStream::Type;
+	Type type = co_await parser.nextType();
+	switch (type) {
+	case Type::NIL:
+		co_await parser.skipNil();
+		out.onNil();
+		break;
+	case Type::BOOL:
+		out.onBool(co_await parser.nextBool());
+		break;
+	case Type::INT:
+		out.onInt(co_await parser.nextInt());
+		break;
+	case Type::UINT:
+		out.onUInt(co_await parser.nextUInt());
+		break;
+	case Type::FLOAT32:
+		out.onFloat32(co_await parser.nextFloat32());
+		break;
+	case Type::FLOAT64:
+		out.onFloat64(co_await parser.nextFloat64());
+		break;
+	case Type::STRING:
+		out.onString(co_await parser.nextString());
+		break;
+	case Type::BINARY:
+		out.onBinary(co_await parser.nextBinary());
+		break;
+	case Type::EXTENSION: {
+		std::vector<unsigned char> ext;
+		int64_t extType = co_await parser.nextExtension(ext);
+		out.onExtension(extType, ext);
+	}
+		break;
+	case Type::ARRAY: {
+		auto arr = co_await parser.nextArray();
+		out.onArrayBegin(arr.arraySize());
+		for (;;) {
+			bool more = co_await arr.hasNext();
+			if (!more) {
+				break;
+			}
+
+			co_await traceAsync(arr, out);
+		}
+		out.onArrayEnd();
+	}
+		break;
+	case Type::MAP: {
+		auto map = co_await parser.nextMap();
+		out.onMapBegin(map.mapSize());
+		for (;;) {
+			bool more = co_await map.hasNext();
+			if (!more) {
+				break;
+			}
+
+			co_await traceAsync(map, out);
+		}
+		out.onMapEnd();
+	}
+		break;
+	}
+}
+
+static MsgStream::Task<void> traceAllAsync(
+		MsgStream::AsyncPipe &pipe, TraceHandler &out) {
+	// A small buffer, so that values straddle refills
+	MsgStream::AsyncParser<MsgStream::AsyncPipe> parser(pipe, 16);
+	for (;;) {
+		bool more = co_await parser.hasNext();
+		if (!more) {
+			break;
+		}
+
+		co_await traceAsync(parser, out);
+		out.onComplete();
+	}
+}
+
+// Write 'bin' to a pipe in pieces of 'chunk' bytes while an async parser
+// reads from it, and check that it produces the same trace as the pull parser
+static void checkAsync(const std::string &bin, const std::string &expected) {
+	for (size_t chunk: {(size_t)1, (size_t)3, bin.size()}) {
+		MsgStream::AsyncPipe pipe;
+		TraceHandler handler;
+		MsgStream::Task<void> task = traceAllAsync(pipe, handler);
+		task.start();
+		for (size_t pos = 0; pos < bin.size(); pos += chunk) {
+			// The pipe only holds so much, but each write lets the parser
+			// read what it can, unless it has stopped
+			std::string_view piece = std::string_view(bin).substr(pos, chunk);
+			while (!piece.empty() && !task.done()) {
+				piece.remove_prefix(pipe.writeSome(piece.data(), piece.size()));
+			}
+		}
+
+		pipe.close();
+		assertEqual(task.done(), true, "Async parser didn't finish");
+		task.result();
+		assertEqual(handler.trace, expected, "Incorrect async parser values");
+	}
+}
+
+static bool runAsyncChecks(Json::Value &val, Stats &stats) {
+	auto &msgpacks = val["msgpack"];
+	for (Json::ArrayIndex i = 0; i < msgpacks.size(); ++i) {
+		auto &msgpackHex = msgpacks[i];
+		std::string bin = hexToBytes(msgpackHex.asCString());
+
+		stats.numTotalChecks += 1;
+		try {
+			TraceHandler expected;
+			MsgStream::SpanSource src(bin);
+			MsgStream::SpanParser parser(src);
+			traceValue(parser, expected);
+			expected.onComplete();
+
+			checkAsync(bin, expected.trace);
+			checkAsync(bin + bin + bin, expected.trace + expected.trace + expected.trace);
+		} catch (std::exception &ex) {
+			std::cout
+				<< "FAIL! Check " << (i + 1) << '/' << msgpacks.size()
+				<< " (async parser)\n"
+				<< "   -- Err: " << ex.what() << '\n'
+				<< "   -- msgpack: " << bytesToHex(bin) << '\n'
+				<< '\n';
+			return false;
+		}
+
+		stats.numPassedChecks += 1;
+	}
+
+	return true;
+}
+
+template<typename Holder>
+static bool runChecks(Json::Value &val, Stats &stats) {
+	auto &msgpacks = val["msgpack"];
+	for (Json::ArrayIndex i = 0; i < msgpacks.size(); ++i) {
+		auto &msgpackHex = msgpacks[i];
+		std::string bin = hexToBytes(msgpackHex.asCString());
+
+		try {
+			check<Holder>(bin, val, stats);
+		} catch (std::exception &ex) {
+			std::cout
+				<< "FAIL! Check " << (i + 1) << '/' << msgpacks.size() << '\n'
+				<< "   -- Err: " << ex.what() << '\n'
+				<< "   -- msgpack: " << bytesToHex(bin) << '\n'
+				<< '\n';
+			return false;
+		}
+
+		std::string roundtripped;
+		try {
+			roundtripped = roundtrip<Holder>(bin);
+		} catch (std::exception &ex) {
+			std::cout
+				<< "FAIL! Check " << (i + 1) << '/' << msgpacks.size() << '\n'
+				<< "   -- Roundtrip err: " << ex.what() << '\n'
+				<< "   -- msgpack: " << bytesToHex(bin) << '\n'
+				<< '\n';
+			return false;
+		}
+
+		try {
+			check<Holder>(roundtripped, val, stats);
+		} catch (std::exception &ex) {
+			std::cout
+				<< "FAIL! Check " << (i + 1) << '/' << msgpacks.size()
+				<< " (roundtripped)\n"
+				<< "   -- Err: " << ex.what() << '\n'
+				<< "   -- Old msgpack: " << bytesToHex(bin) << '\n'
+				<< "   -- New msgpack: " << bytesToHex(roundtripped) << '\n'
+				<< '\n';
+			return false;
+		}
+
+		try {
+			for (auto &deferred: roundtripDeferred<Holder>(bin)) {
+				roundtripped = std::move(deferred);
+				check<Holder>(roundtripped, val, stats);
+			}
+		} catch (std::exception &ex) {
+			std::cout
+				<< "FAIL! Check " << (i + 1) << '/' << msgpacks.size()
+				<< " (roundtripped with deferred lengths)\n"
+				<< "   -- Err: " << ex.what() << '\n'
+				<< "   -- Old msgpack: " << bytesToHex(bin) << '\n'
+				<< "   -- New msgpack: " << bytesToHex(roundtripped) << '\n'
+				<< '\n';
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void runTest(Json::Value &val, Stats &stats) {
+	stats.numTotalTests += 1;
+
+	if (!val["msgpack"].isArray()) {
+		std::cout << "FAIL! Key 'msgpack' is not an array\n";
+		return;
+	}
+
+	if (!runChecks<StreamSourceHolder>(val, stats)) {
+		return;
+	}
+
+	if (!runChecks<SpanSourceHolder>(val, stats)) {
+		return;
+	}
+
+	if (!runChecks<StreambufSourceHolder>(val, stats)) {
+		return;
+	}
+
+	if (!runChecks<TrickleSourceHolder>(val, stats)) {
+		return;
+	}
+
+	if (!runChecks<FdSourceHolder>(val, stats)) {
+		return;
+	}
+
+	if (!runChecks<MappedFileSourceHolder>(val, stats)) {
+		return;
+	}
+
+	if (!runRandomAccessChecks(val, stats)) {
+		return;
+	}
+
+	if (!runPushChecks(val, stats)) {
+		return;
+	}
+
+	if (!runAsyncChecks(val, stats)) {
+		return;
+	}
+
+	std::cout << "OK!\n";
+	stats.numPassedTests += 1;
+	return;
+}
+
+// Deeply nested input must be skipped without exhausting the stack
+static void runDeepNestingTest(Stats &stats) {
+	stats.numTotalTests += 1;
+	std::cout << "deep nesting: " << std::flush;
+
+	std::string bin(10'000'000, '\x91');
+	bin += '\xc0';
+
+	try {
+		MsgStream::SpanSource src(bin);
+		MsgStream::SpanParser parser(src);
+		parser.skipNext();
+		assertEqual(src.position(), bin.size(), "Incorrect skip position");
+
+		MsgStream::SpanSource truncatedSrc(
+			std::string_view(bin).substr(0, bin.size() - 1));
+		MsgStream::SpanParser truncated(truncatedSrc);
+		try {
+			truncated.skipNext();
+			throw std::runtime_error("Truncated input was skipped");
+		} catch (MsgStream::ParseError &) {}
+	} catch (std::exception &ex) {
+		std::cout << "FAIL!\n   -- Err: " << ex.what() << '\n';
+		return;
+	}
+
+	std::cout << "OK!\n";
+	stats.numPassedTests += 1;
+}
+
+static std::string sinkString(MsgStream::BufferSink &sink) {
+	return std::string((const char *)sink.data().data(), sink.size());
+}
+
+struct BoundPoint {
+	int x = 0;
+	int y = 0;
+
+	using MsgStreamFields = MsgStream::FieldList<
+		MsgStream::Field<"x", &BoundPoint::x>,
+		MsgStream::Field<"y", &BoundPoint::y>>;
+};
+
+struct BoundShape {
+	std::string name;
+	uint32_t id = 0;
+	bool visible = false;
+	double scale = 0;
+	float opacity = 0;
+	std::vector<BoundPoint> points;
+	std::optional<BoundPoint> origin;
+	std::vector<unsigned char> data;
+	std::string description;
+};
+
+template<>
+struct MsgStream::Fields<BoundShape> {
+	using Type = MsgStream::FieldList<
+		MsgStream::Field<"name", &BoundShape::name>,
+		MsgStream::Field<"id", &BoundShape::id>,
+		MsgStream::Field<"visible", &BoundShape::visible>,
+		MsgStream::Field<"scale", &BoundShape::scale>,
+		MsgStream::Field<"opacity", &BoundShape::opacity>,
+		MsgStream::Field<"points", &BoundShape::points>,
+		MsgStream::Field<"origin", &BoundShape::origin>,
+		MsgStream::Field<"data", &BoundShape::data>,
+		MsgStream::Field<
+			"a rather long field name which needs a str8 header",
+			&BoundShape::description>>;
+};
+
+struct BoundNarrow {
+	int16_t small = 0;
+	uint8_t byte = 0;
+	int64_t big = 0;
+	uint64_t ubig = 0;
+
+	using MsgStreamFields = MsgStream::FieldList<
+		MsgStream::Field<"small", &BoundNarrow::small>,
+		MsgStream::Field<"byte", &BoundNarrow::byte>,
+		MsgStream::Field<"big", &BoundNarrow::big>,
+		MsgStream::Field<"ubig", &BoundNarrow::ubig>>;
+};
+
+// A map with the one field 'key', whose value is written by 'write'
+template<typename Write>
+static std::string narrowField(const char *key, Write write) {
+	MsgStream::BufferSink sink;
+	MsgStream::BufferSerializer serializer(sink);
+	auto map = serializer.beginMap(1);
+	map.writeString(key);
+	write(map);
+	serializer.endMap(map);
+	return std::string((const char *)sink.data().data(), sink.size());
+}
+
+// Reading 'bin' into a BoundNarrow must fail with INVALID_VALUE,
+// both by throwing and by setting the status
+static void expectNarrowError(const std::string &bin) {
+	MsgStream::SpanSource src(bin);
+	MsgStream::SpanParser parser(src);
+	BoundNarrow narrow;
+	try {
+		MsgStream::deserialize(parser, narrow);
+		throw std::runtime_error("Out of range integer was narrowed");
+	} catch (MsgStream::ParseError &err) {
+		assertEqual(
+			(int)err.code(), (int)MsgStream::ErrorCode::INVALID_VALUE,
+			"Incorrect out of range error");
+	}
+
+	MsgStream::ParseStatus status;
+	MsgStream::SpanSource statusSrc(bin);
+	MsgStream::SpanStatusParser statusParser(statusSrc, status);
+	MsgStream::deserialize(statusParser, narrow);
+	assertEqual(
+		(int)status.code, (int)MsgStream::ErrorCode::INVALID_VALUE,
+		"Incorrect out of range status");
+}
+
+static void assertShapesEqual(const BoundShape &a, const BoundShape &b) {
+	assertEqual(a.name, b.name, "Mismatched name");
+	assertEqual(a.id, b.id, "Mismatched id");
+	assertEqual(a.visible, b.visible, "Mismatched visible");
+	assertEqual(a.scale, b.scale, "Mismatched scale");
+	assertEqual(a.opacity, b.opacity, "Mismatched opacity");
+	assertEqual(a.points.size(), b.points.size(), "Mismatched point count");
+	for (size_t i = 0; i < a.points.size(); ++i) {
+		assertEqual(a.points[i].x, b.points[i].x, "Mismatched point x");
+		assertEqual(a.points[i].y, b.points[i].y, "Mismatched point y");
+	}
+	assertEqual(a.origin.has_value(), b.origin.has_value(), "Mismatched origin");
+	if (a.origin) {
+		assertEqual(a.origin->x, b.origin->x, "Mismatched origin x");
+	}
+	assertEqual(
+		std::string(a.data.begin(), a.data.end()),
+		std::string(b.data.begin(), b.data.end()), "Mismatched data");
+	assertEqual(a.description, b.description, "Mismatched description");
+}
+
+template<typename Parser>
+static BoundShape deserializeShape(Parser &parser) {
+	BoundShape shape;
+	MsgStream::deserialize(parser, shape);
+	if (parser.hasNext()) {
+		throw std::runtime_error("Trailing data after bound struct");
+	}
+	return shape;
+}
+
+static void runBindingTest(Stats &stats) {
+	stats.numTotalTests += 1;
+	std::cout << "struct binding: " << std::flush;
+
+	try {
+		BoundShape shape;
+		shape.name = "triangle";
+		shape.id = 70000;
+		shape.visible = true;
+		shape.scale = 1.5;
+		shape.opacity = 0.25f;
+		shape.points = {{1, 2}, {-3, 4}, {5, -600}};
+		shape.origin = BoundPoint{7, 8};
+		shape.data = {0x00, 0xff, 0x10};
+		shape.description = "described";
+
+		// Encoding must be identical to writing the map by hand
+		MsgStream::BufferSink sink;
+		MsgStream::BufferSerializer serializer(sink);
+		MsgStream::serialize(serializer, shape);
+
+		MsgStream::BufferSink expectedSink;
+		MsgStream::BufferSerializer expected(expectedSink);
+		auto map = expected.beginMap(2);
+		map.writeString("x");
+		map.writeInt(-1);
+		map.writeString("y");
+		map.writeInt(300);
+		expected.endMap(map);
+
+		MsgStream::BufferSink pointSink;
+		MsgStream::BufferSerializer pointSerializer(pointSink);
+		MsgStream::serialize(pointSerializer, BoundPoint{-1, 300});
+		assertEqual(
+			sinkString(pointSink),
+			sinkString(expectedSink),
+			"Bound struct encoded differently");
+
+		std::string bin(sinkString(sink));
+		MsgStream::SpanSource src(bin);
+		MsgStream::SpanParser spanParser(src);
+		assertShapesEqual(deserializeShape(spanParser), shape);
+
+		std::stringstream ss(bin);
+		MsgStream::Parser streamParser(ss);
+		assertShapesEqual(deserializeShape(streamParser), shape);
+
+		// Unknown keys, including non-string and overlong ones, are skipped,
+		// and missing fields keep their values
+		MsgStream::BufferSink unknownSink;
+		MsgStream::BufferSerializer unknown(unknownSink);
+		auto unknownMap = unknown.beginMap(6);
+		unknownMap.writeString("unknown");
+		auto arr = unknownMap.beginArray(2);
+		arr.writeInt(1);
+		arr.writeString("nested");
+		unknownMap.endArray(arr);
+		unknownMap.writeInt(5);
+		unknownMap.writeString("not a key");
+		unknownMap.writeString("name");
+		unknownMap.writeString("square");
+		unknownMap.writeString("a key much longer than any of the field names here");
+		unknownMap.writeNil();
+		unknownMap.writeString("origin");
+		unknownMap.writeNil();
+		unknownMap.writeString("nam");
+		unknownMap.writeBool(true);
+		unknown.endMap(unknownMap);
+
+		std::string unknownBin(sinkString(unknownSink));
+		for (int i = 0; i < 2; ++i) {
+			BoundShape partial = shape;
+			partial.name = "square";
+			partial.origin.reset();
+
+			BoundShape parsed = shape;
+			if (i == 0) {
+				MsgStream::SpanSource unknownSrc(unknownBin);
+				MsgStream::SpanParser parser(unknownSrc);
+				MsgStream::deserialize(parser, parsed);
+				assertEqual(parser.hasNext(), false, "Trailing data");
+			} else {
+				std::stringstream unknownSS(unknownBin);
+				MsgStream::Parser parser(unknownSS);
+				MsgStream::deserialize(parser, parsed);
+				assertEqual(parser.hasNext(), false, "Trailing data");
+			}
+			assertShapesEqual(parsed, partial);
+		}
+
+		// Integers are read into narrower fields only if they fit
+		BoundNarrow narrow;
+		narrow.small = -32768;
+		narrow.byte = 255;
+		narrow.big = INT64_MIN;
+		narrow.ubig = UINT64_MAX;
+		MsgStream::BufferSink narrowSink;
+		MsgStream::BufferSerializer narrowSerializer(narrowSink);
+		MsgStream::serialize(narrowSerializer, narrow);
+		std::string narrowBin(sinkString(narrowSink));
+		MsgStream::SpanSource narrowSrc(narrowBin);
+		MsgStream::SpanParser narrowParser(narrowSrc);
+		BoundNarrow parsedNarrow;
+		MsgStream::deserialize(narrowParser, parsedNarrow);
+		assertEqual(parsedNarrow.small, narrow.small, "Mismatched small");
+		assertEqual((int)parsedNarrow.byte, (int)narrow.byte, "Mismatched byte");
+		assertEqual(parsedNarrow.big, narrow.big, "Mismatched big");
+		assertEqual(parsedNarrow.ubig, narrow.ubig, "Mismatched ubig");
+
+		expectNarrowError(narrowField("small", [](auto &s) { s.writeInt(70000); }));
+		expectNarrowError(narrowField("small", [](auto &s) { s.writeInt(-32769); }));
+		expectNarrowError(narrowField("byte", [](auto &s) { s.writeUInt(300); }));
+		expectNarrowError(narrowField("byte", [](auto &s) { s.writeInt(-1); }));
+		expectNarrowError(narrowField("big", [](auto &s) {
+			s.writeUInt((uint64_t)INT64_MAX + 1);
+		}));
+		expectNarrowError(narrowField("ubig", [](auto &s) { s.writeInt(-1); }));
+	} catch (std::exception &ex) {
+		std::cout << "FAIL!\n   -- Err: " << ex.what() << '\n';
+		return;
+	}
+
+	std::cout << "OK!\n";
+	stats.numPassedTests += 1;
+}
+
+template<typename Source>
+static void checkKeyIndices(
+		MsgStream::BasicParser<Source> &parser,
+		const MsgStream::KeyMatcher &matcher,
+		const std::vector<size_t> &expected) {
+	MsgStream::BasicMapParser<Source> map = parser.nextMap();
+	size_t index;
+	for (size_t want: expected) {
+		if (!map.nextKeyIndex(matcher, index)) {
+			throw std::runtime_error("Map ended early");
+		}
+		assertEqual(index, want, "Incorrect key index");
+		map.skipNext();
+	}
+
+	assertEqual(map.nextKeyIndex(matcher, index), false, "Map didn't end");
+	assertEqual(parser.hasNext(), false, "Trailing data");
+}
+
+static void runKeyMatcherTest(Stats &stats) {
+	stats.numTotalTests += 1;
+	std::cout << "key matcher: " << std::flush;
+
+	try {
+		std::vector<std::string> keys = {
+			"", "a", "b", "ab", "ba", "abc", "abcd", "abce", "abcdefgh",
+			"abcdefghi", "abcdefgi", "userId", "userIds", "created_at",
+			"updated_at", std::string(64, 'x'), std::string(65, 'x'),
+			std::string(100, 'y') + "z", std::string(100, 'y') + "w",
+		};
+		for (int i = 0; i < 40; ++i) {
+			keys.push_back("field_" + std::to_string(i));
+		}
+
+		std::vector<std::string_view> views(keys.begin(), keys.end());
+		MsgStream::KeyMatcher matcher(views);
+		assertEqual(matcher.size(), keys.size(), "Incorrect matcher size");
+		for (size_t i = 0; i < keys.size(); ++i) {
+			assertEqual(matcher.find(keys[i]), i, "Key not found");
+		}
+
+		for (std::string key: std::vector<std::string>{
+				"c", "abcde", "abcdefgj", "field_40", "Field_1", "userI",
+				std::string(63, 'x'), std::string(66, 'x'),
+				std::string(100, 'y') + "x", std::string(200, 'z')}) {
+			assertEqual(
+				matcher.find(key), MsgStream::KeyMatcher::UNKNOWN,
+				"Unknown key found");
+		}
+
+		// A larger set, so that some buckets get several keys
+		std::vector<std::string> many;
+		for (int i = 0; i < 5000; ++i) {
+			many.push_back("k" + std::to_string(i * 7919));
+		}
+		std::vector<std::string_view> manyViews(many.begin(), many.end());
+		MsgStream::KeyMatcher manyMatcher(manyViews);
+		for (size_t i = 0; i < many.size(); ++i) {
+			assertEqual(manyMatcher.find(many[i]), i, "Key not found");
+		}
+		assertEqual(
+			manyMatcher.find("k1"), MsgStream::KeyMatcher::UNKNOWN,
+			"Unknown key found");
+
+		try {
+			MsgStream::KeyMatcher duplicates{"a", "b", "a"};
+			throw std::runtime_error("Duplicate keys were accepted");
+		} catch (MsgStream::ParseError &) {}
+
+		MsgStream::BufferSink sink;
+		MsgStream::BufferSerializer serializer(sink);
+		auto map = serializer.beginMap(7);
+		map.writeString("userId");
+		map.writeInt(1);
+		map.writeString("unknown");
+		map.writeInt(2);
+		map.writeInt(3);
+		map.writeString("non-string key");
+		map.writeString(keys[16]);
+		map.writeNil();
+		map.writeString(std::string(300, 'q'));
+		map.writeNil();
+		auto arr = map.beginArray(1);
+		arr.writeString("userId");
+		map.endArray(arr);
+		map.writeString("array key");
+		map.writeString("");
+		map.writeBool(true);
+		serializer.endMap(map);
+
+		std::vector<size_t> expected = {
+			11, MsgStream::KeyMatcher::UNKNOWN, MsgStream::KeyMatcher::UNKNOWN,
+			16, MsgStream::KeyMatcher::UNKNOWN, MsgStream::KeyMatcher::UNKNOWN, 0};
+
+		std::string bin = sinkString(sink);
+		MsgStream::SpanSource src(bin);
+		MsgStream::SpanParser spanParser(src);
+		checkKeyIndices(spanParser, matcher, expected);
+
+		std::stringstream ss(bin);
+		MsgStream::Parser streamParser(ss);
+		checkKeyIndices(streamParser, matcher, expected);
+	} catch (std::exception &ex) {
+		std::cout << "FAIL!\n   -- Err: " << ex.what() << '\n';
+		return;
+	}
+
+	std::cout << "OK!\n";
+	stats.numPassedTests += 1;
+}
+
+template<typename T, typename Source>
+static void readBulk(
+		MsgStream::BasicParser<Source> &parser, std::vector<T> &vec,
+		bool useReadInto) {
+	MsgStream::BasicArrayParser<Source> arr = parser.nextArray();
+	if (useReadInto) {
+		arr.readInto(vec);
+	} else {
+		// Read in uneven pieces, to start runs in the middle
+		vec.assign(arr.arraySize(), 0);
+		size_t pos = 0;
+		for (size_t piece = 1; pos < vec.size(); piece = piece * 3 + 1) {
+			size_t n = std::min(piece, vec.size() - pos);
+			arr.nextAll(std::span<T>(vec.data() + pos, n));
+			pos += n;
+		}
+	}
+
+	assertEqual(arr.arraySize(), (size_t)0, "Values left in array");
+}
+
+template<typename T>
+static void checkBulk(const std::string &bin, const std::vector<T> &expected) {
+	for (int useReadInto = 0; useReadInto < 2; ++useReadInto) {
+		std::vector<T> spanResult, streamResult;
+
+		MsgStream::SpanSource src(bin);
+		MsgStream::SpanParser spanParser(src);
+		readBulk(spanParser, spanResult, useReadInto);
+		assertEqual(spanParser.hasNext(), false, "Trailing data");
+
+		std::stringstream ss(bin);
+		MsgStream::Parser streamParser(ss);
+		readBulk(streamParser, streamResult, useReadInto);
+
+		assertEqual(spanResult.size(), expected.size(), "Incorrect size");
+		assertEqual(streamResult.size(), expected.size(), "Incorrect size");
+		for (size_t i = 0; i < expected.size(); ++i) {
+			assertEqual(spanResult[i], expected[i], "Incorrect span value");
+			assertEqual(streamResult[i], expected[i], "Incorrect stream value");
+		}
+	}
+}
+
+template<typename T>
+static void expectBulkError(const std::string &bin, size_t count) {
+	MsgStream::SpanSource src(bin);
+	MsgStream::SpanParser parser(src);
+	std::vector<T> vec(count);
+	try {
+		parser.nextArray().nextAll(std::span<T>(vec));
+	} catch (MsgStream::ParseError &) {
+		return;
+	}
+
+	throw std::runtime_error("Invalid bulk input was accepted");
+}
+
+static void runBulkDecodeTest(Stats &stats) {
+	stats.numTotalTests += 1;
+	std::cout << "bulk array decode: " << std::flush;
+
+	try {
+		std::vector<double> doubles;
+		std::vector<int64_t> ints;
+		MsgStream::BufferSink floatSink, intSink;
+		MsgStream::BufferSerializer floatSerializer(floatSink);
+		MsgStream::BufferSerializer intSerializer(intSink);
+
+		// Runs of each encoding, of various lengths, with some isolated values
+		std::vector<int64_t> intSamples = {
+			0, 5, -7, 127, -32, 200, -100, 1000, -1000, 100000, -100000,
+			5000000000, -5000000000, (int64_t)0x8000000000000000ull};
+		for (size_t run = 0; run < 40; ++run) {
+			size_t length = (run * 7) % 23;
+			int64_t sample = intSamples[run % intSamples.size()];
+			for (size_t i = 0; i < length; ++i) {
+				ints.push_back(sample);
+				doubles.push_back(
+					i % 2 == 0 ? sample * 0.5 : (float)(sample * 0.25f));
+			}
+		}
+
+		auto intArr = intSerializer.beginArray(ints.size());
+		auto floatArr = floatSerializer.beginArray(doubles.size());
+		for (size_t i = 0; i < ints.size(); ++i) {
+			if (ints[i] < 0) {
+				intArr.writeInt(ints[i]);
+			} else {
+				intArr.writeUInt(ints[i]);
+			}
+
+			if (i % 2 == 0) {
+				floatArr.writeFloat64(doubles[i]);
+			} else {
+				floatArr.writeFloat32((float)doubles[i]);
+			}
+		}
+		intSerializer.endArray(intArr);
+		floatSerializer.endArray(floatArr);
+
+		std::string intBin = sinkString(intSink);
+		std::string floatBin = sinkString(floatSink);
+		checkBulk(intBin, ints);
+		checkBulk(floatBin, doubles);
+
+		// Long runs of a single encoding
+		std::vector<double> longDoubles;
+		std::vector<int64_t> longInts;
+		MsgStream::BufferSink longSink;
+		MsgStream::BufferSerializer longSerializer(longSink);
+		auto longArr = longSerializer.beginArray(100000);
+		for (int i = 0; i < 100000; ++i) {
+			longDoubles.push_back(i * 1.25 - 7);
+			longArr.writeFloat64(longDoubles.back());
+		}
+		longSerializer.endArray(longArr);
+		checkBulk(sinkString(longSink), longDoubles);
+
+		longSink.clear();
+		MsgStream::BufferSerializer longIntSerializer(longSink);
+		auto longIntArr = longIntSerializer.beginArray(100000);
+		for (int i = 0; i < 100000; ++i) {
+			longInts.push_back((i * 37) % 128 - 32);
+			longIntArr.writeInt(longInts.back());
+		}
+		longIntSerializer.endArray(longIntArr);
+		checkBulk(sinkString(longSink), longInts);
+
+		// Truncated runs, non-numbers and reading past the end
+		expectBulkError<double>(
+			floatBin.substr(0, floatBin.size() - 1), doubles.size());
+		expectBulkError<int64_t>(
+			intBin.substr(0, intBin.size() - 1), ints.size());
+		expectBulkError<double>(intBin, ints.size());
+		expectBulkError<int64_t>(floatBin, doubles.size());
+		expectBulkError<double>(floatBin, doubles.size() + 1);
+
+		std::vector<int64_t> huge;
+		MsgStream::SpanSource hugeSrc(
+			std::string_view("\xdd\xff\xff\xff\xff\x01", 6));
+		MsgStream::SpanParser hugeParser(hugeSrc);
+		try {
+			hugeParser.nextArray().readInto(huge);
+			throw std::runtime_error("Truncated array was read");
+		} catch (MsgStream::ParseError &) {}
+	} catch (std::exception &ex) {
+		std::cout << "FAIL!\n   -- Err: " << ex.what() << '\n';
+		return;
+	}
+
+	std::cout << "OK!\n";
+	stats.numPassedTests += 1;
+}
+
+// Bulk-encode 'values', and check that the result is the same as
+// writing them one at a time with 'writeOne'
+template<typename T, typename WriteOne>
+static void checkBulkEncode(const std::vector<T> &values, WriteOne writeOne) {
+	MsgStream::BufferSink expectedSink;
+	MsgStream::BufferSerializer expected(expectedSink);
+	auto arr = expected.beginArray(values.size());
+	for (T value: values) {
+		writeOne(arr, value);
+	}
+	expected.endArray(arr);
+
+	MsgStream::BufferSink sink;
+	MsgStream::BufferSerializer serializer(sink);
+	serializer.writeArray(std::span<const T>(values));
+	assertEqual(
+		sinkString(sink), sinkString(expectedSink), "Bulk encode mismatch");
+
+	std::stringstream ss;
+	MsgStream::Serializer streamSerializer(ss);
+	streamSerializer.writeArray(std::span<const T>(values));
+	assertEqual(
+		ss.str(), sinkString(expectedSink), "Bulk stream encode mismatch");
+}
+
+static void runBulkEncodeTest(Stats &stats) {
+	stats.numTotalTests += 1;
+	std::cout << "bulk array encode: " << std::flush;
+
+	try {
+		std::vector<int64_t> ints;
+		std::vector<uint64_t> uints;
+		for (int64_t boundary: {
+				0ll, 0x7fll, 0xffll, 0xffffll, 0xffffffffll, -1ll, -32ll,
+				-128ll, -32768ll, -2147483648ll}) {
+			for (int64_t delta = -2; delta <= 2; ++delta) {
+				ints.push_back(boundary + delta);
+				uints.push_back(boundary + delta);
+			}
+		}
+		ints.push_back(INT64_MIN);
+		ints.push_back(INT64_MAX);
+		uints.push_back(UINT64_MAX);
+
+		// Whole blocks of fixints, and fixints mixed with larger values
+		for (int i = 0; i < 1000; ++i) {
+			ints.push_back(i % 160 - 32);
+			uints.push_back(i % 128);
+		}
+		for (int i = 0; i < 1000; ++i) {
+			ints.push_back(i % 37 == 0 ? i * 1000 : i % 20 - 10);
+			uints.push_back(i % 41 == 0 ? i * 100000 : i % 100);
+		}
+
+		auto writeInt = [](auto &s, auto num) { s.writeInt(num); };
+		auto writeUInt = [](auto &s, auto num) { s.writeUInt(num); };
+		checkBulkEncode(ints, writeInt);
+		checkBulkEncode(uints, writeUInt);
+		checkBulkEncode(std::vector<int32_t>(ints.begin(), ints.end()), writeInt);
+		checkBulkEncode(
+			std::vector<uint32_t>(uints.begin(), uints.end()), writeUInt);
+		checkBulkEncode(std::vector<int64_t>(), writeInt);
+
+		std::vector<double> doubles;
+		for (int i = 0; i < 3000; ++i) {
+			doubles.push_back(i * 0.37 - 100);
+		}
+		checkBulkEncode(
+			doubles, [](auto &s, double num) { s.writeFloat64(num); });
+		checkBulkEncode(
+			std::vector<float>(doubles.begin(), doubles.end()),
+			[](auto &s, float num) { s.writeFloat32(num); });
+	} catch (std::exception &ex) {
+		std::cout << "FAIL!\n   -- Err: " << ex.what() << '\n';
+		return;
+	}
+
+	std::cout << "OK!\n";
+	stats.numPassedTests += 1;
+}
+
+static void runExtensionTest(Stats &stats) {
+	stats.numTotalTests += 1;
+	std::cout << "extensions: " << std::flush;
+
+	try {
+		// The type is a single signed byte, whatever its value
+		MsgStream::BufferSink sink;
+		MsgStream::BufferSerializer serializer(sink);
+		serializer.writeExtension(-100, std::vector<unsigned char>{1});
+		serializer.writeInt(5);
+		assertEqual(
+			sinkString(sink), std::string("\xd4\x9c\x01\x05", 4),
+			"Incorrect extension encoding");
+
+		const int64_t types[] = {-128, -100, -33, -1, 0, 1, 127};
+		sink.clear();
+		for (int64_t type: types) {
+			serializer.writeExtension(
+				type, std::vector<unsigned char>((size_t)(type + 128) % 20, 7));
+			serializer.writeInt(type);
+		}
+
+		std::string bin = sinkString(sink);
+		MsgStream::SpanSource src(bin);
+		MsgStream::SpanParser parser(src);
+		std::vector<unsigned char> ext;
+		for (int64_t type: types) {
+			assertEqual(parser.nextExtension(ext), type, "Incorrect extension type");
+			assertEqual(
+				ext == std::vector<unsigned char>((size_t)(type + 128) % 20, 7), true,
+				"Incorrect extension payload");
+			assertEqual(parser.nextInt(), type, "Incorrect value after extension");
+		}
+
+		MsgStream::SpanSource skipSrc(bin);
+		MsgStream::SpanParser skipper(skipSrc);
+		for (int64_t type: types) {
+			skipper.skipNext();
+			assertEqual(skipper.nextInt(), type, "Incorrect value after skip");
+		}
+		assertEqual(skipper.hasNext(), false, "Values left after skipping");
+
+		try {
+			serializer.writeExtension(128, std::span<const unsigned char>());
+			throw std::runtime_error("Out of range extension type was written");
+		} catch (MsgStream::SerializeError &) {}
+	} catch (std::exception &ex) {
+		std::cout << "FAIL!\n   -- Err: " << ex.what() << '\n';
+		return;
+	}
+
+	std::cout << "OK!\n";
+	stats.numPassedTests += 1;
+}
+
+static void runTimestampTest(Stats &stats) {
+	stats.numTotalTests += 1;
+	std::cout << "timestamps: " << std::flush;
+
+	try {
+		using namespace std::chrono;
+		auto time = sys_days(year(2021) / 3 / 4) + hours(5) + microseconds(678);
+		MsgStream::BufferSink sink;
+		MsgStream::BufferSerializer serializer(sink);
+		serializer.writeTimestamp(time);
+		serializer.writeExtension(5, std::span<const unsigned char>());
+		serializer.writeTimestamp(sys_seconds(seconds(-1)));
+
+		std::string bin = sinkString(sink);
+		MsgStream::SpanSource src(bin);
+		MsgStream::SpanParser parser(src);
+		MsgStream::Timestamp ts = parser.nextTimestamp();
+		assertEqual(ts.nanoseconds, 678000u, "Incorrect nanoseconds");
+		assertEqual(
+			ts.sysTime() == time, true, "Incorrect sys_time conversion");
+
+		try {
+			parser.nextTimestamp();
+			throw std::runtime_error("Other extension read as timestamp");
+		} catch (MsgStream::ParseError &) {}
+
+		ts = parser.nextTimestamp();
+		assertEqual(ts.seconds, (int64_t)-1, "Incorrect negative seconds");
+
+		try {
+			serializer.writeTimestamp(MsgStream::Timestamp{0, 1000000000});
+			throw std::runtime_error("Invalid nanoseconds were written");
+		} catch (MsgStream::SerializeError &) {}
+
+		// Nanoseconds are a 30-bit field in the 64-bit form,
+		// which can hold values above the maximum
+		MsgStream::SpanSource invalidSrc(
+			std::string_view("\xd7\xff\xff\xff\xff\xfc\x00\x00\x00\x00", 10));
+		MsgStream::SpanParser invalid(invalidSrc);
+		try {
+			invalid.nextTimestamp();
+			throw std::runtime_error("Invalid nanoseconds were read");
+		} catch (MsgStream::ParseError &) {}
+	} catch (std::exception &ex) {
+		std::cout << "FAIL!\n   -- Err: " << ex.what() << '\n';
+		return;
+	}
+
+	std::cout << "OK!\n";
+	stats.numPassedTests += 1;
+}
+
+// Read every value, like a consumer which doesn't check for errors
+template<typename Source, MsgStream::ErrorMode Mode>
+static void readAllValues(MsgStream::BasicParser<Source, Mode> &parser) {
+	using Type = MsgStream::Type;
+	std::vector<unsigned char> ext;
+	while (parser.hasNext()) {
+		switch (parser.nextType()) {
+		case Type::NIL:
+			parser.skipNil();
+			break;
+		case Type::BOOL:
+			parser.nextBool();
+			break;
+		case Type::INT:
+		case Type::UINT:
+			parser.nextInt();
+			break;
+		case Type::FLOAT32:
+		case Type::FLOAT64:
+			parser.nextFloat64();
+			break;
+		case Type::STRING:
+			parser.nextString();
+			break;
+		case Type::BINARY:
+			parser.nextBinary();
+			break;
+		case Type::EXTENSION:
+			parser.nextExtension(ext);
+			break;
+		case Type::ARRAY: {
+			auto arr = parser.nextArray();
+			readAllValues(arr);
+		}
+			break;
+		case Type::MAP: {
+			auto map = parser.nextMap();
+			readAllValues(map);
+		}
+			break;
+		}
+	}
+}
+
+static void assertStatus(
+		const MsgStream::ParseStatus &status,
+		MsgStream::ErrorCode code, const char *msg) {
+	assertEqual((int)status.code, (int)code, msg);
+	assertEqual(status.ok(), code == MsgStream::ErrorCode::NONE, msg);
+}
+
+// Parse 'bin' with a ParseStatus, from a span and from a stream,
+// which must record 'code' (at 'offset', for spans),
+// and check that parsing without a status throws the same error
+static void expectStatus(
+		const std::string &bin, MsgStream::ErrorCode code, size_t offset) {
+	MsgStream::ParseStatus status;
+	MsgStream::SpanSource src(bin);
+	MsgStream::SpanStatusParser parser(src, status);
+	readAllValues(parser);
+	assertStatus(status, code, "Incorrect span parser status");
+	assertEqual(status.offset, offset, "Incorrect error offset");
+
+	MsgStream::ParseStatus streamStatus;
+	std::stringstream ss(bin);
+	MsgStream::StatusParser streamParser(ss, streamStatus);
+	readAllValues(streamParser);
+	assertStatus(streamStatus, code, "Incorrect stream parser status");
+
+	if (code == MsgStream::ErrorCode::NONE) {
+		return;
+	}
+
+	try {
+		MsgStream::SpanSource throwingSrc(bin);
+		MsgStream::SpanParser throwing(throwingSrc);
+		readAllValues(throwing);
+		throw std::runtime_error("Parsing without a status didn't throw");
+	} catch (MsgStream::ParseError &err) {
+		assertEqual((int)err.code(), (int)code, "Incorrect ParseError code");
+	}
+}
+
+static void runParseStatusTest(Stats &stats) {
+	using MsgStream::ErrorCode;
+	stats.numTotalTests += 1;
+	std::cout << "parse status: " << std::flush;
+
+	try {
+		expectStatus(std::string("\x93\x01\xa1x\xc0", 5), ErrorCode::NONE, 0);
+		expectStatus("\xa5hel", ErrorCode::UNEXPECTED_EOF, 1);
+		expectStatus(std::string("\xc7\x10\x05" "abc"), ErrorCode::UNEXPECTED_EOF, 3);
+		expectStatus("\x92\x01\xc1", ErrorCode::INVALID_HEADER, 2);
+
+		// Containers which claim far more values than the input holds
+		// must stop at the first error, not read billions of nothing
+		expectStatus(
+			"\xdd\xff\xff\xff\xff\x01", ErrorCode::UNEXPECTED_EOF, 6);
+		expectStatus("\xdf\xff\xff\xff\xff", ErrorCode::UNEXPECTED_EOF, 5);
+		expectStatus("\x91\x91\xdc\xff\xff", ErrorCode::UNEXPECTED_EOF, 5);
+
+		MsgStream::ParseStatus status;
+		std::string hostile("\x91\xdf\xff\xff\xff\xff", 6);
+		MsgStream::SpanSource hostileSrc(hostile);
+		MsgStream::SpanStatusParser hostileParser(hostileSrc, status);
+		hostileParser.skipAll();
+		assertStatus(status, ErrorCode::UNEXPECTED_EOF, "Incorrect skip status");
+		assertEqual(status.offset, (size_t)6, "Incorrect skip offset");
+
+		// After a type mismatch, the parser reads nothing more
+		status.clear();
+		std::string mismatch("\xa3" "abc\x05", 5);
+		MsgStream::SpanSource mismatchSrc(mismatch);
+		MsgStream::SpanStatusParser mismatchParser(mismatchSrc, status);
+		assertEqual(mismatchParser.nextInt(), (int64_t)0, "Incorrect failed int");
+		assertStatus(status, ErrorCode::TYPE_MISMATCH, "Incorrect mismatch status");
+		assertEqual(
+			std::string(status.message),
+			std::string("Attempt to parse non-integer as integer"),
+			"Incorrect mismatch message");
+		assertEqual(mismatchParser.hasNext(), false, "Parser continued after error");
+		assertEqual(mismatchParser.nextString(), std::string(), "Read after error");
+		assertEqual(
+			mismatchParser.nextArray().hasNext(), false, "Read after error");
+		assertEqual((int)status.code, (int)ErrorCode::TYPE_MISMATCH, "Error replaced");
+
+		// Bulk reads of a huge array from a stream stop at the first error
+		status.clear();
+		std::stringstream floats(std::string("\xdd\xff\xff\xff\xff\xcb", 6) + "12345678");
+		MsgStream::StatusParser floatsParser(floats, status);
+		std::vector<double> vec;
+		floatsParser.nextArray().readInto(vec);
+		assertStatus(status, ErrorCode::UNEXPECTED_EOF, "Incorrect bulk status");
+
+		status.clear();
+		std::string ts("\xd7\xff\xff\xff\xff\xfc\x00\x00\x00\x00", 10);
+		MsgStream::SpanSource tsSrc(ts);
+		MsgStream::SpanStatusParser tsParser(tsSrc, status);
+		tsParser.nextTimestamp();
+		assertStatus(status, ErrorCode::INVALID_VALUE, "Incorrect timestamp status");
+
+		status.clear();
+		BoundShape shape;
+		std::string shapeBin("\x82\xa4name\x05\xa6points\xdd\xff\xff\xff\xff", 18);
+		MsgStream::SpanSource shapeSrc(shapeBin);
+		MsgStream::SpanStatusParser shapeParser(shapeSrc, status);
+		MsgStream::deserialize(shapeParser, shape);
+		assertStatus(status, ErrorCode::TYPE_MISMATCH, "Incorrect binding status");
+
+		// Push parsers stop at the first error, and ignore further input
+		status.clear();
+		TraceHandler handler;
+		MsgStream::PushParser push(handler, status);
+		push.feed(std::string_view("\x01\x92\x02", 3));
+		push.feed(std::string_view("\xc1\x03", 2));
+		push.feed(std::string_view("\x04", 1));
+		assertStatus(status, ErrorCode::INVALID_HEADER, "Incorrect push status");
+		assertEqual(status.offset, (size_t)3, "Incorrect push offset");
+		assertEqual(handler.trace, std::string("u1 ; [2 u2 "), "Incorrect push events");
+
+		status.clear();
+		push.reset();
+		push.feed(std::string_view("\x92\x01", 2));
+		push.finish();
+		assertStatus(status, ErrorCode::UNEXPECTED_EOF, "Incorrect push EOF status");
+	} catch (std::exception &ex) {
+		std::cout << "FAIL!\n   -- Err: " << ex.what() << '\n';
+		return;
+	}
+
+	std::cout << "OK!\n";
+	stats.numPassedTests += 1;
+}
+
+struct AsyncMessage {
+	int64_t id = 0;
+	std::string tags;
+	float ratio = 0;
+	std::vector<unsigned char> data;
+	MsgStream::Timestamp when;
+	int64_t last = 0;
+	bool ended = false;
+};
+
+static MsgStream::Task<void> writeAsyncMessages(MsgStream::AsyncPipe &pipe) {
+	MsgStream::AsyncSerializer<MsgStream::AsyncPipe> serializer(pipe);
+	MsgStream::BufferSerializer map = serializer.beginMap(5);
+	map.writeString("id");
+	map.writeInt(7);
+	map.writeString("tags");
+	MsgStream::BufferSerializer tags = map.beginArray(3);
+	tags.writeString("a");
+	tags.writeNil();
+	tags.writeBool(true);
+	map.endArray(tags);
+	map.writeString("ratio");
+	map.writeFloat32(0.5);
+	map.writeString("data");
+	map.writeBinary(std::vector<unsigned char>(300, 0xab));
+	map.writeString("when");
+	map.writeTimestamp(MsgStream::Timestamp{1234567890, 5});
+	serializer.endMap(map);
+	co_await serializer.flush();
+
+	// A nested value for the reader to skip
+	MsgStream::BufferSerializer outer = serializer.beginArray(2);
+	outer.writeString(std::string(100, 'x'));
+	MsgStream::BufferSerializer inner = outer.beginMap(1);
+	inner.writeInt(1);
+	inner.writeExtension(3, std::vector<unsigned char>(20, 0));
+	outer.endMap(inner);
+	serializer.endArray(outer);
+	serializer.writeInt(-42);
+	co_await serializer.flush();
+	assertEqual(serializer.buffered(), (size_t)0, "Serializer wasn't flushed");
+
+	pipe.close();
+}
+
+static MsgStream::Task<void> readAsyncMessages(
+		MsgStream::AsyncPipe &pipe, AsyncMessage &msg) {
+	MsgStream::AsyncParser<MsgStream::AsyncPipe> parser(pipe, 64);
+	auto map = co_await parser.nextMap();
+	for (;;) {
+		bool more = co_await map.hasNext();
+		if (!more) {
+			break;
+		}
+
+		std::string key = co_await map.nextString();
+		if (key == "id") {
+			msg.id = co_await map.nextInt();
+		} else if (key == "tags") {
+			auto tags = co_await map.nextArray();
+			msg.tags = co_await tags.nextString();
+			co_await tags.skipNil();
+			bool b = co_await tags.nextBool();
+			msg.tags += b ? "true" : "false";
+		} else if (key == "ratio") {
+			msg.ratio = co_await map.nextFloat32();
+		} else if (key == "data") {
+			msg.data = co_await map.nextBinary();
+		} else if (key == "when") {
+			msg.when = co_await map.nextTimestamp();
+		}
+	}
+
+	co_await parser.skipNext();
+	msg.last = co_await parser.nextInt();
+	bool more = co_await parser.hasNext();
+	msg.ended = !more;
+}
+
+// Read 'bin' to the end with an async parser,
+// and check that it fails with 'code'
+static void expectAsyncError(const std::string &bin, MsgStream::ErrorCode code) {
+	MsgStream::AsyncPipe pipe;
+	TraceHandler handler;
+	MsgStream::Task<void> task = traceAllAsync(pipe, handler);
+	task.start();
+	std::string_view rest(bin);
+	while (!rest.empty() && !task.done()) {
+		rest.remove_prefix(pipe.writeSome(rest.data(), rest.size()));
+	}
+	pipe.close();
+	assertEqual(task.done(), true, "Async parser didn't finish");
+
+	try {
+		task.result();
+	} catch (MsgStream::ParseError &err) {
+		assertEqual((int)err.code(), (int)code, "Incorrect async error code");
+		return;
+	}
+
+	throw std::runtime_error("Invalid input was read");
+}
+
+static MsgStream::Task<void> readStringAsync(MsgStream::AsyncPipe &pipe) {
+	MsgStream::AsyncParser<MsgStream::AsyncPipe> parser(pipe);
+	co_await parser.nextString();
+}
+
+static void runAsyncTest(Stats &stats) {
+	stats.numTotalTests += 1;
+	std::cout << "async: " << std::flush;
+
+	try {
+		// The writer has to wait for the reader to empty the tiny pipe,
+		// and the reader for the writer to fill it
+		MsgStream::AsyncPipe pipe(5);
+		AsyncMessage msg;
+		MsgStream::Task<void> reader = readAsyncMessages(pipe, msg);
+		MsgStream::Task<void> writer = writeAsyncMessages(pipe);
+		reader.start();
+		writer.start();
+		assertEqual(writer.done(), true, "Writer didn't finish");
+		assertEqual(reader.done(), true, "Reader didn't finish");
+		writer.result();
+		reader.result();
+
+		assertEqual(msg.id, (int64_t)7, "Incorrect int");
+		assertEqual(msg.tags, std::string("atrue"), "Incorrect array");
+		assertEqual(msg.ratio, 0.5f, "Incorrect float");
+		assertEqual(msg.data.size(), (size_t)300, "Incorrect binary size");
+		assertEqual((int)msg.data[299], 0xab, "Incorrect binary");
+		assertEqual(msg.when.seconds, (int64_t)1234567890, "Incorrect timestamp");
+		assertEqual(msg.when.nanoseconds, 5u, "Incorrect timestamp");
+		assertEqual(msg.last, (int64_t)-42, "Incorrect int after skipped value");
+		assertEqual(msg.ended, true, "Parser didn't end");
+
+		using MsgStream::ErrorCode;
+		expectAsyncError(hexToBytes("9201"), ErrorCode::UNEXPECTED_EOF);
+		expectAsyncError(hexToBytes("a3616263c1"), ErrorCode::INVALID_HEADER);
+		expectAsyncError(hexToBytes("db00000100"), ErrorCode::UNEXPECTED_EOF);
+		expectAsyncError(hexToBytes("c7"), ErrorCode::UNEXPECTED_EOF);
+
+		// Elements which are already buffered are read without suspending.
+		// Awaiting each one mustn't add to the stack, even when the
+		// compiler doesn't make resumptions into tail calls (at -O0).
+		MsgStream::BufferSink longSink;
+		MsgStream::BufferSerializer longSerializer(longSink);
+		longSerializer.writeArray(std::vector<uint32_t>(1000000, 1));
+		std::string longBin = sinkString(longSink);
+		MsgStream::AsyncPipe longPipe(longBin.size());
+		longPipe.writeSome(longBin.data(), longBin.size());
+		longPipe.close();
+		TraceHandler longHandler;
+		MsgStream::Task<void> longTask = traceAllAsync(longPipe, longHandler);
+		longTask.start();
+		assertEqual(longTask.done(), true, "Async parser didn't finish");
+		longTask.result();
+
+		MsgStream::AsyncPipe intPipe;
+		intPipe.writeSome("\x05", 1);
+		MsgStream::Task<void> mismatch = readStringAsync(intPipe);
+		mismatch.start();
+		try {
+			mismatch.result();
+			throw std::runtime_error("Int was read as a string");
+		} catch (MsgStream::ParseError &err) {
+			assertEqual(
+				(int)err.code(), (int)ErrorCode::TYPE_MISMATCH,
+				"Incorrect async error code");
+		}
+	} catch (std::exception &ex) {
+		std::cout << "FAIL!\n   -- Err: " << ex.what() << '\n';
+		return;
+	}
+
+	std::cout << "OK!\n";
+	stats.numPassedTests += 1;
+}
+
+static void runMappedFileTest(Stats &stats) {
+	stats.numTotalTests += 1;
+	std::cout << "mapped file: " << std::flush;
+
+	FILE *file = tmpfile();
+	try {
+		MsgStream::BufferSink sink;
+		MsgStream::BufferSerializer serializer(sink);
+		serializer.writeInt(1);
+		serializer.writeString("two");
+		std::string bin = sinkString(sink);
+		fwrite(bin.data(), 1, bin.size(), file);
+		fflush(file);
+
+		// The mapping starts where the descriptor's offset is,
+		// like reading from it would
+		fseek(file, 1, SEEK_SET);
+		MsgStream::MappedFile mapped(fileno(file));
+		assertEqual(mapped.data().size(), bin.size() - 1, "Incorrect mapped size");
+		MsgStream::SpanSource src(mapped.data());
+		MsgStream::SpanParser parser(src);
+		assertEqual(parser.nextString(), std::string("two"), "Incorrect mapped value");
+		assertEqual(parser.hasNext(), false, "Mapped past the end");
+
+		fseek(file, 0, SEEK_END);
+		assertEqual(
+			MsgStream::MappedFile(fileno(file)).data().size(), (size_t)0,
+			"Mapped data after the end");
+
+		// Containers of known length can be written straight to
+		// a descriptor, which can't be seeked back into
+		{
+			MsgStream::FdSink fdSink(fileno(file));
+			MsgStream::BasicSerializer<MsgStream::FdSink> fdSerializer(fdSink);
+			auto arr = fdSerializer.beginArray(2);
+			arr.writeInt(3);
+			arr.writeString("four");
+			fdSerializer.endArray(arr);
+		}
+
+		lseek(fileno(file), (off_t)bin.size(), SEEK_SET);
+		MsgStream::MappedFile appended(fileno(file));
+		MsgStream::SpanSource appendedSrc(appended.data());
+		MsgStream::SpanParser appendedParser(appendedSrc);
+		MsgStream::SpanArrayParser arr = appendedParser.nextArray();
+		assertEqual(arr.nextInt(), (int64_t)3, "Incorrect FdSink value");
+		assertEqual(arr.nextString(), std::string("four"), "Incorrect FdSink value");
+		assertEqual(appendedParser.hasNext(), false, "Too much FdSink output");
+	} catch (std::exception &ex) {
+		fclose(file);
+		std::cout << "FAIL!\n   -- Err: " << ex.what() << '\n';
+		return;
+	}
+
+	fclose(file);
+	std::cout << "OK!\n";
+	stats.numPassedTests += 1;
+}
+
+// Writes 'count' records of varying shapes and sizes, each with its index
+static std::string parallelRecords(size_t count) {
+	MsgStream::BufferSink sink;
+	MsgStream::BufferSerializer serializer(sink);
+	for (size_t i = 0; i < count; ++i) {
+		switch (i % 4) {
+		case 0:
+			serializer.writeInt((int64_t)i);
+			break;
+		case 1: {
+			MsgStream::BufferSerializer arr = serializer.beginArray(4);
+			arr.writeInt((int64_t)i);
+			arr.writeString(std::string(i % 50, 'x'));
+			arr.writeBool(true);
+
+			// An extension type outside the fixint range,
+			// with a payload of header-like bytes
+			arr.writeExtension(-100, std::vector<unsigned char>(i % 3 + 1, 0xd4));
+			serializer.endArray(arr);
+			break;
+		}
+		case 2: {
+			MsgStream::BufferSerializer map = serializer.beginMap(2);
+			map.writeString("id");
+			map.writeInt((int64_t)i);
+			map.writeString("nested");
+			map.writeArray(std::vector<double>(i % 7, 0.5));
+			serializer.endMap(map);
+			break;
+		}
+		default: {
+			MsgStream::BufferSerializer arr = serializer.beginArray(2);
+			arr.writeInt((int64_t)i);
+			arr.writeBinary(std::vector<unsigned char>(i % 300, 0xc1));
+			serializer.endArray(arr);
+		}
+		}
+	}
+
+	return sinkString(sink);
+}
+
+// Reads the index of each record in a chunk
+static std::vector<int64_t> parallelIndices(MsgStream::SpanParser &parser) {
+	std::vector<int64_t> indices;
+	while (parser.hasNext()) {
+		switch (parser.nextType()) {
+		case MsgStream::Type::ARRAY: {
+			MsgStream::SpanArrayParser arr = parser.nextArray();
+			indices.push_back(arr.nextInt());
+			arr.skipAll();
+			break;
+		}
+		case MsgStream::Type::MAP: {
+			MsgStream::SpanMapParser map = parser.nextMap();
+			map.skipNext();
+			indices.push_back(map.nextInt());
+			map.skipAll();
+			break;
+		}
+		default:
+			indices.push_back(parser.nextInt());
+		}
+	}
+
+	return indices;
+}
+
+static std::vector<int64_t> parseIndicesParallel(
+		const std::string &bin, const MsgStream::ParallelOptions &options) {
+	std::vector<int64_t> indices;
+	MsgStream::parseParallel(
+		std::span((const unsigned char *)bin.data(), bin.size()),
+		parallelIndices,
+		[&](std::vector<int64_t> chunk) {
+			indices.insert(indices.end(), chunk.begin(), chunk.end());
+		},
+		options);
+	return indices;
+}
+
+static void assertIndices(
+		const std::vector<int64_t> &indices, size_t count, const char *msg) {
+	assertEqual(indices.size(), count, msg);
+	for (size_t i = 0; i < count; ++i) {
+		assertEqual(indices[i], (int64_t)i, msg);
+	}
+}
+
+static void runParallelTest(Stats &stats) {
+	stats.numTotalTests += 1;
+	std::cout << "parallel: " << std::flush;
+
+	try {
+		const size_t count = 20000;
+		std::string bin = parallelRecords(count);
+
+		MsgStream::ParallelOptions options;
+		options.threads = 4;
+		options.chunkSize = 1000;
+		assertIndices(
+			parseIndicesParallel(bin, options), count, "Incorrect ordered results");
+
+		options.ordered = false;
+		std::vector<int64_t> unordered = parseIndicesParallel(bin, options);
+		std::sort(unordered.begin(), unordered.end());
+		assertIndices(unordered, count, "Incorrect unordered results");
+
+		// A single worker with a single chunk in flight,
+		// and chunks which are smaller than a record
+		options.ordered = true;
+		options.threads = 1;
+		options.window = 1;
+		options.chunkSize = 1;
+		assertIndices(
+			parseIndicesParallel(bin, options), count, "Incorrect serial results");
+
+		assertIndices(
+			parseIndicesParallel("", options), 0, "Empty input has results");
+
+		// Every chunk before the invalid header is delivered,
+		// then the error is rethrown
+		options.threads = 4;
+		options.window = 0;
+		options.chunkSize = 1000;
+		std::vector<int64_t> delivered;
+		try {
+			std::string invalid = bin + "\xc1" + bin;
+			MsgStream::parseParallel(
+				std::span((const unsigned char *)invalid.data(), invalid.size()),
+				parallelIndices,
+				[&](std::vector<int64_t> chunk) {
+					delivered.insert(delivered.end(), chunk.begin(), chunk.end());
+				},
+				options);
+			throw std::runtime_error("Invalid input was parsed");
+		} catch (MsgStream::ParseError &err) {
+			assertEqual(
+				(int)err.code(), (int)MsgStream::ErrorCode::INVALID_HEADER,
+				"Incorrect parallel error code");
+		}
+
+		assertEqual(delivered.size() > count / 2, true, "Too few results delivered");
+		assertIndices(delivered, delivered.size(), "Incorrect results before error");
+
+		// An exception from the delivery callback stops the workers
+		size_t deliveries = 0;
+		try {
+			MsgStream::parseParallel(
+				std::span((const unsigned char *)bin.data(), bin.size()),
+				parallelIndices,
+				[&](std::vector<int64_t>) {
+					deliveries += 1;
+					if (deliveries == 3) {
+						throw std::runtime_error("Stop");
+					}
+				},
+				options);
+			throw std::runtime_error("Delivery didn't stop");
+		} catch (std::runtime_error &err) {
+			assertEqual(std::string(err.what()), std::string("Stop"), err.what());
+		}
+		assertEqual(deliveries, (size_t)3, "Delivery continued after exception");
+	} catch (std::exception &ex) {
+		std::cout << "FAIL!\n   -- Err: " << ex.what() << '\n';
+		return;
+	}
+
+	std::cout << "OK!\n";
+	stats.numPassedTests += 1;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 2) {
+		std::cerr << "Usage: " << argv[0] << " <test json>\n";
+		return 1;
+	}
+
+	std::ifstream is(argv[1]);
+	if (!is) {
+		std::cerr << "Failed to open " << argv[1] << '\n';
+		return 1;
+	}
+
+	Json::Value groups;
+	is >> groups;
+	is.close();
+
+	Stats stats;
+	runDeepNestingTest(stats);
+	runBindingTest(stats);
+	runKeyMatcherTest(stats);
+	runBulkDecodeTest(stats);
+	runBulkEncodeTest(stats);
+	runExtensionTest(stats);
+	runTimestampTest(stats);
+	runParseStatusTest(stats);
+	runAsyncTest(stats);
+	runMappedFileTest(stats);
+	runParallelTest(stats);
 
 	auto groupNames = groups.getMemberNames();
 	for (size_t groupIndex = 0; groupIndex < groupNames.size(); ++groupIndex) {
@@ -432,12 +2708,6 @@ int main(int argc, char **argv) {
 		for (testIndex = 0; testIndex < group.size(); ++testIndex) {
 			auto &test = group[testIndex];
 
-			// We don't have special timestamp handling,
-			// so just skip tests which deal with timestamps
-			if (test.isMember("timestamp")) {
-				continue;
-			}
-
 			if (testIndex < 9) {
 				std::cout << ' ';
 			}